@@ -7,6 +7,11 @@
 #include <vector>
 #include <bitset>
 #include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <deque>
+#include <string_view>
 using namespace std;
 
 #define RESET "\033[0m"
@@ -91,6 +96,33 @@ static unordered_map<string, uint32_t> regMap =
 // Stores the addresses of the labels
 unordered_map<string, int> labelMap;
 
+// Diagnostics: errors point at the source line being assembled, as "<file>:<line>: error: <message>"
+string sourceFileName = "";
+int sourceLineNo = 0; // 0 when no source line is being assembled (e.g. in the benchmarks)
+int errorCount = 0;
+int lastErrorLine = 0; // A line reports its first error only (li/la expand to two instructions that fail alike)
+
+void reportDiagnostic(const char *kind, const string &message)
+{
+    if (sourceLineNo > 0)
+        cerr << sourceFileName << ":" << sourceLineNo << ": ";
+    cerr << kind << ": " << message << "\n";
+}
+
+void reportError(const string &message)
+{
+    if (sourceLineNo > 0 && sourceLineNo == lastErrorLine)
+        return;
+    lastErrorLine = sourceLineNo;
+    errorCount++;
+    reportDiagnostic("error", message);
+}
+
+void reportWarning(const string &message)
+{
+    reportDiagnostic("warning", message);
+}
+
 // R TYPE
 struct RSpec
 {
@@ -112,6 +144,9 @@ static unordered_map<string, RSpec> rMap =
         {"and", {0x00, 0x7, 0x33}},
         // M-extension:
         {"mul", {0x01, 0x0, 0x33}},
+        {"mulh", {0x01, 0x1, 0x33}},
+        {"mulhsu", {0x01, 0x2, 0x33}},
+        {"mulhu", {0x01, 0x3, 0x33}},
         {"div", {0x01, 0x4, 0x33}},
         {"divu", {0x01, 0x5, 0x33}},
         {"rem", {0x01, 0x6, 0x33}},
@@ -249,23 +284,237 @@ uint32_t encodeJALR(uint32_t rs1, uint32_t rd, uint32_t imm, JALRSpec &spec)
     return ((imm & 0xFFF) << 20) | (rs1 << 15) | (spec.func3 << 12) | (rd << 7) | (spec.opcode);
 }
 
+// U type
+struct USpec
+{
+    uint32_t opcode;
+};
+static unordered_map<string, USpec> uMap =
+    {
+        {"lui", {0x37}},
+        {"auipc", {0x17}}};
+uint32_t encodeU(uint32_t rd, uint32_t imm, USpec &spec)
+{
+    return ((imm & 0xFFFFF) << 12) | (rd << 7) | spec.opcode;
+}
+
+// System instructions (no operands)
+static unordered_map<string, uint32_t> sysMap =
+    {
+        {"ecall", 0x00000073},
+        {"ebreak", 0x00100073},
+        {"mret", 0x30200073},
+        {"sret", 0x10200073},
+        {"wfi", 0x10500073},
+        {"fence", 0x0FF0000F}}; // fence iorw, iorw
+
+// Zicsr: the register forms read rs1, the immediate forms put a 5 bit zero-extended value in its place
+struct CSRSpec
+{
+    uint32_t func3;
+    bool immediate;
+};
+static unordered_map<string, CSRSpec> csrMap =
+    {
+        {"csrrw", {0x1, false}},
+        {"csrrs", {0x2, false}},
+        {"csrrc", {0x3, false}},
+        {"csrrwi", {0x5, true}},
+        {"csrrsi", {0x6, true}},
+        {"csrrci", {0x7, true}}};
+// CSR names (machine and supervisor mode and the user counters), numbers are accepted as well
+static unordered_map<string, uint32_t> csrNames =
+    {
+        {"sstatus", 0x100}, {"sie", 0x104}, {"stvec", 0x105}, {"sscratch", 0x140}, {"sepc", 0x141},
+        {"scause", 0x142}, {"stval", 0x143}, {"sip", 0x144}, {"satp", 0x180},
+        {"mstatus", 0x300}, {"misa", 0x301}, {"medeleg", 0x302}, {"mideleg", 0x303}, {"mie", 0x304}, {"mtvec", 0x305},
+        {"mscratch", 0x340}, {"mepc", 0x341}, {"mcause", 0x342}, {"mtval", 0x343}, {"mip", 0x344},
+        {"mcycle", 0xB00}, {"minstret", 0xB02}, {"mcycleh", 0xB80}, {"minstreth", 0xB82},
+        {"cycle", 0xC00}, {"time", 0xC01}, {"instret", 0xC02},
+        {"cycleh", 0xC80}, {"timeh", 0xC81}, {"instreth", 0xC82},
+        {"mvendorid", 0xF11}, {"marchid", 0xF12}, {"mimpid", 0xF13}, {"mhartid", 0xF14}};
+uint32_t encodeCSR(uint32_t rd, uint32_t src, uint32_t csr, CSRSpec &spec)
+{
+    return (csr << 20) | (src << 15) | (spec.func3 << 12) | (rd << 7) | 0x73;
+}
+
+/* RVC (C extension) */
+// Registers x8..x15 have a 3 bit encoding in most compressed formats
+bool isCReg(uint32_t r)
+{
+    return r >= 8 && r <= 15;
+}
+
+bool fitsSigned(int32_t value, int bits)
+{
+    return value >= -(1 << (bits - 1)) && value < (1 << (bits - 1));
+}
+
+// Bits [hi:lo] of value, placed at position pos
+uint32_t field(int32_t value, int hi, int lo, int pos)
+{
+    return ((static_cast<uint32_t>(value) >> lo) & ((1u << (hi - lo + 1)) - 1)) << pos;
+}
+
+// Converts an encoded 32 bit instruction to its 16 bit RVC equivalent (if it has one)
+bool compressInstruction(uint32_t ins, uint16_t &c)
+{
+    uint32_t opcode = ins & 0x7F, rd = (ins >> 7) & 0x1F, func3 = (ins >> 12) & 0x7;
+    uint32_t rs1 = (ins >> 15) & 0x1F, rs2 = (ins >> 20) & 0x1F, func7 = ins >> 25;
+    int32_t immI = static_cast<int32_t>(ins) >> 20;
+    int32_t immS = ((static_cast<int32_t>(ins) >> 25) << 5) | ((ins >> 7) & 0x1F);
+    int32_t immB = ((static_cast<int32_t>(ins) >> 31) << 12) | (((ins >> 7) & 0x1) << 11) | (((ins >> 25) & 0x3F) << 5) | (((ins >> 8) & 0xF) << 1);
+    int32_t immJ = ((static_cast<int32_t>(ins) >> 31) << 20) | (((ins >> 12) & 0xFF) << 12) | (((ins >> 20) & 0x1) << 11) | (((ins >> 21) & 0x3FF) << 1);
+    int32_t immU = static_cast<int32_t>(ins) >> 12;
+    uint32_t r = 0;
+
+    switch (opcode)
+    {
+    case 0x13: // I Arith/Shift
+        if (func3 == 0) // ADDI
+        {
+            if (rd == 0 && rs1 == 0 && immI == 0) // C.NOP
+                r = 0x0001;
+            else if (rd != 0 && rs1 == 0 && fitsSigned(immI, 6)) // C.LI
+                r = (0x2 << 13) | field(immI, 5, 5, 12) | (rd << 7) | field(immI, 4, 0, 2) | 0x1;
+            else if (rd == 2 && rs1 == 2 && immI != 0 && immI % 16 == 0 && fitsSigned(immI, 10)) // C.ADDI16SP
+                r = (0x3 << 13) | field(immI, 9, 9, 12) | (2 << 7) | field(immI, 4, 4, 6) | field(immI, 6, 6, 5) | field(immI, 8, 7, 3) | field(immI, 5, 5, 2) | 0x1;
+            else if (rs1 == 2 && isCReg(rd) && immI > 0 && immI < 1024 && immI % 4 == 0) // C.ADDI4SPN
+                r = field(immI, 5, 4, 11) | field(immI, 9, 6, 7) | field(immI, 2, 2, 6) | field(immI, 3, 3, 5) | ((rd - 8) << 2);
+            else if (rd != 0 && rd == rs1 && immI != 0 && fitsSigned(immI, 6)) // C.ADDI
+                r = field(immI, 5, 5, 12) | (rd << 7) | field(immI, 4, 0, 2) | 0x1;
+            else if (rd != 0 && rs1 != 0 && immI == 0) // C.MV (same result as ADDI rd, rs1, 0)
+                r = (0x4 << 13) | (rd << 7) | (rs1 << 2) | 0x2;
+        }
+        else if (func3 == 1 && func7 == 0 && rd != 0 && rd == rs1) // C.SLLI
+            r = (rd << 7) | (rs2 << 2) | 0x2;
+        else if (func3 == 5 && rd == rs1 && isCReg(rd) && (func7 == 0 || func7 == 0x20)) // C.SRLI, C.SRAI
+            r = (0x4 << 13) | ((func7 ? 1u : 0u) << 10) | ((rd - 8) << 7) | (rs2 << 2) | 0x1;
+        else if (func3 == 7 && rd == rs1 && isCReg(rd) && fitsSigned(immI, 6)) // C.ANDI
+            r = (0x4 << 13) | field(immI, 5, 5, 12) | (0x2 << 10) | ((rd - 8) << 7) | field(immI, 4, 0, 2) | 0x1;
+        break;
+
+    case 0x33: // R type
+        if (rd == rs1 && isCReg(rd) && isCReg(rs2) && ((func7 == 0x20 && func3 == 0) || (func7 == 0 && (func3 == 4 || func3 == 6 || func3 == 7))))
+        {
+            uint32_t funct2 = (func7 == 0x20) ? 0 : (func3 == 4) ? 1
+                                                  : (func3 == 6) ? 2
+                                                                 : 3; // C.SUB, C.XOR, C.OR, C.AND
+            r = (0x4 << 13) | (0x3 << 10) | ((rd - 8) << 7) | (funct2 << 5) | ((rs2 - 8) << 2) | 0x1;
+        }
+        else if (func7 == 0 && func3 == 0 && rd != 0)
+        {
+            if (rs1 == 0 && rs2 != 0) // C.MV
+                r = (0x4 << 13) | (rd << 7) | (rs2 << 2) | 0x2;
+            else if (rd == rs1 && rs2 != 0) // C.ADD
+                r = (0x4 << 13) | (1 << 12) | (rd << 7) | (rs2 << 2) | 0x2;
+            else if (rd == rs2 && rs1 != 0) // C.ADD (ADD is commutative)
+                r = (0x4 << 13) | (1 << 12) | (rd << 7) | (rs1 << 2) | 0x2;
+        }
+        break;
+
+    case 0x03: // LW
+        if (func3 != 2)
+            break;
+        if (rs1 == 2 && rd != 0 && immI >= 0 && immI < 256 && immI % 4 == 0) // C.LWSP
+            r = (0x2 << 13) | field(immI, 5, 5, 12) | (rd << 7) | field(immI, 4, 2, 4) | field(immI, 7, 6, 2) | 0x2;
+        else if (isCReg(rd) && isCReg(rs1) && immI >= 0 && immI < 128 && immI % 4 == 0) // C.LW
+            r = (0x2 << 13) | field(immI, 5, 3, 10) | ((rs1 - 8) << 7) | field(immI, 2, 2, 6) | field(immI, 6, 6, 5) | ((rd - 8) << 2);
+        break;
+
+    case 0x23: // SW
+        if (func3 != 2)
+            break;
+        if (rs1 == 2 && immS >= 0 && immS < 256 && immS % 4 == 0) // C.SWSP
+            r = (0x6 << 13) | field(immS, 5, 2, 9) | field(immS, 7, 6, 7) | (rs2 << 2) | 0x2;
+        else if (isCReg(rs1) && isCReg(rs2) && immS >= 0 && immS < 128 && immS % 4 == 0) // C.SW
+            r = (0x6 << 13) | field(immS, 5, 3, 10) | ((rs1 - 8) << 7) | field(immS, 2, 2, 6) | field(immS, 6, 6, 5) | ((rs2 - 8) << 2);
+        break;
+
+    case 0x37: // LUI
+        if (rd != 0 && rd != 2 && immU != 0 && fitsSigned(immU, 6)) // C.LUI
+            r = (0x3 << 13) | field(immU, 5, 5, 12) | (rd << 7) | field(immU, 4, 0, 2) | 0x1;
+        break;
+
+    case 0x6F: // JAL
+        if ((rd == 0 || rd == 1) && fitsSigned(immJ, 12)) // C.J, C.JAL
+            r = ((rd == 0 ? 0x5u : 0x1u) << 13) | field(immJ, 11, 11, 12) | field(immJ, 4, 4, 11) | field(immJ, 9, 8, 9) | field(immJ, 10, 10, 8) |
+                field(immJ, 6, 6, 7) | field(immJ, 7, 7, 6) | field(immJ, 3, 1, 3) | field(immJ, 5, 5, 2) | 0x1;
+        break;
+
+    case 0x67: // JALR
+        if (immI == 0 && rs1 != 0 && (rd == 0 || rd == 1)) // C.JR, C.JALR
+            r = (0x4 << 13) | (rd << 12) | (rs1 << 7) | 0x2;
+        break;
+
+    case 0x63: // BEQ, BNE against x0
+        if ((func3 == 0 || func3 == 1) && rs2 == 0 && isCReg(rs1) && fitsSigned(immB, 9)) // C.BEQZ, C.BNEZ
+            r = ((0x6 + func3) << 13) | field(immB, 8, 8, 12) | field(immB, 4, 3, 10) | ((rs1 - 8) << 7) |
+                field(immB, 7, 6, 5) | field(immB, 2, 1, 3) | field(immB, 5, 5, 2) | 0x1;
+        break;
+    }
+
+    if (r == 0)
+        return false;
+    c = static_cast<uint16_t>(r);
+    return true;
+}
+
 /* Parse Instructions*/
-// Removes comments as they start with '#' (if present)
+// Removes comments as they start with '#' (if present), ignoring '#' inside string literals
 string stripComment(const string &line)
 {
-    size_t pos = line.find("#");
-    if (pos != string::npos)
-        return line.substr(0, pos);
+    bool inString = false;
+    for (size_t pos = 0; pos < line.size(); pos++)
+    {
+        if (line[pos] == '"' && (pos == 0 || line[pos - 1] != '\\'))
+            inString = !inString;
+        else if (line[pos] == '#' && !inString)
+            return line.substr(0, pos);
+    }
     return line;
 }
 
-// Splits on tabs and spaces
+// Splits on tabs and spaces (keeps relocation operators like %hi(sym) and expressions like "N * 4" in one token)
 vector<string> tokenize(const string &line)
 {
+    static const char *operators = "+-*/%&|^<>";
     vector<string> tokens;
     string tok;
-    for (char ch : line)
+    for (size_t i = 0; i < line.size(); i++)
     {
+        char ch = line[i];
+        if (isspace(ch) && !tok.empty() && !tokens.empty())
+        {
+            // Spaces around a binary operator of an operand do not end it (but "-4" after a space starts a new one):
+            size_t next = line.find_first_not_of(" \t", i), end = next;
+            while (end < line.size() && strchr(operators, line[end]))
+                end++;
+            bool operatorAhead = next != string::npos && end > next && end < line.size() && isspace(line[end]);
+            if (operatorAhead || strchr(operators, tok.back()))
+                continue;
+        }
+        if (ch == '(')
+        {
+            // A register in parentheses is the base of a memory operand (8(sp)), anything else belongs to the
+            // expression before it (%hi(sym), (N+1)*4) and is kept without its spaces:
+            size_t close = i, depth = 0;
+            for (; close < line.size(); close++)
+                if (line[close] == '(')
+                    depth++;
+                else if (line[close] == ')' && --depth == 0)
+                    break;
+            string inner;
+            for (size_t k = i + 1; k < close && close < line.size(); k++)
+                if (!isspace(line[k]))
+                    inner += line[k];
+            if (close < line.size() && !regMap.count(inner))
+            {
+                tok += "(" + inner + ")";
+                i = close;
+                continue;
+            }
+        }
         if (isspace(ch) || ch == ',' || ch == '(' || ch == ')')
         {
             if (!tok.empty())
@@ -297,112 +546,135 @@ vector<string> expandPseudo(const vector<string> &tokens)
     {
         if (tokens.size() == 3)
             return {"addi", tokens[1], tokens[2], "0"};
-        cerr << "Error: mv requires 2 operands\n";
+        reportError("mv requires 2 operands");
         return {};
     }
     else if (mne == "li")
     {
         if (tokens.size() == 3)
             return {"addi", tokens[1], "x0", tokens[2]};
-        cerr << "Error: li requires 2 operands\n";
+        reportError("li requires 2 operands");
         return {};
     }
     else if (mne == "j")
     {
         if (tokens.size() == 2)
             return {"jal", "x0", tokens[1]};
-        cerr << "Error: j requires 1 operand\n";
+        reportError("j requires 1 operand");
         return {};
     }
     else if (mne == "jr")
     {
         if (tokens.size() == 2)
             return {"jalr", "x0", "0", tokens[1]};
-        cerr << "Error: jr requires 1 operand\n";
+        reportError("jr requires 1 operand");
         return {};
     }
     else if (mne == "ret")
     {
         if (tokens.size() == 1)
             return {"jalr", "x0", "0", "ra"};
-        cerr << "Error: ret requires NO operands\n";
+        reportError("ret requires NO operands");
         return {};
     }
     else if (mne == "nop")
     {
         if (tokens.size() == 1)
             return {"addi", "x0", "x0", "0"};
-        cerr << "Error: nop requires NO operands\n";
+        reportError("nop requires NO operands");
         return {};
     }
     else if (mne == "ble")
     {
         if (tokens.size() == 4)
             return {"bge", tokens[2], tokens[1], tokens[3]};
-        cerr << "Error: ble requires 3 operands\n";
+        reportError("ble requires 3 operands");
         return {};
     }
     else if (mne == "bgt")
     {
         if (tokens.size() == 4)
             return {"blt", tokens[2], tokens[1], tokens[3]};
-        cerr << "Error: bgt requires 3 operands\n";
+        reportError("bgt requires 3 operands");
         return {};
     }
     else if (mne == "beqz")
     {
         if (tokens.size() == 3)
             return {"beq", tokens[1], "x0", tokens[2]};
-        cerr << "Error: beqz requires 2 operands\n";
+        reportError("beqz requires 2 operands");
         return {};
     }
     else if (mne == "bnez")
     {
         if (tokens.size() == 3)
             return {"bne", tokens[1], "x0", tokens[2]};
-        cerr << "Error: bnez requires 2 operands\n";
+        reportError("bnez requires 2 operands");
         return {};
     }
     else if (mne == "bgez")
     {
         if (tokens.size() == 3)
             return {"bge", tokens[1], "x0", tokens[2]};
-        cerr << "Error: bgez requires 2 operands\n";
+        reportError("bgez requires 2 operands");
         return {};
     }
     else if (mne == "bltz")
     {
         if (tokens.size() == 3)
             return {"blt", tokens[1], "x0", tokens[2]};
-        cerr << "Error: bltz requires 2 operands\n";
+        reportError("bltz requires 2 operands");
         return {};
     }
     else if (mne == "seqz")
     {
         if (tokens.size() == 3)
             return {"sltiu", tokens[1], tokens[2], "1"};
-        cerr << "Error: seqz requires 2 operands\n";
+        reportError("seqz requires 2 operands");
         return {};
     }
     else if (mne == "snez")
     {
         if (tokens.size() == 3)
             return {"sltu", tokens[1], "x0", tokens[2]};
-        cerr << "Error: snez requires 2 operands\n";
+        reportError("snez requires 2 operands");
         return {};
     }
     else if (mne == "sltz")
     {
         if (tokens.size() == 3)
             return {"slt", tokens[1], tokens[2], "x0"};
-        cerr << "Error: sltz requires 2 operands\n";
+        reportError("sltz requires 2 operands");
         return {};
     }
     else if (mne == "sgtz")
     {
         if (tokens.size() == 3)
             return {"slt", tokens[1], "x0", tokens[2]};
-        cerr << "Error: sgtz requires 2 operands\n";
+        reportError("sgtz requires 2 operands");
+        return {};
+    }
+    else if (mne == "csrr")
+    {
+        if (tokens.size() == 3)
+            return {"csrrs", tokens[1], tokens[2], "x0"};
+        reportError("csrr requires 2 operands");
+        return {};
+    }
+    else if (mne == "csrw" || mne == "csrs" || mne == "csrc" || mne == "csrwi" || mne == "csrsi" || mne == "csrci")
+    {
+        // csrw csr, rs -> csrrw x0, csr, rs (and alike)
+        if (tokens.size() == 3)
+            return {"csrr" + mne.substr(3), "x0", tokens[1], tokens[2]};
+        reportError(mne + " requires 2 operands");
+        return {};
+    }
+    else if (mne == "rdcycle" || mne == "rdcycleh" || mne == "rdtime" || mne == "rdtimeh" || mne == "rdinstret" ||
+             mne == "rdinstreth")
+    {
+        if (tokens.size() == 2)
+            return {"csrrs", tokens[1], mne.substr(2), "x0"};
+        reportError(mne + " requires 1 operand");
         return {};
     }
     return tokens; // Unchanged if NOT a pseudo-instruction
@@ -413,6 +685,239 @@ bool validReg(const string &tok)
     return (regMap.find(tok) != regMap.end());
 }
 
+// Parses a numeric literal (decimal, 0x hex, 0b binary)
+bool parseNumber(const string &tok, int64_t &value)
+{
+    if (tok.empty() || !(isdigit(tok[0]) || ((tok[0] == '-' || tok[0] == '+') && tok.size() > 1 && isdigit(tok[1]))))
+        return false;
+    try
+    {
+        size_t used = 0;
+        bool negative = (tok[0] == '-');
+        string digits = (tok[0] == '-' || tok[0] == '+') ? tok.substr(1) : tok;
+        if (digits.size() > 2 && digits[0] == '0' && (digits[1] == 'b' || digits[1] == 'B'))
+            value = stoll(digits.substr(2), &used, 2), used += 2;
+        else
+            value = stoll(digits, &used, 0);
+        if (negative)
+            value = -value;
+        return used == digits.size();
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+// Constant expressions (written without spaces, or inside parentheses): numbers, labels and %hi(x)/%lo(x) with
+// the C operators | ^ & << >> + - * / % and unary - ~, by C precedence. Labels are left out where the value must be
+// known in pass one (.rept counts, .space sizes), as they may still move.
+struct ExprParser
+{
+    const string &text;
+    bool labels;
+    size_t pos = 0;
+    string error;
+    bool usedLabel = false; // A label's address went into the value
+
+    ExprParser(const string &t, bool allowLabels) : text(t), labels(allowLabels) {}
+
+    bool fail(const string &message)
+    {
+        if (error.empty())
+            error = message;
+        return false;
+    }
+
+    bool parse(int64_t &value)
+    {
+        if (!binary(0, value))
+            return false;
+        if (pos != text.size())
+            return fail("invalid expression '" + text + "'");
+        return true;
+    }
+
+    // Binary operators of one precedence level (lowest first) over the levels above it
+    bool binary(size_t level, int64_t &value)
+    {
+        static const vector<vector<string>> levels = {{"|"}, {"^"}, {"&"}, {"<<", ">>"}, {"+", "-"}, {"*", "/", "%"}};
+        if (level == levels.size())
+            return unary(value);
+        if (!binary(level + 1, value))
+            return false;
+        while (true)
+        {
+            string op;
+            for (auto &o : levels[level])
+                if (text.compare(pos, o.size(), o) == 0)
+                    op = o;
+            if (op.empty())
+                return true;
+            pos += op.size();
+            int64_t rhs;
+            if (!binary(level + 1, rhs))
+                return false;
+            if ((op == "/" || op == "%") && rhs == 0)
+                return fail("division by zero in '" + text + "'");
+            if (op == "|")
+                value |= rhs;
+            else if (op == "^")
+                value ^= rhs;
+            else if (op == "&")
+                value &= rhs;
+            else if (op == "<<")
+                value = static_cast<int64_t>(static_cast<uint64_t>(value) << (rhs & 63));
+            else if (op == ">>")
+                value >>= (rhs & 63);
+            else if (op == "+")
+                value += rhs;
+            else if (op == "-")
+                value -= rhs;
+            else if (op == "*")
+                value *= rhs;
+            else if (op == "/")
+                value = (rhs == -1) ? -value : value / rhs;
+            else
+                value = (rhs == -1) ? 0 : value % rhs;
+        }
+    }
+
+    bool unary(int64_t &value)
+    {
+        if (pos < text.size() && (text[pos] == '-' || text[pos] == '+' || text[pos] == '~'))
+        {
+            char op = text[pos++];
+            if (!unary(value))
+                return false;
+            value = (op == '-') ? -value : (op == '~') ? ~value : value;
+            return true;
+        }
+        bool reloc = text.compare(pos, 4, "%hi(") == 0 || text.compare(pos, 4, "%lo(") == 0;
+        if (reloc || (pos < text.size() && text[pos] == '('))
+        {
+            bool hi = reloc && text[pos + 1] == 'h';
+            pos += reloc ? 4 : 1;
+            if (!binary(0, value))
+                return false;
+            if (pos >= text.size() || text[pos] != ')')
+                return fail("missing ')' in '" + text + "'");
+            pos++;
+            uint32_t v = static_cast<uint32_t>(value);
+            if (reloc && hi)
+                value = ((v + 0x800) >> 12) & 0xFFFFF; // Compensates the sign of %lo
+            else if (reloc)
+                value = static_cast<int32_t>(v << 20) >> 20; // Sign extended low 12 bits
+            return true;
+        }
+
+        // Number or symbol:
+        size_t start = pos;
+        while (pos < text.size() && (isalnum(static_cast<unsigned char>(text[pos])) || text[pos] == '_' || text[pos] == '.' || text[pos] == '$'))
+            pos++;
+        string tok = text.substr(start, pos - start);
+        if (tok.empty())
+            return fail("invalid expression '" + text + "'");
+        if (parseNumber(tok, value))
+            return true;
+        if (labels && labelMap.find(tok) != labelMap.end())
+        {
+            value = labelMap[tok];
+            usedLabel = true;
+            return true;
+        }
+        if (!labels && labelMap.find(tok) != labelMap.end())
+            return fail("label '" + tok + "' in an expression that needs a constant");
+        return fail("invalid immediate or unknown symbol '" + tok + "'");
+    }
+};
+
+// Value of an expression without labels, or false (nothing is reported)
+bool evalConstant(const string &expr, int64_t &value)
+{
+    return ExprParser(expr, false).parse(value);
+}
+
+// Resolves an immediate operand: number, label (absolute address) or an expression of them
+bool resolveImm(const string &tok, int32_t &value)
+{
+    int64_t number;
+    if (parseNumber(tok, number))
+    {
+        value = static_cast<int32_t>(number);
+        return true;
+    }
+
+    if (labelMap.find(tok) != labelMap.end())
+    {
+        value = labelMap[tok];
+        return true;
+    }
+
+    ExprParser expr(tok, true);
+    if (!expr.parse(number))
+    {
+        reportError(expr.error);
+        return false;
+    }
+    value = static_cast<int32_t>(number);
+    return true;
+}
+
+// Branch/jump target: an expression with labels is an address (made relative to pc), one without is the offset
+bool resolveTarget(const string &tok, int pc, int32_t &offset)
+{
+    int64_t value;
+    ExprParser expr(tok, true);
+    if (!expr.parse(value))
+    {
+        reportError(expr.error);
+        return false;
+    }
+    offset = static_cast<int32_t>(expr.usedLabel ? value - pc : value);
+    return true;
+}
+
+// True if the expression uses a label's address (its value changes with the layout)
+bool usesLabel(const string &tok)
+{
+    int64_t value;
+    ExprParser expr(tok, true);
+    return expr.parse(value) && expr.usedLabel;
+}
+
+// CSR operand: a name from csrNames or a 12 bit number (constant expressions allowed)
+bool resolveCSR(const string &tok, uint32_t &csr)
+{
+    auto it = csrNames.find(tok);
+    if (it != csrNames.end())
+    {
+        csr = it->second;
+        return true;
+    }
+    int64_t value;
+    if (!evalConstant(tok, value) || value < 0 || value > 0xFFF)
+    {
+        reportError("unknown CSR '" + tok + "'");
+        return false;
+    }
+    csr = value;
+    return true;
+}
+
+// Pseudo-instructions that need two instructions (expanded in pass one, as their size must be known there)
+vector<string> expandMultiPseudo(const vector<string> &tokens)
+{
+    if (tokens.size() != 3 || (tokens[0] != "la" && tokens[0] != "li"))
+        return {};
+
+    int64_t value;
+    if (tokens[0] == "li" && evalConstant(tokens[2], value) && value >= -2048 && value <= 2047)
+        return {}; // Fits in a single ADDI
+    return {"lui " + tokens[1] + ", %hi(" + tokens[2] + ")",
+            "addi " + tokens[1] + ", " + tokens[1] + ", %lo(" + tokens[2] + ")"};
+}
+
 bool parseInstructionLine(const string &line, uint32_t &machineCode, int pc)
 {
     // Remove comments:
@@ -427,6 +932,8 @@ bool parseInstructionLine(const string &line, uint32_t &machineCode, int pc)
 
     // Expand pseudo-instructions:
     tokens = expandPseudo(tokens);
+    if (tokens.empty())
+        return false;
     string mne = tokens[0];
     if (rMap.find(mne) != rMap.end())
     {
@@ -450,7 +957,9 @@ bool parseInstructionLine(const string &line, uint32_t &machineCode, int pc)
         }
         uint32_t rd = regMap[tokens[1]];
         uint32_t rs1 = regMap[tokens[2]];
-        uint32_t imm = stoi(tokens[3]);
+        int32_t imm;
+        if (!resolveImm(tokens[3], imm))
+            return false;
         machineCode = encodeIArith(rd, rs1, imm, spec);
         return true;
     }
@@ -463,7 +972,9 @@ bool parseInstructionLine(const string &line, uint32_t &machineCode, int pc)
         }
         uint32_t rd = regMap[tokens[1]];
         uint32_t rs1 = regMap[tokens[2]];
-        uint32_t shamt = stoi(tokens[3]);
+        int32_t shamt;
+        if (!resolveImm(tokens[3], shamt))
+            return false;
         machineCode = encodeIShift(rd, rs1, shamt, spec);
         return true;
     }
@@ -475,7 +986,9 @@ bool parseInstructionLine(const string &line, uint32_t &machineCode, int pc)
             return false;
         }
         uint32_t rd = regMap[tokens[1]];
-        int32_t imm = stoi(tokens[2]);
+        int32_t imm;
+        if (!resolveImm(tokens[2], imm))
+            return false;
         uint32_t rs1 = regMap[tokens[3]];
         machineCode = encodeL(rd, rs1, imm, spec);
         return true;
@@ -488,7 +1001,9 @@ bool parseInstructionLine(const string &line, uint32_t &machineCode, int pc)
             return false;
         }
         uint32_t rs2 = regMap[tokens[1]];
-        int32_t imm = stoi(tokens[2]);
+        int32_t imm;
+        if (!resolveImm(tokens[2], imm))
+            return false;
         uint32_t rs1 = regMap[tokens[3]];
         machineCode = encodeS(rs1, rs2, imm, spec);
         return true;
@@ -504,19 +1019,12 @@ bool parseInstructionLine(const string &line, uint32_t &machineCode, int pc)
         uint32_t rs2 = regMap[tokens[2]];
         int32_t imm;
 
-        // Handle label or immediate
-        if (labelMap.find(tokens[3]) != labelMap.end())
-            imm = labelMap[tokens[3]] - pc;
-        else if (isdigit(tokens[3][0]) || tokens[3][0] == '-')
-            imm = stoi(tokens[3]);
-        else
-        {
-            cerr << "Unknown label: " << tokens[3] << "\n";
+        // Label expression or offset
+        if (!resolveTarget(tokens[3], pc, imm))
             return false;
-        }
         if (imm % 2)
         {
-            cerr << "Branch target NOT aligned: " << tokens[3] << "\n";
+            reportError("branch target not aligned: " + tokens[3]);
             return false;
         }
         machineCode = encodeB(rs1, rs2, imm, spec);
@@ -532,19 +1040,12 @@ bool parseInstructionLine(const string &line, uint32_t &machineCode, int pc)
         uint32_t rd = regMap[tokens[1]];
         int32_t imm;
 
-        // Handle label or immediate
-        if (labelMap.find(tokens[2]) != labelMap.end())
-            imm = labelMap[tokens[2]] - pc;
-        else if (isdigit(tokens[2][0]) || tokens[2][0] == '-')
-            imm = stoi(tokens[2]);
-        else
-        {
-            cerr << "Unknown label: " << tokens[2] << "\n";
+        // Label expression or offset
+        if (!resolveTarget(tokens[2], pc, imm))
             return false;
-        }
         if (imm % 2)
         {
-            cerr << "Jump target NOT aligned: " << tokens[2] << "\n";
+            reportError("jump target not aligned: " + tokens[2]);
             return false;
         }
         machineCode = encodeJAL(rd, imm, spec);
@@ -558,93 +1059,1071 @@ bool parseInstructionLine(const string &line, uint32_t &machineCode, int pc)
             return false;
         }
         uint32_t rd = regMap[tokens[1]];
-        int32_t imm = stoi(tokens[2]);
+        int32_t imm;
+        if (!resolveImm(tokens[2], imm))
+            return false;
         uint32_t rs1 = regMap[tokens[3]];
         machineCode = encodeJALR(rs1, rd, imm, spec);
         return true;
     }
-    cerr << "Unknown instruction with the mnemonic \' " << mne << " \'\n";
-    return false;
-}
-
-void printUsage()
-{
-    cout << RED << "Usage:\n"
-         << RESET;
-    cout << BLUE << "  RISC-V_Assembler [-i <inputfile>] [-o <outputfile>]\n\n";
-    cout << "Options:\n";
-    cout << "  -i <inputfile>   :  Input assembly file (default: assemblyCode.txt)\n";
-    cout << "  -o <outputfile>  :  Output machine code file (default: machineCode.txt)\n";
-    cout << "  -h --help        :  Show this help message\n"
-         << RESET;
-}
-
-int main(int argc, char *argv[])
-{
-    printf(BOLD RED "  RISC-V_Assembler (by anuragmishra-creates)\n" RESET);
-    string inputFileName = "assemblyCode.txt", outputFileName = "machineCode.txt";
-    for (int i = 1; i < argc; i++)
+    else if (uMap.find(mne) != uMap.end())
     {
-        string arg = argv[i];
-        if (arg == "-i")
+        USpec spec = uMap[mne];
+        if (tokens.size() != 3 || !validReg(tokens[1]))
         {
-            if (i + 1 < argc)
-                inputFileName = argv[++i];
-            else
-            {
-                cerr << RED << "Error: -i requires a filename.\n"
-                     << RESET;
-                return 1;
-            }
+            return false;
         }
-        else if (arg == "-o")
+        uint32_t rd = regMap[tokens[1]];
+        int32_t imm;
+        if (!resolveImm(tokens[2], imm))
+            return false;
+        machineCode = encodeU(rd, imm, spec);
+        return true;
+    }
+    else if (csrMap.find(mne) != csrMap.end())
+    {
+        CSRSpec spec = csrMap[mne];
+        if (tokens.size() != 4 || !validReg(tokens[1]) || (!spec.immediate && !validReg(tokens[3])))
         {
-            if (i + 1 < argc)
-                outputFileName = argv[++i];
-            else
+            return false;
+        }
+        uint32_t rd = regMap[tokens[1]];
+        uint32_t csr;
+        if (!resolveCSR(tokens[2], csr))
+            return false;
+        uint32_t src;
+        if (spec.immediate)
+        {
+            int32_t imm;
+            if (!resolveImm(tokens[3], imm))
+                return false;
+            if (imm < 0 || imm > 31)
             {
-                cerr << RED << "Error: -o requires a filename.\n"
-                     << RESET;
-                return 1;
+                reportError("CSR immediate " + tokens[3] + " does not fit in 5 bits (0..31)");
+                return false;
             }
+            src = imm;
         }
-        else if (arg == "-h" || arg == "--help")
+        else
+            src = regMap[tokens[3]];
+        machineCode = encodeCSR(rd, src, csr, spec);
+        return true;
+    }
+    else if (mne == "sfence.vma") // sfence.vma [rs1[, rs2]]: virtual address and ASID, all by default
+    {
+        if (tokens.size() > 3 || (tokens.size() > 1 && !validReg(tokens[1])) || (tokens.size() > 2 && !validReg(tokens[2])))
         {
-            printUsage();
-            return 0;
+            return false;
         }
-        else
+        uint32_t rs1 = tokens.size() > 1 ? regMap[tokens[1]] : 0, rs2 = tokens.size() > 2 ? regMap[tokens[2]] : 0;
+        machineCode = 0x12000073 | (rs2 << 20) | (rs1 << 15);
+        return true;
+    }
+    else if (sysMap.find(mne) != sysMap.end())
+    {
+        if (tokens.size() != 1)
         {
-            cerr << RED << "Unknown argument: " << arg << "\n"
-                 << RESET;
-            printUsage();
-            return 1;
+            return false;
         }
+        machineCode = sysMap[mne];
+        return true;
     }
+    reportError("unknown instruction '" + mne + "'");
+    return false;
+}
 
-    cout << MAGENTA << "   >>> Assembler Started <<<\n"
-         << RESET;
-    cout << CYAN << "Input File : " << GREEN << inputFileName << "\n"
-         << RESET;
-    cout << CYAN << "Output File: " << GREEN << outputFileName << "\n"
-         << RESET;
+/* Sections and Directives */
+enum Section
+{
+    TEXT = 0,
+    DATA = 1
+};
+// The simulator is Harvard: .text goes to Instruction Memory and .data to the separate Data Memory
+static const uint32_t sectionBase[2] = {0x00000000, 0x00000000};
 
-    // Real assembler code starts here:
-    int pc = 0;
-    vector<string> allLines;
-    string line;
+// Texts of the lines kept for pass 2, each distinct text stored once: the lines a .rept or a macro
+// expands to are mostly the same, so a line costs an index rather than a copy of its text
+deque<string> lineTexts; // A deque, so the views in textIndex stay valid as it grows
+unordered_map<string_view, uint32_t> textIndex;
 
-    ifstream inFile(inputFileName);
-    if (!inFile)
-    {
-        cerr << "Error : Could NOT open the input file: 'assemblyCode.txt'\n";
-        return 1;
+uint32_t internText(const string &text)
+{
+    auto it = textIndex.find(text);
+    if (it != textIndex.end())
+        return it->second;
+    lineTexts.push_back(text);
+    uint32_t id = static_cast<uint32_t>(lineTexts.size() - 1);
+    textIndex.emplace(lineTexts.back(), id);
+    return id;
+}
+
+// A line kept for pass 2 (label, instruction or data directive) with its address and size:
+enum LineKind
+{
+    LABEL,
+    INSTRUCTION,
+    DIRECTIVE
+};
+struct SourceLine
+{
+    uint32_t textId; // Into lineTexts
+    LineKind kind;
+    Section section;
+    uint32_t addr;
+    uint32_t size;  // Instructions: 4, or 2 once compressed
+    int lineNo = 0; // Line in the source file (for diagnostics and the debug file)
+
+    const string &text() const
+    {
+        return lineTexts[textId];
+    }
+};
+
+// Reads the string literal of .string/.ascii (with C escapes)
+bool parseStringLiteral(const string &line, string &out)
+{
+    size_t start = line.find('"');
+    if (start == string::npos)
+        return false;
+    out.clear();
+    for (size_t i = start + 1; i < line.size(); i++)
+    {
+        char ch = line[i];
+        if (ch == '"')
+            return true;
+        if (ch == '\\' && i + 1 < line.size())
+        {
+            char esc = line[++i];
+            if (esc == 'n')
+                ch = '\n';
+            else if (esc == 't')
+                ch = '\t';
+            else if (esc == 'r')
+                ch = '\r';
+            else if (esc == '0')
+                ch = '\0';
+            else
+                ch = esc; // \\ and \"
+        }
+        out += ch;
+    }
+    return false; // Missing closing quote
+}
+
+// Number of bytes a data directive occupies (-1 if the line is not a data directive)
+int64_t directiveSize(const vector<string> &tokens, const string &line, uint32_t addr)
+{
+    string dir = tokens[0];
+    size_t count = tokens.size() - 1;
+    int64_t n = 0;
+
+    if (dir == ".word")
+        return 4 * count;
+    if (dir == ".half" || dir == ".short")
+        return 2 * count;
+    if (dir == ".byte")
+        return count;
+    if (dir == ".string" || dir == ".asciz" || dir == ".ascii")
+    {
+        string str;
+        if (!parseStringLiteral(line, str))
+            return -1;
+        return str.size() + (dir == ".ascii" ? 0 : 1);
+    }
+    if (dir == ".space" || dir == ".zero")
+        return (count == 1 && evalConstant(tokens[1], n) && n >= 0) ? n : -1;
+    if (dir == ".align" || dir == ".p2align" || dir == ".balign")
+    {
+        if (count != 1 || !evalConstant(tokens[1], n) || n < 0 || n > (dir == ".balign" ? INT64_C(0x80000000) : 31))
+            return -1;
+        uint32_t alignment = (dir == ".balign") ? n : (1u << n); // .align is a power of two on RISC-V
+        if (alignment == 0 || (alignment & (alignment - 1)))
+            return -1;
+        return (alignment - addr % alignment) % alignment;
+    }
+    return -1;
+}
+
+// Emits the bytes of a data directive at its address
+bool emitDirective(const SourceLine &sl, vector<uint8_t> &bytes)
+{
+    vector<string> tokens = tokenize(sl.text());
+    string dir = tokens[0];
+    uint32_t off = sl.addr - sectionBase[sl.section];
+
+    int width = (dir == ".word") ? 4 : (dir == ".half" || dir == ".short") ? 2
+                                   : (dir == ".byte")                     ? 1
+                                                                          : 0;
+    if (width)
+    {
+        for (size_t i = 1; i < tokens.size(); i++, off += width)
+        {
+            int32_t value;
+            if (!resolveImm(tokens[i], value))
+                return false;
+            for (int b = 0; b < width; b++)
+                bytes[off + b] = (static_cast<uint32_t>(value) >> (8 * b)) & 0xFF;
+        }
+        return true;
+    }
+    if (dir == ".string" || dir == ".asciz" || dir == ".ascii")
+    {
+        string str;
+        parseStringLiteral(sl.text(), str);
+        memcpy(bytes.data() + off, str.data(), str.size()); // The terminating zero is already there
+        return true;
+    }
+    // .space/.zero/.align: the section is zero filled, except alignment padding in .text which uses NOPs
+    if (sl.section == TEXT && dir != ".space" && dir != ".zero")
+        for (uint32_t i = 0; i + 2 <= sl.size; i += (i + 4 <= sl.size && (off + i) % 4 == 0) ? 4 : 2)
+        {
+            uint32_t nop = (i + 4 <= sl.size && (off + i) % 4 == 0) ? 0x00000013 : 0x0001; // NOP or C.NOP
+            memcpy(bytes.data() + off + i, &nop, (nop == 0x0001) ? 2 : 4);
+        }
+    return true;
+}
+
+/* Constants and Macros */
+// .equ/.set/.equiv symbols: a number, or a parenthesized expression when it uses labels (placed in pass 2)
+unordered_map<string, string> constMap;
+
+// Replaces the constants in the operands of a line (not in a label, the mnemonic, the name a .equ defines or a string)
+string substituteConstants(const string &line)
+{
+    if (constMap.empty())
+        return line;
+    string out;
+    int skip = 1; // Identifiers left before the operands: the mnemonic (plus the name of a .equ)
+    bool inString = false;
+    for (size_t i = 0; i < line.size();)
+    {
+        char ch = line[i];
+        if (ch == '"' && (i == 0 || line[i - 1] != '\\'))
+            inString = !inString;
+        bool identStart = isalpha(static_cast<unsigned char>(ch)) || ch == '_' || ch == '.' || ch == '$';
+        if (inString || !(identStart || isdigit(static_cast<unsigned char>(ch))))
+        {
+            out += line[i++];
+            continue;
+        }
+        size_t start = i;
+        while (i < line.size() && (isalnum(static_cast<unsigned char>(line[i])) || line[i] == '_' || line[i] == '.' || line[i] == '$'))
+            i++;
+        string word = line.substr(start, i - start);
+        bool reloc = start > 0 && line[start - 1] == '%'; // %hi, %lo
+        if (!identStart || reloc)
+            out += word;
+        else if (i < line.size() && line[i] == ':' && skip == 1 && out.find_first_not_of(" \t") == string::npos)
+            out += word; // Label
+        else if (skip > 0)
+        {
+            out += word;
+            skip += (word == ".equ" || word == ".set" || word == ".equiv") ? 0 : -1;
+        }
+        else
+        {
+            auto it = constMap.find(word);
+            out += (it != constMap.end()) ? it->second : word;
+        }
+    }
+    return out;
+}
+
+// .equ/.set <name>, <expression> (redefinable) and .equiv (defined once), after substituteConstants()
+void defineConstant(const vector<string> &tokens, const string &line)
+{
+    size_t comma = line.find(',');
+    if (tokens.size() < 3 || comma == string::npos)
+    {
+        reportError(tokens[0] + " requires a name and a value");
+        return;
+    }
+    const string &name = tokens[1];
+    if (tokens[0] == ".equiv" && constMap.count(name))
+    {
+        reportError("constant '" + name + "' redefined");
+        return;
+    }
+    if (labelMap.count(name))
+    {
+        reportError("constant '" + name + "' is already a label");
+        return;
     }
+    string expr;
+    for (size_t i = comma + 1; i < line.size(); i++)
+        if (!isspace(static_cast<unsigned char>(line[i])))
+            expr += line[i];
+    int64_t value;
+    constMap[name] = evalConstant(expr, value) ? to_string(value) : "(" + expr + ")";
+}
+
+/*
+    Streams the source lines with the macros, .rept and .irp blocks expanded on the fly: a block keeps only its
+    body text and replays it, so a million-instruction unrolled loop is never held in memory as text.
+      .macro name a, b=1  ...  .endm   Defines a macro, used as "name x, y" with \a, \b replaced by the arguments
+                                       (\@ is a unique number per expansion, \() separates an argument from text)
+      .rept <count>  ...  .endr        Repeats the body
+      .irp sym, v1, v2  ...  .endr     Repeats the body with \sym replaced by each value
+    Expanded lines report the source line that started the outermost expansion.
+*/
+class SourceReader
+{
+    struct Macro
+    {
+        vector<string> params, defaults;
+        shared_ptr<const vector<string>> body;
+    };
+    struct Frame
+    {
+        shared_ptr<const vector<string>> body;
+        size_t next = 0;
+        int64_t passes = 1;              // Passes of the body left, including the current one
+        vector<pair<string, string>> args; // \name -> value
+        string irpName;                  // .irp: the symbol, with its values below
+        vector<string> irpValues;
+        string unique; // \@
+        int line = 0;  // Source line that started the expansion
+    };
+    static const size_t maxDepth = 256;
+
+    istream &in;
+    unordered_map<string, Macro> macros;
+    vector<Frame> frames;
+    string pending; // Rest of a line after its label ("loop: .rept 4")
+    int expansions = 0;
+    int fileLine = 0;
 
-    // First pass to find all the labels and their addresses
-    while (getline(inFile, line))
+    // The next line before expansion: from the innermost block (arguments replaced) or the file
+    bool rawLine(string &line)
     {
-        string filtered = stripComment(line);
+        if (!pending.empty())
+        {
+            line = pending;
+            pending.clear();
+            return true;
+        }
+        while (!frames.empty())
+        {
+            Frame &f = frames.back();
+            if (f.next == f.body->size())
+            {
+                if (--f.passes <= 0)
+                {
+                    frames.pop_back();
+                    continue;
+                }
+                f.next = 0;
+                if (!f.irpName.empty())
+                    f.args[0].second = f.irpValues[f.irpValues.size() - f.passes];
+            }
+            line = substituteArgs((*f.body)[f.next++], f);
+            sourceLineNo = lineNo = frames.front().line;
+            return true;
+        }
+        if (!getline(in, line))
+            return false;
+        sourceLineNo = lineNo = ++fileLine;
+        return true;
+    }
+
+    static string substituteArgs(const string &text, const Frame &f)
+    {
+        if (text.find('\\') == string::npos)
+            return text;
+        string out;
+        for (size_t i = 0; i < text.size(); i++)
+        {
+            if (text[i] != '\\' || i + 1 == text.size())
+            {
+                out += text[i];
+                continue;
+            }
+            if (text.compare(i + 1, 2, "()") == 0)
+            {
+                i += 2;
+                continue;
+            }
+            if (text[i + 1] == '@')
+            {
+                out += f.unique;
+                i++;
+                continue;
+            }
+            size_t end = i + 1;
+            while (end < text.size() && (isalnum(static_cast<unsigned char>(text[end])) || text[end] == '_'))
+                end++;
+            string name = text.substr(i + 1, end - i - 1);
+            auto it = find_if(f.args.begin(), f.args.end(), [&](const pair<string, string> &a)
+                              { return a.first == name; });
+            if (it == f.args.end())
+            {
+                out += text[i];
+                continue;
+            }
+            out += it->second;
+            i = end - 1;
+        }
+        return out;
+    }
+
+    // Reads a block body up to its matching .endm/.endr (nested blocks stay in the body)
+    bool collectBody(const string &endDirective, vector<string> &body)
+    {
+        int depth = 1;
+        string line;
+        while (rawLine(line))
+        {
+            vector<string> tokens = tokenize(stripComment(line));
+            if (!tokens.empty())
+            {
+                const string &word = tokens[0];
+                if (word == ".macro" || word == ".rept" || word == ".irp")
+                    depth++;
+                else if ((word == ".endm" || word == ".endr") && --depth == 0)
+                {
+                    if (word != endDirective)
+                        reportError(word + " closes a block that needs " + endDirective);
+                    return true;
+                }
+            }
+            body.push_back(line);
+        }
+        reportError("missing " + endDirective + " at the end of the file");
+        return false;
+    }
+
+    // Splits macro arguments on commas outside parentheses (or on spaces if there are no commas)
+    static vector<string> splitArgs(const string &text)
+    {
+        vector<string> args;
+        string arg;
+        int depth = 0;
+        bool commas = text.find(',') != string::npos;
+        for (char ch : text + (commas ? "," : " "))
+        {
+            depth += (ch == '(') - (ch == ')');
+            if (depth == 0 && (commas ? ch == ',' : isspace(static_cast<unsigned char>(ch))))
+            {
+                size_t first = arg.find_first_not_of(" \t"), last = arg.find_last_not_of(" \t");
+                if (first != string::npos)
+                    args.push_back(arg.substr(first, last - first + 1));
+                else if (commas)
+                    args.push_back("");
+                arg.clear();
+            }
+            else
+                arg += ch;
+        }
+        return args;
+    }
+
+    void push(Frame &&frame, int line)
+    {
+        frame.line = line;
+        if (frames.size() == maxDepth)
+        {
+            reportError("expansions nested too deeply (a recursive macro?)");
+            return;
+        }
+        if (!frame.body->empty() && frame.passes > 0)
+            frames.push_back(move(frame));
+    }
+
+    // Text after the first word of a line (its operands)
+    static string operands(const string &line, const string &word)
+    {
+        size_t at = line.find(word);
+        return (at == string::npos) ? "" : line.substr(at + word.size());
+    }
+
+public:
+    int lineNo = 0; // Line of the file the current line comes from
+
+    SourceReader(istream &input) : in(input) {}
+
+    // The next line to assemble, false at the end of the file
+    bool next(string &line)
+    {
+        while (rawLine(line))
+        {
+            int startLine = lineNo;
+            string filtered = stripComment(line);
+            vector<string> tokens = tokenize(filtered);
+            if (tokens.empty())
+                return true;
+            if (tokens[0].back() == ':' && tokens.size() > 1 &&
+                (tokens[1] == ".macro" || tokens[1] == ".rept" || tokens[1] == ".irp" || macros.count(tokens[1])))
+            {
+                pending = filtered.substr(filtered.find(':') + 1); // The label comes first
+                line = tokens[0];
+                return true;
+            }
+            const string &word = tokens[0];
+
+            if (word == ".macro")
+            {
+                if (tokens.size() < 2)
+                {
+                    reportError(".macro requires a name");
+                    continue;
+                }
+                Macro macro;
+                for (const string &p : splitArgs(operands(filtered, tokens[1])))
+                {
+                    size_t eq = p.find('=');
+                    macro.params.push_back(p.substr(0, eq));
+                    macro.defaults.push_back(eq == string::npos ? "" : p.substr(eq + 1));
+                }
+                auto body = make_shared<vector<string>>();
+                if (collectBody(".endm", *body))
+                {
+                    macro.body = body;
+                    macros[tokens[1]] = macro;
+                }
+                continue;
+            }
+            if (word == ".rept")
+            {
+                Frame frame;
+                string count = operands(substituteConstants(filtered), word);
+                count.erase(remove_if(count.begin(), count.end(), ::isspace), count.end());
+                auto body = make_shared<vector<string>>();
+                if (!collectBody(".endr", *body))
+                    continue;
+                if (!evalConstant(count, frame.passes) || frame.passes < 0)
+                {
+                    sourceLineNo = startLine;
+                    reportError("invalid .rept count '" + count + "'");
+                    continue;
+                }
+                frame.body = body;
+                push(move(frame), startLine);
+                continue;
+            }
+            if (word == ".irp")
+            {
+                Frame frame;
+                vector<string> values = splitArgs(operands(filtered, word));
+                auto body = make_shared<vector<string>>();
+                if (!collectBody(".endr", *body))
+                    continue;
+                if (values.empty() || values[0].empty())
+                {
+                    sourceLineNo = startLine;
+                    reportError(".irp requires a symbol");
+                }
+                else
+                {
+                    frame.body = body;
+                    frame.irpName = values[0];
+                    frame.irpValues.assign(values.begin() + 1, values.end());
+                    frame.passes = frame.irpValues.size();
+                    if (frame.passes)
+                        frame.args.push_back({frame.irpName, frame.irpValues[0]});
+                    push(move(frame), startLine);
+                }
+                continue;
+            }
+            if (word == ".endm" || word == ".endr")
+            {
+                reportError(word + " without a block to close");
+                continue;
+            }
+
+            auto it = macros.find(word);
+            if (it == macros.end())
+                return true;
+            const Macro &macro = it->second;
+            vector<string> args = splitArgs(operands(filtered, word));
+            Frame frame;
+            frame.body = macro.body;
+            frame.unique = to_string(expansions++);
+            for (size_t i = 0; i < macro.params.size(); i++)
+                frame.args.push_back({macro.params[i], macro.defaults[i]});
+            for (size_t i = 0; i < args.size(); i++)
+            {
+                size_t eq = args[i].find('=');
+                auto named = (eq == string::npos) ? frame.args.end() : find_if(frame.args.begin(), frame.args.end(), [&](const pair<string, string> &a)
+                                                                              { return a.first == args[i].substr(0, eq); });
+                if (named != frame.args.end())
+                    named->second = args[i].substr(eq + 1);
+                else if (i < frame.args.size())
+                    frame.args[i].second = args[i];
+                else
+                {
+                    reportError("too many arguments for macro '" + word + "'");
+                    break;
+                }
+            }
+            push(move(frame), startLine);
+        }
+        return false;
+    }
+};
+
+// Assigns addresses to every line from the current instruction sizes and (re)defines the labels
+void layout(vector<SourceLine> &allLines, uint32_t pc[2])
+{
+    pc[TEXT] = sectionBase[TEXT];
+    pc[DATA] = sectionBase[DATA];
+    for (auto &sl : allLines)
+    {
+        sl.addr = pc[sl.section];
+        if (sl.kind == LABEL)
+            labelMap[sl.text()] = sl.addr;
+        else if (sl.kind == DIRECTIVE)
+            sl.size = directiveSize(tokenize(sl.text()), sl.text(), sl.addr);
+        pc[sl.section] += sl.size;
+    }
+}
+
+/* Scheduling Pass (-O) */
+/*
+    Runs between pass one and pass two, on straight-line blocks of instructions (a block ends at a label,
+    a directive, a branch, a jump or an ECALL, which stays last):
+    - Redundant instructions are removed: writes to x0 that have no other effect (nop) and moves of a
+      register to itself (mv a0, a0).
+    - The rest is list scheduled over the dependency DAG of the block (register RAW/WAR/WAW, memory accesses
+      kept in their order, as a load may read a device register such as the UART's) so that no instruction
+      directly follows a load it reads: the pipeline's HazardDetectionUnit inserts a bubble there.
+    Labels are recomputed by layout() afterwards. Code that uses AUIPC or a branch target other than a plain
+    label (a numeric offset, label+8) depends on the exact instruction positions and is left alone.
+*/
+struct InstrInfo
+{
+    uint32_t rd = 0, rs1 = 0, rs2 = 0; // 0 when not used (x0 carries no dependency)
+    uint32_t fieldRs1 = 0, fieldRs2 = 0; // Raw register fields, as HazardDetectionUnit compares them
+    bool load = false, store = false, endsBlock = false, positional = false, redundant = false;
+};
+
+InstrInfo analyzeInstruction(uint32_t ins)
+{
+    InstrInfo info;
+    uint32_t opcode = ins & 0x7F, rd = (ins >> 7) & 0x1F, func3 = (ins >> 12) & 0x7;
+    uint32_t rs1 = (ins >> 15) & 0x1F, rs2 = (ins >> 20) & 0x1F, func7 = ins >> 25;
+    int32_t imm = static_cast<int32_t>(ins) >> 20;
+    info.fieldRs1 = rs1;
+    info.fieldRs2 = rs2;
+
+    switch (opcode)
+    {
+    case 0x33: // R
+        info.rd = rd, info.rs1 = rs1, info.rs2 = rs2;
+        // add/sub/sll/xor/srl/sra/or rd, rd, x0 and add/xor/or rd, x0, rd:
+        {
+            bool identity = func7 != 1 && (func3 == 0 || func3 == 1 || func3 == 4 || func3 == 5 || func3 == 6);
+            info.redundant = rd == 0 || (identity && rs1 == rd && rs2 == 0) ||
+                             (identity && func7 == 0 && func3 != 1 && func3 != 5 && rs1 == 0 && rs2 == rd);
+        }
+        break;
+    case 0x13: // I arithmetic (addi/slli/xori/srli/srai/ori rd, rd, 0 do nothing)
+        info.rd = rd, info.rs1 = rs1;
+        info.redundant = rd == 0 || (rs1 == rd && (imm & ((func3 == 1 || func3 == 5) ? 0x1F : 0xFFF)) == 0 &&
+                                     (func3 == 0 || func3 == 1 || func3 == 4 || func3 == 5 || func3 == 6));
+        break;
+    case 0x37: // LUI
+        info.rd = rd;
+        info.redundant = rd == 0;
+        break;
+    case 0x03: // Load
+        info.rd = rd, info.rs1 = rs1, info.load = true;
+        break;
+    case 0x23: // Store
+        info.rs1 = rs1, info.rs2 = rs2, info.store = true;
+        break;
+    case 0x63: // Branch
+        info.rs1 = rs1, info.rs2 = rs2, info.endsBlock = true;
+        break;
+    case 0x6F: // JAL
+        info.rd = rd, info.endsBlock = true;
+        break;
+    case 0x67: // JALR
+        info.rd = rd, info.rs1 = rs1, info.endsBlock = true;
+        break;
+    default: // AUIPC (PC relative), ECALL and anything unknown
+        info.endsBlock = true;
+        info.positional = (opcode == 0x17);
+    }
+    return info;
+}
+
+// Load-use bubbles of a sequence in this pipeline: a load directly followed by a reader of its rd
+int loadUseStalls(const vector<InstrInfo> &seq)
+{
+    int stalls = 0;
+    for (size_t i = 1; i < seq.size(); i++)
+        if (seq[i - 1].load && seq[i - 1].rd != 0 && (seq[i].fieldRs1 == seq[i - 1].rd || seq[i].fieldRs2 == seq[i - 1].rd))
+            stalls++;
+    return stalls;
+}
+
+struct ScheduleStats
+{
+    int blocks = 0, moved = 0, removed = 0, stallsBefore = 0, stallsAfter = 0;
+};
+
+// Orders one block (the ending instruction, if any, stays last), returns the new order as indices
+vector<size_t> scheduleBlock(const vector<InstrInfo> &block)
+{
+    size_t n = block.size();
+    bool fixedEnd = n > 0 && block[n - 1].endsBlock;
+    vector<vector<size_t>> succs(n);
+    vector<int> preds(n, 0), height(n, 1);
+
+    for (size_t j = 0; j < n; j++)
+        for (size_t i = 0; i < j; i++)
+        {
+            const InstrInfo &a = block[i], &b = block[j];
+            bool raw = a.rd != 0 && (b.rs1 == a.rd || b.rs2 == a.rd);
+            bool war = b.rd != 0 && (a.rs1 == b.rd || a.rs2 == b.rd);
+            bool waw = a.rd != 0 && a.rd == b.rd;
+            bool mem = (a.load || a.store) && (b.load || b.store); // Loads too: a device register read has effects
+            if (raw || war || waw || mem || (fixedEnd && j == n - 1))
+            {
+                succs[i].push_back(j);
+                preds[j]++;
+            }
+        }
+    // Longest path to the end of the block, a load counts twice (its result is a cycle late):
+    for (size_t i = n; i-- > 0;)
+        for (size_t j : succs[i])
+            height[i] = max(height[i], height[j] + (block[i].load ? 2 : 1));
+
+    vector<size_t> order;
+    vector<bool> done(n, false);
+    while (order.size() < n)
+    {
+        size_t best = n;
+        bool bestStalls = true;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (done[i] || preds[i] != 0)
+                continue;
+            bool stalls = !order.empty() && loadUseStalls({block[order.back()], block[i]}) > 0;
+            // No bubble first, then the longest path, then the source order:
+            if (best == n || (!stalls && bestStalls) || (stalls == bestStalls && height[i] > height[best]))
+                best = i, bestStalls = stalls;
+        }
+        done[best] = true;
+        order.push_back(best);
+        for (size_t j : succs[best])
+            preds[j]--;
+    }
+    return order;
+}
+
+// The scheduling pass over all lines of pass one; labels are redefined by the caller's next layout()
+ScheduleStats optimizeSchedule(vector<SourceLine> &allLines)
+{
+    static const size_t maxBlock = 256; // Longer blocks are scheduled in pieces (the DAG is quadratic)
+    ScheduleStats stats;
+    vector<InstrInfo> infos(allLines.size());
+    for (size_t i = 0; i < allLines.size(); i++)
+    {
+        if (allLines[i].kind != INSTRUCTION)
+            continue;
+        uint32_t machineCode;
+        streambuf *cerrBuf = cerr.rdbuf(nullptr); // Errors are reported once, in pass 2
+        int errorsBefore = errorCount, lastErrorLineBefore = lastErrorLine;
+        bool parsed = parseInstructionLine(allLines[i].text(), machineCode, allLines[i].addr);
+        cerr.rdbuf(cerrBuf);
+        cerr.clear();
+        errorCount = errorsBefore;
+        lastErrorLine = lastErrorLineBefore;
+        if (!parsed)
+            return stats;
+        infos[i] = analyzeInstruction(machineCode);
+
+        // Positions matter to PC relative code and to branch/jump targets other than a plain label:
+        vector<string> tokens = expandPseudo(tokenize(stripComment(allLines[i].text())));
+        bool positionalTarget = !tokens.empty() && (bMap.count(tokens[0]) || jalMap.count(tokens[0])) &&
+                                !labelMap.count(tokens.back());
+        if (infos[i].positional || positionalTarget)
+        {
+            sourceLineNo = allLines[i].lineNo;
+            reportWarning("-O skipped: the program depends on instruction positions (" + tokens[0] + ")");
+            return stats;
+        }
+        // An immediate from a symbol (la's addi with %lo, a label expression) is only 0 in this layout:
+        for (auto &tok : tokens)
+            if (tok[0] == '%' || usesLabel(tok))
+                infos[i].redundant = false;
+    }
+
+    vector<SourceLine> result;
+    vector<size_t> block; // Indices into allLines
+    auto flush = [&]()
+    {
+        vector<size_t> kept;
+        for (size_t i : block)
+            if (infos[i].redundant)
+                stats.removed++;
+            else
+                kept.push_back(i);
+        if (!kept.empty())
+        {
+            vector<InstrInfo> seq;
+            for (size_t i : kept)
+                seq.push_back(infos[i]);
+            vector<size_t> order = scheduleBlock(seq);
+            vector<InstrInfo> scheduled;
+            for (size_t k : order)
+                scheduled.push_back(seq[k]);
+
+            int before = loadUseStalls(seq), after = loadUseStalls(scheduled);
+            if (after >= before) // Keep the source order unless it helps
+                for (size_t k = 0; k < order.size(); k++)
+                    order[k] = k;
+            stats.blocks++;
+            stats.stallsBefore += before;
+            stats.stallsAfter += min(before, after);
+            for (size_t k = 0; k < order.size(); k++)
+            {
+                stats.moved += (order[k] != k);
+                result.push_back(allLines[kept[order[k]]]);
+            }
+        }
+        block.clear();
+    };
+
+    for (size_t i = 0; i < allLines.size(); i++)
+    {
+        if (allLines[i].kind != INSTRUCTION)
+        {
+            flush();
+            result.push_back(allLines[i]);
+            continue;
+        }
+        block.push_back(i);
+        if (infos[i].endsBlock || block.size() == maxBlock)
+            flush();
+    }
+    flush();
+    allLines = result;
+    return stats;
+}
+
+/* ELF32 Output */
+// Writes a little-endian RV32 executable with one PT_LOAD segment per non-empty section
+bool writeELF(const string &fileName, const vector<uint8_t> sectionBytes[2], uint32_t entry, bool rvc)
+{
+    auto put16 = [](vector<uint8_t> &v, uint16_t x)
+    { v.push_back(x & 0xFF), v.push_back(x >> 8); };
+    auto put32 = [&](vector<uint8_t> &v, uint32_t x)
+    { put16(v, x & 0xFFFF), put16(v, x >> 16); };
+
+    const uint32_t ehSize = 52, phSize = 32, shSize = 40;
+    const string shstrtab = string("\0.text\0.data\0.shstrtab\0", 24);
+    const uint32_t nameOffset[3] = {1, 7, 13}; // .text, .data, .shstrtab
+
+    vector<int> present;
+    for (int sec = TEXT; sec <= DATA; sec++)
+        if (!sectionBytes[sec].empty())
+            present.push_back(sec);
+
+    // File layout: ELF header | program headers | section contents | .shstrtab | section headers
+    uint32_t offset = ehSize + phSize * present.size();
+    uint32_t fileOffset[2] = {0, 0};
+    for (int sec : present)
+    {
+        offset = (offset + 3) & ~3u;
+        fileOffset[sec] = offset;
+        offset += sectionBytes[sec].size();
+    }
+    uint32_t shstrtabOffset = offset;
+    uint32_t shOffset = (shstrtabOffset + shstrtab.size() + 3) & ~3u;
+    uint16_t shNum = 2 + present.size(); // NULL, sections..., .shstrtab
+
+    vector<uint8_t> out;
+    // ELF header:
+    const uint8_t ident[16] = {0x7F, 'E', 'L', 'F', 1 /* 32 bit */, 1 /* little endian */, 1 /* version */};
+    out.insert(out.end(), ident, ident + 16);
+    put16(out, 2);   // ET_EXEC
+    put16(out, 243); // EM_RISCV
+    put32(out, 1);   // EV_CURRENT
+    put32(out, entry);
+    put32(out, ehSize);   // Program headers follow the ELF header
+    put32(out, shOffset); // Section headers
+    put32(out, rvc ? 0x1 : 0x0); // Flags: EF_RISCV_RVC, soft float
+    put16(out, ehSize);
+    put16(out, phSize);
+    put16(out, present.size());
+    put16(out, shSize);
+    put16(out, shNum);
+    put16(out, shNum - 1); // Index of .shstrtab
+
+    // Program headers:
+    for (int sec : present)
+    {
+        put32(out, 1); // PT_LOAD
+        put32(out, fileOffset[sec]);
+        put32(out, sectionBase[sec]); // vaddr
+        put32(out, sectionBase[sec]); // paddr
+        put32(out, sectionBytes[sec].size());
+        put32(out, sectionBytes[sec].size());
+        put32(out, sec == TEXT ? 5 : 6); // R+X or R+W
+        put32(out, 4);
+    }
+
+    // Contents:
+    for (int sec : present)
+    {
+        out.resize(fileOffset[sec], 0);
+        out.insert(out.end(), sectionBytes[sec].begin(), sectionBytes[sec].end());
+    }
+    out.insert(out.end(), shstrtab.begin(), shstrtab.end());
+    out.resize(shOffset, 0);
+
+    // Section headers:
+    out.resize(out.size() + shSize, 0); // NULL section
+    for (int sec : present)
+    {
+        put32(out, nameOffset[sec]);
+        put32(out, 1);                  // SHT_PROGBITS
+        put32(out, sec == TEXT ? 6 : 3); // ALLOC+EXEC or ALLOC+WRITE
+        put32(out, sectionBase[sec]);
+        put32(out, fileOffset[sec]);
+        put32(out, sectionBytes[sec].size());
+        put32(out, 0);
+        put32(out, 0);
+        put32(out, 4);
+        put32(out, 0);
+    }
+    put32(out, nameOffset[2]);
+    put32(out, 3); // SHT_STRTAB
+    put32(out, 0);
+    put32(out, 0);
+    put32(out, shstrtabOffset);
+    put32(out, shstrtab.size());
+    put32(out, 0);
+    put32(out, 0);
+    put32(out, 1);
+    put32(out, 0);
+
+    ofstream outFile(fileName, ios::binary);
+    if (!outFile)
+        return false;
+    outFile.write(reinterpret_cast<const char *>(out.data()), out.size());
+    return true;
+}
+
+#ifndef RISCV_ASSEMBLER_NO_MAIN // Defined when the assembler is built as a library (benchmarks)
+void printUsage()
+{
+    cout << RED << "Usage:\n"
+         << RESET;
+    cout << BLUE << "  RISC-V_Assembler [-i <inputfile>] [-o <outputfile>] [-f <bin|elf>] [-c] [-O] [-g <debugfile>] [-l <debugfile>]\n\n";
+    cout << "Options:\n";
+    cout << "  -i <inputfile>   :  Input assembly file (default: assemblyCode.txt)\n";
+    cout << "  -o <outputfile>  :  Output machine code file (default: machineCode.txt)\n";
+    cout << "  -f <bin|elf>     :  Output format: text of 32 bit binary lines or ELF32 executable (default: bin)\n";
+    cout << "  -c               :  Compress eligible instructions to 16 bit RVC encodings\n";
+    cout << "  -O               :  Schedule instructions to fill load-use slots and drop redundant ones\n";
+    cout << "  -g <debugfile>   :  Also write the symbols and the source line of every instruction (for profiling and traces)\n";
+    cout << "  -l <debugfile>   :  Same as -g (the line map of earlier versions is part of the debug file)\n";
+    cout << "  -h --help        :  Show this help message\n"
+         << RESET;
+}
+
+int main(int argc, char *argv[])
+{
+    printf(BOLD RED "  RISC-V_Assembler (by anuragmishra-creates)\n" RESET);
+    string inputFileName = "assemblyCode.txt", outputFileName = "machineCode.txt", format = "bin", debugFileName = "";
+    bool compress = false, optimize = false;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "-i")
+        {
+            if (i + 1 < argc)
+                inputFileName = argv[++i];
+            else
+            {
+                cerr << RED << "Error: -i requires a filename.\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "-o")
+        {
+            if (i + 1 < argc)
+                outputFileName = argv[++i];
+            else
+            {
+                cerr << RED << "Error: -o requires a filename.\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "-f")
+        {
+            if (i + 1 < argc && (string(argv[i + 1]) == "bin" || string(argv[i + 1]) == "elf"))
+                format = argv[++i];
+            else
+            {
+                cerr << RED << "Error: -f requires 'bin' or 'elf'.\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "-c")
+            compress = true;
+        else if (arg == "-O")
+            optimize = true;
+        else if (arg == "-g" || arg == "-l") // -l: the line map, now part of the debug file
+        {
+            if (i + 1 < argc)
+                debugFileName = argv[++i];
+            else
+            {
+                cerr << RED << "Error: " << arg << " requires a filename.\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "-h" || arg == "--help")
+        {
+            printUsage();
+            return 0;
+        }
+        else
+        {
+            cerr << RED << "Unknown argument: " << arg << "\n"
+                 << RESET;
+            printUsage();
+            return 1;
+        }
+    }
+
+    cout << MAGENTA << "   >>> Assembler Started <<<\n"
+         << RESET;
+    cout << CYAN << "Input File : " << GREEN << inputFileName << "\n"
+         << RESET;
+    cout << CYAN << "Output File: " << GREEN << outputFileName << "\n"
+         << RESET;
+
+    // Real assembler code starts here:
+    uint32_t pc[2] = {sectionBase[TEXT], sectionBase[DATA]}; // Location counter of each section
+    Section current = TEXT;
+    vector<SourceLine> allLines;
+    string line;
+    int lineNo = 0;
+    unordered_map<string, int> labelLine; // Where each label is defined
+    sourceFileName = inputFileName;
+
+    ifstream inFile(inputFileName);
+    if (!inFile)
+    {
+        cerr << "Error : Could NOT open the input file: '" << inputFileName << "'\n";
+        return 1;
+    }
+
+    // First pass to find all the labels and their addresses (on the lines with macros and repetitions expanded)
+    SourceReader reader(inFile);
+    while (reader.next(line))
+    {
+        sourceLineNo = lineNo = reader.lineNo;
+        string filtered = substituteConstants(stripComment(line));
         if (filtered.empty())
             continue;
 
@@ -653,51 +2132,225 @@ int main(int argc, char *argv[])
             continue;
 
         string lineToStore = filtered; // Stored for pass 2
-        bool instructionFoundInCurrentLine = true;
 
         // Check if the line starts with label (end with ':')
         if (tokens[0].back() == ':')
         {
             string label = tokens[0].substr(0, (int)tokens[0].size() - 1);
-            labelMap[label] = pc;
+            if (labelLine.count(label))
+                reportError("label '" + label + "' redefined (first defined on line " + to_string(labelLine[label]) + ")");
+            else if (constMap.count(label))
+                reportError("label '" + label + "' is already a constant");
+            labelLine.emplace(label, lineNo);
+            labelMap[label] = pc[current];
+            allLines.push_back({internText(label), LABEL, current, pc[current], 0, lineNo});
             tokens.erase(tokens.begin()); // Remove the label token (like .L2)
             if (tokens.empty())
-                instructionFoundInCurrentLine = false;
-            else
+                continue;
+            size_t colonIndex = filtered.find(":");
+            lineToStore = filtered.substr(colonIndex + 1);
+        }
+
+        // Directives:
+        if (tokens[0][0] == '.')
+        {
+            string dir = tokens[0];
+            if (dir == ".text" || dir == ".data" || dir == ".rodata" || dir == ".bss" || dir == ".section")
+            {
+                string name = (dir == ".section" && tokens.size() > 1) ? tokens[1] : dir;
+                current = (name.compare(0, 5, ".text") == 0) ? TEXT : DATA;
+                continue;
+            }
+            if (dir == ".globl" || dir == ".global" || dir == ".type" || dir == ".size" || dir == ".file" || dir == ".option")
+                continue; // Nothing to do for a single statically placed file
+            if (dir == ".equ" || dir == ".set" || dir == ".equiv")
             {
-                size_t colonIndex = filtered.find(":");
-                lineToStore = filtered.substr(colonIndex + 1);
+                defineConstant(tokens, lineToStore);
+                continue;
             }
+
+            int64_t size = directiveSize(tokens, lineToStore, pc[current]);
+            if (size < 0)
+            {
+                reportError("invalid or unsupported directive: " + filtered.substr(filtered.find(tokens[0])));
+                continue;
+            }
+            allLines.push_back({internText(lineToStore), DIRECTIVE, current, pc[current], static_cast<uint32_t>(size), lineNo});
+            pc[current] += size;
+            continue;
         }
 
-        if (instructionFoundInCurrentLine)
+        if (current != TEXT)
         {
-            allLines.push_back(lineToStore);
-            pc += 4; // Note: labels and empty lines are not given any PC
+            reportWarning("instruction outside of .text ignored: " + filtered.substr(filtered.find(tokens[0])));
+            continue;
+        }
+
+        vector<string> expanded = expandMultiPseudo(tokens);
+        if (expanded.empty())
+            expanded.push_back(lineToStore);
+        for (auto &e : expanded)
+        {
+            allLines.push_back({internText(e), INSTRUCTION, TEXT, pc[TEXT], 4, lineNo});
+            pc[TEXT] += 4; // Note: labels and empty lines are not given any PC
         }
     }
     inFile.close();
 
-    // Open Output File:
-    ofstream outFile(outputFileName);
-    if (!outFile)
+    // Scheduling pass on the instructions of pass one (needs the labels of the uncompressed layout):
+    if (optimize && !errorCount)
     {
-        cerr << "Error: Could NOT open the output file: 'machineCode.txt'!\n";
-        return 1;
+        layout(allLines, pc);
+        ScheduleStats stats = optimizeSchedule(allLines);
+        layout(allLines, pc);
+        sourceLineNo = 0;
+        cout << CYAN << "Optimizer  : " << GREEN << stats.blocks << " blocks, " << stats.moved << " instructions moved, "
+             << stats.removed << " removed, load-use stalls " << stats.stallsBefore << " -> " << stats.stallsAfter
+             << " (about " << (stats.stallsBefore - stats.stallsAfter + stats.removed) << " cycles saved per pass)\n"
+             << RESET;
     }
 
-    // Second pass to generate the instructions of size 32 bits each:
-    pc = 0;
-    for (auto &l : allLines)
+    // Compression: start with every instruction at 2 bytes and grow the ones that do not compress in the
+    // current layout (e.g. a branch whose target moved out of range) until the layout no longer changes.
+    if (compress)
     {
+        for (auto &sl : allLines)
+            if (sl.kind == INSTRUCTION)
+                sl.size = 2;
+
+        streambuf *cerrBuf = cerr.rdbuf(nullptr); // Errors are reported once, in pass 2
+        int errorsBefore = errorCount, lastErrorLineBefore = lastErrorLine;
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            layout(allLines, pc);
+            for (auto &sl : allLines)
+            {
+                uint32_t machineCode;
+                uint16_t compressed;
+                if (sl.kind == INSTRUCTION && sl.size == 2 &&
+                    !(parseInstructionLine(sl.text(), machineCode, sl.addr) && compressInstruction(machineCode, compressed)))
+                {
+                    sl.size = 4;
+                    changed = true;
+                }
+            }
+        }
+        cerr.rdbuf(cerrBuf);
+        cerr.clear();
+        errorCount = errorsBefore;
+        lastErrorLine = lastErrorLineBefore;
+    }
+
+    // Second pass to generate the instructions (32 bits each) and the data:
+    vector<uint8_t> sectionBytes[2];
+    sectionBytes[TEXT].resize(pc[TEXT] - sectionBase[TEXT], 0);
+    sectionBytes[DATA].resize(pc[DATA] - sectionBase[DATA], 0);
+
+    for (auto &sl : allLines)
+    {
+        if (sl.kind == LABEL)
+            continue;
+        sourceLineNo = sl.lineNo;
+        if (sl.kind == DIRECTIVE)
+        {
+            if (!emitDirective(sl, sectionBytes[sl.section])) // Unless the line has reported an error already
+                reportError("could not emit the directive: " + sl.text().substr(sl.text().find_first_not_of(" \t")));
+            continue;
+        }
+
         uint32_t machineCode;
-        if (parseInstructionLine(l, machineCode, pc))
-            outFile << bitset<32>(machineCode) << "\n";
-        else
-            outFile << "# There was some error while converting here.\n";
-        pc += 4;
+        uint16_t compressed;
+        if (parseInstructionLine(sl.text(), machineCode, sl.addr))
+        {
+            if (sl.size == 2 && compressInstruction(machineCode, compressed))
+                memcpy(sectionBytes[TEXT].data() + (sl.addr - sectionBase[TEXT]), &compressed, 2);
+            else
+                memcpy(sectionBytes[TEXT].data() + (sl.addr - sectionBase[TEXT]), &machineCode, 4); // Host is little endian like RISC-V
+        }
+        else // Unless the line has reported a more specific error already
+            reportError("invalid operands: " + sl.text().substr(sl.text().find_first_not_of(" \t")));
+    }
+    sourceLineNo = 0;
+
+    // A program with errors is not written at all, so no broken output can reach the simulator:
+    if (errorCount)
+    {
+        cerr << RED << errorCount << " error(s), no output written.\n"
+             << RESET;
+        return 1;
+    }
+
+    if (format == "elf")
+    {
+        uint32_t entry = (labelMap.find("_start") != labelMap.end()) ? labelMap["_start"] : sectionBase[TEXT];
+        if (!writeELF(outputFileName, sectionBytes, entry, compress))
+        {
+            cerr << "Error: Could NOT open the output file: '" << outputFileName << "'!\n";
+            return 1;
+        }
+    }
+    else
+    {
+        if (!sectionBytes[DATA].empty())
+        {
+            cerr << RED << "Error: The program has a data section, which needs ELF output (-f elf).\n"
+                 << RESET;
+            return 1;
+        }
+
+        // Open Output File:
+        ofstream outFile(outputFileName);
+        if (!outFile)
+        {
+            cerr << "Error: Could NOT open the output file: '" << outputFileName << "'!\n";
+            return 1;
+        }
+
+        // One line per instruction: 32 bits, or 16 bits for a compressed one (lowest two bits != 11)
+        sectionBytes[TEXT].resize((sectionBytes[TEXT].size() + 1) & ~size_t(1), 0);
+        for (size_t off = 0; off < sectionBytes[TEXT].size();)
+        {
+            uint32_t word = 0;
+            memcpy(&word, sectionBytes[TEXT].data() + off, min<size_t>(4, sectionBytes[TEXT].size() - off));
+            if ((word & 0x3) != 0x3)
+            {
+                outFile << bitset<16>(word & 0xFFFF) << "\n";
+                off += 2;
+            }
+            else
+            {
+                outFile << bitset<32>(word) << "\n";
+                off += 4;
+            }
+        }
+        outFile.close();
+    }
+
+    // Debug file (final, compressed layout):
+    /*
+        RVDEBUG1 <source file>
+        symbol <text|data> <address> <name>     one per label
+        line <address> <line>                   one per instruction
+    */
+    if (!debugFileName.empty())
+    {
+        ofstream debugFile(debugFileName);
+        if (!debugFile)
+        {
+            cerr << "Error: Could NOT open the debug file: '" << debugFileName << "'!\n";
+            return 1;
+        }
+        debugFile << "RVDEBUG1 " << inputFileName << "\n"
+                  << hex;
+        for (auto &sl : allLines)
+            if (sl.kind == LABEL)
+                debugFile << "symbol " << (sl.section == TEXT ? "text" : "data") << " 0x" << sl.addr << " " << sl.text() << "\n";
+        for (auto &sl : allLines)
+            if (sl.kind == INSTRUCTION)
+                debugFile << "line 0x" << sl.addr << " " << dec << sl.lineNo << hex << "\n";
     }
-    outFile.close();
 
     cout << MAGENTA << "\n   >>> Assembler Ended <<<\n"
          << RESET;
@@ -705,4 +2358,5 @@ int main(int argc, char *argv[])
          << RESET;
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
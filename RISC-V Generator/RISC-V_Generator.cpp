@@ -0,0 +1,452 @@
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <sstream>
+#include <vector>
+#include <random>
+#include <fstream>
+#include <unordered_map>
+#include <algorithm>
+using namespace std;
+
+#define RESET "\033[0m"
+#define RED "\033[91m"
+#define GREEN "\033[92m"
+#define YELLOW "\033[93m"
+#define BLUE "\033[94m"
+#define MAGENTA "\033[95m"
+#define CYAN "\033[96m"
+#define WHITE "\033[97m"
+#define BOLD "\033[1m"
+
+/*
+    Random instruction stream generator: writes an assembly program (accepted by RISC-V_Assembler)
+    meant to stress the forwarding paths and the hazard detection of the pipeline.
+
+    Register use:
+        s0      : Data buffer base (+2048, so that a 12 bit offset reaches 4 KiB)
+        s11     : Repetition counter
+        t6      : Address temporary for buffers larger than 4 KiB
+        sp      : Untouched
+        Others  : Random data (the pool)
+
+    Every instruction is deterministic, so the program runs the same on any correct implementation:
+    branch outcomes are fixed by comparing a register with itself (beq/bge/bgeu always taken,
+    bne/blt/bltu never), which still makes the branch depend on a forwarded value.
+    Branches and jumps only go forward (2 to 4 instructions), so the body always terminates.
+*/
+
+enum Category
+{
+    ALU,
+    MUL,
+    DIV,
+    LOAD,
+    STORE,
+    BRANCH,
+    JUMP,
+    CATEGORIES
+};
+
+static const char *categoryNames[CATEGORIES] = {"alu", "mul", "div", "load", "store", "branch", "jump"};
+
+static const vector<string> pool = {"ra", "gp", "tp", "t0", "t1", "t2", "t3", "t4", "t5", "s1",
+                                    "s2", "s3", "s4", "s5", "s6", "s7", "s8", "s9", "s10",
+                                    "a0", "a1", "a2", "a3", "a4", "a5", "a6", "a7"};
+
+struct GeneratorConfig
+{
+    uint64_t count = 1000; // Instructions in the body
+    uint64_t reps = 1;     // Times the body runs
+    uint32_t seed = 1;
+    double weights[CATEGORIES] = {60, 5, 2, 15, 10, 6, 2};
+    double rawRate = 0.5;      // Probability that a source reads a recent result
+    double rawDistance = 2.0;  // Mean producer to consumer distance (geometric)
+    double loadUse = 0.3;      // Probability that a load is used by the very next instruction
+    double takenRate = 0.5;    // Branch taken rate
+    uint32_t footprint = 4096; // Data buffer size in bytes
+};
+
+class Generator
+{
+private:
+    const GeneratorConfig &cfg;
+    mt19937 rng;
+    discrete_distribution<int> category;
+    geometric_distribution<int> distance;
+
+    // Destination register of the most recent instructions (-1: none), newest last:
+    static const int historySize = 32;
+    int history[historySize];
+
+    int pendingLoadUse = -1;                  // Register the next instruction must read
+    int unusedLoad = -1;                      // Register the next instruction must not read (a load not used)
+    bool consumers;                           // A category that reads a register can follow a load
+    unordered_map<uint64_t, int> labels;      // Body index -> forward label needed there
+    uint64_t index = 0;                       // Body instructions generated so far
+    string out;                               // Output is buffered, written in large blocks
+
+    int randomReg()
+    {
+        return uniform_int_distribution<int>(0, pool.size() - 1)(rng);
+    }
+
+    bool chance(double p)
+    {
+        return uniform_real_distribution<double>(0.0, 1.0)(rng) < p;
+    }
+
+    int32_t randomInt(int32_t lo, int32_t hi)
+    {
+        return uniform_int_distribution<int32_t>(lo, hi)(rng);
+    }
+
+    // Source register: a recent result (RAW at the configured distance) or any pool register
+    int sourceReg()
+    {
+        if (pendingLoadUse >= 0)
+        {
+            int r = pendingLoadUse;
+            pendingLoadUse = -1;
+            return r;
+        }
+        int r = -1;
+        if (chance(cfg.rawRate))
+        {
+            int d = min(distance(rng) + 1, historySize);
+            r = history[historySize - d];
+        }
+        while (r < 0 || r == unusedLoad)
+            r = randomReg();
+        return r;
+    }
+
+    void line(const string &text)
+    {
+        out += "    ";
+        out += text;
+        out += '\n';
+        instructions++;
+    }
+
+    // Memory operand of an aligned access of the given size inside the buffer (direct: in reach of s0, no t6 setup)
+    string address(uint32_t size, bool direct = false)
+    {
+        uint32_t span = direct ? min(cfg.footprint, 4096u) : cfg.footprint;
+        uint32_t addr = uniform_int_distribution<uint32_t>(0, span / size - 1)(rng) * size;
+        int32_t offset = static_cast<int32_t>(addr) - 2048;
+        if (offset <= 2047)
+            return to_string(offset) + "(s0)";
+        line("li t6, " + to_string(offset));
+        line("add t6, t6, s0");
+        return "0(t6)";
+    }
+
+    string forwardTarget()
+    {
+        uint64_t at = min<uint64_t>(index + randomInt(2, 4), cfg.count);
+        labels[at] = 1;
+        return "L" + to_string(at);
+    }
+
+    void instruction()
+    {
+        static const char *rOps[] = {"add", "sub", "sll", "slt", "sltu", "xor", "srl", "sra", "or", "and"};
+        static const char *iOps[] = {"addi", "slti", "sltiu", "xori", "ori", "andi"};
+        static const char *shiftOps[] = {"slli", "srli", "srai"};
+        static const char *mulOps[] = {"mul", "mulh", "mulhsu", "mulhu"};
+        static const char *divOps[] = {"div", "divu", "rem", "remu"};
+        static const char *loadOps[] = {"lb", "lbu", "lh", "lhu", "lw"};
+        static const uint32_t loadSizes[] = {1, 1, 2, 2, 4};
+        static const char *storeOps[] = {"sb", "sh", "sw"};
+        static const char *takenOps[] = {"beq", "bge", "bgeu"};
+        static const char *notTakenOps[] = {"bne", "blt", "bltu"};
+
+        // Right after a load that must be used, the instruction reads a register (no load, jump, lui or auipc)
+        // and nothing is emitted between the two:
+        bool loadUse = pendingLoadUse >= 0;
+        int rd = -1, nextLoadUse = -1, nextUnusedLoad = -1;
+        int kind;
+        do
+            kind = category(rng);
+        while (loadUse && (kind == LOAD || kind == JUMP));
+        switch (kind)
+        {
+        case ALU:
+        {
+            int form = randomInt(0, loadUse ? 8 : 9);
+            if (form < 5)
+            {
+                int a = sourceReg(), b = sourceReg();
+                rd = randomReg();
+                line(string(rOps[randomInt(0, 9)]) + " " + pool[rd] + ", " + pool[a] + ", " + pool[b]);
+            }
+            else if (form < 8)
+            {
+                int a = sourceReg();
+                rd = randomReg();
+                line(string(iOps[randomInt(0, 5)]) + " " + pool[rd] + ", " + pool[a] + ", " + to_string(randomInt(-2048, 2047)));
+            }
+            else if (form < 9)
+            {
+                int a = sourceReg();
+                rd = randomReg();
+                line(string(shiftOps[randomInt(0, 2)]) + " " + pool[rd] + ", " + pool[a] + ", " + to_string(randomInt(0, 31)));
+            }
+            else
+            {
+                rd = randomReg();
+                line(string(chance(0.5) ? "lui " : "auipc ") + pool[rd] + ", " + to_string(randomInt(0, 0xFFFFF)));
+            }
+            break;
+        }
+        case MUL:
+        case DIV:
+        {
+            const char **ops = (kind == MUL) ? mulOps : divOps;
+            int a = sourceReg(), b = sourceReg();
+            rd = randomReg();
+            line(string(ops[randomInt(0, 3)]) + " " + pool[rd] + ", " + pool[a] + ", " + pool[b]);
+            break;
+        }
+        case LOAD:
+        {
+            int k = randomInt(0, 4);
+            string addr = address(loadSizes[k]);
+            rd = randomReg();
+            line(string(loadOps[k]) + " " + pool[rd] + ", " + addr);
+            if (consumers && chance(cfg.loadUse))
+                nextLoadUse = rd;
+            else
+                nextUnusedLoad = rd;
+            break;
+        }
+        case STORE:
+        {
+            int k = randomInt(0, 2);
+            int value = sourceReg();
+            string addr = address(1u << k, loadUse);
+            line(string(storeOps[k]) + " " + pool[value] + ", " + addr);
+            break;
+        }
+        case BRANCH:
+        {
+            int a = sourceReg();
+            const char *op = chance(cfg.takenRate) ? takenOps[randomInt(0, 2)] : notTakenOps[randomInt(0, 2)];
+            line(string(op) + " " + pool[a] + ", " + pool[a] + ", " + forwardTarget());
+            break;
+        }
+        case JUMP:
+            rd = randomReg();
+            line("jal " + pool[rd] + ", " + forwardTarget());
+            break;
+        }
+
+        pendingLoadUse = nextLoadUse; // Only the very next instruction
+        unusedLoad = nextUnusedLoad;
+        copy(history + 1, history + historySize, history);
+        history[historySize - 1] = rd;
+    }
+
+public:
+    uint64_t instructions = 0; // Static instruction count
+
+    Generator(const GeneratorConfig &cfg)
+        : cfg(cfg), rng(cfg.seed), category(cfg.weights, cfg.weights + CATEGORIES),
+          distance(1.0 / max(1.0, cfg.rawDistance))
+    {
+        consumers = false;
+        for (int c : {ALU, MUL, DIV, STORE, BRANCH})
+            consumers = consumers || cfg.weights[c] > 0;
+        fill(history, history + historySize, -1);
+    }
+
+    bool write(const string &fileName)
+    {
+        ofstream file(fileName);
+        if (!file)
+            return false;
+
+        out += "# Generated by RISC-V_Generator: seed " + to_string(cfg.seed) + ", " + to_string(cfg.count) +
+               " instructions, " + to_string(cfg.reps) + " repetition(s)\n";
+        out += "    .data\nbuffer:\n    .space " + to_string(cfg.footprint) + "\n\n    .text\n_start:\n";
+        line("la s0, buffer");
+        line("addi s0, s0, 2047");
+        line("addi s0, s0, 1");
+        for (auto &reg : pool)
+            line("li " + reg + ", " + to_string(randomInt(-2048, 2047)));
+        line("li s11, " + to_string(cfg.reps));
+        out += "outer:\n";
+
+        // The body is written once and repeated by the outer loop:
+        for (index = 0; index < cfg.count; index++)
+        {
+            if (labels.erase(index))
+                out += "L" + to_string(index) + ":\n";
+            instruction();
+            if (out.size() > (1 << 20))
+            {
+                file << out;
+                out.clear();
+            }
+        }
+        out += "L" + to_string(cfg.count) + ":\n";
+
+        // Outer loop (jr reaches the top of a body of any size):
+        line("addi s11, s11, -1");
+        line("beqz s11, finish");
+        line("la t6, outer");
+        line("jr t6");
+
+        // Exit code: every pool register folded into a0
+        out += "finish:\n";
+        for (auto &reg : pool)
+            if (reg != "a0")
+                line("xor a0, a0, " + reg);
+        line("andi a0, a0, 255");
+        line("li a7, 93");
+        line("ecall");
+        file << out;
+        return static_cast<bool>(file);
+    }
+};
+
+// Parses "alu=60,load=20,..." into the category weights (categories not named keep their weight)
+bool parseMix(const string &mix, double weights[CATEGORIES])
+{
+    stringstream ss(mix);
+    string item;
+    while (getline(ss, item, ','))
+    {
+        size_t eq = item.find('=');
+        if (eq == string::npos)
+            return false;
+        string name = item.substr(0, eq);
+        auto it = find(categoryNames, categoryNames + CATEGORIES, name);
+        if (it == categoryNames + CATEGORIES)
+            return false;
+        try
+        {
+            weights[it - categoryNames] = stod(item.substr(eq + 1));
+        }
+        catch (...)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void printUsage()
+{
+    cout << RED << "Usage:\n"
+         << RESET;
+    cout << BLUE << "  RISC-V_Generator [-o <outputfile>] [-n <count>] [-r <reps>] [-s <seed>] [--mix <weights>]\n";
+    cout << "                   [--raw <p>] [--raw-dist <mean>] [--load-use <p>] [--taken <p>] [--footprint <bytes>]\n\n";
+    cout << "Options:\n";
+    cout << "  -o <outputfile>       :  Output assembly file (default: randomCode.s)\n";
+    cout << "  -n <count>            :  Instructions in the program body (default: 1000)\n";
+    cout << "  -r <reps>             :  Times the body runs (default: 1)\n";
+    cout << "  -s <seed>             :  Random seed (default: 1)\n";
+    cout << "  --mix <weights>       :  Instruction mix, e.g. alu=60,mul=5,div=2,load=15,store=10,branch=6,jump=2\n";
+    cout << "  --raw <p>             :  Probability that a source reads a recent result (default: 0.5)\n";
+    cout << "  --raw-dist <mean>     :  Mean RAW distance in instructions, 1 = back to back (default: 2)\n";
+    cout << "  --load-use <p>        :  Probability that a load is used by the next instruction (default: 0.3)\n";
+    cout << "  --taken <p>           :  Branch taken rate (default: 0.5)\n";
+    cout << "  --footprint <bytes>   :  Data buffer size, at least 4 (default: 4096)\n";
+    cout << "  -h --help             :  Show this help message\n"
+         << RESET;
+}
+
+int main(int argc, char *argv[])
+{
+    printf(BOLD RED "  RISC-V_Generator (by anuragmishra-creates)\n" RESET);
+    string outputFileName = "randomCode.s";
+    GeneratorConfig cfg;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        try
+        {
+            if (arg == "-h" || arg == "--help")
+            {
+                printUsage();
+                return 0;
+            }
+            else if (!hasValue)
+            {
+                cerr << RED << "Error: " << arg << " requires a value (or is unknown).\n"
+                     << RESET;
+                printUsage();
+                return 1;
+            }
+            else if (arg == "-o")
+                outputFileName = argv[++i];
+            else if (arg == "-n")
+                cfg.count = stoull(argv[++i]);
+            else if (arg == "-r")
+                cfg.reps = max(1ULL, stoull(argv[++i]));
+            else if (arg == "-s")
+                cfg.seed = stoul(argv[++i]);
+            else if (arg == "--mix")
+            {
+                if (!parseMix(argv[++i], cfg.weights))
+                {
+                    cerr << RED << "Error: --mix expects name=weight pairs of alu, mul, div, load, store, branch, jump.\n"
+                         << RESET;
+                    return 1;
+                }
+            }
+            else if (arg == "--raw")
+                cfg.rawRate = stod(argv[++i]);
+            else if (arg == "--raw-dist")
+                cfg.rawDistance = stod(argv[++i]);
+            else if (arg == "--load-use")
+                cfg.loadUse = stod(argv[++i]);
+            else if (arg == "--taken")
+                cfg.takenRate = stod(argv[++i]);
+            else if (arg == "--footprint")
+                cfg.footprint = max(4ul, stoul(argv[++i]));
+            else
+            {
+                cerr << RED << "Unknown argument: " << arg << "\n"
+                     << RESET;
+                printUsage();
+                return 1;
+            }
+        }
+        catch (...)
+        {
+            cerr << RED << "Error: Invalid value for " << arg << ": " << argv[i] << "\n"
+                 << RESET;
+            return 1;
+        }
+    }
+
+    double total = 0;
+    for (double w : cfg.weights)
+        total += w;
+    if (total <= 0)
+    {
+        cerr << RED << "Error: The instruction mix is empty.\n"
+             << RESET;
+        return 1;
+    }
+
+    Generator gen(cfg);
+    if (!gen.write(outputFileName))
+    {
+        cerr << RED << "Error: Could NOT write the output file: '" << outputFileName << "'!\n"
+             << RESET;
+        return 1;
+    }
+
+    cout << CYAN << "Output File: " << GREEN << outputFileName << "\n"
+         << RESET;
+    cout << YELLOW << gen.instructions << " instructions written, the body runs " << cfg.reps << " time(s).\n";
+    cout << "Simulate with a Data Memory of at least " << cfg.footprint << " bytes (-m).\n"
+         << RESET;
+    return 0;
+}
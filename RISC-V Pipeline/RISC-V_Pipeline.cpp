@@ -1,5 +1,6 @@
 #include <iostream>
 #include <unordered_map>
+#include <map>
 #include <string>
 #include <cstdint>
 #include <sstream>
@@ -8,6 +9,26 @@
 #include <bitset>
 #include <algorithm>
 #include <fstream>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <chrono>
+#include <memory>
+#include <queue>
+#include <deque>
+#include <array>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
 #define BLACK "\033[90m"
@@ -21,15 +42,15 @@ using namespace std;
 #define BOLD "\033[1m"
 #define RESET "\033[0m"
 
+// Control signals, packed into two bytes (a copy travels down the pipeline registers every cycle)
 struct ControlWord
 {
-    bool regRead, regWrite, memRead, memWrite, mem2Reg, branch, jump, ALUSrc;
-    uint32_t ALUOp; // 2 bits
+    uint16_t regRead : 1, regWrite : 1, memRead : 1, memWrite : 1, mem2Reg : 1, branch : 1, jump : 1, ALUSrc : 1;
+    uint16_t ALUOp : 2;
+    uint16_t illegal : 1; // Unknown opcode (raises an illegal instruction exception)
 
-    ControlWord()
+    ControlWord() : regRead(0), regWrite(0), memRead(0), memWrite(0), mem2Reg(0), branch(0), jump(0), ALUSrc(0), ALUOp(0), illegal(0)
     {
-        regRead = regWrite = memRead = memWrite = mem2Reg = branch = jump = ALUSrc = 0;
-        ALUOp = 0;
     }
 };
 
@@ -111,13 +132,97 @@ public:
     }
 };
 
-// Instruction Memory:
+// Loadable segment of a program (from an ELF file):
+struct Segment
+{
+    uint32_t vaddr;
+    vector<uint8_t> bytes; // File contents, zero filled up to memSize when loaded
+    uint32_t memSize;
+    bool executable;
+};
+
+// ELF32 Loader:
+/*
+    Reads the PT_LOAD segments of a little-endian RV32 executable.
+    Executable segments go to Instruction Memory and the others to Data Memory (Harvard).
+*/
+bool isELFFile(const string &filename)
+{
+    ifstream file(filename, ios::binary);
+    char magic[4] = {0, 0, 0, 0};
+    file.read(magic, 4);
+    return file && magic[0] == 0x7F && magic[1] == 'E' && magic[2] == 'L' && magic[3] == 'F';
+}
+
+bool loadELF(const string &filename, vector<Segment> &segments, uint32_t &entry)
+{
+    ifstream file(filename, ios::binary);
+    vector<uint8_t> img((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    auto rd16 = [&](size_t off)
+    { return static_cast<uint32_t>(img[off] | (img[off + 1] << 8)); };
+    auto rd32 = [&](size_t off)
+    { return rd16(off) | (rd16(off + 2) << 16); };
+
+    if (img.size() < 52 || img[4] != 1 || img[5] != 1) // ELFCLASS32, little endian
+    {
+        cerr << "ELF Loader: Only little-endian ELF32 files are supported\n";
+        return false;
+    }
+    if (rd16(18) != 243) // EM_RISCV
+    {
+        cerr << "ELF Loader: Not a RISC-V executable\n";
+        return false;
+    }
+
+    entry = rd32(24);
+    uint32_t phOff = rd32(28), phEntSize = rd16(42), phNum = rd16(44);
+    for (uint32_t i = 0; i < phNum; i++)
+    {
+        size_t ph = static_cast<size_t>(phOff) + static_cast<size_t>(i) * phEntSize;
+        if (ph + 32 > img.size())
+        {
+            cerr << "ELF Loader: Truncated program header table\n";
+            return false;
+        }
+        if (rd32(ph) != 1) // Only PT_LOAD matters
+            continue;
+
+        Segment seg;
+        uint32_t offset = rd32(ph + 4), fileSize = rd32(ph + 16);
+        seg.vaddr = rd32(ph + 8);
+        seg.memSize = rd32(ph + 20);
+        seg.executable = (rd32(ph + 24) & 1) != 0; // PF_X
+        if (static_cast<size_t>(offset) + fileSize > img.size() || fileSize > seg.memSize)
+        {
+            cerr << "ELF Loader: Segment " << i << " lies outside of the file\n";
+            return false;
+        }
+        seg.bytes.assign(img.begin() + offset, img.begin() + offset + fileSize);
+        segments.push_back(seg);
+    }
+    return true;
+}
+
+// Instruction Memory (byte addressed, holds 32 bit and 16 bit compressed instructions):
 class InstructionMemory
 {
 private:
-    vector<uint32_t> IM;
+    vector<uint8_t> IM;
+    uint32_t baseAddr = 0;
+
+    bool validAddress(uint32_t address, uint32_t bytesCount) const
+    {
+        return address >= baseAddr && address - baseAddr + bytesCount <= IM.size();
+    }
 
 public:
+    // Executable segment of an ELF file:
+    InstructionMemory(const Segment &text) : IM(text.bytes), baseAddr(text.vaddr)
+    {
+        IM.resize(text.memSize, 0);
+    }
+
+    // Text file with one binary instruction per line (32 bits, or 16 bits for a compressed instruction):
     InstructionMemory(const string &filename)
     {
         ifstream file(filename);
@@ -134,9 +239,9 @@ public:
             if (line.empty())
                 continue;
 
-            if (line.size() != 32)
+            if (line.size() != 32 && line.size() != 16)
             {
-                cerr << "Error: Instruction must be 32 bits only. Received: " << line << "\n";
+                cerr << "Error: Instruction must be 32 (or 16 compressed) bits only. Received: " << line << "\n";
                 exit(1);
             }
 
@@ -149,27 +254,111 @@ public:
                 }
             }
             uint32_t ins = bitset<32>(line).to_ulong();
-            IM.push_back(ins);
+            for (size_t b = 0; b < line.size() / 8; b++) // Little endian
+                IM.push_back((ins >> (8 * b)) & 0xFF);
         }
         file.close();
     }
 
+    // 32 bit read at any 2 byte aligned address:
     uint32_t read(uint32_t address) const
     {
-        if (address / 4 >= IM.size())
+        if (!validAddress(address, 4))
         {
             cerr << "Error: Instruction memory out of bounds. PC= " << address << "\n";
             exit(1);
         }
-        return IM[address / 4];
+        uint32_t off = address - baseAddr;
+        return IM[off] | (IM[off + 1] << 8) | (IM[off + 2] << 16) | (static_cast<uint32_t>(IM[off + 3]) << 24);
     }
 
+    uint16_t readHalf(uint32_t address) const
+    {
+        if (!validAddress(address, 2))
+        {
+            cerr << "Error: Instruction memory out of bounds. PC= " << address << "\n";
+            exit(1);
+        }
+        uint32_t off = address - baseAddr;
+        return IM[off] | (IM[off + 1] << 8);
+    }
+
+    // Code size in bytes:
     size_t size() const
     {
         return IM.size();
     }
+
+    uint32_t baseAddress() const
+    {
+        return baseAddr;
+    }
+
+    uint32_t endAddress() const
+    {
+        return baseAddr + static_cast<uint32_t>(IM.size());
+    }
+};
+
+// Memory-Mapped Devices:
+/*
+    Devices are mapped into the Data Memory address space above the RAM and accessed by the ordinary loads and
+    stores. They do not run every cycle: a device that has something to do later (a timer reaching its compare
+    value, a character finishing transmission) schedules an event for that cycle. The pipeline only compares the
+    cycle with the earliest event, so idle devices cost nothing.
+*/
+class Device
+{
+public:
+    virtual ~Device() {}
+    virtual uint32_t read(uint32_t offset, uint32_t bytes) = 0; // Value in the low bytes
+    virtual void write(uint32_t offset, uint32_t value, uint32_t bytes) = 0;
+    virtual void event(uint32_t) {} // A scheduled event is due
+};
+
+// Interrupt pending bits raised by the devices (mip layout):
+const uint32_t MIP_MSIP = 1u << 3, MIP_MTIP = 1u << 7, MIP_MEIP = 1u << 11;
+uint32_t mip = 0;
+
+// Device events ordered by cycle
+class EventQueue
+{
+private:
+    struct Event
+    {
+        uint64_t when;
+        Device *device;
+        uint32_t tag;
+        bool operator>(const Event &other) const { return when > other.when; }
+    };
+    priority_queue<Event, vector<Event>, greater<Event>> queue;
+
+public:
+    uint64_t next = UINT64_MAX; // Cycle of the earliest event
+    uint64_t dispatched = 0;
+
+    void schedule(uint64_t when, Device *device, uint32_t tag)
+    {
+        queue.push({when, device, tag});
+        next = queue.top().when;
+    }
+
+    // Runs the events due by cycle now
+    void run(uint64_t now)
+    {
+        while (!queue.empty() && queue.top().when <= now)
+        {
+            Event e = queue.top();
+            queue.pop();
+            dispatched++;
+            e.device->event(e.tag);
+        }
+        next = queue.empty() ? UINT64_MAX : queue.top().when;
+    }
 };
 
+EventQueue events;
+
 class DataMemory
 {
 private:
@@ -181,11 +370,55 @@ private:
         return ((static_cast<int32_t>(val << shift)) >> shift);
     }
 
+    struct MappedDevice
+    {
+        uint32_t base, size;
+        Device *device;
+    };
+    vector<MappedDevice> devices;
+    uint32_t ioBase = UINT32_MAX; // Lowest device address: RAM accesses stay below it after a single compare
+
+    // Reads or writes a device register, false if no device is mapped there
+    bool deviceAccess(uint32_t addr, uint32_t bytes, bool write, uint32_t &value)
+    {
+        for (auto &d : devices)
+            if (addr - d.base < d.size)
+            {
+                if (write)
+                    d.device->write(addr - d.base, value, bytes);
+                else
+                    value = d.device->read(addr - d.base, bytes);
+                return true;
+            }
+        return false;
+    }
+
 public:
     DataMemory(size_t bytes = 4096, uint32_t base = 0) : DM(bytes, 0), baseAddr(base)
     {
     }
 
+    // Maps a device at [base, base + size), which must lie above the RAM
+    void mapDevice(uint32_t base, uint32_t size, Device *device)
+    {
+        devices.push_back({base, size, device});
+        ioBase = min(ioBase, base);
+    }
+
+    bool isDevice(uint32_t addr) const
+    {
+        for (auto &d : devices)
+            if (addr - d.base < d.size)
+                return true;
+        return false;
+    }
+
+    // Whether an access reaches the RAM or a device (anything else is an access fault)
+    bool accessible(uint32_t addr, uint32_t bytesCount)
+    {
+        return (addr >= ioBase && isDevice(addr)) || validAddress(addr, bytesCount);
+    }
+
     bool validAddress(uint32_t addr, size_t bytesCount)
     {
         if (addr < baseAddr)
@@ -201,6 +434,8 @@ public:
     // Word operations
     void writeWord(uint32_t addr, uint32_t value)
     {
+        if (addr >= ioBase && deviceAccess(addr, 4, true, value))
+            return;
         if (!validAddress(addr, 4))
         {
             cerr << "Data Memory: writeWord() invalid address 0x" << hex << addr << dec << "\n";
@@ -215,6 +450,9 @@ public:
     }
     uint32_t readWord(uint32_t addr)
     {
+        uint32_t io;
+        if (addr >= ioBase && deviceAccess(addr, 4, false, io))
+            return io;
         if (!validAddress(addr, 4))
         {
             cerr << "Data Memory: readWord() invalid address 0x" << hex << addr << dec << "\n";
@@ -231,6 +469,8 @@ public:
     // Byte operations:
     void writeByte(uint32_t addr, uint32_t value)
     {
+        if (addr >= ioBase && deviceAccess(addr, 1, true, value))
+            return;
         if (!validAddress(addr, 1))
         {
             cerr << "Data Memory: writeByte() invalid address 0x" << hex << addr << dec << "\n";
@@ -241,6 +481,9 @@ public:
     }
     uint32_t readByte(uint32_t addr, bool signedExt = false)
     {
+        uint32_t io;
+        if (addr >= ioBase && deviceAccess(addr, 1, false, io))
+            return signedExt ? static_cast<uint32_t>(signExtend(io & 0xFF, 8)) : (io & 0xFF);
         if (!validAddress(addr, 1))
         {
             cerr << "Data Memory: readByte() invalid address 0x" << hex << addr << dec << "\n";
@@ -256,6 +499,9 @@ public:
     // Half word operations:
     void writeHalf(uint32_t addr, uint16_t value)
     {
+        uint32_t io = value;
+        if (addr >= ioBase && deviceAccess(addr, 2, true, io))
+            return;
         if (!validAddress(addr, 2))
         {
             cerr << "Data Memory: writeHalf() invalid address 0x" << hex << addr << dec << "\n";
@@ -267,6 +513,9 @@ public:
     }
     uint32_t readHalf(uint32_t addr, bool signedExt = false)
     {
+        uint32_t io;
+        if (addr >= ioBase && deviceAccess(addr, 2, false, io))
+            return signedExt ? static_cast<uint32_t>(signExtend(io & 0xFFFF, 16)) : (io & 0xFFFF);
         if (!validAddress(addr, 2))
         {
             cerr << "Data Memory: readHalf() invalid address 0x" << hex << addr << dec << "\n";
@@ -280,6 +529,37 @@ public:
         return v;
     }
 
+    // Direct access to the backing bytes (used by the syscall layer to move buffers without copying):
+    uint8_t *hostPointer(uint32_t addr, size_t bytesCount)
+    {
+        if (!validAddress(addr, bytesCount))
+            return nullptr;
+        return DM.data() + (addr - baseAddr);
+    }
+
+    uint32_t endAddress() const
+    {
+        return baseAddr + static_cast<uint32_t>(DM.size());
+    }
+
+    // Copies bytes [addr, addr + bytesCount) from another memory of the same layout:
+    void copyFrom(const DataMemory &from, uint32_t addr, uint32_t bytesCount)
+    {
+        if (!validAddress(addr, bytesCount) || addr - from.baseAddr + bytesCount > from.DM.size())
+            return;
+        auto src = from.DM.begin() + (addr - from.baseAddr);
+        copy(src, src + bytesCount, DM.begin() + (addr - baseAddr));
+    }
+
+    // Copies a data segment in (the rest of the segment stays zero filled):
+    bool loadSegment(const Segment &seg)
+    {
+        if (!validAddress(seg.vaddr, seg.memSize))
+            return false;
+        copy(seg.bytes.begin(), seg.bytes.end(), DM.begin() + (seg.vaddr - baseAddr));
+        return true;
+    }
+
     // Dump:
     void dump(uint32_t start = 0, uint32_t end = 128)
     {
@@ -298,6 +578,243 @@ public:
     }
 };
 
+// Proxy Kernel:
+/*
+    Emulates the Linux RV32 system calls a program makes with ECALL:
+        a7 = syscall number, a0..a5 = arguments, a0 = return value (negative errno on failure).
+    Buffers are moved straight between DataMemory and the host file descriptors.
+    Files can only be opened inside the sandbox directory (no absolute paths, no "..").
+*/
+class ProxyKernel
+{
+private:
+    string sandboxDir;
+    unordered_map<uint32_t, int> fdTable; // guest fd -> host fd
+    uint32_t programBreak;
+
+    // Simulated time is derived from the cycle count:
+    static const uint64_t clockHz = 100000000; // 100 MHz
+
+    // Linux RV32 (asm-generic) open flags:
+    static const uint32_t G_O_ACCMODE = 03, G_O_WRONLY = 01, G_O_RDWR = 02;
+    static const uint32_t G_O_CREAT = 0100, G_O_EXCL = 0200, G_O_TRUNC = 01000, G_O_APPEND = 02000;
+    static const int32_t G_AT_FDCWD = -100;
+
+    int hostFd(uint32_t fd)
+    {
+        auto it = fdTable.find(fd);
+        if (it == fdTable.end())
+            return -1;
+        return it->second;
+    }
+
+    bool readString(DataMemory &DM, uint32_t addr, string &str)
+    {
+        str.clear();
+        for (uint32_t i = 0; i < PATH_MAX; i++)
+        {
+            uint8_t *ch = DM.hostPointer(addr + i, 1);
+            if (ch == nullptr)
+                return false;
+            if (*ch == 0)
+                return true;
+            str += static_cast<char>(*ch);
+        }
+        return false;
+    }
+
+    bool insideSandbox(const string &path)
+    {
+        if (path.empty() || path[0] == '/')
+            return false;
+        stringstream ss(path);
+        string part;
+        while (getline(ss, part, '/'))
+            if (part == "..")
+                return false;
+        return true;
+    }
+
+    int32_t sysOpenAt(DataMemory &DM, int32_t dirfd, uint32_t pathAddr, uint32_t flags, uint32_t mode)
+    {
+        string path;
+        if (!readString(DM, pathAddr, path))
+            return -EFAULT;
+        if (dirfd != G_AT_FDCWD)
+            return -EBADF;
+        if (!insideSandbox(path))
+            return -EACCES;
+
+        int hostFlags = 0;
+        if ((flags & G_O_ACCMODE) == G_O_WRONLY)
+            hostFlags = O_WRONLY;
+        else if ((flags & G_O_ACCMODE) == G_O_RDWR)
+            hostFlags = O_RDWR;
+        else
+            hostFlags = O_RDONLY;
+        if (flags & G_O_CREAT)
+            hostFlags |= O_CREAT;
+        if (flags & G_O_EXCL)
+            hostFlags |= O_EXCL;
+        if (flags & G_O_TRUNC)
+            hostFlags |= O_TRUNC;
+        if (flags & G_O_APPEND)
+            hostFlags |= O_APPEND;
+
+        int fd = ::open((sandboxDir + "/" + path).c_str(), hostFlags, mode & 0777);
+        if (fd < 0)
+            return -errno;
+
+        // Lowest free guest descriptor:
+        uint32_t guestFd = 3;
+        while (fdTable.find(guestFd) != fdTable.end())
+            guestFd++;
+        fdTable[guestFd] = fd;
+        return guestFd;
+    }
+
+    int32_t sysClose(uint32_t fd)
+    {
+        int hfd = hostFd(fd);
+        if (hfd < 0)
+            return -EBADF;
+        fdTable.erase(fd);
+        if (hfd > 2 && ::close(hfd) < 0) // Never close the simulator's own stdin/stdout/stderr
+            return -errno;
+        return 0;
+    }
+
+    int32_t sysRead(DataMemory &DM, uint32_t fd, uint32_t bufAddr, uint32_t count)
+    {
+        int hfd = hostFd(fd);
+        if (hfd < 0)
+            return -EBADF;
+        uint8_t *buf = DM.hostPointer(bufAddr, count);
+        if (buf == nullptr)
+            return -EFAULT;
+        ssize_t n = ::read(hfd, buf, count);
+        if (n > 0)
+            setWritten(bufAddr, static_cast<uint32_t>(n));
+        return (n < 0) ? -errno : static_cast<int32_t>(n);
+    }
+
+    int32_t sysWrite(DataMemory &DM, uint32_t fd, uint32_t bufAddr, uint32_t count)
+    {
+        int hfd = hostFd(fd);
+        if (hfd < 0)
+            return -EBADF;
+        uint8_t *buf = DM.hostPointer(bufAddr, count);
+        if (buf == nullptr)
+            return -EFAULT;
+        if (hfd == 1 || hfd == 2) // Keep the program output in order with the pipeline trace
+            cout.flush();
+        ssize_t n = ::write(hfd, buf, count);
+        return (n < 0) ? -errno : static_cast<int32_t>(n);
+    }
+
+    int32_t sysLseek(uint32_t fd, int32_t offset, uint32_t whence)
+    {
+        int hfd = hostFd(fd);
+        if (hfd < 0)
+            return -EBADF;
+        off_t pos = ::lseek(hfd, offset, static_cast<int>(whence));
+        return (pos < 0) ? -errno : static_cast<int32_t>(pos);
+    }
+
+    void setWritten(uint32_t addr, uint32_t bytes)
+    {
+        writtenAddr = addr;
+        writtenBytes = bytes;
+    }
+
+    uint32_t sysBrk(DataMemory &DM, uint32_t addr)
+    {
+        // On failure Linux returns the unchanged break:
+        if (addr != 0 && addr <= DM.endAddress() && DM.validAddress(addr - 1, 1))
+            programBreak = addr;
+        return programBreak;
+    }
+
+    int32_t sysClockGettime(DataMemory &DM, uint32_t tpAddr, uint64_t cycle, bool time64)
+    {
+        uint64_t sec = cycle / clockHz;
+        uint64_t nsec = (cycle % clockHz) * (1000000000ull / clockHz);
+        if (!DM.validAddress(tpAddr, time64 ? 16 : 8))
+            return -EFAULT;
+        setWritten(tpAddr, time64 ? 16 : 8);
+        if (time64) // struct timespec with 64 bit time_t
+        {
+            DM.writeWord(tpAddr + 0, static_cast<uint32_t>(sec));
+            DM.writeWord(tpAddr + 4, static_cast<uint32_t>(sec >> 32));
+            DM.writeWord(tpAddr + 8, static_cast<uint32_t>(nsec));
+            DM.writeWord(tpAddr + 12, 0);
+        }
+        else
+        {
+            DM.writeWord(tpAddr + 0, static_cast<uint32_t>(sec));
+            DM.writeWord(tpAddr + 4, static_cast<uint32_t>(nsec));
+        }
+        return 0;
+    }
+
+public:
+    bool exited;
+    int32_t exitCode;
+    uint32_t writtenAddr = 0, writtenBytes = 0; // Data Memory the last syscall wrote (read buffer, timespec)
+
+    ProxyKernel(const string &sandbox = ".", uint32_t heapStart = 0) : sandboxDir(sandbox), programBreak(heapStart)
+    {
+        fdTable[0] = 0;
+        fdTable[1] = 1;
+        fdTable[2] = 2;
+        exited = false;
+        exitCode = 0;
+    }
+
+    ~ProxyKernel()
+    {
+        for (auto &entry : fdTable)
+            if (entry.second > 2)
+                ::close(entry.second);
+    }
+
+    // Performs the syscall requested in a7 and returns the value for a0:
+    uint32_t ecall(RegisterFile &RF, DataMemory &DM, uint64_t cycle)
+    {
+        uint32_t num = RF.read(17);
+        uint32_t a0 = RF.read(10), a1 = RF.read(11), a2 = RF.read(12), a3 = RF.read(13);
+        writtenBytes = 0;
+
+        switch (num)
+        {
+        case 56: // openat
+            return sysOpenAt(DM, static_cast<int32_t>(a0), a1, a2, a3);
+        case 57: // close
+            return sysClose(a0);
+        case 62: // lseek
+            return sysLseek(a0, static_cast<int32_t>(a1), a2);
+        case 63: // read
+            return sysRead(DM, a0, a1, a2);
+        case 64: // write
+            return sysWrite(DM, a0, a1, a2);
+        case 93: // exit
+        case 94: // exit_group
+            exited = true;
+            exitCode = static_cast<int32_t>(a0);
+            return a0;
+        case 113: // clock_gettime (32 bit time_t)
+            return sysClockGettime(DM, a1, cycle, false);
+        case 214: // brk
+            return sysBrk(DM, a0);
+        case 403: // clock_gettime64
+            return sysClockGettime(DM, a1, cycle, true);
+        default:
+            cerr << "Proxy Kernel: Unsupported syscall number: " << num << "\n";
+            return static_cast<uint32_t>(-ENOSYS);
+        }
+    }
+};
+
 ControlWord ControlUnit(uint32_t opcode)
 {
     ControlWord CW;
@@ -387,15 +904,63 @@ ControlWord ControlUnit(uint32_t opcode)
         CW.ALUOp = 0; // Matters
         break;
 
-    default:
-        cerr << "Control Unit: Unknown opcode: " << opcode << "\n";
-        exit(1);
+    case 55: // LUI (U type): 0 + imm
+        CW.regRead = 0;
+        CW.regWrite = 1;
+        CW.memRead = 0;
+        CW.memWrite = 0;
+        CW.mem2Reg = 0;
+        CW.branch = 0;
+        CW.jump = 0;
+        CW.ALUSrc = 1;
+        CW.ALUOp = 0;
+        break;
+
+    case 23: // AUIPC (U type): PC + imm
+        CW.regRead = 0;
+        CW.regWrite = 1;
+        CW.memRead = 0;
+        CW.memWrite = 0;
+        CW.mem2Reg = 0;
+        CW.branch = 0;
+        CW.jump = 0;
+        CW.ALUSrc = 1;
+        CW.ALUOp = 0;
+        break;
+
+    case 15: // FENCE: memory is accessed in program order here, so it does nothing
+        CW.regRead = 0;
+        CW.regWrite = 0;
+        CW.memRead = 0;
+        CW.memWrite = 0;
+        CW.mem2Reg = 0;
+        CW.branch = 0;
+        CW.jump = 0;
+        CW.ALUSrc = 1;
+        CW.ALUOp = 0;
+        break;
+
+    case 115: // System (ECALL, CSR): the result (syscall return, old CSR value) travels down the pipeline like an ADDI into rd
+        CW.regRead = 0;
+        CW.regWrite = 1;
+        CW.memRead = 0;
+        CW.memWrite = 0;
+        CW.mem2Reg = 0;
+        CW.branch = 0;
+        CW.jump = 0;
+        CW.ALUSrc = 1;
+        CW.ALUOp = 0; // ADD (result + 0)
+        break;
+
+    default: // Decode raises the exception
+        CW.illegal = true;
         break;
     }
     return CW;
 }
 
-uint32_t ALUControl(uint32_t ALUOp, uint32_t func7, uint32_t func3, uint32_t opcode)
+// Evaluated at compile time by the pipeline (see aluDecodeTable), the benchmarks call it directly
+constexpr uint32_t ALUControl(uint32_t ALUOp, uint32_t func7, uint32_t func3, uint32_t opcode)
 {
     /*
         ALUOp: Action
@@ -464,186 +1029,119 @@ uint32_t ALUControl(uint32_t ALUOp, uint32_t func7, uint32_t func3, uint32_t opc
     return 2;
 }
 
-uint32_t ALU(uint32_t ALUSelect, uint32_t A, uint32_t B)
+// ALU operations (the ALUSelect values of ALUControl):
+enum AluOp : uint32_t
 {
-    /*
-        ALUSelect: ALU Action
-        0: AND
-        1: OR
-        2: ADD
-        3: XOR
-        4: SLL
-        5: SRL
-        6: SUB
-        7: SRA
-        8: SLT
-        9: SLTU
-        10: MUL
-        11: MULH
-        12: MULHSU
-        13: MULHU
-        14: DIV
-        15: DIVU
-        16: REM
-        17: REMU
-    */
+    ALU_AND,
+    ALU_OR,
+    ALU_ADD,
+    ALU_XOR,
+    ALU_SLL,
+    ALU_SRL,
+    ALU_SUB,
+    ALU_SRA,
+    ALU_SLT,
+    ALU_SLTU,
+    ALU_MUL,
+    ALU_MULH,
+    ALU_MULHSU,
+    ALU_MULHU,
+    ALU_DIV,
+    ALU_DIVU,
+    ALU_REM,
+    ALU_REMU,
+    ALU_OPS
+};
 
-    uint32_t result = 0;
+// One handler per operation: each instantiation compiles to just its own operation
+template <AluOp op>
+uint32_t aluExec(uint32_t A, uint32_t B)
+{
+    int32_t aS = static_cast<int32_t>(A), bS = static_cast<int32_t>(B);
+    if constexpr (op == ALU_AND)
+        return A & B;
+    else if constexpr (op == ALU_OR)
+        return A | B;
+    else if constexpr (op == ALU_ADD)
+        return A + B;
+    else if constexpr (op == ALU_XOR)
+        return A ^ B;
+    else if constexpr (op == ALU_SLL)
+        return A << (B & 0x1F);
+    else if constexpr (op == ALU_SRL)
+        return A >> (B & 0x1F);
+    else if constexpr (op == ALU_SUB)
+        return A - B;
+    else if constexpr (op == ALU_SRA)
+        return static_cast<uint32_t>(aS >> (B & 0x1F));
+    else if constexpr (op == ALU_SLT)
+        return aS < bS ? 1 : 0;
+    else if constexpr (op == ALU_SLTU)
+        return A < B ? 1 : 0;
+    else if constexpr (op == ALU_MUL)
+        return A * B;
+    else if constexpr (op == ALU_MULH) // High 32 bits of signed * signed
+        return static_cast<uint32_t>((static_cast<int64_t>(aS) * bS) >> 32);
+    else if constexpr (op == ALU_MULHSU) // High 32 bits of signed * unsigned (the 64 bit product wraps correctly)
+        return static_cast<uint32_t>((static_cast<uint64_t>(static_cast<int64_t>(aS)) * B) >> 32);
+    else if constexpr (op == ALU_MULHU) // High 32 bits of unsigned * unsigned
+        return static_cast<uint32_t>((static_cast<uint64_t>(A) * B) >> 32);
+    else if constexpr (op == ALU_DIV) // Divide by zero gives -1, INT_MIN / -1 overflows to INT_MIN
+        return B == 0 ? 0xFFFFFFFF : (A == 0x80000000 && bS == -1) ? 0x80000000 : static_cast<uint32_t>(aS / bS);
+    else if constexpr (op == ALU_DIVU)
+        return B == 0 ? 0xFFFFFFFF : A / B;
+    else if constexpr (op == ALU_REM) // Remainder of a divide by zero is the dividend, of INT_MIN / -1 it is 0
+        return B == 0 ? A : (A == 0x80000000 && bS == -1) ? 0 : static_cast<uint32_t>(aS % bS);
+    else // ALU_REMU
+        return B == 0 ? A : A % B;
+}
 
-    switch (ALUSelect)
-    {
-    case 0:
-        result = A & B;
-        break;
+typedef uint32_t (*ALUHandler)(uint32_t A, uint32_t B);
 
-    case 1:
-        result = A | B;
-        break;
+template <size_t... ops>
+constexpr array<ALUHandler, ALU_OPS> makeALUHandlers(index_sequence<ops...>)
+{
+    return {{&aluExec<static_cast<AluOp>(ops)>...}};
+}
+constexpr array<ALUHandler, ALU_OPS> aluHandlers = makeALUHandlers(make_index_sequence<ALU_OPS>());
 
-    case 2:
-        result = A + B;
-        break;
+// ALU decode table: ALUControl depends only on ALUOp, whether it is an R type, func7 bits 5 and 0 (SUB/SRA and M)
+// and func3, so those 8 bits index a table generated at compile time. Decode looks the operation up once and
+// Execute calls its handler, with no if/switch chain on the way.
+constexpr uint32_t aluDecodeKey(uint32_t ALUOp, uint32_t func7, uint32_t func3, uint32_t opcode)
+{
+    return ((ALUOp & 3) << 6) | ((opcode == 51) << 5) | (((func7 >> 5) & 1) << 4) | ((func7 & 1) << 3) | (func3 & 7);
+}
 
-    case 3:
-        result = A ^ B;
-        break;
+constexpr array<uint8_t, 256> makeALUDecodeTable()
+{
+    array<uint8_t, 256> table = {};
+    for (uint32_t key = 0; key < 256; key++)
+        table[key] = static_cast<uint8_t>(ALUControl(key >> 6, (((key >> 4) & 1) << 5) | ((key >> 3) & 1), key & 7, ((key >> 5) & 1) ? 51 : 19));
+    return table;
+}
+constexpr array<uint8_t, 256> aluDecodeTable = makeALUDecodeTable();
+static_assert(aluDecodeTable[aluDecodeKey(2, 0x20, 0, 51)] == ALU_SUB && aluDecodeTable[aluDecodeKey(2, 0x20, 0, 19)] == ALU_ADD,
+              "SUB only for R type");
+static_assert(aluDecodeTable[aluDecodeKey(2, 0x01, 6, 51)] == ALU_REM && aluDecodeTable[aluDecodeKey(2, 0x20, 5, 19)] == ALU_SRA,
+              "M extension and SRAI");
 
-    case 4:
-        result = A << (B & (0x1F));
-        break;
+inline uint32_t aluDecode(uint32_t ALUOp, uint32_t func7, uint32_t func3, uint32_t opcode)
+{
+    return aluDecodeTable[aluDecodeKey(ALUOp, func7, func3, opcode)];
+}
 
-    case 5:
-        result = A >> (B & (0x1F));
-        break;
+// ALUSelect is an AluOp (0: AND ... 17: REMU)
+uint32_t ALU(uint32_t ALUSelect, uint32_t A, uint32_t B)
+{
+    return ALUSelect < ALU_OPS ? aluHandlers[ALUSelect](A, B) : 0;
+}
 
-    case 6:
-        result = A - B;
-        break;
-
-    case 7:
-        result = static_cast<int32_t>(A) >> (B & (0x1F));
-        break;
-
-    case 8:
-        result = (static_cast<int32_t>(A) < static_cast<int32_t>(B)) ? 1 : 0;
-        break;
-
-    case 9:
-        result = (A < B) ? 1 : 0;
-        break;
-
-    case 10:
-        result = A * B;
-        break;
-
-    case 11: // mulh: High 32 bits of signed*signed
-    {
-        // This was your line 525
-        int64_t aS = static_cast<int32_t>(A);
-        int64_t bS = static_cast<int32_t>(B);
-        int64_t resS = aS * bS;
-        result = static_cast<uint32_t>(resS >> 32); // Upper 32 bits
-        break;
-    }
-    case 12: // mulhsu: High 32 bits of signed*unsigned
-    {
-        // This was your line 534
-        int32_t a_s32 = static_cast<int32_t>(A);
-        uint64_t b_u64 = B;
-
-        if (a_s32 >= 0)
-        {
-            // A is positive, same as mulhu but with a signed cast
-            uint64_t res = static_cast<uint64_t>(a_s32) * b_u64;
-            result = static_cast<uint32_t>(res >> 32);
-        }
-        else
-        {
-            // A is negative. Calculate product of abs(A) * B, then negate.
-            uint64_t a_abs;
-            if (a_s32 == INT32_MIN)
-            {
-                a_abs = static_cast<uint64_t>(INT32_MIN); // 2^31
-            }
-            else
-            {
-                a_abs = static_cast<uint64_t>(-a_s32);
-            }
-
-            uint64_t abs_prod = a_abs * b_u64;
-            uint64_t neg_prod = ~abs_prod + 1; // Two's complement negation
-            result = static_cast<uint32_t>(neg_prod >> 32);
-        }
-        break;
-    }
-
-    case 13: // mulhu: High 32 bits of unsigned*unsigned
-    {
-        // This was your line 543
-        uint64_t aU = A;
-        uint64_t bU = B;
-        uint64_t resU = aU * bU;
-        result = static_cast<uint32_t>(resU >> 32); // Upper 32 bits
-        break;
-    }
-
-    case 14:
-    {
-        int32_t aS = static_cast<int32_t>(A);
-        int32_t bS = static_cast<int32_t>(B);
-
-        if (bS == 0) // Divide by zero
-            result = 0xFFFFFFFF;
-        else if (aS == 0x80000000 && bS == -1) // Overflow (INT_MIN/-1)
-            result = 0x80000000;
-        else
-            result = static_cast<uint32_t>(aS / bS);
-        break;
-    }
-
-    case 15:
-    {
-        if (B == 0)
-            result = 0xFFFFFFFF;
-        else
-            result = A / B;
-        break;
-    }
-
-    case 16: // REM (signed)
-    {
-        int32_t a_s = static_cast<int32_t>(A);
-        int32_t b_s = static_cast<int32_t>(B);
-
-        if (b_s == 0)                            // Divide by zero
-            result = A;                          // Remainder is dividend
-        else if (a_s == 0x80000000 && b_s == -1) // Overflow (INT_MIN % -1)
-            result = 0;
-        else
-            result = static_cast<uint32_t>(a_s % b_s);
-        break;
-    }
-
-    case 17: // REMU (unsigned)
-    {
-        if (B == 0)     // Divide by zero
-            result = A; // Remainder is dividend
-        else
-            result = A % B;
-        break;
-    }
-
-    default:
-        result = 0;
-    }
-    return result;
-}
-
-int32_t signExtend(uint32_t val, int bits)
-{
-    int shift = 32 - bits;
-    return ((static_cast<int32_t>(val << shift)) >> shift);
-}
+int32_t signExtend(uint32_t val, int bits)
+{
+    int shift = 32 - bits;
+    return ((static_cast<int32_t>(val << shift)) >> shift);
+}
 
 void prepareOpcodeAndFunctions(uint32_t instr, uint32_t &opcode, uint32_t &rdl, uint32_t &func3,
                                uint32_t &rsl1, uint32_t &rsl2, uint32_t &func7)
@@ -700,12 +1198,129 @@ int32_t genImm(uint32_t instr, uint32_t opcode)
         imm = ((instr >> 31) << 12) | (((instr >> 7) & 0x1) << 11) | (((instr >> 25) & 0x3F) << 5) | (((instr >> 8) & 0xF) << 1);
         imm = signExtend(imm, 13);
     }
+    else if (opcode == 55 || opcode == 23) // U type (LUI, AUIPC)
+    {
+        imm = static_cast<int32_t>(instr & 0xFFFFF000);
+    }
     else
         imm = 0;
 
     return imm;
 }
 
+// RVC (C extension) Decoder:
+// Expands a 16 bit compressed instruction into its 32 bit equivalent (0 if it is illegal or not part of RV32C)
+uint32_t expandCompressed(uint16_t c)
+{
+    auto bits = [c](int hi, int lo)
+    { return (static_cast<uint32_t>(c) >> lo) & ((1u << (hi - lo + 1)) - 1); };
+    auto encI = [](int32_t imm, uint32_t rs1, uint32_t func3, uint32_t rd, uint32_t opcode)
+    { return (static_cast<uint32_t>(imm & 0xFFF) << 20) | (rs1 << 15) | (func3 << 12) | (rd << 7) | opcode; };
+    auto encR = [](uint32_t func7, uint32_t rs2, uint32_t rs1, uint32_t func3, uint32_t rd)
+    { return (func7 << 25) | (rs2 << 20) | (rs1 << 15) | (func3 << 12) | (rd << 7) | 0x33u; };
+    auto encS = [](int32_t imm, uint32_t rs2, uint32_t rs1, uint32_t func3)
+    { return (static_cast<uint32_t>((imm >> 5) & 0x7F) << 25) | (rs2 << 20) | (rs1 << 15) | (func3 << 12) | ((imm & 0x1F) << 7) | 0x23u; };
+    auto encB = [](int32_t imm, uint32_t rs2, uint32_t rs1, uint32_t func3)
+    { return (static_cast<uint32_t>((imm >> 12) & 1) << 31) | (((imm >> 5) & 0x3F) << 25) | (rs2 << 20) | (rs1 << 15) | (func3 << 12) |
+             (((imm >> 1) & 0xF) << 8) | (((imm >> 11) & 1) << 7) | 0x63u; };
+    auto encJ = [](int32_t imm, uint32_t rd)
+    { return (static_cast<uint32_t>((imm >> 20) & 1) << 31) | (((imm >> 1) & 0x3FF) << 21) | (((imm >> 11) & 1) << 20) |
+             (((imm >> 12) & 0xFF) << 12) | (rd << 7) | 0x6Fu; };
+
+    uint32_t func3 = bits(15, 13);
+    uint32_t rd = bits(11, 7), rs2 = bits(6, 2);         // Full register fields
+    uint32_t rs1P = bits(9, 7) + 8, rdP = bits(4, 2) + 8; // x8..x15 register fields
+    int32_t imm6 = signExtend((bits(12, 12) << 5) | bits(6, 2), 6);
+    int32_t immJ = signExtend((bits(12, 12) << 11) | (bits(11, 11) << 4) | (bits(10, 9) << 8) | (bits(8, 8) << 10) |
+                                  (bits(7, 7) << 6) | (bits(6, 6) << 7) | (bits(5, 3) << 1) | (bits(2, 2) << 5),
+                              12);
+
+    switch (c & 0x3)
+    {
+    case 0: // Quadrant 0
+    {
+        uint32_t uimm = (bits(12, 10) << 3) | (bits(6, 6) << 2) | (bits(5, 5) << 6);
+        if (func3 == 0) // C.ADDI4SPN
+        {
+            uint32_t nzuimm = (bits(12, 11) << 4) | (bits(10, 7) << 6) | (bits(6, 6) << 2) | (bits(5, 5) << 3);
+            return nzuimm ? encI(nzuimm, 2, 0, rdP, 0x13) : 0;
+        }
+        if (func3 == 2) // C.LW
+            return encI(uimm, rs1P, 2, rdP, 0x03);
+        if (func3 == 6) // C.SW
+            return encS(uimm, rdP, rs1P, 2);
+        return 0;
+    }
+
+    case 1: // Quadrant 1
+        switch (func3)
+        {
+        case 0: // C.ADDI (C.NOP)
+            return encI(imm6, rd, 0, rd, 0x13);
+        case 1: // C.JAL
+            return encJ(immJ, 1);
+        case 2: // C.LI
+            return encI(imm6, 0, 0, rd, 0x13);
+        case 3:
+            if (rd == 2) // C.ADDI16SP
+            {
+                int32_t nzimm = signExtend((bits(12, 12) << 9) | (bits(6, 6) << 4) | (bits(5, 5) << 6) | (bits(4, 3) << 7) | (bits(2, 2) << 5), 10);
+                return nzimm ? encI(nzimm, 2, 0, 2, 0x13) : 0;
+            }
+            return imm6 ? ((static_cast<uint32_t>(imm6) << 12) | (rd << 7) | 0x37) : 0; // C.LUI
+        case 4:
+            switch (bits(11, 10))
+            {
+            case 0: // C.SRLI
+                return bits(12, 12) ? 0 : encI(rs2, rs1P, 5, rs1P, 0x13);
+            case 1: // C.SRAI
+                return bits(12, 12) ? 0 : encI(0x400 | rs2, rs1P, 5, rs1P, 0x13);
+            case 2: // C.ANDI
+                return encI(imm6, rs1P, 7, rs1P, 0x13);
+            default: // C.SUB, C.XOR, C.OR, C.AND
+            {
+                if (bits(12, 12))
+                    return 0; // RV64 only
+                static const uint32_t func3Of[4] = {0, 4, 6, 7};
+                uint32_t sel = bits(6, 5);
+                return encR(sel == 0 ? 0x20 : 0x00, rdP, rs1P, func3Of[sel], rs1P);
+            }
+            }
+        case 5: // C.J
+            return encJ(immJ, 0);
+        default: // C.BEQZ, C.BNEZ
+        {
+            int32_t off = signExtend((bits(12, 12) << 8) | (bits(11, 10) << 3) | (bits(6, 5) << 6) | (bits(4, 3) << 1) | (bits(2, 2) << 5), 9);
+            return encB(off, 0, rs1P, func3 - 6);
+        }
+        }
+
+    case 2: // Quadrant 2
+        if (func3 == 0) // C.SLLI
+            return bits(12, 12) ? 0 : encI(rs2, rd, 1, rd, 0x13);
+        if (func3 == 2) // C.LWSP
+            return rd ? encI((bits(12, 12) << 5) | (bits(6, 4) << 2) | (bits(3, 2) << 6), 2, 2, rd, 0x03) : 0;
+        if (func3 == 4)
+        {
+            if (bits(12, 12) == 0)
+            {
+                if (rs2 == 0) // C.JR
+                    return rd ? encI(0, rd, 0, 0, 0x67) : 0;
+                return encR(0, rs2, 0, 0, rd); // C.MV
+            }
+            if (rd == 0 && rs2 == 0) // C.EBREAK
+                return 0x00100073;
+            if (rs2 == 0) // C.JALR
+                return encI(0, rd, 0, 1, 0x67);
+            return encR(0, rs2, rd, 0, rd); // C.ADD
+        }
+        if (func3 == 6) // C.SWSP
+            return encS((bits(12, 9) << 2) | (bits(8, 7) << 6), rs2, 2, 2);
+        return 0;
+    }
+    return 0; // Not a compressed instruction
+}
+
 // Pipeline registers:
 /*
     Note:
@@ -715,22 +1330,29 @@ int32_t genImm(uint32_t instr, uint32_t opcode)
 
 struct PC_Reg
 {
+    static const uint32_t NO_TARGET = UINT32_MAX; // TPC when the normal flow continues
     uint32_t value, TPC;
 
     PC_Reg()
     {
         value = 0;
-        TPC = -1;
+        TPC = NO_TARGET;
     }
 };
 
 struct IFID_Reg
 {
-    uint32_t DPC, IR;
+    uint32_t DPC, IR; // IR always holds the 32 bit form (compressed instructions are expanded in fetch)
+    uint32_t ilen;    // 4, or 2 for a compressed instruction
+    uint32_t id;      // Fetch order, follows the instruction down the pipeline (trace)
+    bool trap;        // The fetch faulted (IR is 0), Decode raises the exception
+    uint32_t cause, tval;
     bool stall, valid;
     IFID_Reg()
     {
-        DPC = IR = 0;
+        DPC = IR = id = 0;
+        ilen = 4;
+        trap = false, cause = tval = 0;
         stall = false, valid = false;
     }
 };
@@ -738,7 +1360,7 @@ struct IFID_Reg
 struct IDEX_Reg
 {
     ControlWord CW;
-    uint32_t DPC;
+    uint32_t DPC, ilen, id;
     uint32_t rs1, rs2;
     int32_t imm;
 
@@ -747,15 +1369,24 @@ struct IDEX_Reg
     uint32_t func3;
     uint32_t rsl1, rsl2; // for operand forwarding
     uint32_t func7;
+    uint32_t ALUSelect; // AluOp, looked up in Decode
+    uint32_t busy;      // Execute cycles left before the result is ready (multi-cycle MUL/DIV)
+
+    bool trap;           // Exception found in Decode, taken when the instruction reaches Memory Operation
+    uint32_t cause, tval;
 
     bool stall, valid;
 
     IDEX_Reg()
     {
         CW = ControlWord();
-        DPC = 0;
+        DPC = id = 0;
+        ilen = 4;
         rs1 = rs2 = 0;
         opcode = rdl = func3 = rsl1 = rsl2 = func7 = 0;
+        ALUSelect = ALU_ADD;
+        busy = 0;
+        trap = false, cause = tval = 0;
         stall = false, valid = false;
     }
 };
@@ -763,20 +1394,28 @@ struct IDEX_Reg
 struct EXMO_Reg
 {
     ControlWord CW;
-    uint32_t DPC;
+    uint32_t DPC, id;
     uint32_t ALUOut;
-    uint32_t rs2; // Will be required for store
+    uint32_t rs2;  // Will be required for store
+    uint32_t rsl2; // Store data register (forwarded into Memory Operation)
+    uint64_t memReady; // Blocking data cache: cycle the access is done, Memory Operation waits without accessing again
 
-    uint32_t rdl;   // Will be required in Operand forwarding
+    uint32_t rdl;    // Will be required in Operand forwarding
+    uint32_t rdMask; // 1 << rdl if the instruction writes a register other than x0, else 0 (forwarding)
     uint32_t func3; // Will be required for Load type determination
 
+    bool trap;
+    uint32_t cause, tval;
+
     bool stall, valid;
 
     EXMO_Reg()
     {
         CW = ControlWord();
-        DPC = rdl = func3 = 0;
+        DPC = id = rdl = rdMask = func3 = rsl2 = 0;
+        memReady = 0;
         ALUOut = 0;
+        trap = false, cause = tval = 0;
         stall = false, valid = false;
     }
 };
@@ -784,385 +1423,4959 @@ struct EXMO_Reg
 struct MOWB_Reg
 {
     ControlWord CW;
-    uint32_t DPC;
+    uint32_t DPC, id;
     uint32_t ALUOut, LDOut;
-    uint32_t rdl; // Will be required in operand forwarding
+    uint32_t rdl;        // Will be required in operand forwarding
+    uint32_t rs2, func3; // Store data and width (checked by the co-simulation)
+    uint32_t interrupt;  // mcause of an interrupt taken after this instruction (0: none), for the co-simulation
+    uint32_t interruptPC;
 
     bool stall, valid;
 
-    // To remember current state for MOWB before it is overwritten by EXMO (in MO stage):
-    ControlWord CWOld;
-    uint32_t ALUOutOld, LDOutOld, rdlOld;
-    bool validOld;
-    /*
-        Why do we need old values?
-        Reason: Suppose in EX, we have rsl2=X5,
-                        in MO, we have rdl=X4,
-                        in WB, we have rdl=X5.
-        Now when we move sequentially from right to left, we get overwrite MOWB.rdl=X4.
-        Now operand forwarding will not find that there is any issue and it will continue with stale value.
-    */
-
     MOWB_Reg()
     {
         CW = ControlWord();
-        DPC = 0;
+        DPC = id = 0;
         ALUOut = LDOut = rdl = 0;
-        ALUOutOld = LDOutOld = rdlOld = 0;
-        CWOld = ControlWord();
-        stall = false, valid = false, validOld = false;
+        rs2 = func3 = 0;
+        interrupt = interruptPC = 0;
+        stall = false, valid = false;
+    }
+};
+
+const uint32_t ECALL = 0x00000073, EBREAK = 0x00100073, MRET = 0x30200073, SRET = 0x10200073, WFI = 0x10500073;
+const uint32_t SFENCE_VMA = 0x12000073; // rs1/rs2 (address, ASID) are ignored
+
+// Fetch Buffer: the fetch unit reads one aligned 32 bit word per cycle from Instruction Memory
+struct FetchBuffer
+{
+    uint32_t wordAddr; // Word currently held
+    bool valid;
+
+    // Fetch statistics:
+    uint64_t instructions, compressed, wordsRead, stallCycles;
+
+    FetchBuffer()
+    {
+        wordAddr = 0;
+        valid = false;
+        instructions = compressed = wordsRead = stallCycles = 0;
     }
 };
 
 bool programRunning = true;
 bool insertBubble = false;
+bool verbose = true; // Per-cycle stage trace (-q turns it off for long runs)
+uint64_t cycle = 0;
+uint64_t retired = 0; // Instructions that reached WriteBack
 PC_Reg PC;
 IFID_Reg IFID;
 IDEX_Reg IDEX;
 EXMO_Reg EXMO;
 MOWB_Reg MOWB;
+FetchBuffer FB;
+uint32_t fetchStallCycles = 0;                      // Fetch wait cycles left: I-TLB page walk, I-cache miss
+uint32_t dataStallCycles = 0;                       // Memory Operation waits: D-TLB page walk, data cache (see DataCacheModel)
+uint32_t mulLatency = 1, divLatency = 1;           // Execute cycles of MUL* and of DIV*/REM* (--mul-latency, --div-latency)
 
-// Functions:
-void InstructionFetch(InstructionMemory &IM)
+// Forwarding network and branch resolution (--forwarding, --branch-stage):
+/*
+    FORWARD_EX (default): results reach Execute from EXMO and through the WriteBack write-through; only a load
+                          directly followed by a user of its value stalls (one bubble).
+    FORWARD_NONE:         full interlock, an instruction waits in Decode until every older instruction writing one of
+                          its source registers has written back (WriteBack runs first, so it reads the value that cycle).
+    FORWARD_EX_MEM:       as FORWARD_EX, plus the loaded value goes from MOWB to a store right behind the load in Memory
+                          Operation, so a load followed by a store of its value does not stall.
+    BRANCH_EX (default):  branches and jumps resolve in Execute, two slots are squashed.
+    BRANCH_ID:            they resolve in Decode with forwarding from MOWB, one slot is squashed. A source written by the
+                          instruction right ahead (or a load two ahead) stalls them in Decode.
+*/
+enum ForwardingMode
 {
-    cout << "\n[IF Stage]" << endl;
-    if (IFID.stall)
+    FORWARD_NONE,
+    FORWARD_EX,
+    FORWARD_EX_MEM
+};
+
+enum BranchStage
+{
+    BRANCH_EX,
+    BRANCH_ID
+};
+
+ForwardingMode forwarding = FORWARD_EX;
+uint32_t forwardMask = ~0u; // 0 with FORWARD_NONE: the forwarding paths into Execute are cut off
+BranchStage branchStage = BRANCH_EX;
+
+// Device addresses: a window at the top of the address space, above any RAM -m can give (the register layouts
+// are those of the CLINT and the 16550 on QEMU's virt machine)
+const uint32_t IO_BASE = 0xF0000000;
+const uint32_t TIMER_BASE = IO_BASE, TIMER_SIZE = 0x10000;
+const uint32_t UART_BASE = IO_BASE + 0x10000, UART_SIZE = 0x100;
+
+// Timer (CLINT layout): msip at +0x0, mtimecmp at +0x4000 and mtime at +0xBFF8 (64 bit, low word first).
+// mtime counts cycles; reaching mtimecmp raises MIP_MTIP through an event at that cycle.
+class Timer : public Device
+{
+private:
+    uint64_t mtimecmp = UINT64_MAX;
+    uint64_t mtimeOffset = 0; // mtime = cycle + mtimeOffset (wraps like the register)
+    uint32_t generation = 0; // Events of an older mtimecmp are stale
+
+    // Word at a register offset (the halves of the 64 bit registers)
+    uint32_t readRegister(uint32_t reg) const
     {
-        cout << "  IF: Stalled" << endl;
-        return;
+        if (reg == 0x0)
+            return (mip & MIP_MSIP) ? 1 : 0;
+        if (reg == 0x4000 || reg == 0x4004)
+            return static_cast<uint32_t>(mtimecmp >> (reg == 0x4004 ? 32 : 0));
+        if (reg == 0xBFF8 || reg == 0xBFFC)
+            return static_cast<uint32_t>(mtime() >> (reg == 0xBFFC ? 32 : 0));
+        return 0;
     }
 
-    // Program is over but we might have to continue running till the pipeline is empty:
-    if (PC.value >= 4 * IM.size())
+    // MTIP follows mtime >= mtimecmp; a compare value in the future is one event away
+    void reschedule()
     {
-        // Bubble injection:
-        IFID.valid = false;
-
-        // Check if all pipeline stages are empty:
-        if (!IDEX.valid && !EXMO.valid && !MOWB.valid)
-            programRunning = false;
-        return;
+        generation++;
+        if (mtime() >= mtimecmp)
+            mip |= MIP_MTIP;
+        else
+        {
+            mip &= ~MIP_MTIP;
+            events.schedule(cycle + (mtimecmp - mtime()), this, generation);
+        }
     }
 
-    IFID.IR = IM.read(PC.value);
-    IFID.DPC = PC.value;
-    cout << "  IF: PC=0x" << hex << PC.value << " (dec: " << dec << PC.value << ")"
-         << " IR=0x" << hex << IFID.IR << " (dec: " << dec << IFID.IR << ")" << endl;
+public:
+    uint64_t interrupts = 0; // Times MTIP was raised by an event
 
-    // PC Update logic: For next instruction and NOT the current instruction:
-    if (PC.TPC != -1) // The normal flow is broken
+    uint64_t mtime() const { return cycle + mtimeOffset; } // Also the time CSR
+
+    uint32_t read(uint32_t offset, uint32_t) override
     {
-        PC.value = PC.TPC;
-        PC.TPC = -1; // Reset the TPC so that normal flow is continued now
+        return readRegister(offset & ~3u) >> (8 * (offset & 3));
     }
-    else // Normal flow
-        PC.value = PC.value + 4;
-
-    IFID.valid = true;
-}
 
-// Finds the load-use hazard in Decode stage before actual decoding starts
-void HazardDetectionUnit()
-{
-    // If the instruction infront is Load instruction
-    if (IDEX.valid && IFID.valid && IDEX.CW.memRead && IDEX.rdl != 0)
+    void write(uint32_t offset, uint32_t value, uint32_t bytes) override
     {
-        uint32_t rsl1 = (IFID.IR >> 15) & 0x1F;
-        uint32_t rsl2 = (IFID.IR >> 20) & 0x1F;
+        uint32_t reg = offset & ~3u, shift = 8 * (offset & 3);
+        uint32_t mask = (bytes == 4) ? 0xFFFFFFFF : ((1u << (8 * bytes)) - 1) << shift;
+        uint32_t word = (readRegister(reg) & ~mask) | ((value << shift) & mask);
+        if (reg == 0x0)
+            mip = (word & 1) ? (mip | MIP_MSIP) : (mip & ~MIP_MSIP);
+        else if (reg == 0x4000 || reg == 0x4004)
+        {
+            int half = (reg == 0x4004) ? 32 : 0;
+            mtimecmp = (mtimecmp & ~(0xFFFFFFFFull << half)) | (static_cast<uint64_t>(word) << half);
+            reschedule();
+        }
+        else if (reg == 0xBFF8 || reg == 0xBFFC)
+        {
+            int half = (reg == 0xBFFC) ? 32 : 0;
+            uint64_t value64 = (mtime() & ~(0xFFFFFFFFull << half)) | (static_cast<uint64_t>(word) << half);
+            mtimeOffset = value64 - cycle;
+            reschedule();
+        }
+    }
 
-        // Check if the to-be-decoded instruction (in IFID) needs the loaded value
-        if (IDEX.rdl == rsl1 || IDEX.rdl == rsl2)
+    void event(uint32_t tag) override
+    {
+        if (tag == generation && mtime() >= mtimecmp)
         {
-            // Handled in Decode now: IFID.stall = true;  // Keep current instruction in IFID (stall Fetch)
-            IDEX.stall = true;  // Keep current instruction in IDEX (stall Decode)
-            IDEX.valid = false; // Insert bubble in IDEX (ensure NOP in EX in next cycle)
-            cout << "Load-Use Hazard detected.\n";
+            mip |= MIP_MTIP;
+            interrupts++;
         }
     }
-}
+};
 
-void InstructionDecode(RegisterFile &RF)
+// UART (16550 subset, byte registers): RBR/THR at +0, IER at +1, IIR at +2, LCR at +3, MCR at +4, LSR at +5,
+// SCR at +7 (DLL/DLM at +0/+1 while LCR.DLAB is set). A character takes charCycles to send or arrive; the
+// transmitter and the receiver each schedule one event per character. Raises MIP_MEIP when an interrupt
+// enabled in IER is pending.
+class Uart : public Device
 {
-    cout << "\n[ID Stage]" << endl;
-    HazardDetectionUnit();
-
-    if (IDEX.stall)
+private:
+    enum
     {
-        IFID.stall = true; // Left stage should also be stalled now
-        return;
+        TX_DONE,
+        RX_ARRIVE
+    };
+    ostream &out;
+    istream *in;
+    uint64_t charCycles;
+    uint8_t ier = 0, lcr = 0, mcr = 0, scr = 0, dll = 0, dlm = 0, rbr = 0;
+    bool dataReady = false, txBusy = false, rxPending = false;
+    uint64_t txDoneAt = 0; // Cycle the last character written finishes sending
+
+    void updateInterrupt()
+    {
+        bool pending = ((ier & 0x1) && dataReady) || ((ier & 0x2) && !txBusy);
+        mip = pending ? (mip | MIP_MEIP) : (mip & ~MIP_MEIP);
     }
 
-    if (IFID.valid == false) // Bubble in IFID => NOP in Decode
+    // The next character arrives charCycles after the last one was taken (no overruns)
+    void expectCharacter()
     {
-        // Propagate the bubble
-        IDEX.valid = false;
-
-        // Since bubble moves and is NOT stalled, we should signal left stage to move by removing the latter's stall!
-        IFID.stall = false;
-        return;
+        if (in != nullptr && !rxPending)
+        {
+            rxPending = true;
+            events.schedule(cycle + max<uint64_t>(charCycles, 1), this, RX_ARRIVE);
+        }
     }
 
-    // Prepare opcode and functions:
-    prepareOpcodeAndFunctions(IFID.IR, IDEX.opcode, IDEX.rdl, IDEX.func3, IDEX.rsl1, IDEX.rsl2, IDEX.func7);
-
-    // Immediate generation:
-    IDEX.imm = genImm(IFID.IR, IDEX.opcode);
+public:
+    uint64_t sent = 0, received = 0;
 
-    // Control Word Generation:
-    IDEX.CW = ControlUnit(IDEX.opcode);
+    Uart(ostream &output, istream *input, uint64_t cyclesPerChar) : out(output), in(input), charCycles(cyclesPerChar)
+    {
+        expectCharacter();
+    }
 
-    // Read Register:
-    IDEX.rs1 = 0, IDEX.rs2 = 0;
-    if (IDEX.CW.regRead)
+    uint32_t read(uint32_t offset, uint32_t) override
     {
-        IDEX.rs1 = RF.read(IDEX.rsl1);
-        IDEX.rs2 = RF.read(IDEX.rsl2);
+        bool dlab = lcr & 0x80;
+        switch (offset)
+        {
+        case 0:
+            if (dlab)
+                return dll;
+            if (dataReady)
+            {
+                dataReady = false;
+                updateInterrupt();
+                expectCharacter();
+            }
+            return rbr;
+        case 1:
+            return dlab ? dlm : ier;
+        case 2: // IIR: received data first, then transmitter empty, else none pending
+            return ((ier & 0x1) && dataReady) ? 0x04 : ((ier & 0x2) && !txBusy) ? 0x02 : 0x01;
+        case 3:
+            return lcr;
+        case 4:
+            return mcr;
+        case 5: // LSR: data ready, transmit holding register empty, transmitter empty
+            return (dataReady ? 0x01 : 0) | (txBusy ? 0 : 0x60);
+        case 7:
+            return scr;
+        default:
+            return 0;
+        }
     }
-    IDEX.DPC = IFID.DPC;
 
-    IFID.stall = false;
-    IDEX.valid = true;
-}
+    void write(uint32_t offset, uint32_t value, uint32_t) override
+    {
+        uint8_t byte = value & 0xFF;
+        bool dlab = lcr & 0x80;
+        if (offset == 0 && dlab)
+            dll = byte;
+        else if (offset == 0)
+        {
+            out.put(static_cast<char>(byte));
+            if (byte == '\n')
+                out.flush();
+            sent++;
+            if (charCycles > 0) // Queued behind a character still being sent
+            {
+                txBusy = true;
+                txDoneAt = max(txDoneAt, cycle) + charCycles;
+                events.schedule(txDoneAt, this, TX_DONE);
+            }
+        }
+        else if (offset == 1 && dlab)
+            dlm = byte;
+        else if (offset == 1)
+            ier = byte & 0x0F;
+        else if (offset == 3)
+            lcr = byte;
+        else if (offset == 4)
+            mcr = byte;
+        else if (offset == 7)
+            scr = byte;
+        updateInterrupt();
+    }
 
-uint32_t ALUForwarder(int i)
-{
-    switch (i)
+    void event(uint32_t tag) override
     {
-    case 1:
-        if (EXMO.valid && EXMO.CW.regWrite && EXMO.rdl != 0 && EXMO.rdl == IDEX.rsl1)
-            return EXMO.ALUOut;
-        else if (MOWB.validOld && MOWB.CWOld.regWrite && MOWB.rdlOld != 0 && MOWB.rdlOld == IDEX.rsl1)
-            return ((MOWB.CWOld.mem2Reg) ? (MOWB.LDOutOld) : (MOWB.ALUOutOld));
+        if (tag == TX_DONE)
+            txBusy = cycle < txDoneAt;
         else
-            return IDEX.rs1;
-        break;
-
-    case 2:
-        if (IDEX.CW.ALUSrc == 1) // Forwarding never required, as imm is ALWAYS updated!
-            return (static_cast<uint32_t>(IDEX.imm));
-        else // Forwarding might be required as we want UPDATED rs2!
-        {
-            if (EXMO.valid && EXMO.CW.regWrite && EXMO.rdl != 0 && EXMO.rdl == IDEX.rsl2)
-                return EXMO.ALUOut;
-            else if (MOWB.validOld && MOWB.CWOld.regWrite && MOWB.rdlOld != 0 && MOWB.rdlOld == IDEX.rsl2)
-                return ((MOWB.CWOld.mem2Reg) ? (MOWB.LDOutOld) : (MOWB.ALUOutOld));
+        {
+            rxPending = false;
+            int ch = in->get();
+            if (ch == EOF)
+                in = nullptr; // Nothing more will arrive
             else
-                return IDEX.rs2;
+            {
+                rbr = static_cast<uint8_t>(ch);
+                dataReady = true;
+                received++;
+            }
         }
-        break;
+        updateInterrupt();
+    }
+};
 
+// Control and Status Registers:
+/*
+    Machine and supervisor mode (Zicsr), with U mode below them. A trap saves the PC to return to in xepc, the
+    reason in xcause (the top bit is set for an interrupt) and the faulting address or instruction in xtval,
+    moves xstatus.xIE to xPIE and the privilege to xPP, clears xIE and continues at xtvec (mode 1: interrupts go
+    to base + 4 * cause). x is M, or S for a trap from S or U mode delegated by medeleg/mideleg. MRET and SRET
+    undo it. The counters are the simulator's own: mcycle is the cycle count, minstret the retired instructions
+    and time the timer's mtime.
+*/
+const uint32_t PRIV_U = 0, PRIV_S = 1, PRIV_M = 3;
+const uint32_t MSTATUS_SIE = 1u << 1, MSTATUS_MIE = 1u << 3, MSTATUS_SPIE = 1u << 5, MSTATUS_MPIE = 1u << 7;
+const uint32_t MSTATUS_SPP = 1u << 8, MSTATUS_MPP = 3u << 11, MSTATUS_SUM = 1u << 18, MSTATUS_MXR = 1u << 19;
+const uint32_t SSTATUS_MASK = MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP | MSTATUS_SUM | MSTATUS_MXR;
+const uint32_t MIP_SSIP = 1u << 1, MIP_STIP = 1u << 5, MIP_SEIP = 1u << 9; // Set by M mode software
+const uint32_t MIP_S_MASK = MIP_SSIP | MIP_STIP | MIP_SEIP;
+const uint32_t CAUSE_INTERRUPT = 0x80000000u;
+const uint32_t CAUSE_FETCH_FAULT = 1, CAUSE_ILLEGAL = 2, CAUSE_BREAKPOINT = 3, CAUSE_LOAD_FAULT = 5, CAUSE_STORE_FAULT = 7;
+const uint32_t CAUSE_ECALL_U = 8, CAUSE_ECALL_S = 9;
+const uint32_t CAUSE_FETCH_PAGE_FAULT = 12, CAUSE_LOAD_PAGE_FAULT = 13, CAUSE_STORE_PAGE_FAULT = 15;
+const uint32_t MEDELEG_MASK = 0xB3FF; // Every exception but ECALL from M mode
+const uint32_t MISA_RV32IMC = (1u << 30) | (1u << ('I' - 'A')) | (1u << ('M' - 'A')) | (1u << ('C' - 'A')) |
+                              (1u << ('S' - 'A')) | (1u << ('U' - 'A'));
+
+const char *trapName(uint32_t cause)
+{
+    switch (cause)
+    {
+    case CAUSE_FETCH_FAULT:
+        return "instruction access fault";
+    case CAUSE_ILLEGAL:
+        return "illegal instruction";
+    case CAUSE_BREAKPOINT:
+        return "breakpoint";
+    case CAUSE_LOAD_FAULT:
+        return "load access fault";
+    case CAUSE_STORE_FAULT:
+        return "store access fault";
+    case CAUSE_ECALL_U:
+        return "environment call from U mode";
+    case CAUSE_ECALL_S:
+        return "environment call from S mode";
+    case CAUSE_FETCH_PAGE_FAULT:
+        return "instruction page fault";
+    case CAUSE_LOAD_PAGE_FAULT:
+        return "load page fault";
+    case CAUSE_STORE_PAGE_FAULT:
+        return "store page fault";
+    case CAUSE_INTERRUPT | 1:
+    case CAUSE_INTERRUPT | 3:
+        return "software interrupt";
+    case CAUSE_INTERRUPT | 5:
+    case CAUSE_INTERRUPT | 7:
+        return "timer interrupt";
+    case CAUSE_INTERRUPT | 9:
+    case CAUSE_INTERRUPT | 11:
+        return "external interrupt";
     default:
-        cout << "ALUForwarder(): Error! Called with invalid value of i = " << i << ".\n";
-        return 0;
+        return "trap";
     }
-    return 0;
 }
 
-uint32_t rs2Forwarder() // also called storedDataForwarder()
+class CSRFile
 {
-    /*
-        (I)
-        ADDI rs2, rs2, 1;
-        SW rs2, off(rs1);
-
-        (II)
-        ADDI rs2, rs2, 1;
-        XXXXXXXXXXXXXXXX; // Some other instruction
-        SW rs2, off(rs1);
-
-        Example I indicates the requirement of rs2Forwarder().
-        Example II indicates to us that the rs2Forwarder() should be in Execute() and NOT MemoryOperation().
-        If we do the otherway around, then we will will have to forward data from RF as well.
-
-        (III)
-        ADDI rs2, rs2, 1;
-        ADDI rs2, rs2, 1;
-        SW rs2, off(rs1);
-
-        Example III indicates that we must borrow from EXMO first.
-    */
-
-    if (EXMO.valid && EXMO.CW.regWrite && EXMO.rdl != 0 && EXMO.rdl == IDEX.rsl2)
-        return EXMO.ALUOut;
-    else if (MOWB.validOld && MOWB.CWOld.regWrite && MOWB.rdlOld != 0 && MOWB.rdlOld == IDEX.rsl2)
-        return ((MOWB.CWOld.mem2Reg) ? (MOWB.LDOutOld) : (MOWB.ALUOutOld));
-    else
-        return IDEX.rs2;
-    return 0;
-}
+private:
+    uint64_t cycleOffset = 0, instretOffset = 0; // mcycle = cycle + cycleOffset (writes move the offset)
 
-void Execute()
-{
-    cout << "\n[EX Stage]" << endl;
-    if (EXMO.stall)
+    static uint64_t withHalf(uint64_t value, uint32_t word, bool high)
     {
-        IDEX.stall = true; // Left stage should also be stalled now
-        return;
+        return high ? (value & 0xFFFFFFFFull) | (static_cast<uint64_t>(word) << 32)
+                    : (value & ~0xFFFFFFFFull) | word;
     }
 
-    if (IDEX.valid == false) // Bubble in IDEX => NOP in Execute
+    static uint32_t vector(uint32_t tvec, uint32_t cause)
     {
-        // Propagate the bubble
-        EXMO.valid = false;
-
-        // Since bubble moves and is NOT stalled, we should signal left stage to move by removing the latter's stall!
-        IDEX.stall = false;
-        return;
+        uint32_t base = tvec & ~3u;
+        return ((tvec & 1) && (cause & CAUSE_INTERRUPT)) ? base + 4 * (cause & ~CAUSE_INTERRUPT) : base;
     }
 
-    // Determine ALU Input:
-    uint32_t alusrc1 = ALUForwarder(1);
-    uint32_t alusrc2 = ALUForwarder(2);
-    uint32_t &rs1 = alusrc1;
-    uint32_t rs2 = rs2Forwarder();
-
-    // ALU Select:
-    uint32_t ALUSelect = ALUControl(IDEX.CW.ALUOp, IDEX.func7, IDEX.func3, IDEX.opcode);
+public:
+    uint32_t priv = PRIV_M;
+    uint32_t mstatus = MSTATUS_MPP, mie = 0, mtvec = 0, mscratch = 0, mepc = 0, mcause = 0, mtval = 0;
+    uint32_t medeleg = 0, mideleg = 0;
+    uint32_t stvec = 0, sscratch = 0, sepc = 0, scause = 0, stval = 0, satp = 0;
+    Timer *timer = nullptr; // time CSR (cycle count without a timer)
+    uint64_t traps = 0, interrupts = 0;
+
+    uint64_t mcycle() const { return cycle + cycleOffset; }
+    uint64_t minstret() const { return retired + instretOffset; }
+
+    // Reads a CSR, false if it does not exist or needs a higher privilege (bits 9:8 of the number)
+    bool read(uint32_t csr, uint32_t &value) const
+    {
+        if (((csr >> 8) & 3) > priv)
+            return false;
+        uint64_t time = timer != nullptr ? timer->mtime() : cycle;
+        switch (csr)
+        {
+        case 0x100: value = mstatus & SSTATUS_MASK; break;
+        case 0x104: value = mie & mideleg; break;
+        case 0x105: value = stvec; break;
+        case 0x140: value = sscratch; break;
+        case 0x141: value = sepc; break;
+        case 0x142: value = scause; break;
+        case 0x143: value = stval; break;
+        case 0x144: value = mip & mideleg; break;
+        case 0x180: value = satp; break;
+        case 0x300: value = mstatus; break;
+        case 0x301: value = MISA_RV32IMC; break;
+        case 0x302: value = medeleg; break;
+        case 0x303: value = mideleg; break;
+        case 0x304: value = mie; break;
+        case 0x305: value = mtvec; break;
+        case 0x340: value = mscratch; break;
+        case 0x341: value = mepc; break;
+        case 0x342: value = mcause; break;
+        case 0x343: value = mtval; break;
+        case 0x344: value = mip; break;
+        case 0xB00: case 0xC00: value = static_cast<uint32_t>(mcycle()); break;
+        case 0xB80: case 0xC80: value = static_cast<uint32_t>(mcycle() >> 32); break;
+        case 0xB02: case 0xC02: value = static_cast<uint32_t>(minstret()); break;
+        case 0xB82: case 0xC82: value = static_cast<uint32_t>(minstret() >> 32); break;
+        case 0xC01: value = static_cast<uint32_t>(time); break;
+        case 0xC81: value = static_cast<uint32_t>(time >> 32); break;
+        case 0xF11: case 0xF12: case 0xF13: case 0xF14: value = 0; break; // Vendor, architecture, implementation, hart
+        default: return false;
+        }
+        return true;
+    }
 
-    // ALU Execute:
-    uint32_t ALUResult = ALU(ALUSelect, alusrc1, alusrc2);
-    cout << "  EX: ALU op=" << dec << ALUSelect << " src1=0x" << hex << alusrc1
-         << " (dec: " << dec << alusrc1 << ") src2=0x" << hex << alusrc2
-         << " (dec: " << dec << alusrc2 << ") result=0x" << hex << ALUResult
-         << " (dec: " << dec << ALUResult << ")" << endl;
+    // The top two bits of the number mark a read-only CSR
+    static bool writable(uint32_t csr) { return (csr >> 10) != 3; }
 
-    // Branch and jump handling:
-    uint32_t BPC = static_cast<uint32_t>(static_cast<int32_t>(IDEX.DPC) + IDEX.imm); // (B and JAL)
-    uint32_t JPC = (ALUResult & (~1u));                                              // Ignoring the odd bit (JALR)
+    // Writes a CSR (WARL: unsupported bits keep their fixed value)
+    void write(uint32_t csr, uint32_t value)
+    {
+        uint32_t mstatusMask = MSTATUS_MIE | MSTATUS_MPIE | MSTATUS_MPP | SSTATUS_MASK;
+        if (csr == 0x300 && ((value & MSTATUS_MPP) >> 11) == 2) // Reserved privilege: MPP keeps its value
+            value = (value & ~MSTATUS_MPP) | (mstatus & MSTATUS_MPP);
+        switch (csr)
+        {
+        case 0x100: mstatus = (mstatus & ~SSTATUS_MASK) | (value & SSTATUS_MASK); break;
+        case 0x104: mie = (mie & ~mideleg) | (value & mideleg); break;
+        case 0x105: stvec = value & ~2u; break;
+        case 0x140: sscratch = value; break;
+        case 0x141: sepc = value & ~1u; break;
+        case 0x142: scause = value; break;
+        case 0x143: stval = value; break;
+        case 0x144: mip = (mip & ~(mideleg & MIP_SSIP)) | (value & mideleg & MIP_SSIP); break;
+        case 0x180: satp = value & 0x803FFFFF; break; // Bare or Sv32, no ASID bits
+        case 0x300: mstatus = value & mstatusMask; break;
+        case 0x302: medeleg = value & MEDELEG_MASK; break;
+        case 0x303: mideleg = value & MIP_S_MASK; break;
+        case 0x304: mie = value & (MIP_MSIP | MIP_MTIP | MIP_MEIP | MIP_S_MASK); break;
+        case 0x305: mtvec = value & ~2u; break; // Direct (0) or vectored (1) mode
+        case 0x340: mscratch = value; break;
+        case 0x341: mepc = value & ~1u; break;
+        case 0x342: mcause = value; break;
+        case 0x343: mtval = value; break;
+        case 0x344: mip = (mip & ~MIP_S_MASK) | (value & MIP_S_MASK); break; // The M bits are set by the devices
+        case 0xB00: case 0xB80: cycleOffset = withHalf(mcycle(), value, csr == 0xB80) - cycle; break;
+        case 0xB02: case 0xB82: instretOffset = withHalf(minstret(), value, csr == 0xB82) - retired; break;
+        default: break; // misa: fixed
+        }
+    }
 
-    // If TPC is set to != -1, it means that we are taking a branch/jump
-    if (IDEX.CW.branch && branchTaken(IDEX.func3, rs1, rs2)) // B
+    // Whether a trap from the current privilege goes to S mode
+    bool toSupervisor(uint32_t cause) const
     {
-        PC.TPC = BPC;
-        insertBubble = true;
+        uint32_t delegated = (cause & CAUSE_INTERRUPT) ? mideleg : medeleg;
+        return priv <= PRIV_S && ((delegated >> (cause & 31)) & 1);
     }
-    else if (IDEX.CW.jump && IDEX.opcode == 111) // JAL
+
+    uint32_t handler(uint32_t cause) const
+    {
+        return toSupervisor(cause) ? vector(stvec, cause) : vector(mtvec, cause);
+    }
+
+    // Enters the trap handler, returns its address
+    uint32_t trap(uint32_t cause, uint32_t epc, uint32_t tval)
+    {
+        uint32_t target = handler(cause);
+        if (toSupervisor(cause))
+        {
+            sepc = epc;
+            scause = cause;
+            stval = tval;
+            mstatus = (mstatus & ~(MSTATUS_SPIE | MSTATUS_SIE | MSTATUS_SPP)) | ((mstatus & MSTATUS_SIE) ? MSTATUS_SPIE : 0) |
+                      (priv << 8);
+            priv = PRIV_S;
+        }
+        else
+        {
+            mepc = epc;
+            mcause = cause;
+            mtval = tval;
+            mstatus = (mstatus & ~(MSTATUS_MPIE | MSTATUS_MIE | MSTATUS_MPP)) | ((mstatus & MSTATUS_MIE) ? MSTATUS_MPIE : 0) |
+                      (priv << 11);
+            priv = PRIV_M;
+        }
+        if (cause & CAUSE_INTERRUPT)
+            interrupts++;
+        else
+            traps++;
+        return target;
+    }
+
+    // MRET and SRET: return the address to continue at
+    uint32_t mret()
+    {
+        priv = (mstatus & MSTATUS_MPP) >> 11;
+        mstatus = (mstatus & ~(MSTATUS_MIE | MSTATUS_MPP)) | ((mstatus & MSTATUS_MPIE) ? MSTATUS_MIE : 0) | MSTATUS_MPIE;
+        return mepc;
+    }
+    uint32_t sret()
+    {
+        priv = (mstatus & MSTATUS_SPP) ? PRIV_S : PRIV_U;
+        mstatus = (mstatus & ~(MSTATUS_SIE | MSTATUS_SPP)) | ((mstatus & MSTATUS_SPIE) ? MSTATUS_SIE : 0) | MSTATUS_SPIE;
+        return sepc;
+    }
+
+    // Highest priority enabled interrupt (M external, software, timer, then the same for S), 0 if none
+    uint32_t pendingInterrupt() const
+    {
+        uint32_t pending = mip & mie;
+        if (pending == 0)
+            return 0;
+        bool mEnabled = priv < PRIV_M || (mstatus & MSTATUS_MIE);
+        bool sEnabled = priv < PRIV_S || (priv == PRIV_S && (mstatus & MSTATUS_SIE));
+        uint32_t enabled = (mEnabled ? pending & ~mideleg : 0) | (sEnabled ? pending & mideleg : 0);
+        for (uint32_t code : {11, 3, 7, 9, 1, 5})
+            if (enabled & (1u << code))
+                return CAUSE_INTERRUPT | code;
+        return 0;
+    }
+
+    // Loads, stores and fetches go through the page tables (Sv32 in satp, below M mode)
+    bool translating() const { return priv != PRIV_M && (satp >> 31); }
+};
+
+CSRFile csr;
+bool trapTaken = false;     // Memory Operation redirected to a trap handler: the younger stages are squashed this cycle
+bool unhandledTrap = false; // A trap with no handler (xtvec = 0) stopped the program
+uint32_t unhandledCause = 0, unhandledPC = 0; // Its cause and the pc it was taken at (for GDB)
+
+// Virtual Memory (Sv32):
+/*
+    Below M mode with satp.MODE = 1, fetches, loads and stores are translated through the two level page table
+    in Data Memory: 4 KiB pages and 4 MiB megapages, R/W/X/U permissions with mstatus.SUM and MXR. A and D are
+    not updated by the walker: a page without A, or a store to a page without D, is a page fault (Svade), so the
+    operating system sets them. Instruction Memory is addressed by the physical address of a fetch.
+
+    Two separate things cache translations:
+    - The I-TLB and D-TLB are timing models (set associative, LRU, entries and ways configurable). A miss stalls
+      Fetch or Memory Operation for the page walk: walkCycles per page table level read.
+    - The translation itself comes from a direct-mapped software TLB on the host, so a translated access normally
+      costs one compare instead of a walk. It holds the leaf PTE, and permissions are checked on every access.
+    Both are flushed by SFENCE.VMA (all of it: address and ASID operands are not looked at) and by a satp write,
+    as there are no ASIDs.
+*/
+const uint32_t PTE_V = 1u << 0, PTE_R = 1u << 1, PTE_W = 1u << 2, PTE_X = 1u << 3, PTE_U = 1u << 4;
+const uint32_t PTE_A = 1u << 6, PTE_D = 1u << 7;
+enum AccessType
+{
+    ACCESS_FETCH = 0,
+    ACCESS_LOAD = 1,
+    ACCESS_STORE = 2
+};
+
+// TLB timing model: set associative with LRU replacement, one entry per 4 KiB page (a megapage fills one per page used)
+class TLBModel
+{
+private:
+    struct Entry
+    {
+        uint32_t vpn;
+        bool valid;
+        uint64_t lastUse;
+    };
+    vector<Entry> entries; // sets * ways, the ways of a set side by side
+    uint32_t sets, ways;
+    uint64_t useClock = 0;
+
+public:
+    uint64_t hits = 0, misses = 0;
+
+    TLBModel(uint32_t entryCount = 32, uint32_t wayCount = 4) : sets(entryCount / wayCount), ways(wayCount)
+    {
+        entries.assign(entryCount, {0, false, 0});
+    }
+
+    // True on a hit; a miss replaces the least recently used way of the set
+    bool access(uint32_t vpn)
+    {
+        Entry *set = &entries[(vpn % sets) * ways], *victim = set;
+        useClock++;
+        for (uint32_t w = 0; w < ways; w++)
+        {
+            if (set[w].valid && set[w].vpn == vpn)
+            {
+                set[w].lastUse = useClock;
+                hits++;
+                return true;
+            }
+            if (!set[w].valid || (victim->valid && set[w].lastUse < victim->lastUse))
+                victim = &set[w];
+        }
+        *victim = {vpn, true, useClock};
+        misses++;
+        return false;
+    }
+
+    void flush()
+    {
+        for (auto &e : entries)
+            e.valid = false;
+    }
+};
+
+class MMU
+{
+private:
+    static const uint32_t softEntries = 256;
+    struct SoftEntry
+    {
+        uint32_t vpn = UINT32_MAX; // Invalid
+        uint32_t ppn, pte, levels; // Physical page, leaf PTE bits, PTEs read by the walk
+    };
+    SoftEntry soft[softEntries];
+    DataMemory *DM = nullptr;
+
+    static uint32_t pageFault(AccessType type)
+    {
+        return type == ACCESS_FETCH ? CAUSE_FETCH_PAGE_FAULT : type == ACCESS_LOAD ? CAUSE_LOAD_PAGE_FAULT : CAUSE_STORE_PAGE_FAULT;
+    }
+    static uint32_t accessFault(AccessType type)
+    {
+        return type == ACCESS_FETCH ? CAUSE_FETCH_FAULT : type == ACCESS_LOAD ? CAUSE_LOAD_FAULT : CAUSE_STORE_FAULT;
+    }
+
+    // Sv32 walk of the page containing va, returns 0 or the fault cause
+    uint32_t walk(uint32_t va, AccessType type, SoftEntry &e)
+    {
+        uint64_t table = static_cast<uint64_t>(csr.satp & 0x3FFFFF) << 12;
+        e.levels = 0;
+        walks++;
+        for (int level = 1; level >= 0; level--)
+        {
+            uint64_t pteAddr = table + ((va >> (level ? 22 : 12)) & 0x3FF) * 4;
+            if (pteAddr > UINT32_MAX || !DM->validAddress(static_cast<uint32_t>(pteAddr), 4))
+                return accessFault(type);
+            uint32_t pte = DM->readWord(static_cast<uint32_t>(pteAddr));
+            e.levels++;
+            if (!(pte & PTE_V) || (!(pte & PTE_R) && (pte & PTE_W)))
+                return pageFault(type);
+            uint32_t ppn = pte >> 10;
+            if (pte & (PTE_R | PTE_X)) // Leaf
+            {
+                if (level == 1 && (ppn & 0x3FF) != 0) // Misaligned megapage
+                    return pageFault(type);
+                if (ppn >= (1u << 20)) // Above the 32 bit physical address space
+                    return accessFault(type);
+                e.vpn = va >> 12;
+                e.ppn = level ? (ppn | ((va >> 12) & 0x3FF)) : ppn;
+                e.pte = pte & 0xFF;
+                return 0;
+            }
+            if (level == 0)
+                return pageFault(type);
+            table = static_cast<uint64_t>(ppn) << 12;
+        }
+        return pageFault(type);
+    }
+
+    // Permission check of a leaf PTE for the current privilege
+    static bool permitted(uint32_t pte, AccessType type)
+    {
+        if (!(pte & PTE_A) || (type == ACCESS_STORE && !(pte & PTE_D)))
+            return false;
+        if (csr.priv == PRIV_U ? !(pte & PTE_U) : ((pte & PTE_U) && (type == ACCESS_FETCH || !(csr.mstatus & MSTATUS_SUM))))
+            return false;
+        if (type == ACCESS_FETCH)
+            return pte & PTE_X;
+        if (type == ACCESS_LOAD)
+            return (pte & PTE_R) || ((csr.mstatus & MSTATUS_MXR) && (pte & PTE_X));
+        return pte & PTE_W;
+    }
+
+public:
+    TLBModel itlb, dtlb;
+    uint32_t walkCycles = 4; // Per page table level read
+    uint64_t walks = 0, softHits = 0;
+
+    void attach(DataMemory &dm) { DM = &dm; }
+
+    // Translates va (the caller checks csr.translating() first). Returns 0 or the fault cause; stallCycles is
+    // the page walk time when the modeled TLB missed
+    uint32_t translate(uint32_t va, AccessType type, uint32_t &pa, uint32_t &stallCycles)
+    {
+        uint32_t vpn = va >> 12;
+        SoftEntry &e = soft[vpn % softEntries];
+        if (e.vpn == vpn)
+            softHits++;
+        else
+        {
+            uint32_t fault = walk(va, type, e);
+            if (fault != 0) // Taken right away (the walk is not charged)
+            {
+                e.vpn = UINT32_MAX;
+                stallCycles = 0;
+                return fault;
+            }
+        }
+        TLBModel &tlb = (type == ACCESS_FETCH) ? itlb : dtlb;
+        stallCycles = tlb.access(vpn) ? 0 : e.levels * walkCycles;
+        if (!permitted(e.pte, type))
+            return pageFault(type);
+        pa = (e.ppn << 12) | (va & 0xFFF);
+        return 0;
+    }
+
+    void flush()
+    {
+        for (auto &e : soft)
+            e.vpn = UINT32_MAX;
+        itlb.flush();
+        dtlb.flush();
+    }
+};
+
+MMU mmu;
+
+// Data Cache, Store Buffer and MSHRs (timing models, --dcache):
+/*
+    Data Memory stays a functional memory: loads and stores read and write it in Memory Operation, in program order.
+    These models only decide when a loaded value is there and when Memory Operation has to wait.
+    - The L1 D-cache holds tags only: set associative, LRU, write-allocate, write-back. Its misses and write backs
+      go to the memory below it (see Memory Hierarchy).
+    - A load miss takes an MSHR (miss status holding register) and goes on to WriteBack while its line is fetched.
+      Its destination register is marked with the cycle the line arrives (regReady), and Decode holds back any
+      instruction that reads or writes it until then (see HazardDetectionUnit()), so independent instructions and
+      loads that hit run under the miss. A miss to a line already being fetched joins its MSHR. With every MSHR
+      busy Memory Operation waits for the first to finish; without MSHRs (--mshrs 0) the cache blocks: the load
+      waits in Memory Operation until its line arrives.
+    - Stores go into the store buffer and drain to the cache one after the other (a miss waits for its line), so
+      Memory Operation only waits when the buffer is full. A load of bytes that a buffered store covers gets them
+      from the buffer (store-to-load forwarding); one that only overlaps it waits until that store has drained.
+      Without a store buffer (--store-buffer 0) a store waits in Memory Operation until it is written.
+    Device accesses bypass all of it. Accesses are timed by the line of their first byte.
+*/
+class CacheModel
+{
+public:
+    struct Line
+    {
+        uint32_t tag; // Line address (address / lineBytes)
+        bool valid;
+        bool prefetched; // Brought in by a prefetch and not used yet
+        bool dirty;      // Written since it was filled (written back when it is evicted)
+        uint64_t lastUse;
+        uint64_t ready; // Cycle the line arrives
+    };
+
+private:
+    vector<Line> lines; // sets * ways, the ways of a set side by side
+    uint32_t sets = 0, ways = 0;
+    uint64_t useClock = 0;
+
+public:
+    uint32_t lineBytes = 32;
+
+    CacheModel() {}
+    CacheModel(uint32_t bytes, uint32_t wayCount, uint32_t lineSize)
+        : sets(bytes / (wayCount * lineSize)), ways(wayCount), lineBytes(lineSize)
+    {
+        lines.assign(sets * ways, {0, false, false, false, 0, 0});
+    }
+
+    bool enabled() const { return sets > 0; }
+    uint32_t lineOf(uint32_t addr) const { return addr / lineBytes; }
+
+    // The line if it is present, else nullptr. A use (touch) makes it the most recently used of its set.
+    Line *find(uint32_t line, bool touch = true)
+    {
+        Line *set = &lines[(line % sets) * ways];
+        for (uint32_t w = 0; w < ways; w++)
+            if (set[w].valid && set[w].tag == line)
+            {
+                if (touch)
+                    set[w].lastUse = ++useClock;
+                return &set[w];
+            }
+        return nullptr;
+    }
+
+    // Installs the line in place of the least recently used way of its set. Returns what was there before
+    // (valid and dirty: a line to write back).
+    Line fill(uint32_t line, uint64_t ready, bool prefetched = false)
+    {
+        Line *set = &lines[(line % sets) * ways], *victim = set;
+        for (uint32_t w = 0; w < ways; w++)
+            if (!set[w].valid || (victim->valid && set[w].lastUse < victim->lastUse))
+                victim = &set[w];
+        Line evicted = *victim;
+        *victim = {line, true, prefetched, false, ++useClock, ready};
+        return evicted;
+    }
+
+    void flush()
+    {
+        for (auto &l : lines)
+            l.valid = false;
+    }
+};
+
+// Memory Hierarchy (timing models, --icache, --l2, --dram):
+/*
+    The L1 caches (the I-cache in front of Instruction Memory, the D-cache in front of Data Memory) send their
+    misses to the memory below them:
+    - The unified L2 (--l2) holds tags only like the L1s: set associative, LRU, write-allocate, write-back.
+      A hit takes --l2-cycles, a miss that much more plus the time of the memory below it.
+    - Below the last cache: the DRAM model (--dram <banks>), or a flat --miss-cycles.
+    - DRAM: lines are interleaved over the banks by row (--dram-row bytes each), every bank keeps its last row
+      open. An access to the open row takes tCAS, to a closed bank tRCD + tCAS, to another row tRP + tRCD + tCAS
+      (--dram-timing). The data then needs the bus for line / --dram-bandwidth cycles, one burst at a time:
+      accesses to different banks overlap their activations, accesses to an open row their column latency, but
+      no two overlap their transfers.
+    - Instruction and Data Memory are separate address spaces, so below the L1s instruction addresses are put
+      above the data ones (INSTRUCTION_SPACE): they share the L2 and DRAM without aliasing.
+    - Dirty lines are written back when they are evicted. Nobody waits for a write back, but in DRAM it holds
+      its bank and the bus like a read.
+    Every miss is timed when it is issued: the cycle its line arrives follows from the banks and the bus as the
+    earlier requests left them, and goes with the line (CacheModel::Line::ready) and the MSHR that waits for it.
+    The MSHRs are a completion queue ordered by that cycle, retired when an access comes by; nothing is polled
+    per cycle.
+*/
+class DRAMModel
+{
+private:
+    struct Bank
+    {
+        uint32_t openRow = UINT32_MAX;
+        uint64_t free = 0; // Cycle it can take the next command
+    };
+    vector<Bank> bankState;
+    uint64_t busFree = 0; // Cycle the data bus is free
+
+public:
+    uint32_t banks = 0, rowBytes = 2048, tRCD = 14, tCAS = 14, tRP = 14, bytesPerCycle = 8;
+    uint64_t reads = 0, writes = 0, rowHits = 0, rowEmpty = 0, rowConflicts = 0;
+    uint64_t busCycles = 0, busWaitCycles = 0; // Cycles of transfers, and of bursts waiting for the bus
+
+    bool enabled() const { return banks > 0; }
+
+    // An access of bytes at addr arriving in cycle now: returns the cycle its burst has ended
+    uint64_t access(uint64_t addr, uint32_t bytes, uint64_t now, bool write)
+    {
+        if (bankState.size() != banks)
+            bankState.assign(banks, Bank());
+        uint64_t rowIndex = addr / rowBytes;
+        uint32_t row = static_cast<uint32_t>(rowIndex / banks);
+        Bank &bank = bankState[rowIndex % banks];
+        uint64_t start = max(now, bank.free);
+        uint32_t latency;
+        if (bank.openRow == row)
+        {
+            rowHits++;
+            latency = tCAS;
+        }
+        else if (bank.openRow == UINT32_MAX)
+        {
+            rowEmpty++;
+            latency = tRCD + tCAS;
+        }
+        else
+        {
+            rowConflicts++;
+            latency = tRP + tRCD + tCAS;
+        }
+        bank.openRow = row;
+        uint32_t burst = (bytes + bytesPerCycle - 1) / bytesPerCycle;
+        uint64_t transfer = max(start + latency, busFree);
+        busWaitCycles += transfer - (start + latency);
+        busCycles += burst;
+        busFree = transfer + burst;
+        bank.free = start + (latency - tCAS) + burst; // Column accesses to the open row are pipelined
+        (write ? writes : reads)++;
+        return busFree;
+    }
+
+    void reset()
+    {
+        bankState.clear();
+        busFree = 0;
+        reads = writes = rowHits = rowEmpty = rowConflicts = busCycles = busWaitCycles = 0;
+    }
+};
+
+const uint64_t INSTRUCTION_SPACE = 1ull << 32; // Instruction Memory addresses below the L1s start here
+
+// Everything below the L1 caches: the L2 and DRAM (or a fixed latency). Addresses are 33 bits (INSTRUCTION_SPACE).
+class LowerMemoryModel
+{
+private:
+    // Below the L2
+    uint64_t memoryAccess(uint64_t addr, uint32_t bytes, uint64_t now, bool write)
+    {
+        if (dram.enabled())
+            return dram.access(addr, bytes, now, write);
+        return now + missCycles;
+    }
+
+    void writeBackL2(const CacheModel::Line &evicted, uint64_t now)
+    {
+        if (evicted.valid && evicted.dirty)
+        {
+            l2WriteBacks++;
+            memoryAccess(static_cast<uint64_t>(evicted.tag) * l2.lineBytes, l2.lineBytes, now, true);
+        }
+    }
+
+public:
+    CacheModel l2;
+    DRAMModel dram;
+    uint32_t l2Cycles = 12, missCycles = 20;
+    uint64_t l2Hits = 0, l2Misses = 0, writeBacks = 0, l2WriteBacks = 0;
+
+    // An L1 miss on the line of bytes at addr in cycle now: returns the cycle the line arrives
+    uint64_t read(uint64_t addr, uint32_t bytes, uint64_t now)
+    {
+        if (!l2.enabled())
+            return memoryAccess(addr, bytes, now, false);
+        uint32_t line = static_cast<uint32_t>(addr / l2.lineBytes);
+        if (CacheModel::Line *l = l2.find(line))
+        {
+            l2Hits++;
+            return max(now + l2Cycles, l->ready);
+        }
+        l2Misses++;
+        uint64_t ready = memoryAccess(static_cast<uint64_t>(line) * l2.lineBytes, l2.lineBytes, now + l2Cycles, false);
+        writeBackL2(l2.fill(line, ready), now);
+        return ready;
+    }
+
+    // A dirty L1 line written back in cycle now. A line the L2 does not have is allocated without reading it.
+    void write(uint64_t addr, uint32_t bytes, uint64_t now)
+    {
+        writeBacks++;
+        if (!l2.enabled())
+        {
+            if (dram.enabled())
+                dram.access(addr, bytes, now, true);
+            return;
+        }
+        uint32_t line = static_cast<uint32_t>(addr / l2.lineBytes);
+        CacheModel::Line *l = l2.find(line);
+        if (l == nullptr)
+        {
+            writeBackL2(l2.fill(line, now), now);
+            l = l2.find(line, false);
+        }
+        l->dirty = true;
+    }
+
+    // Empty L2, closed DRAM rows and zero counters (the configuration stays)
+    void reset()
+    {
+        l2.flush();
+        dram.reset();
+        l2Hits = l2Misses = writeBacks = l2WriteBacks = 0;
+    }
+};
+
+LowerMemoryModel lowerMemory;
+
+// L1 I-cache (--icache): Fetch looks up the line of every instruction it reads; a miss stalls Fetch until it arrives
+class InstructionCacheModel
+{
+private:
+    uint32_t lastLine = UINT32_MAX; // Line of the previous fetch, and the cycle it arrived (not looked up again)
+    uint64_t lastReady = 0;
+
+public:
+    CacheModel cache;
+    uint64_t accesses = 0, misses = 0;
+
+    bool enabled() const { return cache.enabled(); }
+
+    // Cycles Fetch waits for the instruction at addr in cycle now (0: it is there)
+    uint32_t fetch(uint32_t addr, uint64_t now)
+    {
+        uint32_t line = cache.lineOf(addr);
+        if (line != lastLine)
+        {
+            lastLine = line;
+            accesses++;
+            if (CacheModel::Line *l = cache.find(line))
+                lastReady = l->ready;
+            else
+            {
+                misses++;
+                lastReady = lowerMemory.read(INSTRUCTION_SPACE + line * cache.lineBytes, cache.lineBytes, now);
+                cache.fill(line, lastReady);
+            }
+        }
+        return lastReady > now ? static_cast<uint32_t>(lastReady - now) : 0;
+    }
+
+    void reset()
+    {
+        cache.flush();
+        lastLine = UINT32_MAX;
+        lastReady = accesses = misses = 0;
+    }
+};
+
+InstructionCacheModel icache;
+
+// Prefetchers (--prefetch):
+/*
+    They watch the demand loads in Memory Operation and bring lines in ahead of them, read like misses:
+    - next-line: a miss, or the first use of a prefetched line, fetches the --prefetch-degree lines starting
+      --prefetch-distance lines after it.
+    - stride: a table of 64 entries indexed by the PC of the load (EXMO.DPC) keeps its last address and stride.
+      Once the same stride is seen twice in a row, the addresses distance ... distance + degree - 1 strides
+      ahead are fetched.
+    - stream: --stream-buffers FIFOs of degree lines each, outside the cache. A miss that finds its line at the
+      head of a buffer takes it from there (the buffer fetches one more line at its tail), any other miss
+      restarts the least recently used buffer at distance lines after it.
+    next-line and stride fill the cache, marking the line as prefetched until its first use.
+    Prefetches do not take MSHRs. The metrics: accuracy = useful / issued prefetches, coverage = useful / (useful
+    + demand misses), timeliness = useful prefetches that had arrived by their first use / useful.
+*/
+enum PrefetchKind
+{
+    PREFETCH_NONE,
+    PREFETCH_NEXT_LINE,
+    PREFETCH_STRIDE,
+    PREFETCH_STREAM
+};
+
+class DataCacheModel
+{
+private:
+    struct MSHR
+    {
+        uint32_t line;
+        uint64_t ready; // Cycle the line arrives
+    };
+    struct BufferedStore
+    {
+        uint32_t addr, bytes;
+        uint64_t done; // Cycle it has drained to the cache
+    };
+    struct StrideEntry
+    {
+        uint32_t pc = UINT32_MAX, lastAddr = 0;
+        int32_t stride = 0;
+        bool confirmed = false; // The last stride was seen twice in a row
+    };
+    struct StreamBuffer
+    {
+        deque<MSHR> lines; // Oldest first
+        uint32_t next = 0; // Line fetched next at the tail
+        uint64_t lastUse = 0;
+    };
+    vector<MSHR> mshrs;          // Misses in flight: a heap, the first to complete on top
+    deque<BufferedStore> buffer; // Oldest first
+    uint64_t busyUntil = 0;      // Last cycle a load miss is outstanding so far (memory-level parallelism)
+    vector<StrideEntry> strideTable = vector<StrideEntry>(64);
+    vector<StreamBuffer> streams;
+
+    static bool later(const MSHR &a, const MSHR &b) { return a.ready > b.ready; }
+
+    void retire(uint64_t now)
+    {
+        while (!buffer.empty() && buffer.front().done <= now)
+            buffer.pop_front();
+        while (!mshrs.empty() && mshrs.front().ready <= now)
+        {
+            pop_heap(mshrs.begin(), mshrs.end(), later);
+            mshrs.pop_back();
+        }
+    }
+
+    // Cycle a line missed in cycle now arrives from the memory below
+    uint64_t fetchLine(uint32_t line, uint64_t now)
+    {
+        return lowerMemory.read(line * cache.lineBytes, cache.lineBytes, now);
+    }
+
+    // Puts the line in the cache, writing back the dirty line it replaces
+    CacheModel::Line *install(uint32_t line, uint64_t ready, uint64_t now, bool prefetched = false)
+    {
+        CacheModel::Line evicted = cache.fill(line, ready, prefetched);
+        if (evicted.valid && evicted.dirty)
+            lowerMemory.write(evicted.tag * cache.lineBytes, cache.lineBytes, now);
+        return cache.find(line, false);
+    }
+
+    // Fetches a line into the cache ahead of its use, unless it is there or on its way
+    void prefetch(uint32_t line, uint64_t now)
+    {
+        if (cache.find(line, false) != nullptr)
+            return;
+        for (auto &m : mshrs)
+            if (m.line == line)
+                return;
+        install(line, fetchLine(line, now), now, true);
+        prefetches++;
+    }
+
+    // First use of a prefetched line by a demand access in cycle now
+    void prefetchUsed(CacheModel::Line &l, uint64_t now)
+    {
+        l.prefetched = false;
+        usefulPrefetches++;
+        if (l.ready > now)
+            latePrefetches++;
+    }
+
+    // Trains the prefetcher with a demand load (miss: it missed the cache and the stream buffers)
+    void train(uint32_t addr, uint32_t pc, bool miss, bool prefetchHit, uint64_t now)
+    {
+        uint32_t line = cache.lineOf(addr);
+        if (prefetcher == PREFETCH_NEXT_LINE && (miss || prefetchHit))
+        {
+            for (uint32_t i = 0; i < degree; i++)
+                prefetch(line + distance + i, now);
+        }
+        else if (prefetcher == PREFETCH_STRIDE)
+        {
+            StrideEntry &e = strideTable[(pc >> 1) % strideTable.size()];
+            if (e.pc != pc)
+            {
+                e = StrideEntry();
+                e.pc = pc;
+            }
+            else
+            {
+                int32_t stride = static_cast<int32_t>(addr - e.lastAddr);
+                e.confirmed = (stride == e.stride && stride != 0);
+                e.stride = stride;
+            }
+            e.lastAddr = addr;
+            if (e.confirmed)
+                for (uint32_t i = 0; i < degree; i++)
+                {
+                    uint32_t ahead = cache.lineOf(addr + static_cast<uint32_t>(e.stride) * (distance + i));
+                    if (ahead != line)
+                        prefetch(ahead, now);
+                }
+        }
+        else if (prefetcher == PREFETCH_STREAM && miss) // Restart the least recently used stream buffer
+        {
+            if (streams.size() != streamCount)
+                streams.assign(streamCount, StreamBuffer());
+            if (streams.empty())
+                return;
+            StreamBuffer *victim = &streams[0];
+            for (auto &sb : streams)
+                if (sb.lastUse < victim->lastUse)
+                    victim = &sb;
+            prefetches += degree;
+            victim->lines.clear();
+            victim->next = line + distance;
+            victim->lastUse = now;
+            for (uint32_t i = 0; i < degree; i++)
+            {
+                victim->lines.push_back({victim->next, fetchLine(victim->next, now)});
+                victim->next++;
+            }
+        }
+    }
+
+    // A miss that finds its line at the head of a stream buffer: the line moves into the cache
+    bool streamHit(uint32_t line, uint64_t now, uint64_t &ready)
+    {
+        for (auto &sb : streams)
+            if (!sb.lines.empty() && sb.lines.front().line == line)
+            {
+                ready = max(now, sb.lines.front().ready);
+                usefulPrefetches++;
+                if (sb.lines.front().ready > now)
+                    latePrefetches++;
+                sb.lines.pop_front();
+                sb.lines.push_back({sb.next, fetchLine(sb.next, now)});
+                sb.next++;
+                sb.lastUse = now;
+                prefetches++;
+                install(line, ready, now);
+                return true;
+            }
+        return false;
+    }
+
+public:
+    CacheModel cache;
+    uint32_t mshrCount = 4, bufferSize = 4;
+    PrefetchKind prefetcher = PREFETCH_NONE;
+    uint32_t degree = 1, distance = 1, streamCount = 4;
+    uint64_t loads = 0, loadHits = 0, loadMisses = 0, merged = 0, forwarded = 0;
+    uint64_t stores = 0, storeHits = 0, storeMisses = 0;
+    uint64_t mshrFullCycles = 0, bufferFullCycles = 0, overlapCycles = 0;
+    uint64_t missCycleSum = 0, outstandingCycles = 0; // Load miss cycles, and cycles with at least one outstanding
+    uint64_t prefetches = 0, usefulPrefetches = 0, latePrefetches = 0;
+
+    bool enabled() const { return cache.enabled(); }
+
+    // A load (at pc) in cycle now: returns the cycles Memory Operation has to wait before it tries again, or 0 when
+    // the load is accepted and its value is there at ready
+    uint32_t load(uint32_t addr, uint32_t bytes, uint32_t pc, uint64_t now, uint64_t &ready)
+    {
+        retire(now);
+        for (auto it = buffer.rbegin(); it != buffer.rend(); ++it) // Youngest store first
+        {
+            if (addr >= it->addr && addr + bytes <= it->addr + it->bytes)
+            {
+                loads++;
+                forwarded++;
+                ready = now;
+                return 0;
+            }
+            if (addr < it->addr + it->bytes && it->addr < addr + bytes)
+            {
+                overlapCycles += it->done - now;
+                return static_cast<uint32_t>(it->done - now);
+            }
+        }
+
+        uint32_t line = cache.lineOf(addr);
+        for (auto &m : mshrs)
+            if (m.line == line)
+            {
+                loads++;
+                merged++;
+                ready = m.ready;
+                train(addr, pc, false, false, now);
+                return 0;
+            }
+        if (CacheModel::Line *l = cache.find(line))
+        {
+            loads++;
+            loadHits++;
+            ready = max(now, l->ready);
+            bool prefetchHit = l->prefetched;
+            if (prefetchHit)
+                prefetchUsed(*l, now);
+            train(addr, pc, false, prefetchHit, now);
+            return 0;
+        }
+        if (prefetcher == PREFETCH_STREAM && streamHit(line, now, ready))
+        {
+            loads++;
+            loadHits++;
+            return 0;
+        }
+        if (mshrCount > 0 && mshrs.size() >= mshrCount)
+        {
+            uint64_t first = mshrs.front().ready;
+            mshrFullCycles += first - now;
+            return static_cast<uint32_t>(first - now);
+        }
+
+        loads++;
+        loadMisses++;
+        ready = fetchLine(line, now);
+        install(line, ready, now);
+        missCycleSum += ready - now;
+        if (ready > busyUntil) // Misses finish out of order with DRAM timing
+        {
+            outstandingCycles += ready - max(now, busyUntil);
+            busyUntil = ready;
+        }
+        if (mshrCount > 0)
+        {
+            mshrs.push_back({line, ready});
+            push_heap(mshrs.begin(), mshrs.end(), later);
+        }
+        train(addr, pc, true, false, now);
+        return 0;
+    }
+
+    // A store in cycle now: returns the cycles to wait for a free store buffer entry, or 0 when it is accepted.
+    // ready is when Memory Operation is done with it (later than now only without a store buffer).
+    uint32_t store(uint32_t addr, uint32_t bytes, uint64_t now, uint64_t &ready)
+    {
+        retire(now);
+        if (bufferSize > 0 && buffer.size() >= bufferSize)
+        {
+            bufferFullCycles += buffer.front().done - now;
+            return static_cast<uint32_t>(buffer.front().done - now);
+        }
+
+        stores++;
+        uint32_t line = cache.lineOf(addr);
+        uint64_t start = buffer.empty() ? now : max(now, buffer.back().done);
+        for (auto &m : mshrs) // The line is on its way
+            if (m.line == line)
+                start = max(start, m.ready);
+        uint64_t done;
+        CacheModel::Line *l = cache.find(line);
+        if (l != nullptr)
+        {
+            storeHits++;
+            if (l->prefetched)
+                prefetchUsed(*l, start);
+            done = max(start, l->ready) + 1;
+        }
+        else
+        {
+            storeMisses++;
+            done = fetchLine(line, start);
+            l = install(line, done, start);
+        }
+        l->dirty = true;
+        if (bufferSize == 0)
+        {
+            ready = done - 1;
+            return 0;
+        }
+        buffer.push_back({addr, bytes, done});
+        ready = now;
+        return 0;
+    }
+
+    // Empty cache, buffers, prefetcher state and counters (the configuration stays)
+    void reset()
+    {
+        DataCacheModel fresh;
+        fresh.cache = cache;
+        fresh.cache.flush();
+        fresh.mshrCount = mshrCount;
+        fresh.bufferSize = bufferSize;
+        fresh.prefetcher = prefetcher;
+        fresh.degree = degree;
+        fresh.distance = distance;
+        fresh.streamCount = streamCount;
+        *this = fresh;
+    }
+};
+
+DataCacheModel dcache;
+uint64_t regReady[32] = {0}; // Cycle the value of a register's load miss arrives (0: none in flight)
+uint64_t loadsReady = 0;     // The latest of them: SYSTEM instructions wait for all loads
+
+// Debug Information:
+/*
+    Sidecar file of the assembler (-g), so PCs can be shown as symbols and source lines:
+        RVDEBUG1 <source file>
+        symbol <text|data> <address> <name>
+        line <address> <line>
+    The line map of earlier assemblers (-l) is read too, as lines without symbols:
+        RVLINES1 <source file>
+        <address> <line>
+*/
+class DebugInfo
+{
+private:
+    map<uint32_t, string> textSymbols;
+    unordered_map<uint32_t, int> lines;
+
+public:
+    string sourceFileName = "";
+
+    bool load(const string &fileName)
+    {
+        ifstream file(fileName);
+        string header;
+        if (!file || !(file >> header) || (header != "RVDEBUG1" && header != "RVLINES1"))
+            return false;
+        getline(file >> ws, sourceFileName);
+        if (header == "RVLINES1")
+        {
+            string addr;
+            int lineNo;
+            while (file >> addr >> lineNo)
+                lines[static_cast<uint32_t>(stoul(addr, nullptr, 0))] = lineNo;
+            return file.eof();
+        }
+
+        string kind, section, addr, name;
+        while (file >> kind)
+        {
+            if (kind == "symbol" && file >> section >> addr >> name)
+            {
+                if (section == "text")
+                    textSymbols.emplace(static_cast<uint32_t>(stoul(addr, nullptr, 0)), name);
+            }
+            else if (kind == "line" && file >> addr >> name)
+                lines[static_cast<uint32_t>(stoul(addr, nullptr, 0))] = stoi(name);
+            else
+                return false;
+        }
+        return true;
+    }
+
+    bool empty() const
+    {
+        return textSymbols.empty() && lines.empty();
+    }
+
+    // Source line of the instruction at pc (0 if unknown)
+    int lineOf(uint32_t pc) const
+    {
+        auto it = lines.find(pc);
+        return (it == lines.end()) ? 0 : it->second;
+    }
+
+    // The text label at or before pc: its address and name (false before the first label)
+    bool labelOf(uint32_t pc, uint32_t &addr, string &name) const
+    {
+        auto it = textSymbols.upper_bound(pc);
+        if (it == textSymbols.begin())
+            return false;
+        --it;
+        addr = it->first;
+        name = it->second;
+        return true;
+    }
+
+    // "label+0x8", or "" before the first label
+    string symbolize(uint32_t pc) const
+    {
+        auto it = textSymbols.upper_bound(pc);
+        if (it == textSymbols.begin())
+            return "";
+        --it;
+        ostringstream os;
+        os << it->second;
+        if (pc != it->first)
+            os << "+0x" << hex << pc - it->first;
+        return os.str();
+    }
+
+    // " <label+0x8> (file:line)", or "" without debug information
+    string describe(uint32_t pc) const
+    {
+        string sym = symbolize(pc), text;
+        if (!sym.empty())
+            text += " <" + sym + ">";
+        if (lineOf(pc) > 0)
+            text += " (" + sourceFileName + ":" + to_string(lineOf(pc)) + ")";
+        return text;
+    }
+};
+
+DebugInfo debugInfo; // Loaded by -g
+
+// Differential Co-simulation:
+/*
+    A golden reference model runs alongside the pipeline. Every instruction retired in WriteBack is
+    recorded; the records are compared in batches against the reference executing the same program:
+    PC, register write (rdl and value) and store (address and data).
+    The first difference stops the simulation with a compact diff.
+
+    The reference is a plain instruction set simulator written independently of the ControlUnit,
+    ALUControl, ALU and genImm used by the pipeline, so a bug there shows up as a mismatch.
+    Only the 16 bit expansion is shared. ECALL results are taken from the pipeline (the syscall
+    runs once), and the bytes the syscall wrote (read, clock_gettime) are copied into the reference
+    memory after each ECALL. Likewise device
+    registers are not touched by the reference: a load from one returns the pipeline's value, and
+    so does a read of the counters, time, mip and the fixed ID registers.
+    The reference takes exceptions itself. Interrupts arrive at the pipeline's timing, as a marker
+    after the retirement they follow; the reference checks that it would return to the same PC.
+*/
+
+// One retired instruction, as seen in WriteBack (or as executed by the reference)
+struct Retirement
+{
+    uint64_t cycle;
+    uint32_t pc;
+    bool regWrite;
+    uint32_t rdl, value;
+    bool store;
+    uint32_t addr, data, func3;
+    bool interrupt = false; // Marker: interrupt value (mcause) taken with mepc = pc
+};
+
+class ReferenceISS
+{
+private:
+    const InstructionMemory &IM;
+    uint32_t x[32];
+    uint32_t priv = PRIV_M;
+    uint32_t mstatus = MSTATUS_MPP, mie = 0, mtvec = 0, mscratch = 0, mepc = 0, mcause = 0, mtval = 0;
+    uint32_t medeleg = 0, mideleg = 0, stvec = 0, sscratch = 0, sepc = 0, scause = 0, stval = 0, satp = 0;
+
+    void trap(uint32_t cause, uint32_t tval)
+    {
+        uint32_t delegated = (cause >> 31) ? mideleg : medeleg;
+        uint32_t tvec;
+        if (priv <= PRIV_S && ((delegated >> (cause & 31)) & 1))
+        {
+            uint32_t spie = (mstatus & MSTATUS_SIE) << 4;
+            mstatus = (mstatus & ~(MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP)) | spie | (priv << 8);
+            sepc = pc;
+            scause = cause;
+            stval = tval;
+            tvec = stvec;
+            priv = PRIV_S;
+        }
+        else
+        {
+            uint32_t mpie = (mstatus & MSTATUS_MIE) << 4;
+            mstatus = (mstatus & ~(MSTATUS_MIE | MSTATUS_MPIE | MSTATUS_MPP)) | mpie | (priv << 11);
+            mepc = pc;
+            mcause = cause;
+            mtval = tval;
+            tvec = mtvec;
+            priv = PRIV_M;
+        }
+        pc = (tvec & ~3u) + (((tvec & 1) && (cause >> 31)) ? 4 * (cause & 0x7FFFFFFF) : 0);
+    }
+
+    // CSR instruction: old receives the value read, false if the access is illegal
+    bool csrAccess(uint32_t number, uint32_t func3, uint32_t source, bool writes, uint32_t observedValue, uint32_t &old)
+    {
+        uint32_t *reg = (number == 0x300 || number == 0x100) ? &mstatus : (number == 0x304 || number == 0x104) ? &mie
+                      : (number == 0x305) ? &mtvec : (number == 0x340) ? &mscratch : (number == 0x341) ? &mepc
+                      : (number == 0x342) ? &mcause : (number == 0x343) ? &mtval : (number == 0x302) ? &medeleg
+                      : (number == 0x303) ? &mideleg : (number == 0x105) ? &stvec : (number == 0x140) ? &sscratch
+                      : (number == 0x141) ? &sepc : (number == 0x142) ? &scause : (number == 0x143) ? &stval
+                      : (number == 0x180) ? &satp : nullptr;
+        uint32_t counter = number & ~0x80u; // The high halves of the counters are 0x80 above
+        bool observed = number == 0x301 || number == 0x344 || number == 0x144 || (number >= 0xF11 && number <= 0xF14) ||
+                        counter == 0xB00 || counter == 0xB02 || (counter >= 0xC00 && counter <= 0xC02);
+        if ((reg == nullptr && !observed) || ((number >> 8) & 3) > priv || (writes && (number >> 10) == 3))
+            return false;
+        uint32_t view = number == 0x100 ? SSTATUS_MASK : number == 0x104 ? mideleg : 0xFFFFFFFF; // S views of M registers
+        old = reg != nullptr ? *reg & view : observedValue;
+        if (!writes || reg == nullptr)
+            return true;
+
+        uint32_t value = (func3 & 3) == 1 ? source : (func3 & 3) == 2 ? (old | source) : (old & ~source);
+        if (number == 0x300)
+            value = (value & (MSTATUS_MIE | MSTATUS_MPIE | SSTATUS_MASK)) |
+                    (((value & MSTATUS_MPP) >> 11) == 2 ? mstatus & MSTATUS_MPP : value & MSTATUS_MPP);
+        else if (number == 0x304)
+            value &= MIP_MSIP | MIP_MTIP | MIP_MEIP | MIP_S_MASK;
+        else if (number == 0x302)
+            value &= MEDELEG_MASK;
+        else if (number == 0x303)
+            value &= MIP_S_MASK;
+        else if (number == 0x305 || number == 0x105)
+            value &= ~2u;
+        else if (number == 0x341 || number == 0x141)
+            value &= ~1u;
+        else if (number == 0x180)
+            value &= 0x803FFFFF;
+        *reg = (*reg & ~view) | (value & view);
+        return true;
+    }
+
+    // Sv32 translation by the same rules as the MMU, with a page walk on every access: 0 or the fault cause
+    uint32_t translate(uint32_t va, AccessType type, uint32_t &pa)
+    {
+        pa = va;
+        if (priv == PRIV_M || !(satp >> 31))
+            return 0;
+        uint32_t pageFault = type == ACCESS_FETCH ? CAUSE_FETCH_PAGE_FAULT : type == ACCESS_LOAD ? CAUSE_LOAD_PAGE_FAULT : CAUSE_STORE_PAGE_FAULT;
+        uint32_t accessFault = type == ACCESS_FETCH ? CAUSE_FETCH_FAULT : type == ACCESS_LOAD ? CAUSE_LOAD_FAULT : CAUSE_STORE_FAULT;
+        uint64_t table = static_cast<uint64_t>(satp & 0x3FFFFF) << 12;
+        for (int level = 1; level >= 0; level--)
+        {
+            uint64_t pteAddr = table + ((va >> (12 + 10 * level)) & 0x3FF) * 4;
+            if (pteAddr > UINT32_MAX || !DM.validAddress(static_cast<uint32_t>(pteAddr), 4))
+                return accessFault;
+            uint32_t pte = DM.readWord(static_cast<uint32_t>(pteAddr)), ppn = pte >> 10;
+            if (!(pte & PTE_V) || (!(pte & PTE_R) && (pte & PTE_W)))
+                return pageFault;
+            if (!(pte & (PTE_R | PTE_X)))
+            {
+                table = static_cast<uint64_t>(ppn) << 12;
+                continue;
+            }
+            if (level == 1 && (ppn & 0x3FF) != 0) // Misaligned megapage
+                return pageFault;
+            if (ppn >= (1u << 20))
+                return accessFault;
+            if (!(pte & PTE_A) || (type == ACCESS_STORE && !(pte & PTE_D)))
+                return pageFault;
+            bool user = pte & PTE_U;
+            if (priv == PRIV_U ? !user : (user && (type == ACCESS_FETCH || !(mstatus & MSTATUS_SUM))))
+                return pageFault;
+            bool allowed = type == ACCESS_FETCH ? (pte & PTE_X) : type == ACCESS_STORE ? (pte & PTE_W)
+                         : ((pte & PTE_R) || ((mstatus & MSTATUS_MXR) && (pte & PTE_X)));
+            if (!allowed)
+                return pageFault;
+            pa = ((level ? (ppn | ((va >> 12) & 0x3FF)) : ppn) << 12) | (va & 0xFFF);
+            return 0;
+        }
+        return pageFault;
+    }
+
+    static uint32_t integerOp(uint32_t func3, bool alternate, uint32_t a, uint32_t b)
+    {
+        switch (func3)
+        {
+        case 0:
+            return alternate ? a - b : a + b;
+        case 1:
+            return a << (b & 31);
+        case 2:
+            return static_cast<int32_t>(a) < static_cast<int32_t>(b);
+        case 3:
+            return a < b;
+        case 4:
+            return a ^ b;
+        case 5:
+            return alternate ? static_cast<uint32_t>(static_cast<int32_t>(a) >> (b & 31)) : a >> (b & 31);
+        case 6:
+            return a | b;
+        default:
+            return a & b;
+        }
+    }
+
+    static uint32_t multiplyDivideOp(uint32_t func3, uint32_t a, uint32_t b)
+    {
+        int64_t sa = static_cast<int32_t>(a), sb = static_cast<int32_t>(b);
+        bool overflow = (a == 0x80000000u && b == 0xFFFFFFFFu);
+        switch (func3)
+        {
+        case 0: // MUL
+            return a * b;
+        case 1: // MULH
+            return static_cast<uint32_t>((sa * sb) >> 32);
+        case 2: // MULHSU
+            return static_cast<uint32_t>((sa * static_cast<int64_t>(b)) >> 32);
+        case 3: // MULHU
+            return static_cast<uint32_t>((static_cast<uint64_t>(a) * b) >> 32);
+        case 4: // DIV
+            return b == 0 ? 0xFFFFFFFFu : overflow ? a : static_cast<uint32_t>(sa / sb);
+        case 5: // DIVU
+            return b == 0 ? 0xFFFFFFFFu : a / b;
+        case 6: // REM
+            return b == 0 ? a : overflow ? 0 : static_cast<uint32_t>(sa % sb);
+        default: // REMU
+            return b == 0 ? a : a % b;
+        }
+    }
+
+public:
+    DataMemory DM;
+    uint32_t pc;
+
+    ReferenceISS(const InstructionMemory &IM, const DataMemory &DM, uint32_t sp, uint32_t entry) : IM(IM), DM(DM), pc(entry)
+    {
+        fill(x, x + 32, 0);
+        x[2] = sp;
+    }
+
+    // Executes the instruction at pc, observedValue is the a0 an ECALL returns or what a device load or a
+    // counter read. An exception enters the handler and execution goes on until an instruction retires.
+    Retirement step(uint32_t observedValue)
+    {
+        for (int traps = 0;; traps++)
+        {
+            uint32_t fetchAddr;
+            uint32_t fault = translate(pc, ACCESS_FETCH, fetchAddr);
+            if (fault == 0 && (fetchAddr < IM.baseAddress() || fetchAddr + 2 > IM.endAddress()))
+                fault = CAUSE_FETCH_FAULT;
+            if (fault != 0)
+            {
+                if (traps == 64)
+                    return {0, pc, false, 0, 0, false, 0, 0, 0};
+                trap(fault, pc);
+                continue;
+            }
+            uint16_t low = IM.readHalf(fetchAddr);
+            uint32_t ilen = ((low & 0x3) != 0x3) ? 2 : 4;
+            uint32_t ir = (ilen == 2) ? expandCompressed(low) : IM.read(fetchAddr);
+
+            uint32_t opcode = ir & 0x7F, rd = (ir >> 7) & 0x1F, func3 = (ir >> 12) & 0x7, func7 = ir >> 25;
+            uint32_t a = x[(ir >> 15) & 0x1F], b = x[(ir >> 20) & 0x1F];
+            int32_t immI = static_cast<int32_t>(ir) >> 20;
+            int32_t immS = (static_cast<int32_t>(ir & 0xFE000000) >> 20) | ((ir >> 7) & 0x1F);
+            int32_t immB = (static_cast<int32_t>(ir & 0x80000000) >> 19) | ((ir << 4) & 0x800) | ((ir >> 20) & 0x7E0) | ((ir >> 7) & 0x1E);
+            int32_t immJ = (static_cast<int32_t>(ir & 0x80000000) >> 11) | (ir & 0xFF000) | ((ir >> 9) & 0x800) | ((ir >> 20) & 0x7FE);
+
+            Retirement r = {0, pc, true, rd, 0, false, 0, 0, 0};
+            uint32_t nextPC = pc + ilen;
+            int64_t cause = -1; // Exception
+            uint32_t tval = 0;
+            switch (opcode)
+            {
+            case 0x33: // R type
+                r.value = (func7 == 0x01) ? multiplyDivideOp(func3, a, b) : integerOp(func3, func7 == 0x20, a, b);
+                break;
+            case 0x13: // I type arithmetic (only the shifts use the upper immediate bits as a function)
+                r.value = integerOp(func3, func3 == 5 && func7 == 0x20, a, static_cast<uint32_t>(immI));
+                break;
+            case 0x37: // LUI
+                r.value = ir & 0xFFFFF000;
+                break;
+            case 0x17: // AUIPC
+                r.value = pc + (ir & 0xFFFFF000);
+                break;
+            case 0x6F: // JAL
+                r.value = nextPC;
+                nextPC = pc + immJ;
+                break;
+            case 0x67: // JALR
+                r.value = nextPC;
+                nextPC = (a + immI) & ~1u;
+                break;
+            case 0x63: // Branches
+            {
+                bool taken = (func3 == 0) ? a == b : (func3 == 1) ? a != b
+                           : (func3 == 4) ? static_cast<int32_t>(a) < static_cast<int32_t>(b)
+                           : (func3 == 5) ? static_cast<int32_t>(a) >= static_cast<int32_t>(b)
+                           : (func3 == 6) ? a < b : (func3 == 7) ? a >= b : false;
+                if (taken)
+                    nextPC = pc + immB;
+                r.regWrite = false;
+                break;
+            }
+            case 0x03: // Loads
+            {
+                uint32_t addr, fault = translate(a + immI, ACCESS_LOAD, addr);
+                if (fault != 0)
+                    cause = fault, tval = a + immI;
+                else if (!DM.accessible(addr, 1u << (func3 & 3)))
+                    cause = CAUSE_LOAD_FAULT, tval = a + immI;
+                else if (DM.isDevice(addr))
+                    r.value = observedValue;
+                else if (func3 == 0)
+                    r.value = DM.readByte(addr, true);
+                else if (func3 == 1)
+                    r.value = DM.readHalf(addr, true);
+                else if (func3 == 4)
+                    r.value = DM.readByte(addr, false);
+                else if (func3 == 5)
+                    r.value = DM.readHalf(addr, false);
+                else
+                    r.value = DM.readWord(addr);
+                break;
+            }
+            case 0x23: // Stores (the retirement shows the virtual address)
+            {
+                r.regWrite = false;
+                r.store = true;
+                r.addr = a + immS;
+                r.data = b;
+                r.func3 = func3;
+                uint32_t addr, fault = translate(r.addr, ACCESS_STORE, addr);
+                if (fault != 0)
+                    cause = fault, tval = r.addr;
+                else if (!DM.accessible(addr, 1u << (func3 & 3)))
+                    cause = CAUSE_STORE_FAULT, tval = r.addr;
+                else if (DM.isDevice(addr))
+                    break;
+                else if (func3 == 0)
+                    DM.writeByte(addr, b & 0xFF);
+                else if (func3 == 1)
+                    DM.writeHalf(addr, b & 0xFFFF);
+                else
+                    DM.writeWord(addr, b);
+                break;
+            }
+            case 0x0F: // FENCE
+                r.regWrite = false;
+                break;
+            case 0x73: // SYSTEM
+                if (ir == 0x00000073 && priv != PRIV_M) // ECALL to the operating system
+                    cause = priv == PRIV_S ? CAUSE_ECALL_S : CAUSE_ECALL_U;
+                else if (ir == 0x00000073) // ECALL to the proxy kernel
+                {
+                    r.rdl = 10;
+                    r.value = observedValue;
+                }
+                else if (func3 != 0 && func3 != 4) // CSRRW/CSRRS/CSRRC and the immediate forms
+                {
+                    uint32_t rs1 = (ir >> 15) & 0x1F;
+                    bool writes = (func3 & 3) == 1 || rs1 != 0;
+                    if (!csrAccess(ir >> 20, func3, (func3 & 4) ? rs1 : a, writes, observedValue, r.value))
+                        cause = 2, tval = ir;
+                }
+                else if (ir == 0x30200073 && priv == PRIV_M) // MRET
+                {
+                    priv = (mstatus & MSTATUS_MPP) >> 11;
+                    mstatus = (mstatus & ~(MSTATUS_MIE | MSTATUS_MPP)) | ((mstatus >> 4) & MSTATUS_MIE) | MSTATUS_MPIE;
+                    nextPC = mepc;
+                    r.regWrite = false;
+                }
+                else if (ir == 0x10200073 && priv >= PRIV_S) // SRET
+                {
+                    priv = (mstatus & MSTATUS_SPP) >> 8;
+                    mstatus = (mstatus & ~(MSTATUS_SIE | MSTATUS_SPP)) | ((mstatus >> 4) & MSTATUS_SIE) | MSTATUS_SPIE;
+                    nextPC = sepc;
+                    r.regWrite = false;
+                }
+                else if ((ir & 0xFE007FFF) == 0x12000073 && priv >= PRIV_S) // SFENCE.VMA: nothing cached
+                    r.regWrite = false;
+                else if (ir == 0x10500073) // WFI
+                    r.regWrite = false;
+                else if (ir == 0x00100073) // EBREAK
+                    cause = 3, tval = pc;
+                else
+                    cause = 2, tval = ir;
+                break;
+            default:
+                cause = 2, tval = ir;
+            }
+
+            if (cause >= 0 && traps < 64) // The instruction does not retire
+            {
+                trap(static_cast<uint32_t>(cause), tval);
+                continue;
+            }
+            r.regWrite = r.regWrite && r.rdl != 0;
+            if (r.regWrite)
+                x[r.rdl] = r.value;
+            pc = nextPC;
+            return r;
+        }
+    }
+
+    // Interrupt taken before the instruction at pc
+    void interrupt(uint32_t cause)
+    {
+        trap(cause, 0);
+    }
+
+    bool machineMode() const { return priv == PRIV_M; }
+};
+
+class CoSimChecker
+{
+private:
+    static const size_t batchSize = 1024;
+    const InstructionMemory &IM;
+    const DataMemory &DM; // The pipeline's memory
+    const ProxyKernel &PK;
+    ReferenceISS ref;
+    vector<Retirement> batch;
+
+    bool isECALL(uint32_t pc) const
+    {
+        return IM.readHalf(pc) == (ECALL & 0xFFFF) && IM.read(pc) == ECALL;
+    }
+
+    static uint32_t storeMask(uint32_t func3)
+    {
+        return (func3 == 0) ? 0xFF : (func3 == 1) ? 0xFFFF : 0xFFFFFFFF;
+    }
+
+    static bool same(const Retirement &a, const Retirement &b)
+    {
+        if (a.pc != b.pc || a.regWrite != b.regWrite || a.store != b.store)
+            return false;
+        if (a.regWrite && (a.rdl != b.rdl || a.value != b.value))
+            return false;
+        if (a.store && (a.addr != b.addr || a.func3 != b.func3 || (a.data & storeMask(a.func3)) != (b.data & storeMask(b.func3))))
+            return false;
+        return true;
+    }
+
+    static void print(ostream &out, const char *who, const Retirement &r)
+    {
+        out << "  " << who << ": pc=0x" << hex << setw(8) << setfill('0') << r.pc << debugInfo.describe(r.pc);
+        if (r.regWrite)
+            out << " x" << dec << r.rdl << "=0x" << hex << setw(8) << r.value;
+        if (r.store)
+            out << " M[0x" << hex << setw(8) << r.addr << "]=0x" << (r.data & storeMask(r.func3))
+                << (r.func3 == 0 ? " (byte)" : r.func3 == 1 ? " (half)" : " (word)");
+        if (!r.regWrite && !r.store)
+            out << " (no write)";
+        out << dec << setfill(' ') << "\n";
+    }
+
+public:
+    uint64_t checked = 0; // Instructions that matched the reference
+    bool diverged = false;
+
+    CoSimChecker(const InstructionMemory &IM, const DataMemory &DM, const ProxyKernel &PK, uint32_t sp, uint32_t entry)
+        : IM(IM), DM(DM), PK(PK), ref(IM, DM, sp, entry)
+    {
+        batch.reserve(batchSize);
+    }
+
+    void retire(const Retirement &r)
+    {
+        batch.push_back(r);
+
+        // An ECALL changes memory outside the instruction stream: check up to it and re-synchronize now,
+        // while no younger instruction has reached Memory Operation yet
+        if (batch.size() == batchSize || (csr.priv == PRIV_M && isECALL(r.pc)))
+            check();
+    }
+
+    // Runs the reference over the recorded retirements, returns false at the first mismatch
+    bool check()
+    {
+        for (auto &observed : batch)
+        {
+            if (diverged)
+                break;
+            if (observed.interrupt)
+            {
+                if (ref.pc != observed.pc)
+                {
+                    diverged = true;
+                    programRunning = false;
+                    cerr << RED << "Co-simulation mismatch at an interrupt (cycle " << dec << observed.cycle << "): pipeline returns to pc=0x"
+                         << hex << observed.pc << ", reference is at pc=0x" << ref.pc << dec << "\n"
+                         << RESET;
+                    break;
+                }
+                ref.interrupt(observed.value);
+                continue;
+            }
+            bool ecall = ref.machineMode() && isECALL(ref.pc); // Below M mode an ECALL traps
+            Retirement expected = ref.step(observed.value);
+            if (ecall) // Only the bytes the syscall wrote differ
+                ref.DM.copyFrom(DM, PK.writtenAddr, PK.writtenBytes);
+
+            if (!same(observed, expected))
+            {
+                diverged = true;
+                programRunning = false;
+                cerr << RED << "Co-simulation mismatch at instruction " << dec << checked + 1 << " (cycle " << observed.cycle << "):\n"
+                     << RESET;
+                print(cerr, "pipeline ", observed);
+                print(cerr, "reference", expected);
+                break;
+            }
+            checked++;
+        }
+        batch.clear();
+        return !diverged;
+    }
+};
+
+CoSimChecker *cosim = nullptr; // Set by --cosim
+
+// Pipeline Trace:
+/*
+    Binary stream of stage events, converted to Konata or Chrome trace_event JSON by RISC-V_Trace.
+    File: the magic "RVTRACE1", then 16 byte little endian records:
+        uint32 cycle, uint32 id (fetch order), uint32 value, uint8 kind, uint8 stage, uint16 reserved
+    value is the instruction word for INSTR records and the DPC for all others.
+    Only the events inside the cycle window are written.
+*/
+enum TraceKind
+{
+    TRACE_STAGE,  // Instruction is in the stage this cycle
+    TRACE_INSTR,  // Instruction word (right after its IF stage event)
+    TRACE_STALL,  // Instruction is held in the stage this cycle
+    TRACE_RETIRE, // Instruction completed WriteBack
+    TRACE_FLUSH   // Instruction was squashed by a taken branch or jump
+};
+
+enum TraceStage
+{
+    STAGE_IF,
+    STAGE_ID,
+    STAGE_EX,
+    STAGE_MEM,
+    STAGE_WB
+};
+
+class TraceWriter
+{
+private:
+    FILE *file;
+    uint64_t startCycle, endCycle;
+    vector<uint8_t> buffer;
+
+    void flush()
+    {
+        fwrite(buffer.data(), 1, buffer.size(), file);
+        buffer.clear();
+    }
+
+public:
+    uint64_t records = 0;
+
+    TraceWriter(const string &fileName, uint64_t startCycle, uint64_t endCycle) : startCycle(startCycle), endCycle(endCycle)
+    {
+        file = fopen(fileName.c_str(), "wb");
+        if (file == nullptr)
+        {
+            cerr << RED << "Error: Cannot open the trace file: " << fileName << "\n"
+                 << RESET;
+            exit(1);
+        }
+        fwrite("RVTRACE1", 1, 8, file);
+        buffer.reserve(1 << 20);
+    }
+
+    ~TraceWriter()
+    {
+        flush();
+        fclose(file);
+    }
+
+    void record(uint32_t id, uint32_t value, TraceKind kind, TraceStage stage)
+    {
+        if (cycle < startCycle || cycle > endCycle)
+            return;
+        uint8_t rec[16] = {0};
+        uint32_t c = static_cast<uint32_t>(cycle);
+        memcpy(rec, &c, 4); // Host is little endian like the format
+        memcpy(rec + 4, &id, 4);
+        memcpy(rec + 8, &value, 4);
+        rec[12] = kind;
+        rec[13] = stage;
+        buffer.insert(buffer.end(), rec, rec + 16);
+        records++;
+        if (buffer.size() >= (1 << 20))
+            flush();
+    }
+};
+
+TraceWriter *trace = nullptr; // Set by --trace
+
+// Profiling:
+/*
+    Attributes the cycles of the run to the PC they were spent on:
+    - a retired instruction costs its own cycle,
+    - a load-use stall is charged to the instruction waiting for the load, an ECALL drain to the ECALL,
+    - a fetch buffer refill to the instruction being fetched,
+    - a page walk (TLB miss) to the instruction being fetched or the load/store,
+    - the extra Execute cycles of a multi-cycle MUL/DIV to it,
+    - a data hazard stall that forwarding does not cover (no forwarding, branch operands in Decode) to the waiting instruction,
+    - a wait for the data cache: in Memory Operation to the load/store, in Decode for a load miss to the waiting instruction,
+    - the squashed slots of a redirect (two, one with --branch-stage id) to the branch/jump, a taken conditional branch also counts as
+      a mispredict (Fetch always predicts not taken).
+    With the debug file of the assembler (-g) the costs are summed per source line and printed next to the source.
+*/
+enum ProfileEvent
+{
+    PROF_LOAD_USE,
+    PROF_DRAIN,
+    PROF_FETCH,
+    PROF_FLUSH,
+    PROF_WALK,
+    PROF_MULDIV,
+    PROF_RAW,
+    PROF_MEM,
+    PROF_IDLE,
+    PROF_EVENTS
+};
+
+struct ProfileEntry
+{
+    uint64_t retired = 0;
+    uint64_t stalls[PROF_EVENTS] = {0}; // Cycles lost, per ProfileEvent
+    uint64_t mispredicts = 0;
+
+    uint64_t cost() const
+    {
+        uint64_t c = retired;
+        for (uint64_t s : stalls)
+            c += s;
+        return c;
+    }
+
+    void add(const ProfileEntry &e)
+    {
+        retired += e.retired;
+        for (int i = 0; i < PROF_EVENTS; i++)
+            stalls[i] += e.stalls[i];
+        mispredicts += e.mispredicts;
+    }
+};
+
+class Profiler
+{
+private:
+    const InstructionMemory &IM;
+    vector<ProfileEntry> entries; // One per halfword of code
+    ProfileEntry outside;         // PCs outside Instruction Memory (virtual addresses that are not identity mapped)
+
+    // Row of the report: cost share and breakdown (where it was spent follows)
+    static void printRow(ostream &out, const ProfileEntry &e, uint64_t total)
+    {
+        out << setw(6) << fixed << setprecision(2) << (total ? 100.0 * e.cost() / total : 0.0) << "%"
+            << setw(10) << e.cost() << setw(10) << e.retired;
+        for (uint64_t s : e.stalls)
+            out << setw(9) << s;
+        out << setw(9) << e.mispredicts << "  ";
+    }
+
+    static void printHeader(ostream &out)
+    {
+        out << "  Cost%    Cycles   Retired LoadUse    Drain    Fetch    Flush     Walk   MulDiv      RAW   Memory     Idle  Mispred  Location\n";
+    }
+
+public:
+    Profiler(const InstructionMemory &IM) : IM(IM), entries(IM.size() / 2 + 1) {}
+
+    ProfileEntry &at(uint32_t pc)
+    {
+        size_t i = (pc - IM.baseAddress()) >> 1;
+        return i < entries.size() ? entries[i] : outside;
+    }
+
+    void retire(uint32_t pc)
+    {
+        at(pc).retired++;
+    }
+
+    void stall(uint32_t pc, ProfileEvent event, uint64_t cycles = 1)
+    {
+        at(pc).stalls[event] += cycles;
+    }
+
+    void mispredict(uint32_t pc)
+    {
+        at(pc).mispredicts++;
+    }
+
+    // Sum over the whole program
+    ProfileEntry total() const
+    {
+        ProfileEntry sum = outside;
+        for (auto &e : entries)
+            sum.add(e);
+        return sum;
+    }
+
+    // Hotspots sorted by cost, then (with debug information) the whole source annotated with its cost
+    void report(ostream &out, const DebugInfo &debug, uint64_t cycles)
+    {
+        uint64_t total = 0;
+        for (auto &e : entries)
+            total += e.cost();
+        const string &sourceFileName = debug.sourceFileName;
+
+        vector<string> source;
+        if (!sourceFileName.empty())
+        {
+            ifstream sourceFile(sourceFileName);
+            if (!sourceFile)
+                cerr << YELLOW << "Warning: Cannot open the source file " << sourceFileName << ", only line numbers are shown\n"
+                     << RESET;
+            string line;
+            while (getline(sourceFile, line))
+                source.push_back(line);
+        }
+
+        // Sum per source line (PCs outside the line map stay on their own):
+        map<int, ProfileEntry> perLine;
+        vector<pair<uint32_t, ProfileEntry>> perPC;
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            if (entries[i].cost() == 0 && entries[i].mispredicts == 0)
+                continue;
+            uint32_t pc = IM.baseAddress() + static_cast<uint32_t>(2 * i);
+            int lineNo = debug.lineOf(pc);
+            if (lineNo > 0)
+                perLine[lineNo].add(entries[i]);
+            else
+                perPC.push_back({pc, entries[i]});
+        }
+
+        // Hotspots: source lines first, then the PCs without a line (with their symbol), most expensive first
+        vector<pair<const ProfileEntry *, int64_t>> rows; // Line number, or -1 - PC
+        for (auto &[lineNo, e] : perLine)
+            rows.push_back({&e, lineNo});
+        for (auto &[pc, e] : perPC)
+            rows.push_back({&e, -1 - static_cast<int64_t>(pc)});
+        stable_sort(rows.begin(), rows.end(), [](const auto &a, const auto &b)
+                    { return a.first->cost() > b.first->cost(); });
+
+        out << "Profile: " << cycles << " cycles, " << total << " attributed to instructions (the rest is pipeline fill and drain)\n\n";
+        out << "Hotspots:\n";
+        printHeader(out);
+        for (auto &[e, key] : rows)
+        {
+            printRow(out, *e, total);
+            if (key >= 0)
+            {
+                const string &text = (key <= static_cast<int64_t>(source.size())) ? source[key - 1] : "";
+                size_t start = text.find_first_not_of(" \t");
+                out << sourceFileName << ":" << key << "  " << (start == string::npos ? "" : text.c_str() + start) << "\n";
+                continue;
+            }
+            uint32_t pc = static_cast<uint32_t>(-1 - key);
+            uint16_t low = IM.readHalf(pc);
+            out << "0x" << hex << setfill('0') << setw(8) << pc << "  ";
+            if ((low & 0x3) != 0x3)
+                out << setw(4) << low << " (compressed)";
+            else
+                out << setw(8) << IM.read(pc);
+            out << dec << setfill(' ');
+            string sym = debug.symbolize(pc);
+            out << (sym.empty() ? "" : "  <" + sym + ">") << "\n";
+        }
+
+        if (!source.empty())
+        {
+            out << "\nAnnotated source (" << sourceFileName << "):\n";
+            printHeader(out);
+            for (int lineNo = 1; lineNo <= static_cast<int>(source.size()); lineNo++)
+            {
+                auto it = perLine.find(lineNo);
+                if (it != perLine.end())
+                    printRow(out, it->second, total);
+                else
+                    out << string(110, ' ');
+                out << lineNo << ": " << source[lineNo - 1] << "\n";
+            }
+        }
+    }
+};
+
+Profiler *profiler = nullptr; // Set by --profile
+
+// Energy Estimation:
+/*
+    Counts the activity of the pipeline per PC, like the profiler counts cycles, and prices it with an energy per
+    event (energyCoeff, in pJ, set with --energy-coeff):
+    - fetch: an instruction passed from Fetch to Decode (wrong path ones included),
+    - rf-read: a register operand read in Decode (x0 and the rs2 field of an immediate instruction are not read),
+    - rf-write: a register written in WriteBack,
+    - logic, add, shift, mul, div: the operation in Execute by its ALUSelect class (AND/OR/XOR; ADD/SUB/SLT/SLTU,
+      which also compute addresses; SLL/SRL/SRA; MUL, MULH*; DIV*, REM*),
+    - load, store: a Data Memory or device access in Memory Operation,
+    - bubble: a stall cycle, charged to the same instruction as in the profile,
+    - flush: a wrong path instruction squashed by a taken branch or jump, charged to the branch/jump.
+    Leakage (leakagePerCycle) is charged per cycle to the whole run. The report gives the energy per instruction and
+    per region of code: the text label a PC belongs to with the debug file (-g), else aligned 64 byte blocks.
+*/
+enum EnergyEvent
+{
+    ENERGY_FETCH,
+    ENERGY_RF_READ,
+    ENERGY_RF_WRITE,
+    ENERGY_LOGIC,
+    ENERGY_ADD,
+    ENERGY_SHIFT,
+    ENERGY_MUL,
+    ENERGY_DIV,
+    ENERGY_LOAD,
+    ENERGY_STORE,
+    ENERGY_BUBBLE,
+    ENERGY_FLUSH,
+    ENERGY_EVENTS
+};
+
+const char *const energyEventNames[ENERGY_EVENTS] = {"fetch", "rf-read", "rf-write", "logic", "add", "shift",
+                                                     "mul", "div", "load", "store", "bubble", "flush"};
+// Defaults in the proportions of a small in-order core (memories and M unit dominate); calibrate for a real design
+double energyCoeff[ENERGY_EVENTS] = {8.0, 1.5, 2.0, 0.5, 1.0, 1.5, 12.0, 30.0, 15.0, 15.0, 0.8, 4.0};
+double leakagePerCycle = 3.0;
+
+// Energy class of an ALUSelect value
+inline EnergyEvent aluEnergyClass(uint32_t op)
+{
+    if (op >= ALU_DIV)
+        return ENERGY_DIV;
+    if (op >= ALU_MUL)
+        return ENERGY_MUL;
+    if (op == ALU_SLL || op == ALU_SRL || op == ALU_SRA)
+        return ENERGY_SHIFT;
+    if (op == ALU_AND || op == ALU_OR || op == ALU_XOR)
+        return ENERGY_LOGIC;
+    return ENERGY_ADD;
+}
+
+struct EnergyEntry
+{
+    uint64_t retired = 0;
+    uint64_t counts[ENERGY_EVENTS] = {0};
+
+    // pJ
+    double energy() const
+    {
+        double e = 0;
+        for (int i = 0; i < ENERGY_EVENTS; i++)
+            e += counts[i] * energyCoeff[i];
+        return e;
+    }
+
+    void add(const EnergyEntry &e)
+    {
+        retired += e.retired;
+        for (int i = 0; i < ENERGY_EVENTS; i++)
+            counts[i] += e.counts[i];
+    }
+};
+
+class EnergyModel
+{
+private:
+    const InstructionMemory &IM;
+    vector<EnergyEntry> entries; // One per halfword of code
+    EnergyEntry outside;         // PCs outside Instruction Memory
+
+public:
+    EnergyModel(const InstructionMemory &IM) : IM(IM), entries(IM.size() / 2 + 1) {}
+
+    EnergyEntry &at(uint32_t pc)
+    {
+        size_t i = (pc - IM.baseAddress()) >> 1;
+        return i < entries.size() ? entries[i] : outside;
+    }
+
+    void count(uint32_t pc, EnergyEvent event, uint64_t n = 1)
+    {
+        at(pc).counts[event] += n;
+    }
+
+    void retire(uint32_t pc)
+    {
+        at(pc).retired++;
+    }
+
+    EnergyEntry total() const
+    {
+        EnergyEntry sum = outside;
+        for (auto &e : entries)
+            sum.add(e);
+        return sum;
+    }
+
+    // pJ of the whole run, leakage included
+    double totalEnergy(uint64_t cycles) const
+    {
+        return total().energy() + leakagePerCycle * cycles;
+    }
+
+    // Totals per event, then the regions of code sorted by energy
+    void report(ostream &out, const DebugInfo &debug, uint64_t cycles)
+    {
+        EnergyEntry sum = total();
+        double dynamic = sum.energy(), leakage = leakagePerCycle * cycles, all = dynamic + leakage;
+        out << fixed << "Energy: " << setprecision(3) << all / 1000 << " nJ over " << cycles << " cycles and " << sum.retired
+            << " instructions";
+        if (sum.retired > 0)
+            out << ", " << setprecision(2) << all / sum.retired << " pJ/instruction";
+        if (cycles > 0)
+            out << ", " << setprecision(2) << all / cycles << " pJ/cycle";
+        out << "\n\n";
+
+        out << "Event          Count  pJ/event         nJ   Share\n";
+        for (int i = 0; i <= ENERGY_EVENTS; i++)
+        {
+            bool leak = (i == ENERGY_EVENTS);
+            uint64_t n = leak ? cycles : sum.counts[i];
+            double coeff = leak ? leakagePerCycle : energyCoeff[i], e = n * coeff;
+            out << left << setw(9) << (leak ? "leakage" : energyEventNames[i]) << right << setw(10) << n << setw(10)
+                << setprecision(2) << coeff << setw(11) << setprecision(3) << e / 1000 << setw(7) << setprecision(1)
+                << (all > 0 ? 100 * e / all : 0.0) << "%\n";
+        }
+
+        // Regions: by label with debug information, else by 64 byte block
+        map<uint32_t, pair<string, EnergyEntry>> regions;
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            if (entries[i].retired == 0 && entries[i].energy() == 0)
+                continue;
+            uint32_t pc = IM.baseAddress() + static_cast<uint32_t>(2 * i), start;
+            string name;
+            if (!debug.labelOf(pc, start, name))
+            {
+                start = pc & ~63u;
+                ostringstream os;
+                os << "0x" << hex << setfill('0') << setw(8) << start;
+                name = os.str();
+            }
+            auto &region = regions[start];
+            region.first = name;
+            region.second.add(entries[i]);
+        }
+        if (outside.retired > 0 || outside.energy() > 0)
+            regions[UINT32_MAX] = {"(outside Instruction Memory)", outside};
+        vector<const pair<string, EnergyEntry> *> rows;
+        for (auto &[start, region] : regions)
+            rows.push_back(&region);
+        stable_sort(rows.begin(), rows.end(), [](const auto *a, const auto *b)
+                    { return a->second.energy() > b->second.energy(); });
+
+        out << "\nRegions (dynamic energy, nJ):\n";
+        out << "Energy%        nJ   Retired  pJ/Instr";
+        for (auto name : energyEventNames)
+            out << setw(9) << name;
+        out << "  Region\n";
+        for (auto *row : rows)
+        {
+            const EnergyEntry &e = row->second;
+            out << setw(6) << setprecision(2) << (dynamic > 0 ? 100 * e.energy() / dynamic : 0.0) << "%" << setw(10)
+                << setprecision(3) << e.energy() / 1000 << setw(10) << e.retired << setw(10) << setprecision(2)
+                << (e.retired > 0 ? e.energy() / e.retired : 0.0);
+            for (int i = 0; i < ENERGY_EVENTS; i++)
+                out << setw(9) << setprecision(3) << e.counts[i] * energyCoeff[i] / 1000;
+            out << "  " << row->first << "\n";
+        }
+    }
+};
+
+EnergyModel *energy = nullptr; // Set by --energy
+
+// A stall cycle (a bubble) charged to pc by the profiler and the energy model
+void chargeStall(uint32_t pc, ProfileEvent event, uint64_t cycles = 1)
+{
+    if (profiler != nullptr)
+        profiler->stall(pc, event, cycles);
+    if (energy != nullptr)
+        energy->count(pc, ENERGY_BUBBLE, cycles);
+}
+
+// GDB Remote Serial Protocol:
+/*
+    --gdb <port> waits for GDB on a local TCP port ("target remote :<port>") before the first cycle.
+    The pipeline is stopped at a clean point: Fetch is held and the instructions in flight drain, so
+    registers, memory and pc are exactly those after the last retired instruction.
+    - Breakpoints (Z0/Z1) are a bitmap over the code, tested in InstructionFetch. A breakpoint hit on a
+      wrong path fetch is released when the older branch redirects Fetch.
+    - Watchpoints (Z2/Z3/Z4) are checked in MemoryOperation. The younger instructions are squashed, so
+      the stop is right after the accessing instruction.
+    - s steps one instruction (fetch one, then drain). "monitor cycle [n]" clocks n cycles without
+      draining and prints what each pipeline register holds.
+    - Ctrl-C is polled every 4096 cycles.
+    m/M packets access Data Memory, "monitor imem on" switches them to Instruction Memory (the Harvard
+    memories both start at 0).
+*/
+void clockPipeline(InstructionMemory &IM, RegisterFile &RF, DataMemory &DM, ProxyKernel &PK);
+
+class GdbStub
+{
+private:
+    int listenFd = -1, fd = -1;
+    bool noAck = false;
+    string received; // Bytes read from the socket but not parsed yet
+
+    InstructionMemory &IM;
+    RegisterFile &RF;
+    DataMemory &DM;
+    ProxyKernel &PK;
+
+    vector<uint64_t> breakpoints; // One bit per halfword of code
+    uint32_t breakpointCount = 0;
+
+    struct Watchpoint
+    {
+        uint32_t addr, len;
+        char type; // '2' write, '3' read, '4' access (the Z packet type)
+    };
+    vector<Watchpoint> watchpoints;
+    uint32_t watchHitAddr = 0;
+    char watchHitType = 0;
+
+    bool stopRequested = false;  // Hold Fetch whatever the PC (watchpoint, Ctrl-C)
+    bool stepping = false, stepFetched = false;
+    bool skipBreakpoint = false; // Resuming from a breakpoint: its first fetch goes ahead
+    bool held = false;           // Fetch was held this cycle
+    bool imem = false;           // m/M packets access Instruction Memory
+    string stopReason = "S05";
+
+    static string hexByte(uint32_t b)
+    {
+        static const char digits[] = "0123456789abcdef";
+        return string(1, digits[(b >> 4) & 0xF]) + digits[b & 0xF];
+    }
+
+    static string hexWord(uint32_t w) // Target byte order (little endian)
+    {
+        return hexByte(w) + hexByte(w >> 8) + hexByte(w >> 16) + hexByte(w >> 24);
+    }
+
+    // Hex number (the whole text), false on anything else
+    static bool parseHex(const string &hex, uint32_t &value)
+    {
+        if (hex.empty() || !isxdigit(static_cast<unsigned char>(hex[0])))
+            return false;
+        char *end = nullptr;
+        errno = 0;
+        unsigned long v = strtoul(hex.c_str(), &end, 16);
+        if (*end != '\0' || errno == ERANGE || v > UINT32_MAX)
+            return false;
+        value = static_cast<uint32_t>(v);
+        return true;
+    }
+
+    static bool parseWord(const string &hex, uint32_t &w) // Little endian hex bytes
+    {
+        if (hex.size() != 8)
+            return false;
+        w = 0;
+        for (size_t i = 0; i < 8; i += 2)
+        {
+            uint32_t byte;
+            if (!parseHex(hex.substr(i, 2), byte))
+                return false;
+            w |= byte << (4 * i);
+        }
+        return true;
+    }
+
+    // Connection:
+    bool readByte(char &ch)
+    {
+        if (received.empty())
+        {
+            char buf[4096];
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0)
+                return false;
+            received.assign(buf, n);
+        }
+        ch = received[0];
+        received.erase(0, 1);
+        return true;
+    }
+
+    bool readPacket(string &packet)
+    {
+        while (true)
+        {
+            char ch;
+            do
+                if (!readByte(ch))
+                    return false;
+            while (ch != '$'); // Acks and Ctrl-C while stopped are skipped
+
+            packet.clear();
+            uint8_t sum = 0;
+            while (readByte(ch) && ch != '#')
+            {
+                packet += ch;
+                sum += ch;
+            }
+            char checksum[2];
+            if (!readByte(checksum[0]) || !readByte(checksum[1]))
+                return false;
+            if (noAck)
+                return true;
+
+            // A corrupted packet is NAKed ('-') and GDB sends it again:
+            uint32_t expected;
+            bool intact = parseHex(string(checksum, 2), expected) && expected == sum;
+            send(fd, intact ? "+" : "-", 1, 0);
+            if (intact)
+                return true;
+        }
+    }
+
+    void sendPacket(const string &data)
+    {
+        uint8_t sum = 0;
+        for (char ch : data)
+            sum += ch;
+        string packet = "$" + data + "#" + hexByte(sum);
+        send(fd, packet.data(), packet.size(), 0);
+        if (!noAck) // Wait for the ack ('+'), a NAK ('-') is answered with the packet again
+        {
+            char ch;
+            while (readByte(ch) && ch != '+')
+                if (ch == '-')
+                    send(fd, packet.data(), packet.size(), 0);
+        }
+    }
+
+    // Breakpoints and watchpoints:
+    bool inCode(uint32_t addr) const
+    {
+        return addr >= IM.baseAddress() && addr < IM.endAddress();
+    }
+
+    bool isBreakpoint(uint32_t pc) const
+    {
+        uint32_t bit = (pc - IM.baseAddress()) >> 1;
+        return inCode(pc) && (breakpoints[bit >> 6] >> (bit & 63) & 1);
+    }
+
+    void setBreakpoint(uint32_t pc, bool set)
+    {
+        if (!inCode(pc) || isBreakpoint(pc) == set)
+            return;
+        uint32_t bit = (pc - IM.baseAddress()) >> 1;
+        breakpoints[bit >> 6] ^= 1ull << (bit & 63);
+        breakpointCount += set ? 1 : -1;
+    }
+
+    // Pipeline state:
+    bool drained() const
+    {
+        return !IFID.valid && !IDEX.valid && !EXMO.valid && !MOWB.valid;
+    }
+
+    // PC of the oldest instruction that has not retired (the fetch PC once drained)
+    uint32_t currentPC() const
+    {
+        if (MOWB.valid)
+            return MOWB.DPC;
+        if (EXMO.valid)
+            return EXMO.DPC;
+        if (IDEX.valid)
+            return IDEX.DPC;
+        if (IFID.valid)
+            return IFID.DPC;
+        return PC.value;
+    }
+
+    string occupancy() const
+    {
+        ostringstream os;
+        auto stage = [&](const char *name, bool valid, uint32_t pc)
+        {
+            os << name << " ";
+            if (valid)
+                os << "0x" << hex << setw(8) << setfill('0') << pc << dec << setfill(' ');
+            else
+                os << "    --    ";
+            os << "  ";
+        };
+        os << "cycle " << cycle << ": ";
+        stage("IFID", IFID.valid, IFID.DPC);
+        stage("IDEX", IDEX.valid, IDEX.DPC);
+        stage("EXMO", EXMO.valid, EXMO.DPC);
+        stage("MOWB", MOWB.valid, MOWB.DPC);
+        os << "PC 0x" << hex << PC.value << dec << "\n";
+        return os.str();
+    }
+
+    // Register 0-31 are x0-x31, 32 is pc
+    bool readRegister(uint32_t n, uint32_t &value) const
+    {
+        if (n > 32)
+            return false;
+        value = (n == 32) ? currentPC() : RF.read(n);
+        return true;
+    }
+
+    bool writeRegister(uint32_t n, uint32_t value)
+    {
+        if (n < 32)
+            RF.write(n, value);
+        else if (n == 32 && drained()) // The pc can only move while nothing is in flight
+            PC.value = value;
+        else
+            return false;
+        return true;
+    }
+
+    bool readMemory(uint32_t addr, uint32_t len, string &hex)
+    {
+        hex.clear();
+        if (imem)
+        {
+            if (len == 0 || !inCode(addr) || !inCode(addr + len - 1))
+                return false;
+            for (uint32_t a = addr; a < addr + len; a++)
+                hex += hexByte(IM.readHalf(a & ~1u) >> (8 * (a & 1)));
+            return true;
+        }
+        uint8_t *p = DM.hostPointer(addr, len);
+        if (p == nullptr)
+            return false;
+        for (uint32_t i = 0; i < len; i++)
+            hex += hexByte(p[i]);
+        return true;
+    }
+
+    string monitor(const string &command)
+    {
+        istringstream in(command);
+        string word;
+        in >> word;
+        if (word == "cycle")
+        {
+            uint64_t n = 1;
+            in >> n;
+            string out;
+            skipBreakpoint = true; // Clocked as is: no stop is pending
+            stepping = stopRequested = false;
+            for (uint64_t i = 0; i < n && programRunning; i++)
+            {
+                clockPipeline(IM, RF, DM, PK);
+                if (n <= 32 || i + 1 == n)
+                    out += occupancy();
+            }
+            if (!programRunning)
+                out += "The program has ended, continue to let GDB see the exit.\n";
+            return out + "Registers changed: use 'maintenance flush register-cache'.\n";
+        }
+        if (word == "info")
+            return "Cycles " + to_string(cycle) + ", instructions retired " + to_string(retired) + "\n" + occupancy();
+        if (word == "imem")
+        {
+            in >> word;
+            imem = (word == "on");
+            return string("Memory packets access ") + (imem ? "Instruction" : "Data") + " Memory\n";
+        }
+        return "Commands: cycle [n], info, imem on|off\n";
+    }
+
+    static string targetXML()
+    {
+        static const char *names[32] = {"zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "fp", "s1", "a0",
+                                        "a1", "a2", "a3", "a4", "a5", "a6", "a7", "s2", "s3", "s4", "s5",
+                                        "s6", "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6"};
+        string xml = "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\"><target version=\"1.0\">"
+                     "<architecture>riscv:rv32</architecture><feature name=\"org.gnu.gdb.riscv.cpu\">";
+        for (int i = 0; i < 32; i++)
+            xml += string("<reg name=\"") + names[i] + "\" bitsize=\"32\" type=\"" +
+                   (i == 1 || i == 2 || i == 8 ? (i == 1 ? "code_ptr" : "data_ptr") : "int") + "\" regnum=\"" + to_string(i) + "\"/>";
+        return xml + "<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\" regnum=\"32\"/></feature></target>";
+    }
+
+    // Handles packets until the program is resumed (returns false once GDB has gone)
+    bool serve()
+    {
+        string packet;
+        while (readPacket(packet))
+        {
+            char cmd = packet.empty() ? 0 : packet[0];
+            string args = packet.substr(packet.empty() ? 0 : 1);
+            uint32_t addr = 0, len = 0, value = 0;
+
+            if (cmd == '?')
+                sendPacket(stopReason);
+            else if (cmd == 'g')
+            {
+                string regs;
+                for (uint32_t n = 0; n <= 32; n++)
+                    regs += hexWord((readRegister(n, value), value));
+                sendPacket(regs);
+            }
+            else if (cmd == 'G')
+            {
+                uint32_t regs[33];
+                bool ok = args.size() >= 8 * 33;
+                for (uint32_t n = 0; n <= 32 && ok; n++)
+                    ok = parseWord(args.substr(8 * n, 8), regs[n]);
+                for (uint32_t n = 1; n <= 32 && ok; n++)
+                    writeRegister(n, regs[n]);
+                sendPacket(ok ? "OK" : "E01");
+            }
+            else if (cmd == 'p')
+            {
+                uint32_t n;
+                if (!parseHex(args, n))
+                    sendPacket("E01");
+                else
+                    sendPacket(readRegister(n, value) ? hexWord(value) : "E00");
+            }
+            else if (cmd == 'P')
+            {
+                size_t eq = args.find('=');
+                uint32_t n;
+                if (eq == string::npos || !parseHex(args.substr(0, eq), n) || !parseWord(args.substr(eq + 1), value))
+                    sendPacket("E01");
+                else
+                    sendPacket(writeRegister(n, value) ? "OK" : "E00");
+            }
+            else if (cmd == 'm' && sscanf(args.c_str(), "%x,%x", &addr, &len) == 2)
+            {
+                string hex;
+                sendPacket(readMemory(addr, len, hex) ? hex : "E14");
+            }
+            else if (cmd == 'M' && sscanf(args.c_str(), "%x,%x:", &addr, &len) == 2)
+            {
+                string data = args.substr(args.find(':') + 1);
+                bool ok = data.size() == 2 * static_cast<uint64_t>(len);
+                vector<uint8_t> bytes(ok ? len : 0);
+                for (uint32_t i = 0; i < bytes.size() && ok; i++)
+                {
+                    ok = parseHex(data.substr(2 * i, 2), value);
+                    bytes[i] = static_cast<uint8_t>(value);
+                }
+                uint8_t *p = imem ? nullptr : DM.hostPointer(addr, len); // Instruction Memory is read only
+                if (!ok)
+                    sendPacket("E01");
+                else if (p == nullptr)
+                    sendPacket("E14");
+                else
+                {
+                    copy(bytes.begin(), bytes.end(), p);
+                    sendPacket("OK");
+                }
+            }
+            else if (cmd == 'c' || cmd == 's')
+            {
+                if (!args.empty())
+                {
+                    if (!parseHex(args, value))
+                    {
+                        sendPacket("E01");
+                        continue;
+                    }
+                    writeRegister(32, value);
+                }
+                stepping = (cmd == 's');
+                stepFetched = false;
+                skipBreakpoint = true;
+                return true;
+            }
+            else if ((cmd == 'Z' || cmd == 'z') && sscanf(args.c_str(), "%*c,%x,%x", &addr, &len) == 2)
+            {
+                char type = args[0];
+                bool set = (cmd == 'Z');
+                if (type == '0' || type == '1')
+                    setBreakpoint(addr, set);
+                else if (type >= '2' && type <= '4')
+                {
+                    auto same = [&](const Watchpoint &w)
+                    { return w.addr == addr && w.len == len && w.type == type; };
+                    watchpoints.erase(remove_if(watchpoints.begin(), watchpoints.end(), same), watchpoints.end());
+                    if (set)
+                        watchpoints.push_back({addr, len, type});
+                }
+                else
+                {
+                    sendPacket("");
+                    continue;
+                }
+                sendPacket("OK");
+            }
+            else if (packet.compare(0, 10, "qSupported") == 0)
+                sendPacket("PacketSize=4000;QStartNoAckMode+;qXfer:features:read+");
+            else if (packet.compare(0, 31, "qXfer:features:read:target.xml:") == 0 &&
+                     sscanf(packet.c_str() + 31, "%x,%x", &addr, &len) == 2)
+            {
+                string xml = targetXML();
+                string chunk = (addr < xml.size()) ? xml.substr(addr, len) : "";
+                sendPacket((addr + chunk.size() < xml.size() ? "m" : "l") + chunk);
+            }
+            else if (packet == "QStartNoAckMode")
+            {
+                sendPacket("OK");
+                noAck = true;
+            }
+            else if (packet.compare(0, 6, "qRcmd,") == 0)
+            {
+                string command;
+                bool ok = packet.size() % 2 == 0;
+                for (size_t i = 6; i + 1 < packet.size() && ok; i += 2)
+                    if ((ok = parseHex(packet.substr(i, 2), value)))
+                        command += static_cast<char>(value);
+                if (!ok)
+                {
+                    sendPacket("E01");
+                    continue;
+                }
+                string out = monitor(command), hex;
+                for (char ch : out)
+                    hex += hexByte(static_cast<uint8_t>(ch));
+                sendPacket("O" + hex);
+                sendPacket("OK");
+            }
+            else if (packet == "qAttached")
+                sendPacket("1");
+            else if (packet == "qC")
+                sendPacket("QC1");
+            else if (packet == "qfThreadInfo")
+                sendPacket("m1");
+            else if (packet == "qsThreadInfo")
+                sendPacket("l");
+            else if (cmd == 'H' || cmd == 'T')
+                sendPacket("OK");
+            else if (cmd == 'k' || packet == "vKill;1")
+            {
+                cout << YELLOW << "GDB: killed at cycle " << cycle << "\n"
+                     << RESET;
+                exit(0);
+            }
+            else if (cmd == 'D')
+            {
+                sendPacket("OK");
+                break;
+            }
+            else
+                sendPacket(""); // Not supported
+        }
+
+        // Detached or disconnected: run on without the debugger
+        close(fd);
+        fd = -1;
+        breakpointCount = 0;
+        fill(breakpoints.begin(), breakpoints.end(), 0);
+        watchpoints.clear();
+        stepping = stopRequested = false;
+        return false;
+    }
+
+    // Reports the stop to GDB and serves it until it resumes
+    void stop()
+    {
+        sendPacket(stopReason);
+        serve();
+        stopReason = "S05";
+        stopRequested = false;
+        watchHitType = 0;
+    }
+
+public:
+    GdbStub(uint16_t port, InstructionMemory &IM, RegisterFile &RF, DataMemory &DM, ProxyKernel &PK)
+        : IM(IM), RF(RF), DM(DM), PK(PK), breakpoints(IM.size() / 128 + 1, 0)
+    {
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Local connections only
+        int one = 1;
+        listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenFd >= 0)
+            setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || listen(listenFd, 1) < 0)
+        {
+            cerr << RED << "Error: Cannot listen on port " << port << ": " << strerror(errno) << "\n"
+                 << RESET;
+            exit(1);
+        }
+        cout << YELLOW << "GDB: waiting on port " << port << " (target remote :" << port << ")\n"
+             << RESET;
+        fd = accept(listenFd, nullptr, nullptr);
+        close(listenFd);
+        if (fd < 0)
+        {
+            cerr << RED << "Error: No GDB connection: " << strerror(errno) << "\n"
+                 << RESET;
+            exit(1);
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        cout << YELLOW << "GDB: connected\n"
+             << RESET;
+    }
+
+    ~GdbStub()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    // Serves GDB before the first cycle
+    void start()
+    {
+        serve();
+    }
+
+    // InstructionFetch: true to hold Fetch at pc (breakpoint, step done or stop request)
+    bool holdFetch(uint32_t pc)
+    {
+        bool hold = stopRequested || (stepping && stepFetched) || (breakpointCount > 0 && !skipBreakpoint && isBreakpoint(pc));
+        held = held || hold;
+        return hold;
+    }
+
+    // InstructionFetch: an instruction was fetched
+    void fetched()
+    {
+        skipBreakpoint = false;
+        stepFetched = stepping;
+    }
+
+    bool watching() const
+    {
+        return !watchpoints.empty();
+    }
+
+    // MemoryOperation: a load (write = false) or store of len bytes at addr
+    void access(uint32_t addr, uint32_t len, bool write)
+    {
+        for (auto &w : watchpoints)
+            if (addr < w.addr + w.len && w.addr < addr + len && (w.type == '4' || (w.type == '2') == write) && !watchHitType)
+            {
+                watchHitType = w.type;
+                watchHitAddr = w.addr;
+            }
+    }
+
+    // End of a cycle: stops once the pipeline has drained behind a held Fetch
+    void afterCycle()
+    {
+        if (fd < 0)
+            return;
+        if (watchHitType && !stopRequested)
+        {
+            // Squash everything younger than the accessing instruction (now in MOWB) and resume after it:
+            uint32_t resume = EXMO.valid ? EXMO.DPC : IDEX.valid ? IDEX.DPC
+                                                 : IFID.valid  ? IFID.DPC
+                                                               : PC.value;
+            if (trace != nullptr)
+            {
+                if (IFID.valid)
+                    trace->record(IFID.id, IFID.DPC, TRACE_FLUSH, STAGE_IF);
+                if (IDEX.valid)
+                    trace->record(IDEX.id, IDEX.DPC, TRACE_FLUSH, STAGE_ID);
+                if (EXMO.valid)
+                    trace->record(EXMO.id, EXMO.DPC, TRACE_FLUSH, STAGE_EX);
+            }
+            IFID.valid = IDEX.valid = EXMO.valid = false;
+            IFID.stall = IDEX.stall = false;
+            PC.value = resume;
+            PC.TPC = PC_Reg::NO_TARGET;
+            stopRequested = true;
+            static const char *kinds[3] = {"watch", "rwatch", "awatch"};
+            ostringstream os;
+            os << "T05" << kinds[watchHitType - '2'] << ":" << hex << watchHitAddr << ";";
+            stopReason = os.str();
+        }
+        if ((cycle & 4095) == 0) // Ctrl-C from GDB
+        {
+            char ch;
+            ssize_t n = recv(fd, &ch, 1, MSG_DONTWAIT);
+            if (n == 1 && ch == 0x03)
+            {
+                stopRequested = true;
+                stopReason = "S02";
+            }
+            else if (n == 0)
+                serve(); // Connection closed: cleans up
+        }
+        if (held && drained())
+        {
+            held = false;
+            stop();
+        }
+        held = false;
+    }
+
+    // GDB signal of a trap: SIGILL, SIGSYS (ECALL below M mode), SIGTRAP (EBREAK, interrupts) or SIGSEGV (faults)
+    static uint32_t trapSignal(uint32_t cause)
+    {
+        if (cause == CAUSE_ILLEGAL)
+            return 4;
+        if (cause == CAUSE_ECALL_U || cause == CAUSE_ECALL_S)
+            return 12;
+        if ((cause & CAUSE_INTERRUPT) || cause == CAUSE_BREAKPOINT)
+            return 5;
+        return 11;
+    }
+
+    // The program exited, stopped at a trap without a handler, or ran out of cycles
+    void finish(bool exited, int32_t exitCode)
+    {
+        if (fd < 0)
+            return;
+        if (unhandledTrap)
+        {
+            // GDB stops at the trapping instruction with its signal to show the state; resuming ends the program
+            string signal = hexByte(trapSignal(unhandledCause));
+            PC.value = unhandledPC;
+            stopReason = "T" + signal;
+            stop();
+            if (fd >= 0)
+                sendPacket("X" + signal);
+        }
+        else
+            sendPacket(exited ? "W" + hexByte(exitCode) : "X18"); // SIGXCPU: out of cycles
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+};
+
+GdbStub *gdb = nullptr; // Set by --gdb
+bool fetchHeld = false;  // Nothing is fetched while the DSE checkpoint drains the pipeline
+
+// Functions:
+// Moves the PC on past the instruction just fetched
+void advancePC(uint32_t ilen)
+{
+    if (PC.TPC != PC_Reg::NO_TARGET) // The normal flow is broken
+    {
+        PC.value = PC.TPC;
+        PC.TPC = PC_Reg::NO_TARGET; // Reset the TPC so that normal flow is continued now
+    }
+    else // Normal flow
+        PC.value = PC.value + ilen;
+}
+
+// Translates the PC below M mode. Returns false when Fetch has nothing more to do this cycle: an I-TLB miss
+// (Fetch waits for the page walk) or a fault, passed on as an instruction that traps in Memory Operation.
+// An instruction that crosses into the next page is read from the physical page after the first one.
+bool translateFetch(InstructionMemory &IM, uint32_t &fetchAddr)
+{
+    uint32_t stallCycles;
+    uint32_t fault = mmu.translate(PC.value, ACCESS_FETCH, fetchAddr, stallCycles);
+    if (stallCycles > 0)
+    {
+        fetchStallCycles = stallCycles - 1;
+        IFID.valid = false;
+        chargeStall(PC.value, PROF_WALK, stallCycles);
+        if (verbose)
+            cout << "  IF: I-TLB miss at PC=0x" << hex << PC.value << dec << ", page walk of " << stallCycles << " cycles" << endl;
+        return false;
+    }
+    if (fault == 0 && (fetchAddr < IM.baseAddress() || fetchAddr + 2 > IM.endAddress()))
+        fault = CAUSE_FETCH_FAULT;
+    if (fault == 0)
+        return true;
+
+    IFID.IR = 0;
+    IFID.DPC = PC.value;
+    IFID.ilen = 4;
+    IFID.id = static_cast<uint32_t>(++FB.instructions);
+    IFID.trap = true;
+    IFID.cause = fault;
+    IFID.tval = PC.value;
+    if (trace != nullptr)
+        trace->record(IFID.id, IFID.DPC, TRACE_STAGE, STAGE_IF);
+    if (verbose)
+        cout << "  IF: " << trapName(fault) << " at PC=0x" << hex << PC.value << dec << endl;
+    advancePC(4);
+    IFID.valid = true;
+    return false;
+}
+
+void InstructionFetch(InstructionMemory &IM)
+{
+    if (verbose)
+        cout << "\n[IF Stage]" << endl;
+    if (IFID.stall)
+    {
+        if (verbose)
+            cout << "  IF: Stalled" << endl;
+        return;
+    }
+
+    // I-TLB miss (the page walk) or I-cache miss (the line) in progress
+    if (fetchStallCycles > 0)
+    {
+        fetchStallCycles--;
+        IFID.valid = false;
+        return;
+    }
+
+    // Below M mode the PC is a virtual address:
+    uint32_t fetchAddr = PC.value;
+    if (csr.translating() && !translateFetch(IM, fetchAddr))
+        return;
+
+    // Program is over but we might have to continue running till the pipeline is empty:
+    if (fetchAddr >= IM.endAddress())
+    {
+        // Bubble injection:
+        IFID.valid = false;
+
+        // Check if all pipeline stages are empty:
+        if (!IDEX.valid && !EXMO.valid && !MOWB.valid)
+            programRunning = false;
+        return;
+    }
+
+    // Breakpoint or stop request of the debugger, or the DSE checkpoint: nothing is fetched while the pipeline drains
+    if (fetchHeld || (gdb != nullptr && gdb->holdFetch(PC.value)))
+    {
+        IFID.valid = false;
+        return;
+    }
+
+    // I-cache miss: Fetch waits for the line of the instruction's first byte
+    if (icache.enabled())
+    {
+        uint32_t waitCycles = icache.fetch(fetchAddr, cycle);
+        if (waitCycles > 0)
+        {
+            fetchStallCycles = waitCycles - 1;
+            IFID.valid = false;
+            chargeStall(PC.value, PROF_FETCH, waitCycles);
+            if (verbose)
+                cout << "  IF: I-cache miss at PC=0x" << hex << PC.value << dec << ", waiting " << waitCycles << " cycles" << endl;
+            return;
+        }
+    }
+
+    // The lowest two bits tell a compressed (16 bit) instruction from a 32 bit one:
+    uint16_t low = IM.readHalf(fetchAddr);
+    uint32_t ilen = ((low & 0x3) != 0x3) ? 2 : 4;
+
+    // Bytes that are not in the fetch buffer are read from Instruction Memory, one aligned word per cycle:
+    uint32_t firstWord = fetchAddr & ~3u, lastWord = (fetchAddr + ilen - 1) & ~3u;
+    bool firstBuffered = FB.valid && FB.wordAddr == firstWord;
+    if (!firstBuffered && lastWord != firstWord) // Misaligned 32 bit instruction right after a redirect: needs two words
+    {
+        FB.wordAddr = firstWord;
+        FB.valid = true;
+        FB.wordsRead++;
+        FB.stallCycles++;
+        chargeStall(PC.value, PROF_FETCH);
+        IFID.valid = false;
+        if (verbose)
+            cout << "  IF: Filling the fetch buffer for a misaligned instruction at PC=0x" << hex << PC.value << dec << endl;
+        return;
+    }
+    FB.wordsRead += (firstBuffered ? 0 : 1) + (lastWord != firstWord ? 1 : 0);
+    FB.wordAddr = lastWord;
+    FB.valid = true;
+    FB.instructions++;
+
+    if (ilen == 2)
+    {
+        FB.compressed++;
+        IFID.IR = expandCompressed(low);
+    }
+    else
+        IFID.IR = IM.read(fetchAddr);
+    IFID.DPC = PC.value;
+    IFID.ilen = ilen;
+    IFID.trap = false;
+    IFID.id = static_cast<uint32_t>(FB.instructions);
+    if (trace != nullptr)
+    {
+        trace->record(IFID.id, IFID.DPC, TRACE_STAGE, STAGE_IF);
+        trace->record(IFID.id, IFID.IR, TRACE_INSTR, STAGE_IF);
+    }
+    if (verbose)
+        cout << "  IF: PC=0x" << hex << PC.value << " (dec: " << dec << PC.value << ")"
+             << " IR=0x" << hex << IFID.IR << " (dec: " << dec << IFID.IR << ")" << (ilen == 2 ? " [C]" : "") << endl;
+
+    // PC Update logic: For next instruction and NOT the current instruction:
+    advancePC(ilen);
+
+    IFID.valid = true;
+    if (energy != nullptr)
+        energy->count(IFID.DPC, ENERGY_FETCH);
+    if (gdb != nullptr)
+        gdb->fetched();
+}
+
+// Non-blocking loads: a register whose load missed is not there until its line arrives (not even to overwrite).
+// Returns the cycle the instruction in IFID can stop waiting for load misses.
+uint64_t loadMissWait()
+{
+    uint32_t opcode = IFID.IR & 0x7F;
+    uint32_t rsl1 = (IFID.IR >> 15) & 0x1F;
+    uint32_t rsl2 = (IFID.IR >> 20) & 0x1F;
+    uint32_t rdl = (opcode == 35 || opcode == 99) ? 0 : (IFID.IR >> 7) & 0x1F;
+    return max({regReady[rsl1], regReady[rsl2], regReady[rdl]});
+}
+
+// Finds the hazards that hold the instruction in Decode for a cycle (a bubble goes on), before actual decoding starts.
+// When Decode runs, the instruction that was in IDEX has just been executed into EXMO.
+void HazardDetectionUnit()
+{
+    if (!IFID.valid)
+        return;
+    uint32_t opcode = IFID.IR & 0x7F;
+    uint32_t rsl1 = (IFID.IR >> 15) & 0x1F;
+    uint32_t rsl2 = (IFID.IR >> 20) & 0x1F;
+    uint32_t sources = ((1u << rsl1) | (1u << rsl2)) & ~1u;
+    uint32_t exWrites = EXMO.valid ? EXMO.rdMask : 0;
+    uint32_t memWrites = (MOWB.valid && MOWB.CW.regWrite) ? (1u << MOWB.rdl) & ~1u : 0;
+    ProfileEvent stall = PROF_EVENTS; // None
+
+    if (loadMissWait() > cycle)
+        stall = PROF_MEM;
+    else if (forwarding == FORWARD_NONE) // Full interlock: wait for every older writer of a source to write back
+    {
+        if ((exWrites | memWrites) & sources)
+            stall = PROF_RAW;
+    }
+    // If the instruction infront is Load instruction, check if the to-be-decoded instruction (in IFID) needs the
+    // loaded value (with FORWARD_EX_MEM the data of a store is forwarded in Memory Operation instead)
+    else if (IDEX.valid && IDEX.CW.memRead && IDEX.rdl != 0 && (IDEX.rdl == rsl1 || IDEX.rdl == rsl2) &&
+             !(forwarding == FORWARD_EX_MEM && opcode == 35 && IDEX.rdl != rsl1))
+        stall = PROF_LOAD_USE;
+    // Branch operands in Decode: the result of the instruction right ahead is only ready at the end of this cycle,
+    // a loaded value one cycle after that
+    else if (branchStage == BRANCH_ID && (opcode == 99 || opcode == 103))
+    {
+        uint32_t reads = (opcode == 99 ? sources : (1u << rsl1) & ~1u);
+        if ((exWrites | (MOWB.CW.mem2Reg ? memWrites : 0)) & reads)
+            stall = PROF_RAW;
+    }
+
+    // ECALL and the CSR instructions read and write the architectural state (a CSR read of minstret must count every
+    // older instruction), so a SYSTEM instruction waits in Decode until every older instruction has written back
+    if (stall == PROF_EVENTS && opcode == 115 && (EXMO.valid || MOWB.valid || loadsReady > cycle))
+        stall = PROF_DRAIN;
+    // WFI then waits until an interrupt is pending and enabled in mie (taken or not, as xIE decides)
+    else if (stall == PROF_EVENTS && IFID.IR == WFI && (mip & csr.mie) == 0)
+        stall = PROF_IDLE;
+
+    if (stall == PROF_EVENTS)
+        return;
+    // Handled in Decode now: IFID.stall = true;  // Keep current instruction in IFID (stall Fetch)
+    IDEX.stall = true;  // Keep current instruction in IDEX (stall Decode)
+    IDEX.valid = false; // Insert bubble in IDEX (ensure NOP in EX in next cycle)
+    chargeStall(IFID.DPC, stall);
+    if (verbose)
+        cout << (stall == PROF_LOAD_USE ? "Load-Use Hazard detected.\n"
+                 : stall == PROF_RAW    ? "Data Hazard: waiting for a source register.\n"
+                 : stall == PROF_MEM    ? "Data Hazard: waiting for a load miss.\n"
+                 : stall == PROF_IDLE   ? "WFI: Waiting for an interrupt.\n"
+                                        : "SYSTEM: Waiting for the pipeline to drain.\n");
+}
+
+// The instruction in Decode raises an exception: it goes on as a NOP and traps in Memory Operation, in program order
+void raiseException(uint32_t cause, uint32_t tval)
+{
+    IDEX.CW = ControlWord();
+    IDEX.rsl1 = IDEX.rsl2 = IDEX.rdl = 0;
+    IDEX.trap = true;
+    IDEX.cause = cause;
+    IDEX.tval = tval;
+    if (verbose)
+        cout << "  ID: " << trapName(cause) << " (0x" << hex << tval << dec << ")" << endl;
+}
+
+// SYSTEM instructions, executed in Decode once the pipeline has drained (see HazardDetectionUnit()) so they see the
+// up-to-date state. A result (syscall return, old CSR value) travels down to rd as rs1 + 0.
+void decodeSystem(RegisterFile &RF, DataMemory &DM, ProxyKernel &PK)
+{
+    uint32_t rsl1 = IDEX.rsl1;
+    IDEX.rsl1 = IDEX.rsl2 = 0; // Nothing to forward
+    IDEX.imm = 0;
+
+    if (IFID.IR == ECALL && csr.priv != PRIV_M) // An operating system below M mode handles it
+        raiseException(csr.priv == PRIV_S ? CAUSE_ECALL_S : CAUSE_ECALL_U, 0);
+    else if (IFID.IR == ECALL)
+    {
+        IDEX.rs1 = PK.ecall(RF, DM, cycle);
+        IDEX.rdl = 10; // a0
+        if (verbose)
+            cout << "  ID: ECALL a7=" << dec << RF.read(17) << " returned 0x" << hex << IDEX.rs1 << dec << endl;
+
+        if (PK.exited)
+            programRunning = false;
+    }
+    else if (IDEX.func3 != 0 && IDEX.func3 != 4) // CSRRW/CSRRS/CSRRC, and with a 5 bit immediate in the rs1 field
+    {
+        uint32_t number = IFID.IR >> 20, old;
+        uint32_t source = (IDEX.func3 & 4) ? rsl1 : RF.read(rsl1);
+        bool writes = (IDEX.func3 & 3) == 1 || rsl1 != 0; // CSRRS/CSRRC with x0 (or 0) only read
+        if (!csr.read(number, old) || (writes && !CSRFile::writable(number)))
+        {
+            raiseException(CAUSE_ILLEGAL, IFID.IR);
+            return;
+        }
+        if (writes)
+            csr.write(number, (IDEX.func3 & 3) == 1 ? source : (IDEX.func3 & 3) == 2 ? (old | source) : (old & ~source));
+        if (writes && number == 0x180) // satp: no ASIDs, the TLBs are flushed
+            mmu.flush();
+        IDEX.rs1 = old;
+        if (verbose)
+            cout << "  ID: CSR 0x" << hex << number << " read 0x" << old << dec << endl;
+    }
+    else if ((IFID.IR == MRET && csr.priv == PRIV_M) || (IFID.IR == SRET && csr.priv >= PRIV_S))
+    {
+        // Fetch runs after Decode: it continues at xepc (with the restored privilege) in this cycle
+        IDEX.CW.regWrite = false;
+        PC.value = (IFID.IR == MRET) ? csr.mret() : csr.sret();
+        PC.TPC = PC_Reg::NO_TARGET;
+        if (verbose)
+            cout << "  ID: " << (IFID.IR == MRET ? "MRET" : "SRET") << " to 0x" << hex << PC.value << dec << " (privilege "
+                 << csr.priv << ")" << endl;
+    }
+    else if ((IFID.IR & 0xFE007FFF) == SFENCE_VMA && csr.priv >= PRIV_S)
+    {
+        IDEX.CW.regWrite = false;
+        mmu.flush();
+    }
+    else if (IFID.IR == WFI) // Decoded once an interrupt is pending (see HazardDetectionUnit())
+        IDEX.CW.regWrite = false;
+    else if (IFID.IR == EBREAK)
+        raiseException(CAUSE_BREAKPOINT, IFID.DPC);
+    else
+        raiseException(CAUSE_ILLEGAL, IFID.IR);
+}
+
+// Early branch resolution (BRANCH_ID): the comparator and target adder work on the operands read in Decode, with the
+// result of the instruction in MOWB forwarded (HazardDetectionUnit() has stalled for anything younger)
+void resolveBranchInDecode()
+{
+    uint32_t memMask = (MOWB.valid && MOWB.CW.regWrite) ? (1u << MOWB.rdl) & ~1u & forwardMask : 0;
+    uint32_t select1 = 0u - ((memMask >> IDEX.rsl1) & 1), select2 = 0u - ((memMask >> IDEX.rsl2) & 1);
+    IDEX.rs1 = (MOWB.ALUOut & select1) | (IDEX.rs1 & ~select1);
+    IDEX.rs2 = (MOWB.ALUOut & select2) | (IDEX.rs2 & ~select2);
+
+    if (IDEX.CW.branch && !branchTaken(IDEX.func3, IDEX.rs1, IDEX.rs2))
+        return;
+    if (IDEX.opcode == 103) // JALR
+        PC.TPC = (IDEX.rs1 + static_cast<uint32_t>(IDEX.imm)) & ~1u;
+    else // B and JAL
+        PC.TPC = static_cast<uint32_t>(static_cast<int32_t>(IFID.DPC) + IDEX.imm);
+    insertBubble = true;
+    if (verbose)
+        cout << "  ID: Redirecting Fetch to 0x" << hex << PC.TPC << dec << endl;
+}
+
+void InstructionDecode(RegisterFile &RF, DataMemory &DM, ProxyKernel &PK)
+{
+    if (verbose)
+        cout << "\n[ID Stage]" << endl;
+    if (!IDEX.stall) // Otherwise Execute is stalled (D-TLB miss) and IDEX holds a valid instruction
+        HazardDetectionUnit();
+
+    if (IDEX.stall)
+    {
+        IFID.stall = true; // Left stage should also be stalled now
+        if (trace != nullptr && IFID.valid)
+            trace->record(IFID.id, IFID.DPC, TRACE_STALL, STAGE_ID);
+        return;
+    }
+
+    if (IFID.valid == false) // Bubble in IFID => NOP in Decode
+    {
+        // Propagate the bubble
+        IDEX.valid = false;
+
+        // Since bubble moves and is NOT stalled, we should signal left stage to move by removing the latter's stall!
+        IFID.stall = false;
+        return;
+    }
+
+    if (trace != nullptr)
+        trace->record(IFID.id, IFID.DPC, TRACE_STAGE, STAGE_ID);
+
+    // Prepare opcode and functions:
+    prepareOpcodeAndFunctions(IFID.IR, IDEX.opcode, IDEX.rdl, IDEX.func3, IDEX.rsl1, IDEX.rsl2, IDEX.func7);
+
+    // Immediate generation:
+    IDEX.imm = genImm(IFID.IR, IDEX.opcode);
+
+    // Control Word Generation:
+    IDEX.CW = ControlUnit(IDEX.opcode);
+    IDEX.trap = false;
+
+    // Read Register:
+    IDEX.rs1 = 0, IDEX.rs2 = 0;
+    if (IDEX.CW.regRead)
+    {
+        IDEX.rs1 = RF.read(IDEX.rsl1);
+        IDEX.rs2 = RF.read(IDEX.rsl2);
+        if (energy != nullptr)
+            energy->count(IFID.DPC, ENERGY_RF_READ,
+                          (IDEX.rsl1 != 0) + (IDEX.rsl2 != 0 && (!IDEX.CW.ALUSrc || IDEX.CW.memWrite)));
+    }
+
+    if (IDEX.opcode == 55 || IDEX.opcode == 23) // U type: the rs1/rs2 fields are part of the immediate
+    {
+        IDEX.rsl1 = IDEX.rsl2 = 0;
+        IDEX.rs1 = (IDEX.opcode == 23) ? IFID.DPC : 0; // AUIPC adds to its own PC
+    }
+
+    if (IFID.trap)
+        raiseException(IFID.cause, IFID.tval);
+    else if (IDEX.opcode == 115)
+        decodeSystem(RF, DM, PK);
+    else if (IDEX.CW.illegal)
+        raiseException(CAUSE_ILLEGAL, IFID.IR);
+    IDEX.ALUSelect = aluDecode(IDEX.CW.ALUOp, IDEX.func7, IDEX.func3, IDEX.opcode);
+    IDEX.busy = (IDEX.ALUSelect >= ALU_DIV ? divLatency : IDEX.ALUSelect >= ALU_MUL ? mulLatency : 1) - 1;
+    if (branchStage == BRANCH_ID && (IDEX.CW.branch || IDEX.CW.jump))
+        resolveBranchInDecode();
+    IDEX.DPC = IFID.DPC;
+    IDEX.id = IFID.id;
+    IDEX.ilen = IFID.ilen;
+
+    IFID.stall = false;
+    IDEX.valid = true;
+}
+
+// Operand forwarding:
+/*
+    The stages run right to left, so when Execute runs, EXMO still holds the instruction Memory Operation worked on
+    this cycle, one ahead of IDEX. Its result is forwarded here. The instruction two ahead was in MOWB and has been
+    written back already: WriteBack puts its value straight into IDEX (see WriteBack()), so nothing has to be kept
+    of it once Memory Operation overwrites MOWB.
+
+        ADDI x5, x5, 1    <- WriteBack: x5 written to the Register File and to IDEX.rs2
+        ADDI x4, x4, 1    <- Memory Operation
+        SW   x5, 0(x4)    <- Execute: x4 from EXMO.ALUOut, x5 from IDEX.rs2
+
+    The select is branch free: EXMO.rdMask is the one-hot destination (0 for x0 or no write), cleared for a bubble.
+*/
+inline uint32_t forward(uint32_t rsl, uint32_t value, uint32_t exMask)
+{
+    uint32_t select = 0u - ((exMask >> rsl) & 1);
+    return (EXMO.ALUOut & select) | (value & ~select);
+}
+
+void Execute()
+{
+    if (verbose)
+        cout << "\n[EX Stage]" << endl;
+    if (EXMO.stall)
+    {
+        IDEX.stall = true; // Left stage should also be stalled now
+        return;
+    }
+
+    if (IDEX.valid == false) // Bubble in IDEX => NOP in Execute
+    {
+        // Propagate the bubble
+        EXMO.valid = false;
+
+        // Since bubble moves and is NOT stalled, we should signal left stage to move by removing the latter's stall!
+        IDEX.stall = false;
+        return;
+    }
+
+    if (trace != nullptr)
+        trace->record(IDEX.id, IDEX.DPC, TRACE_STAGE, STAGE_EX);
+
+    // Multi-cycle M unit: the instruction stays in Execute (bubbles go on) until its last cycle, where it reads its
+    // operands. Values written back meanwhile reach IDEX through the WriteBack write-through.
+    if (IDEX.busy > 0)
+    {
+        IDEX.busy--;
+        chargeStall(IDEX.DPC, PROF_MULDIV);
+        EXMO.valid = false;
+        IDEX.stall = true;
+        return;
+    }
+
+    // Determine ALU Input (rs2 is also the store data and the second branch operand):
+    uint32_t exMask = EXMO.rdMask & (0u - static_cast<uint32_t>(EXMO.valid)) & forwardMask;
+    uint32_t rs1 = forward(IDEX.rsl1, IDEX.rs1, exMask);
+    uint32_t rs2 = forward(IDEX.rsl2, IDEX.rs2, exMask);
+    uint32_t alusrc1 = rs1;
+    uint32_t alusrc2 = IDEX.CW.ALUSrc ? static_cast<uint32_t>(IDEX.imm) : rs2;
+
+    // ALU Execute (the operation was selected in Decode):
+    uint32_t ALUResult = aluHandlers[IDEX.ALUSelect](alusrc1, alusrc2);
+    if (energy != nullptr)
+        energy->count(IDEX.DPC, aluEnergyClass(IDEX.ALUSelect));
+    if (verbose)
+        cout << "  EX: ALU op=" << dec << IDEX.ALUSelect << " src1=0x" << hex << alusrc1
+             << " (dec: " << dec << alusrc1 << ") src2=0x" << hex << alusrc2
+             << " (dec: " << dec << alusrc2 << ") result=0x" << hex << ALUResult
+             << " (dec: " << dec << ALUResult << ")" << endl;
+
+    // Branch and jump handling:
+    uint32_t BPC = static_cast<uint32_t>(static_cast<int32_t>(IDEX.DPC) + IDEX.imm); // (B and JAL)
+    uint32_t JPC = (ALUResult & (~1u));                                              // Ignoring the odd bit (JALR)
+
+    // If TPC is set to != NO_TARGET, it means that we are taking a branch/jump (unless they were resolved in Decode)
+    bool resolve = branchStage == BRANCH_EX;
+    if (resolve && IDEX.CW.branch && branchTaken(IDEX.func3, rs1, rs2)) // B
+    {
+        PC.TPC = BPC;
+        insertBubble = true;
+    }
+    else if (resolve && IDEX.CW.jump && IDEX.opcode == 111) // JAL
     {
         PC.TPC = BPC;
         insertBubble = true;
     }
-    else if (IDEX.CW.jump && IDEX.opcode == 103) // JALR
+    else if (resolve && IDEX.CW.jump && IDEX.opcode == 103) // JALR
+    {
+        PC.TPC = JPC;
+        insertBubble = true;
+    }
+
+    EXMO.DPC = IDEX.DPC;
+    EXMO.id = IDEX.id;
+    EXMO.CW = IDEX.CW;
+    EXMO.ALUOut = IDEX.CW.jump ? (IDEX.DPC + IDEX.ilen) : ALUResult; // JAL/JALR write the return address
+    EXMO.rdl = IDEX.rdl;
+    EXMO.rdMask = (IDEX.CW.regWrite << IDEX.rdl) & ~1u;
+    EXMO.func3 = IDEX.func3; // For checking the load type in MO stage
+    EXMO.rs2 = rs2;          // For store in MO in next stage
+    EXMO.rsl2 = IDEX.rsl2;
+    EXMO.memReady = 0;
+    EXMO.trap = IDEX.trap;
+    EXMO.cause = IDEX.cause;
+    EXMO.tval = IDEX.tval;
+
+    IDEX.stall = false;
+    EXMO.valid = true;
+}
+
+// Redirects Fetch to the trap handler from Memory Operation. epc is the instruction to return to; everything younger
+// than the trapping point (in IDEX and IFID) is squashed, and the stages left of Memory Operation do not run this cycle.
+void takeTrap(uint32_t cause, uint32_t epc, uint32_t tval)
+{
+    bool supervisor = csr.toSupervisor(cause);
+    if ((supervisor ? csr.stvec : csr.mtvec) == 0)
+    {
+        cerr << RED << "Unhandled trap: " << trapName(cause) << " at pc 0x" << hex << epc << debugInfo.describe(epc)
+             << " (tval 0x" << tval << ")" << dec << ", " << (supervisor ? "stvec" : "mtvec") << " is not set\n"
+             << RESET;
+        unhandledTrap = true;
+        unhandledCause = cause;
+        unhandledPC = epc;
+        programRunning = false;
+    }
+    PC.value = csr.trap(cause, epc, tval);
+    PC.TPC = PC_Reg::NO_TARGET;
+    if (trace != nullptr)
+    {
+        if (IFID.valid)
+            trace->record(IFID.id, IFID.DPC, TRACE_FLUSH, STAGE_IF);
+        if (IDEX.valid)
+            trace->record(IDEX.id, IDEX.DPC, TRACE_FLUSH, STAGE_ID);
+    }
+    IFID.valid = IDEX.valid = EXMO.valid = false;
+    IFID.stall = IDEX.stall = EXMO.stall = false;
+    insertBubble = false;
+    fetchStallCycles = dataStallCycles = 0;
+    trapTaken = true;
+    if (verbose)
+        cout << "  MEM: " << trapName(cause) << " (cause 0x" << hex << cause << "), handler at 0x" << PC.value << dec
+             << (csr.priv == PRIV_S ? " in S mode" : "") << endl;
+}
+
+// Memory Operation waits cycles (counting this one) and then tries the access in EXMO again; the stages behind stall
+void waitInMemory(uint32_t cycles)
+{
+    dataStallCycles = cycles - 1;
+    MOWB.valid = false;
+    EXMO.stall = true;
+    chargeStall(EXMO.DPC, PROF_MEM, cycles);
+    if (verbose)
+        cout << "  MEM: Waiting " << cycles << " cycles for the data cache" << endl;
+}
+
+void MemoryOperation(DataMemory &DM)
+{
+    if (verbose)
+        cout << "\n[MEM Stage]" << endl;
+    if (MOWB.stall)
+    {
+        return;
+    }
+
+    // D-TLB miss: the page walk is in progress, the stages behind wait (Execute sees EXMO.stall)
+    if (dataStallCycles > 0)
+    {
+        dataStallCycles--;
+        MOWB.valid = false;
+        EXMO.stall = true;
+        return;
+    }
+
+
+    if (EXMO.valid == false) // Bubble in PC => NOP in Memory Operation
+    {
+        // Propagate the bubble
+        MOWB.valid = false;
+
+        // Since bubble moves and is NOT stalled, we should signal left stage to move by removing the latter's stall!
+        EXMO.stall = false;
+        return;
+    }
+
+    if (trace != nullptr)
+        trace->record(EXMO.id, EXMO.DPC, TRACE_STAGE, STAGE_MEM);
+
+    // Store data forwarding (FORWARD_EX_MEM): the load right ahead of the store is still in MOWB. The value is kept in
+    // EXMO, so it survives a page walk of the store.
+    if (forwarding == FORWARD_EX_MEM && EXMO.CW.memWrite && MOWB.valid && MOWB.CW.mem2Reg && MOWB.rdl != 0 &&
+        MOWB.rdl == EXMO.rsl2)
+    {
+        EXMO.rs2 = MOWB.LDOut;
+        if (regReady[MOWB.rdl] > cycle) // The load missed: the store waits for the data
+        {
+            waitInMemory(static_cast<uint32_t>(regReady[MOWB.rdl] - cycle));
+            return;
+        }
+    }
+
+    // Below M mode the address is virtual:
+    bool access = EXMO.CW.memRead || EXMO.CW.memWrite;
+    uint32_t addr = EXMO.ALUOut, fault = 0;
+    if (access && !EXMO.trap && csr.translating())
+    {
+        uint32_t stallCycles;
+        fault = mmu.translate(EXMO.ALUOut, EXMO.CW.memWrite ? ACCESS_STORE : ACCESS_LOAD, addr, stallCycles);
+        if (stallCycles > 0)
+        {
+            dataStallCycles = stallCycles - 1;
+            MOWB.valid = false;
+            EXMO.stall = true;
+            chargeStall(EXMO.DPC, PROF_WALK, stallCycles);
+            if (verbose)
+                cout << "  MEM: D-TLB miss at 0x" << hex << EXMO.ALUOut << dec << ", page walk of " << stallCycles << " cycles" << endl;
+            return;
+        }
+    }
+    uint32_t bytes = 1u << (EXMO.func3 & 3);
+    if (fault == 0 && access && !DM.accessible(addr, bytes))
+        fault = EXMO.CW.memRead ? CAUSE_LOAD_FAULT : CAUSE_STORE_FAULT;
+
+    // Exceptions are taken here, in program order: the instruction does not complete
+    if (EXMO.trap || fault != 0)
+    {
+        if (EXMO.trap)
+            takeTrap(EXMO.cause, EXMO.DPC, EXMO.tval);
+        else
+            takeTrap(fault, EXMO.DPC, EXMO.ALUOut);
+        if (trace != nullptr)
+            trace->record(EXMO.id, EXMO.DPC, TRACE_FLUSH, STAGE_MEM);
+        MOWB.valid = false;
+        return;
+    }
+
+    // Data cache timing (see DataCacheModel): a load miss goes on, its register is ready at loadReady
+    uint64_t loadReady = cycle;
+    if (dcache.enabled() && access && EXMO.memReady == 0 && DM.validAddress(addr, bytes))
+    {
+        uint64_t ready = cycle;
+        uint32_t wait = EXMO.CW.memRead ? dcache.load(addr, bytes, EXMO.DPC, cycle, ready) : dcache.store(addr, bytes, cycle, ready);
+        if (wait == 0 && ready > cycle && (EXMO.CW.memRead ? dcache.mshrCount : dcache.bufferSize) == 0) // Blocking
+        {
+            EXMO.memReady = ready;
+            wait = static_cast<uint32_t>(ready - cycle);
+        }
+        if (wait > 0)
+        {
+            waitInMemory(wait);
+            return;
+        }
+        loadReady = ready;
+        if (verbose && ready > cycle)
+            cout << "  MEM: D-cache miss at 0x" << hex << addr << dec << ", x" << EXMO.rdl << " ready in cycle " << ready << endl;
+    }
+    if (EXMO.CW.memRead && EXMO.rdl != 0 && loadReady > cycle)
+    {
+        regReady[EXMO.rdl] = loadReady;
+        loadsReady = max(loadsReady, loadReady);
+    }
+
+    if (energy != nullptr && access)
+        energy->count(EXMO.DPC, EXMO.CW.memRead ? ENERGY_LOAD : ENERGY_STORE);
+
+    // Memory Read (Load) and Write (Store):
+    uint32_t LDResult = 0;
+    if (EXMO.CW.memRead)
+    {
+        if (verbose)
+            cout << "  MEM: Reading from addr 0x" << hex << EXMO.ALUOut << " (dec: " << dec << EXMO.ALUOut << ")" << endl;
+        if (EXMO.func3 == 0) // LB
+            LDResult = DM.readByte(addr, true);
+        else if (EXMO.func3 == 1) // LH
+            LDResult = DM.readHalf(addr, true);
+        else if (EXMO.func3 == 2) // LW
+            LDResult = DM.readWord(addr);
+        else if (EXMO.func3 == 4) // LBU
+            LDResult = DM.readByte(addr, false);
+        else if (EXMO.func3 == 5) // LHU
+            LDResult = DM.readHalf(addr, false);
+        else // No LWU
+            LDResult = DM.readWord(addr);
+    }
+    MOWB.LDOut = LDResult;
+    MOWB.ALUOut = EXMO.ALUOut;
+    if (gdb != nullptr && gdb->watching() && (EXMO.CW.memRead || EXMO.CW.memWrite))
+        gdb->access(EXMO.ALUOut, 1u << (EXMO.func3 & 3), EXMO.CW.memWrite);
+
+    if (EXMO.CW.memWrite)
+    {
+        if (verbose)
+            cout << "  MEM: Writing to addr 0x" << hex << EXMO.ALUOut << " (dec: " << dec << EXMO.ALUOut
+                 << ") value=0x" << hex << EXMO.rs2 << " (dec: " << dec << EXMO.rs2 << ")" << endl;
+        if (EXMO.func3 == 0) // SB
+            DM.writeByte(addr, static_cast<uint8_t>(EXMO.rs2 & 0xFF));
+        else if (EXMO.func3 == 1) // SH
+            DM.writeHalf(addr, static_cast<uint16_t>(EXMO.rs2 & 0xFFFF));
+        else if (EXMO.func3 == 2) // SW
+            DM.writeWord(addr, EXMO.rs2);
+        else // Fallback
+            DM.writeWord(addr, EXMO.rs2);
+    }
+
+    MOWB.CW = EXMO.CW;
+    MOWB.DPC = EXMO.DPC;
+    MOWB.id = EXMO.id;
+    MOWB.rdl = EXMO.rdl;
+    MOWB.rs2 = EXMO.rs2;
+    MOWB.func3 = EXMO.func3;
+
+    EXMO.stall = false;
+    MOWB.valid = true;
+
+    // An enabled pending interrupt is taken once this instruction has completed, returning to the next one:
+    MOWB.interrupt = csr.pendingInterrupt();
+    if (MOWB.interrupt != 0)
+    {
+        MOWB.interruptPC = IDEX.valid ? IDEX.DPC : IFID.valid ? IFID.DPC : PC.value;
+        takeTrap(MOWB.interrupt, MOWB.interruptPC, 0);
+    }
+}
+
+void WriteBack(RegisterFile &RF)
+{
+    if (verbose)
+        cout << "\n[WB Stage]" << endl;
+    if (MOWB.valid == false) // Bubble in PC => NOP in WriteBack
+    {
+        // Since bubble moves and is NOT stalled, we should signal left stage to move by removing the latter's stall!
+        MOWB.stall = false;
+        return;
+    }
+
+    // Write Register:
+    uint32_t writeVal = 0;
+    if (MOWB.CW.regWrite)
+    {
+        if (MOWB.CW.jump) // JAL, JALR (return address computed in Execute)
+            writeVal = MOWB.ALUOut;
+        else if (MOWB.CW.mem2Reg) // Load
+            writeVal = MOWB.LDOut;
+        else // R, I
+            writeVal = MOWB.ALUOut;
+
+        if (verbose)
+            cout << "  WB: Writing value 0x" << hex << writeVal << " (dec: " << dec << writeVal
+                 << ") to register x" << dec << MOWB.rdl << endl;
+        RF.write(MOWB.rdl, writeVal);
+        if (energy != nullptr && MOWB.rdl != 0)
+            energy->count(MOWB.DPC, ENERGY_RF_WRITE);
+
+        // Forwarding to Execute: the instruction in IDEX read the Register File before this write
+        uint32_t written = (1u << MOWB.rdl) & ~1u & forwardMask;
+        uint32_t select1 = 0u - ((written >> IDEX.rsl1) & 1), select2 = 0u - ((written >> IDEX.rsl2) & 1);
+        IDEX.rs1 = (writeVal & select1) | (IDEX.rs1 & ~select1);
+        IDEX.rs2 = (writeVal & select2) | (IDEX.rs2 & ~select2);
+    }
+    retired++;
+    if (trace != nullptr)
+        trace->record(MOWB.id, MOWB.DPC, TRACE_RETIRE, STAGE_WB);
+    if (profiler != nullptr)
+        profiler->retire(MOWB.DPC);
+    if (energy != nullptr)
+        energy->retire(MOWB.DPC);
+
+    if (cosim != nullptr)
+    {
+        cosim->retire({cycle, MOWB.DPC, MOWB.CW.regWrite && MOWB.rdl != 0, MOWB.rdl, writeVal,
+                       MOWB.CW.memWrite != 0, MOWB.ALUOut, MOWB.rs2, MOWB.func3});
+        if (MOWB.interrupt != 0)
+            cosim->retire({cycle, MOWB.interruptPC, false, 0, MOWB.interrupt, false, 0, 0, 0, true});
+    }
+
+    MOWB.stall = false;
+}
+
+// Clears the pipeline registers and counters, so a new program can be run in the same process
+void resetPipeline()
+{
+    programRunning = true;
+    insertBubble = false;
+    cycle = retired = 0;
+    PC = PC_Reg();
+    IFID = IFID_Reg();
+    IDEX = IDEX_Reg();
+    EXMO = EXMO_Reg();
+    MOWB = MOWB_Reg();
+    FB = FetchBuffer();
+    events = EventQueue();
+    mip = 0;
+    csr = CSRFile();
+    trapTaken = unhandledTrap = false;
+    mmu.flush();
+    mmu.walks = mmu.softHits = 0;
+    mmu.itlb.hits = mmu.itlb.misses = mmu.dtlb.hits = mmu.dtlb.misses = 0;
+    fetchStallCycles = dataStallCycles = 0;
+    dcache.reset();
+    icache.reset();
+    lowerMemory.reset();
+    fill(begin(regReady), end(regReady), 0);
+    loadsReady = 0;
+}
+
+// One clock cycle of the pipeline (the stages run right to left, so each reads its latch before it is overwritten)
+void clockPipeline(InstructionMemory &IM, RegisterFile &RF, DataMemory &DM, ProxyKernel &PK)
+{
+    ++cycle;
+    if (cycle >= events.next)
+        events.run(cycle);
+    if (verbose)
+        cout << BLUE << "\n===================== Cycle " << dec << cycle << " =====================" << RESET << endl;
+    WriteBack(RF);
+    MemoryOperation(DM);
+    if (trapTaken) // Fetch starts at the handler in the next cycle
+    {
+        trapTaken = false;
+        return;
+    }
+    Execute();
+    InstructionDecode(RF, DM, PK);
+    InstructionFetch(IM);
+
+    if (insertBubble) // NOP in the next cycle preparation
+    {
+        // The branch/jump redirecting Fetch has just moved to EXMO, or to IDEX when it was resolved in Decode
+        bool inDecode = branchStage == BRANCH_ID;
+        if (trace != nullptr) // The wrong path instructions are squashed
+        {
+            if (IFID.valid)
+                trace->record(IFID.id, IFID.DPC, TRACE_FLUSH, STAGE_IF);
+            if (IDEX.valid && !inDecode)
+                trace->record(IDEX.id, IDEX.DPC, TRACE_FLUSH, STAGE_ID);
+        }
+        if (profiler != nullptr)
+        {
+            uint32_t branchPC = inDecode ? IDEX.DPC : EXMO.DPC;
+            profiler->stall(branchPC, PROF_FLUSH, inDecode ? 1 : 2);
+            if (inDecode ? IDEX.CW.branch : EXMO.CW.branch)
+                profiler->mispredict(branchPC);
+        }
+        if (energy != nullptr)
+            energy->count(inDecode ? IDEX.DPC : EXMO.DPC, ENERGY_FLUSH, IFID.valid + (IDEX.valid && !inDecode));
+        IFID.valid = false; // NOP in Decode in the next cycle
+        if (!inDecode)
+            IDEX.valid = false; // NOP in Execute in the next cycle
+        insertBubble = false;   // Bubble injection is done!
+
+        // Fetch was stalled this cycle (e.g. ECALL waiting in Decode) and could not take the redirect itself:
+        if (PC.TPC != PC_Reg::NO_TARGET)
+        {
+            PC.value = PC.TPC;
+            PC.TPC = PC_Reg::NO_TARGET;
+        }
+    }
+}
+
+// Cycle Skipping:
+/*
+    During a long wait the pipeline is frozen: every stage is stalled or passes a bubble, and from one cycle to the
+    next only a countdown to a known cycle changes. Before each cycle runPipeline() looks for such a wait, in a
+    state one of its cycles has already settled (the stall signals set, the latches behind it empty), and jumps
+    cycle over the frozen cycles at once, doing in bulk what they would have done:
+    - Memory Operation waiting (dataStallCycles: D-TLB walk, D-cache) with MOWB empty: the countdown ends (the
+      wait was charged to the profile when it started),
+    - Execute busy with a multi-cycle MUL/DIV (IDEX.busy) with EXMO and MOWB empty: the countdown ends, a MulDiv
+      stall cycle each,
+    - Decode waiting for a load miss (loadMissWait()), a SYSTEM instruction for every load (loadsReady), or WFI
+      for an interrupt (the next device event), with the stages after it empty: a Memory, Drain or Idle stall
+      cycle each,
+    - Fetch waiting (fetchStallCycles: I-TLB walk, I-cache miss) with the pipeline empty: the countdown ends.
+    A jump never passes the next device event (events.next) or the cycle limit, so the devices and interrupts see
+    every cycle they would have; cycles, stalls and energy come out the same as clocked one by one. With the
+    verbose output, a trace or GDB every cycle is clocked, and --no-skip turns skipping off.
+*/
+bool cycleSkipping = true;                // --no-skip
+uint64_t skippedCycles = 0, skipJumps = 0; // Cycles jumped over, and how many jumps
+
+void skipFrozenCycles(uint64_t maxCycles)
+{
+    if (MOWB.valid || MOWB.stall)
+        return;
+    uint64_t frozen = 0;
+    ProfileEvent stall = PROF_EVENTS; // Charged per frozen cycle, to stallPC
+    uint32_t stallPC = 0;
+    if (dataStallCycles > 0)
+    {
+        if (!EXMO.stall || !IDEX.stall || !IFID.stall)
+            return;
+        frozen = dataStallCycles;
+    }
+    else if (EXMO.valid || EXMO.stall)
+        return;
+    else if (IDEX.valid)
+    {
+        if (IDEX.busy == 0 || !IDEX.stall || !IFID.stall)
+            return;
+        frozen = IDEX.busy;
+        stall = PROF_MULDIV;
+        stallPC = IDEX.DPC;
+    }
+    else if (IFID.valid)
+    {
+        if (!IDEX.stall || !IFID.stall)
+            return;
+        uint64_t until = loadMissWait();
+        stall = PROF_MEM;
+        if (until <= cycle + 1 && (IFID.IR & 0x7F) == 115)
+        {
+            until = loadsReady;
+            stall = PROF_DRAIN;
+        }
+        if (until <= cycle + 1 && IFID.IR == WFI && (mip & csr.mie) == 0) // Only a device event raises mip
+        {
+            until = events.next;
+            stall = PROF_IDLE;
+        }
+        if (until <= cycle + 1)
+            return;
+        frozen = until - cycle - 1;
+        stallPC = IFID.DPC;
+    }
+    else if (fetchStallCycles > 0 && !IDEX.stall && !IFID.stall)
+        frozen = fetchStallCycles;
+
+    frozen = min(frozen, maxCycles > cycle ? maxCycles - cycle : 0);
+    if (events.next <= cycle + frozen)
+        frozen = events.next > cycle + 1 ? events.next - cycle - 1 : 0;
+    if (frozen == 0)
+        return;
+
+    if (dataStallCycles > 0)
+        dataStallCycles -= static_cast<uint32_t>(frozen);
+    else if (IDEX.valid)
+        IDEX.busy -= static_cast<uint32_t>(frozen);
+    else if (!IFID.valid)
+        fetchStallCycles -= static_cast<uint32_t>(frozen);
+    if (stall != PROF_EVENTS)
+        chargeStall(stallPC, stall, frozen);
+    cycle += frozen;
+    skippedCycles += frozen;
+    skipJumps++;
+}
+
+// Clocks the pipeline from PC until the program ends, returns false if it ran out of cycles
+bool runPipeline(InstructionMemory &IM, RegisterFile &RF, DataMemory &DM, ProxyKernel &PK, uint64_t maxCycles)
+{
+    bool skipping = cycleSkipping && !verbose && trace == nullptr && gdb == nullptr;
+    while (programRunning)
+    {
+        if (skipping)
+            skipFrozenCycles(maxCycles);
+        clockPipeline(IM, RF, DM, PK);
+        if (gdb != nullptr)
+            gdb->afterCycle();
+
+        // Failsafe
+        if (cycle > maxCycles)
+            return false;
+    }
+    return true;
+}
+
+// Batch (lane-parallel) Execution:
+/*
+    Runs the same program over many a0 inputs in lock-step, functionally (no pipeline timing).
+    Every lane has its own registers, Data Memory and proxy kernel. Registers are stored as
+    SoA (register r of all lanes is contiguous), so one decoded instruction is executed for all
+    lanes by one SIMD kernel call.
+
+    Divergence: lanes that take different paths are tracked with per-lane PCs. Each step executes
+    the group of lanes at the lowest PC under a lane mask, so paths reconverge where they meet again.
+    Small groups, memory accesses and ECALLs fall back to a scalar per-lane loop.
+*/
+struct DecodedInstr
+{
+    uint32_t IR, opcode, rdl, func3, rsl1, rsl2, func7, ilen, ALUSelect;
+    int32_t imm;
+    ControlWord CW;
+};
+
+DecodedInstr decodeInstruction(const InstructionMemory &IM, uint32_t pc)
+{
+    DecodedInstr d;
+    uint16_t low = IM.readHalf(pc);
+    d.ilen = ((low & 0x3) != 0x3) ? 2 : 4;
+    d.IR = (d.ilen == 2) ? expandCompressed(low) : IM.read(pc);
+    prepareOpcodeAndFunctions(d.IR, d.opcode, d.rdl, d.func3, d.rsl1, d.rsl2, d.func7);
+    d.imm = genImm(d.IR, d.opcode);
+    d.CW = ControlUnit(d.opcode);
+    d.ALUSelect = aluDecode(d.CW.ALUOp, d.func7, d.func3, d.opcode);
+    // Lanes have no CSRs and take no traps: only ECALL is run
+    if ((d.opcode == 115 && d.IR != ECALL) || d.CW.illegal)
     {
-        PC.TPC = JPC;
-        insertBubble = true;
+        cerr << "Decode: Instruction not supported in batch mode: 0x" << hex << d.IR << dec << " at pc 0x" << hex << pc << dec << "\n";
+        exit(1);
     }
+    return d;
+}
 
-    EXMO.DPC = IDEX.DPC;
-    EXMO.CW = IDEX.CW;
-    EXMO.ALUOut = ALUResult;
-    EXMO.rdl = IDEX.rdl;
-    EXMO.func3 = IDEX.func3; // For checking the load type in MO stage
-    EXMO.rs2 = rs2;          // For store in MO in next stage
+// ALU kernels: out[i] = ALU(ALUSelect, A[i], B ? B[i] : imm) for i < n (n is a multiple of 16)
+typedef void (*ALUKernel)(uint32_t ALUSelect, const uint32_t *A, const uint32_t *B, uint32_t imm, uint32_t *out, size_t n);
 
-    IDEX.stall = false;
-    EXMO.valid = true;
+void aluBatchScalar(uint32_t ALUSelect, const uint32_t *A, const uint32_t *B, uint32_t imm, uint32_t *out, size_t n)
+{
+    // Simple loops per operation, which the compiler can auto-vectorize:
+#define SCALAR_LOOP(EXPR)                      \
+    for (size_t i = 0; i < n; i++)             \
+    {                                          \
+        uint32_t a = A[i], b = B ? B[i] : imm; \
+        out[i] = (EXPR);                       \
+    }                                          \
+    break;
+
+    switch (ALUSelect)
+    {
+    case 0:
+        SCALAR_LOOP(a & b)
+    case 1:
+        SCALAR_LOOP(a | b)
+    case 2:
+        SCALAR_LOOP(a + b)
+    case 3:
+        SCALAR_LOOP(a ^ b)
+    case 4:
+        SCALAR_LOOP(a << (b & 0x1F))
+    case 5:
+        SCALAR_LOOP(a >> (b & 0x1F))
+    case 6:
+        SCALAR_LOOP(a - b)
+    case 10:
+        SCALAR_LOOP(a * b)
+    default:
+        SCALAR_LOOP(ALU(ALUSelect, a, b))
+    }
+#undef SCALAR_LOOP
 }
 
-void MemoryOperation(DataMemory &DM)
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) void aluBatchAVX2(uint32_t ALUSelect, const uint32_t *A, const uint32_t *B, uint32_t imm, uint32_t *out, size_t n)
 {
-    cout << "\n[MEM Stage]" << endl;
-    if (MOWB.stall)
+    const __m256i vimm = _mm256_set1_epi32(static_cast<int>(imm));
+    const __m256i shamtMask = _mm256_set1_epi32(0x1F), signBit = _mm256_set1_epi32(INT32_MIN), one = _mm256_set1_epi32(1);
+
+#define AVX2_LOOP(EXPR)                                                                         \
+    for (size_t i = 0; i < n; i += 8)                                                           \
+    {                                                                                           \
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(A + i));               \
+        __m256i b = B ? _mm256_loadu_si256(reinterpret_cast<const __m256i *>(B + i)) : vimm;    \
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), (EXPR));                      \
+    }                                                                                           \
+    break;
+// High 32 bits of the 64 bit products: even lanes from mul(a, b) and odd lanes from mul(a >> 32, b >> 32)
+#define AVX2_MULH(MUL) _mm256_blend_epi32(_mm256_srli_epi64(MUL(a, b), 32), MUL(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32)), 0xAA)
+
+    switch (ALUSelect)
     {
-        return;
+    case 0:
+        AVX2_LOOP(_mm256_and_si256(a, b))
+    case 1:
+        AVX2_LOOP(_mm256_or_si256(a, b))
+    case 2:
+        AVX2_LOOP(_mm256_add_epi32(a, b))
+    case 3:
+        AVX2_LOOP(_mm256_xor_si256(a, b))
+    case 4:
+        AVX2_LOOP(_mm256_sllv_epi32(a, _mm256_and_si256(b, shamtMask)))
+    case 5:
+        AVX2_LOOP(_mm256_srlv_epi32(a, _mm256_and_si256(b, shamtMask)))
+    case 6:
+        AVX2_LOOP(_mm256_sub_epi32(a, b))
+    case 7:
+        AVX2_LOOP(_mm256_srav_epi32(a, _mm256_and_si256(b, shamtMask)))
+    case 8:
+        AVX2_LOOP(_mm256_and_si256(_mm256_cmpgt_epi32(b, a), one))
+    case 9: // Unsigned compare = signed compare with flipped sign bits
+        AVX2_LOOP(_mm256_and_si256(_mm256_cmpgt_epi32(_mm256_xor_si256(b, signBit), _mm256_xor_si256(a, signBit)), one))
+    case 10:
+        AVX2_LOOP(_mm256_mullo_epi32(a, b))
+    case 11:
+        AVX2_LOOP(AVX2_MULH(_mm256_mul_epi32))
+    case 13:
+        AVX2_LOOP(AVX2_MULH(_mm256_mul_epu32))
+    default: // MULHSU, DIV, REM: no SIMD equivalent
+        aluBatchScalar(ALUSelect, A, B, imm, out, n);
     }
+#undef AVX2_MULH
+#undef AVX2_LOOP
+}
 
-    // Store current values before overwriting them:
-    MOWB.LDOutOld = MOWB.LDOut;
-    MOWB.ALUOutOld = MOWB.ALUOut;
-    MOWB.rdlOld = MOWB.rdl;
-    MOWB.CWOld = MOWB.CW;
-    MOWB.validOld = MOWB.valid;
+__attribute__((target("avx512f"))) void aluBatchAVX512(uint32_t ALUSelect, const uint32_t *A, const uint32_t *B, uint32_t imm, uint32_t *out, size_t n)
+{
+    const __m512i vimm = _mm512_set1_epi32(static_cast<int>(imm));
+    const __m512i shamtMask = _mm512_set1_epi32(0x1F), one = _mm512_set1_epi32(1);
+    // Shifts and 64 bit multiplies use the zero-masked forms with every lane set: the plain ones take an undefined
+    // vector as their merge source, which GCC reports as maybe-uninitialized
+    const __mmask16 all32 = 0xFFFF;
+    const __mmask8 all64 = 0xFF;
+
+#define AVX512_LOOP(EXPR)                                                      \
+    for (size_t i = 0; i < n; i += 16)                                         \
+    {                                                                          \
+        __m512i a = _mm512_loadu_si512(A + i);                                 \
+        __m512i b = B ? _mm512_loadu_si512(B + i) : vimm;                      \
+        _mm512_storeu_si512(out + i, (EXPR));                                  \
+    }                                                                          \
+    break;
+#define AVX512_SRLI64(x) _mm512_maskz_srli_epi64(all64, (x), 32)
+#define AVX512_MULH(MUL) _mm512_mask_blend_epi32(0xAAAA, AVX512_SRLI64(MUL(all64, a, b)), MUL(all64, AVX512_SRLI64(a), AVX512_SRLI64(b)))
 
-    if (EXMO.valid == false) // Bubble in PC => NOP in Memory Operation
+    switch (ALUSelect)
     {
-        // Propagate the bubble
-        MOWB.valid = false;
+    case 0:
+        AVX512_LOOP(_mm512_and_si512(a, b))
+    case 1:
+        AVX512_LOOP(_mm512_or_si512(a, b))
+    case 2:
+        AVX512_LOOP(_mm512_add_epi32(a, b))
+    case 3:
+        AVX512_LOOP(_mm512_xor_si512(a, b))
+    case 4:
+        AVX512_LOOP(_mm512_maskz_sllv_epi32(all32, a, _mm512_and_si512(b, shamtMask)))
+    case 5:
+        AVX512_LOOP(_mm512_maskz_srlv_epi32(all32, a, _mm512_and_si512(b, shamtMask)))
+    case 6:
+        AVX512_LOOP(_mm512_sub_epi32(a, b))
+    case 7:
+        AVX512_LOOP(_mm512_maskz_srav_epi32(all32, a, _mm512_and_si512(b, shamtMask)))
+    case 8:
+        AVX512_LOOP(_mm512_maskz_mov_epi32(_mm512_cmplt_epi32_mask(a, b), one))
+    case 9:
+        AVX512_LOOP(_mm512_maskz_mov_epi32(_mm512_cmplt_epu32_mask(a, b), one))
+    case 10:
+        AVX512_LOOP(_mm512_mullo_epi32(a, b))
+    case 11:
+        AVX512_LOOP(AVX512_MULH(_mm512_maskz_mul_epi32))
+    case 13:
+        AVX512_LOOP(AVX512_MULH(_mm512_maskz_mul_epu32))
+    default: // MULHSU, DIV, REM: no SIMD equivalent
+        aluBatchScalar(ALUSelect, A, B, imm, out, n);
+    }
+#undef AVX512_MULH
+#undef AVX512_SRLI64
+#undef AVX512_LOOP
+}
+#endif
 
-        // Since bubble moves and is NOT stalled, we should signal left stage to move by removing the latter's stall!
-        EXMO.stall = false;
-        return;
+// Picks the widest kernel the host supports ("auto"), or the requested one:
+ALUKernel selectALUKernel(string &isa)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if ((isa == "auto" || isa == "avx512") && __builtin_cpu_supports("avx512f"))
+    {
+        isa = "avx512";
+        return aluBatchAVX512;
+    }
+    if ((isa == "auto" || isa == "avx2") && __builtin_cpu_supports("avx2"))
+    {
+        isa = "avx2";
+        return aluBatchAVX2;
     }
+#endif
+    if (isa != "auto" && isa != "scalar")
+        cerr << "Batch: " << isa << " is not supported on this host, using scalar kernels\n";
+    isa = "scalar";
+    return aluBatchScalar;
+}
 
-    // Memory Read (Load) and Write (Store):
-    uint32_t LDResult = 0;
-    if (EXMO.CW.memRead)
+class BatchCore
+{
+private:
+    const InstructionMemory &IM;
+    ALUKernel aluKernel;
+    size_t lanes, stride;  // stride: lanes rounded up to a multiple of the widest vector (16)
+    vector<uint32_t> regs; // SoA: register r of lane i is regs[r * stride + i]
+    vector<uint32_t> pc;
+    vector<uint8_t> active, mask;
+    vector<uint32_t> scratch;
+    vector<unique_ptr<DataMemory>> DMs;
+    vector<unique_ptr<ProxyKernel>> PKs;
+    unordered_map<uint32_t, DecodedInstr> decoded; // Decode once per PC
+    bool converged;                                // All running lanes share one PC
+    size_t running;
+
+    static const size_t scalarThreshold = 4; // Groups with fewer lanes run the scalar path
+
+    uint32_t *reg(uint32_t r)
     {
-        cout << "  MEM: Reading from addr 0x" << hex << EXMO.ALUOut << " (dec: " << dec << EXMO.ALUOut << ")" << endl;
-        if (EXMO.func3 == 0) // LB
-            LDResult = DM.readByte(EXMO.ALUOut, true);
-        else if (EXMO.func3 == 1) // LH
-            LDResult = DM.readHalf(EXMO.ALUOut, true);
-        else if (EXMO.func3 == 2) // LW
-            LDResult = DM.readWord(EXMO.ALUOut);
-        else if (EXMO.func3 == 4) // LBU
-            LDResult = DM.readByte(EXMO.ALUOut, false);
-        else if (EXMO.func3 == 5) // LHU
-            LDResult = DM.readHalf(EXMO.ALUOut, false);
-        else // No LWU
-            LDResult = DM.readWord(EXMO.ALUOut);
+        return regs.data() + r * stride;
     }
-    MOWB.LDOut = LDResult;
-    MOWB.ALUOut = EXMO.ALUOut;
 
-    if (EXMO.CW.memWrite)
+    const DecodedInstr &decode(uint32_t addr)
     {
-        cout << "  MEM: Writing to addr 0x" << hex << EXMO.ALUOut << " (dec: " << dec << EXMO.ALUOut
-             << ") value=0x" << hex << EXMO.rs2 << " (dec: " << dec << EXMO.rs2 << ")" << endl;
-        if (EXMO.func3 == 0) // SB
-            DM.writeByte(EXMO.ALUOut, static_cast<uint8_t>(EXMO.rs2 & 0xFF));
-        else if (EXMO.func3 == 1) // SH
-            DM.writeHalf(EXMO.ALUOut, static_cast<uint16_t>(EXMO.rs2 & 0xFFFF));
-        else if (EXMO.func3 == 2) // SW
-            DM.writeWord(EXMO.ALUOut, EXMO.rs2);
-        else // Fallback
-            DM.writeWord(EXMO.ALUOut, EXMO.rs2);
+        auto it = decoded.find(addr);
+        if (it == decoded.end())
+            it = decoded.emplace(addr, decodeInstruction(IM, addr)).first;
+        return it->second;
     }
 
-    MOWB.CW = EXMO.CW;
-    MOWB.DPC = EXMO.DPC;
-    MOWB.rdl = EXMO.rdl;
+    // One instruction for one lane (used for small groups, memory and system instructions):
+    void stepLane(size_t i, const DecodedInstr &d, uint32_t groupPC)
+    {
+        uint32_t a = reg(d.rsl1)[i], b = reg(d.rsl2)[i];
+        uint32_t nextPC = groupPC + d.ilen, result = 0;
+        bool write = d.CW.regWrite;
+        DataMemory &DM = *DMs[i];
 
-    EXMO.stall = false;
-    MOWB.valid = true;
+        switch (d.opcode)
+        {
+        case 51:
+            result = ALU(d.ALUSelect, a, b);
+            break;
+        case 19:
+            result = ALU(d.ALUSelect, a, static_cast<uint32_t>(d.imm));
+            break;
+        case 55:
+            result = static_cast<uint32_t>(d.imm);
+            break;
+        case 23:
+            result = groupPC + d.imm;
+            break;
+        case 3:
+        {
+            uint32_t addr = a + d.imm;
+            if (d.func3 == 0)
+                result = DM.readByte(addr, true);
+            else if (d.func3 == 1)
+                result = DM.readHalf(addr, true);
+            else if (d.func3 == 4)
+                result = DM.readByte(addr, false);
+            else if (d.func3 == 5)
+                result = DM.readHalf(addr, false);
+            else
+                result = DM.readWord(addr);
+            break;
+        }
+        case 35:
+        {
+            uint32_t addr = a + d.imm;
+            if (d.func3 == 0)
+                DM.writeByte(addr, b & 0xFF);
+            else if (d.func3 == 1)
+                DM.writeHalf(addr, b & 0xFFFF);
+            else
+                DM.writeWord(addr, b);
+            break;
+        }
+        case 99:
+            if (branchTaken(d.func3, a, b))
+                nextPC = groupPC + d.imm;
+            break;
+        case 111:
+            result = nextPC;
+            nextPC = groupPC + d.imm;
+            break;
+        case 103:
+            result = nextPC;
+            nextPC = (a + d.imm) & ~1u;
+            break;
+        case 115:
+        {
+            RegisterFile RF(0);
+            for (uint32_t r = 10; r <= 17; r++)
+                RF.write(r, reg(r)[i]);
+            result = PKs[i]->ecall(RF, DM, 0);
+            write = true;
+            if (PKs[i]->exited)
+            {
+                active[i] = 0;
+                running--;
+                write = false;
+            }
+            break;
+        }
+        }
+
+        if (write && d.rdl != 0)
+            reg(d.rdl)[i] = result;
+        pc[i] = nextPC;
+    }
+
+public:
+    uint64_t steps, laneInstructions, divergences;
+
+    BatchCore(const InstructionMemory &im, const vector<Segment> &segments, const vector<uint32_t> &inputs,
+              uint32_t entry, uint32_t memSize, const string &sandboxDir, ALUKernel kernel)
+        : IM(im), aluKernel(kernel), lanes(inputs.size())
+    {
+        stride = (lanes + 15) & ~size_t(15);
+        regs.assign(32 * stride, 0);
+        pc.assign(stride, entry);
+        active.assign(stride, 0);
+        mask.assign(stride, 0);
+        scratch.assign(stride, 0);
+
+        uint32_t heapStart = 0;
+        for (auto &seg : segments)
+            if (!seg.executable)
+                heapStart = max(heapStart, (seg.vaddr + seg.memSize + 7) & ~7u);
+        for (size_t i = 0; i < lanes; i++)
+        {
+            active[i] = 1;
+            reg(2)[i] = memSize;   // sp
+            reg(10)[i] = inputs[i]; // a0
+            DMs.emplace_back(new DataMemory(memSize, 0));
+            for (auto &seg : segments)
+                if (!seg.executable)
+                    DMs[i]->loadSegment(seg);
+            PKs.emplace_back(new ProxyKernel(sandboxDir, heapStart));
+        }
+        running = lanes;
+        converged = true;
+        steps = laneInstructions = divergences = 0;
+    }
+
+    void run(uint64_t maxSteps)
+    {
+        while (running > 0 && steps < maxSteps)
+        {
+            // Group of lanes to execute: all running lanes when converged, otherwise the lanes at the lowest PC
+            uint32_t groupPC = UINT32_MAX;
+            size_t count = 0;
+            const uint8_t *m = active.data();
+            for (size_t i = 0; i < lanes; i++)
+                if (active[i])
+                {
+                    groupPC = min(groupPC, pc[i]);
+                    if (converged)
+                        break;
+                }
+            if (!converged)
+            {
+                bool same = true;
+                for (size_t i = 0; i < lanes; i++)
+                {
+                    mask[i] = active[i] && pc[i] == groupPC;
+                    count += mask[i];
+                    same = same && (!active[i] || pc[i] == groupPC);
+                }
+                converged = same;
+                m = converged ? active.data() : mask.data();
+            }
+            if (converged)
+                count = running;
+
+            if (groupPC >= IM.endAddress()) // Ran off the end of the program (like the pipeline does)
+            {
+                for (size_t i = 0; i < lanes; i++)
+                    if (m[i])
+                        active[i] = 0, running--;
+                continue;
+            }
+
+            const DecodedInstr &d = decode(groupPC);
+            steps++;
+            laneInstructions += count;
+
+            bool vectorizable = (d.opcode == 51 || d.opcode == 19 || d.opcode == 55 || d.opcode == 23);
+            if (vectorizable && count >= scalarThreshold)
+            {
+                // One kernel call for every lane, then merge the group's results into rd:
+                if (d.rdl != 0)
+                {
+                    uint32_t *rd = reg(d.rdl);
+                    bool full = (count == lanes);
+                    uint32_t *out = full ? rd : scratch.data();
+                    if (d.opcode == 51)
+                        aluKernel(d.ALUSelect, reg(d.rsl1), reg(d.rsl2), 0, out, stride);
+                    else if (d.opcode == 19)
+                        aluKernel(d.ALUSelect, reg(d.rsl1), nullptr, static_cast<uint32_t>(d.imm), out, stride);
+                    else // LUI, AUIPC: the same value for the whole group
+                        fill(out, out + stride, (d.opcode == 23 ? groupPC : 0) + static_cast<uint32_t>(d.imm));
+                    if (!full)
+                        for (size_t i = 0; i < stride; i++)
+                            rd[i] = m[i] ? scratch[i] : rd[i];
+                }
+                for (size_t i = 0; i < lanes; i++)
+                    if (m[i])
+                        pc[i] = groupPC + d.ilen;
+                continue;
+            }
+
+            // Scalar path:
+            for (size_t i = 0; i < lanes; i++)
+                if (m[i])
+                    stepLane(i, d, groupPC);
+
+            // Control flow (and exits) may split the group:
+            if (converged && (d.CW.branch || d.CW.jump || d.opcode == 115))
+            {
+                uint32_t first = UINT32_MAX;
+                for (size_t i = 0; i < lanes && converged; i++)
+                    if (active[i])
+                    {
+                        if (first == UINT32_MAX)
+                            first = pc[i];
+                        else if (pc[i] != first)
+                            converged = false;
+                    }
+                if (!converged)
+                    divergences++;
+            }
+        }
+    }
+
+    // One line per lane: input, exit code (or "-" if it did not exit) and final a0:
+    void report(ostream &out, const vector<uint32_t> &inputs)
+    {
+        out << "lane,a0_in,exit_code,a0_out\n";
+        for (size_t i = 0; i < lanes; i++)
+        {
+            out << i << "," << static_cast<int32_t>(inputs[i]) << ",";
+            if (PKs[i]->exited)
+                out << PKs[i]->exitCode;
+            else
+                out << "-";
+            out << "," << static_cast<int32_t>(reg(10)[i]) << "\n";
+        }
+    }
+};
+
+#ifndef RISCV_PIPELINE_NO_MAIN // Defined when the simulator is built as a library (benchmarks)
+// Microarchitecture parameters:
+/*
+    Each one has its own command line option (--<name> <value>) and can be an axis of the design-space
+    exploration (--sweep <name>=<v1>,<v2>,...). set() returns false for a value it does not accept.
+*/
+struct SimParam
+{
+    const char *name;
+    const char *format; // What set() accepts, for the error message
+    bool (*set)(const string &value);
+};
+
+// Decimal number of at least min (the whole text)
+bool parseNumber(const string &text, uint32_t &value, uint32_t min)
+{
+    if (text.empty() || !isdigit(static_cast<unsigned char>(text[0])))
+        return false;
+    char *end = nullptr;
+    errno = 0;
+    unsigned long v = strtoul(text.c_str(), &end, 10);
+    if (*end != '\0' || errno == ERANGE || v < min || v > UINT32_MAX)
+        return false;
+    value = static_cast<uint32_t>(v);
+    return true;
 }
 
-void WriteBack(RegisterFile &RF)
+// <entries>[:<ways>] (ways default to min(entries, 4))
+bool setTLB(TLBModel &tlb, const string &spec)
 {
-    cout << "\n[WB Stage]" << endl;
-    if (MOWB.valid == false) // Bubble in PC => NOP in WriteBack
+    size_t colon = spec.find(':');
+    uint32_t entries = 0, ways = 0;
+    if (!parseNumber(spec.substr(0, colon), entries, 1))
+        return false;
+    if (colon == string::npos)
+        ways = min(entries, 4u);
+    else if (!parseNumber(spec.substr(colon + 1), ways, 1))
+        return false;
+    if (entries % ways != 0)
+        return false;
+    tlb = TLBModel(entries, ways);
+    return true;
+}
+
+// <bytes>[:<ways>[:<line bytes>]] (2 ways, 32 byte lines by default), or off
+bool setCache(CacheModel &cache, const string &spec)
+{
+    if (spec == "off")
     {
-        // Since bubble moves and is NOT stalled, we should signal left stage to move by removing the latter's stall!
-        MOWB.stall = false;
-        return;
+        cache = CacheModel();
+        return true;
+    }
+    size_t colon1 = spec.find(':'), colon2 = colon1 == string::npos ? colon1 : spec.find(':', colon1 + 1);
+    uint32_t bytes = 0, ways = 2, line = 32;
+    if (!parseNumber(spec.substr(0, colon1), bytes, 1))
+        return false;
+    if (colon1 != string::npos && !parseNumber(spec.substr(colon1 + 1, colon2 - colon1 - 1), ways, 1))
+        return false;
+    if (colon2 != string::npos && !parseNumber(spec.substr(colon2 + 1), line, 4))
+        return false;
+    if ((line & (line - 1)) != 0 || bytes % (static_cast<uint64_t>(ways) * line) != 0)
+        return false;
+    cache = CacheModel(bytes, ways, line);
+    return true;
+}
+
+// Comma separated list of the energy events
+string energyEventList()
+{
+    string list;
+    for (auto name : energyEventNames)
+        list += (list.empty() ? "" : ", ") + string(name);
+    return list;
+}
+
+// <event>=<pJ>[,<event>=<pJ>...], the event leakage sets the energy per cycle
+bool setEnergyCoefficients(const string &list)
+{
+    stringstream ss(list);
+    string item;
+    bool any = false;
+    while (getline(ss, item, ','))
+    {
+        size_t equals = item.find('=');
+        if (equals == string::npos || equals + 1 == item.size())
+            return false;
+        string name = item.substr(0, equals);
+        char *end = nullptr;
+        double value = strtod(item.c_str() + equals + 1, &end);
+        if (*end != '\0' || !(value >= 0) || value > 1e9)
+            return false;
+        double *coeff = (name == "leakage") ? &leakagePerCycle : nullptr;
+        for (int i = 0; i < ENERGY_EVENTS; i++)
+            if (name == energyEventNames[i])
+                coeff = &energyCoeff[i];
+        if (coeff == nullptr)
+            return false;
+        *coeff = value;
+        any = true;
     }
+    return any;
+}
 
-    // Write Register:
-    if (MOWB.CW.regWrite)
+const SimParam simParams[] = {
+    {"itlb", "<entries>[:<ways>], entries a multiple of ways", [](const string &v)
+     { return setTLB(mmu.itlb, v); }},
+    {"dtlb", "<entries>[:<ways>], entries a multiple of ways", [](const string &v)
+     { return setTLB(mmu.dtlb, v); }},
+    {"walk-cycles", "a number of cycles", [](const string &v)
+     { return parseNumber(v, mmu.walkCycles, 0); }},
+    {"mul-latency", "a number of cycles (at least 1)", [](const string &v)
+     { return parseNumber(v, mulLatency, 1); }},
+    {"div-latency", "a number of cycles (at least 1)", [](const string &v)
+     { return parseNumber(v, divLatency, 1); }},
+    {"dcache", "<bytes>[:<ways>[:<line bytes>]] or off", [](const string &v)
+     { return setCache(dcache.cache, v); }},
+    {"miss-cycles", "a number of cycles (at least 1)", [](const string &v)
+     { return parseNumber(v, lowerMemory.missCycles, 1); }},
+    {"mshrs", "a number of MSHRs", [](const string &v)
+     { return parseNumber(v, dcache.mshrCount, 0); }},
+    {"store-buffer", "a number of entries", [](const string &v)
+     { return parseNumber(v, dcache.bufferSize, 0); }},
+    {"prefetch", "none, next-line, stride or stream", [](const string &v)
+     {
+         static const char *kinds[] = {"none", "next-line", "stride", "stream"};
+         for (int k = 0; k < 4; k++)
+             if (v == kinds[k])
+             {
+                 dcache.prefetcher = static_cast<PrefetchKind>(k);
+                 return true;
+             }
+         return false;
+     }},
+    {"prefetch-degree", "a number of lines (at least 1)", [](const string &v)
+     { return parseNumber(v, dcache.degree, 1); }},
+    {"prefetch-distance", "a number of lines (at least 1)", [](const string &v)
+     { return parseNumber(v, dcache.distance, 1); }},
+    {"stream-buffers", "a number of stream buffers (at least 1)", [](const string &v)
+     { return parseNumber(v, dcache.streamCount, 1); }},
+    {"icache", "<bytes>[:<ways>[:<line bytes>]] or off", [](const string &v)
+     { return setCache(icache.cache, v); }},
+    {"l2", "<bytes>[:<ways>[:<line bytes>]] or off", [](const string &v)
+     { return setCache(lowerMemory.l2, v); }},
+    {"l2-cycles", "a number of cycles (at least 1)", [](const string &v)
+     { return parseNumber(v, lowerMemory.l2Cycles, 1); }},
+    {"dram", "a number of banks, 0 for --miss-cycles", [](const string &v)
+     { return parseNumber(v, lowerMemory.dram.banks, 0); }},
+    {"dram-row", "a number of bytes (at least 32)", [](const string &v)
+     { return parseNumber(v, lowerMemory.dram.rowBytes, 32); }},
+    {"dram-timing", "<tRCD>:<tCAS>:<tRP> in cycles", [](const string &v)
+     {
+         size_t colon1 = v.find(':'), colon2 = colon1 == string::npos ? colon1 : v.find(':', colon1 + 1);
+         DRAMModel &dram = lowerMemory.dram;
+         return colon2 != string::npos && parseNumber(v.substr(0, colon1), dram.tRCD, 0) &&
+                parseNumber(v.substr(colon1 + 1, colon2 - colon1 - 1), dram.tCAS, 1) &&
+                parseNumber(v.substr(colon2 + 1), dram.tRP, 0);
+     }},
+    {"dram-bandwidth", "a number of bytes per cycle (at least 1)", [](const string &v)
+     { return parseNumber(v, lowerMemory.dram.bytesPerCycle, 1); }},
+    {"forwarding", "none, ex or ex-mem", [](const string &v)
+     {
+         if (v != "none" && v != "ex" && v != "ex-mem")
+             return false;
+         forwarding = (v == "none") ? FORWARD_NONE : (v == "ex") ? FORWARD_EX : FORWARD_EX_MEM;
+         forwardMask = (forwarding == FORWARD_NONE) ? 0 : ~0u;
+         return true;
+     }},
+    {"branch-stage", "ex or id", [](const string &v)
+     {
+         if (v != "ex" && v != "id")
+             return false;
+         branchStage = (v == "ex") ? BRANCH_EX : BRANCH_ID;
+         return true;
+     }},
+};
+
+const SimParam *findParam(const string &name)
+{
+    for (auto &param : simParams)
+        if (name == param.name)
+            return &param;
+    return nullptr;
+}
+
+// Everything the parameters set: --sweep checks its values with set() and then puts the previous state back
+struct SimParamState
+{
+    MMU mmu;
+    uint32_t mulLatency, divLatency;
+    DataCacheModel dcache;
+    InstructionCacheModel icache;
+    LowerMemoryModel lowerMemory;
+    ForwardingMode forwarding;
+    uint32_t forwardMask;
+    BranchStage branchStage;
+
+    static SimParamState now()
     {
-        uint32_t writeVal = 0;
-        if (MOWB.CW.jump) // JAL, JALR
-            writeVal = MOWB.DPC + 4;
-        else if (MOWB.CW.mem2Reg) // Load
-            writeVal = MOWB.LDOut;
-        else // R, I
-            writeVal = MOWB.ALUOut;
+        return {::mmu, ::mulLatency, ::divLatency, ::dcache, ::icache, ::lowerMemory, ::forwarding, ::forwardMask, ::branchStage};
+    }
+
+    void restore() const
+    {
+        ::mmu = mmu;
+        ::mulLatency = mulLatency;
+        ::divLatency = divLatency;
+        ::dcache = dcache;
+        ::icache = icache;
+        ::lowerMemory = lowerMemory;
+        ::forwarding = forwarding;
+        ::forwardMask = forwardMask;
+        ::branchStage = branchStage;
+    }
+};
+
+// Design-Space Exploration:
+/*
+    --sweep <name>=<v1>,<v2>,... (repeatable) runs the program once for every point of the cross product of the
+    swept values and writes one CSV row per point (--dse-out): the values, how the run ended, cycles, CPI and the
+    stall, trap and TLB counters.
+    The program is loaded once, and with --fast-forward <n> clocked n cycles with the command line parameters,
+    then with Fetch held until the pipeline has drained. That state is the checkpoint: every point is a fork() of the process there, so it shares the loaded image
+    (copy on write), sets its values and runs to the end. The counters only cover the cycles after the checkpoint.
+    -j workers run at a time (default: one per core). The rows are written in grid order, the last axis fastest.
+*/
+struct SweepAxis
+{
+    const SimParam *param;
+    vector<string> values;
+};
+
+// Counters compared before and after a point's run
+struct RunCounters
+{
+    uint64_t cycles, instructions, traps, interrupts, itlbMisses, dtlbMisses, walks, dcacheMisses, prefetches, useful;
+    uint64_t icacheMisses, l2Misses, dramAccesses, rowHits;
+
+    static RunCounters now()
+    {
+        return {cycle, retired, csr.traps, csr.interrupts, mmu.itlb.misses, mmu.dtlb.misses, mmu.walks,
+                dcache.loadMisses + dcache.storeMisses, dcache.prefetches, dcache.usefulPrefetches, icache.misses,
+                lowerMemory.l2Misses, lowerMemory.dram.reads + lowerMemory.dram.writes, lowerMemory.dram.rowHits};
+    }
+};
+
+// Runs one point of the sweep (in the forked worker) and returns its CSV row
+string runDSEPoint(InstructionMemory &IM, RegisterFile &RF, DataMemory &DM, ProxyKernel &PK, uint64_t maxCycles,
+                   const vector<SweepAxis> &axes, size_t point)
+{
+    ostringstream row;
+    vector<size_t> index(axes.size());
+    for (size_t a = axes.size(); a-- > 0;)
+    {
+        index[a] = point % axes[a].values.size();
+        point /= axes[a].values.size();
+    }
+    for (size_t a = 0; a < axes.size(); a++)
+    {
+        axes[a].param->set(axes[a].values[index[a]]);
+        row << axes[a].values[index[a]] << ",";
+    }
+
+    Profiler profile(IM);
+    profiler = &profile;
+    EnergyModel power(IM);
+    energy = &power;
+    RunCounters before = RunCounters::now();
+    bool finished = runPipeline(IM, RF, DM, PK, maxCycles);
+    if (cosim != nullptr)
+        cosim->check();
+    RunCounters after = RunCounters::now();
+    ProfileEntry total = profile.total();
+
+    uint64_t cycles = after.cycles - before.cycles, instructions = after.instructions - before.instructions;
+    const char *status = (cosim != nullptr && cosim->diverged) ? "mismatch"
+                         : !finished                           ? "timeout"
+                         : unhandledTrap                       ? "trap"
+                         : PK.exited                           ? "exit"
+                                                               : "end";
+    row << status << "," << (PK.exited ? to_string(PK.exitCode) : "") << "," << cycles << "," << instructions << ",";
+    if (instructions > 0)
+        row << fixed << setprecision(4) << static_cast<double>(cycles) / instructions;
+    for (uint64_t s : total.stalls)
+        row << "," << s;
+    row << "," << total.mispredicts << "," << after.traps - before.traps << "," << after.interrupts - before.interrupts
+        << "," << after.itlbMisses - before.itlbMisses << "," << after.dtlbMisses - before.dtlbMisses << ","
+        << after.walks - before.walks << "," << after.dcacheMisses - before.dcacheMisses << ","
+        << after.prefetches - before.prefetches << "," << after.useful - before.useful << ","
+        << after.icacheMisses - before.icacheMisses << "," << after.l2Misses - before.l2Misses << ","
+        << after.dramAccesses - before.dramAccesses << "," << after.rowHits - before.rowHits << "," << fixed
+        << setprecision(3) << power.totalEnergy(cycles) / 1000 << "\n";
+    return row.str();
+}
+
+// Clocks to the checkpoint, then runs every point in a forked worker. Returns the exit status of the simulator.
+int runDSE(InstructionMemory &IM, RegisterFile &RF, DataMemory &DM, ProxyKernel &PK, uint64_t maxCycles,
+           const vector<SweepAxis> &axes, unsigned jobs, uint64_t fastForward, const string &fileName)
+{
+    ofstream out(fileName);
+    if (!out)
+    {
+        cerr << RED << "Error: Cannot open the DSE output file: " << fileName << "\n"
+             << RESET;
+        return 1;
+    }
+
+    while (programRunning && cycle < fastForward)
+        clockPipeline(IM, RF, DM, PK);
+
+    // The checkpoint is precise, so a point can change the pipeline structure (forwarding, branch stage):
+    fetchHeld = true;
+    while (programRunning && cycle <= maxCycles && (IFID.valid || IDEX.valid || EXMO.valid || MOWB.valid))
+        clockPipeline(IM, RF, DM, PK);
+    fetchHeld = false;
+    if (!programRunning)
+    {
+        cerr << RED << "Error: The program ended during the fast-forward (cycle " << cycle << ").\n"
+             << RESET;
+        return 1;
+    }
+
+    size_t points = 1;
+    for (auto &axis : axes)
+        points *= axis.values.size();
+    cout << CYAN << "DSE: " << points << " configurations on " << jobs << " workers, checkpoint at cycle " << cycle << "\n"
+         << RESET;
+    cout.flush(); // Nothing buffered may be written again by the workers
+    cerr.flush();
+    fflush(stdout);
+
+    vector<string> rows(points);
+    map<pid_t, pair<size_t, int>> running; // Worker -> point and the read end of its pipe
+    size_t next = 0, failed = 0;
+    auto start = chrono::steady_clock::now();
+    while (next < points || !running.empty())
+    {
+        if (next < points && running.size() < jobs)
+        {
+            int fds[2];
+            if (pipe(fds) != 0)
+            {
+                cerr << RED << "Error: pipe() failed: " << strerror(errno) << "\n"
+                     << RESET;
+                return 1;
+            }
+            pid_t pid = fork();
+            if (pid == 0) // Worker: quiet (program and device output included), one row to the pipe
+            {
+                close(fds[0]);
+                int devNull = open("/dev/null", O_WRONLY);
+                dup2(devNull, STDOUT_FILENO);
+                dup2(devNull, STDERR_FILENO);
+                string row = runDSEPoint(IM, RF, DM, PK, maxCycles, axes, next);
+                for (size_t done = 0; done < row.size();)
+                {
+                    ssize_t n = write(fds[1], row.data() + done, row.size() - done);
+                    if (n <= 0)
+                        break;
+                    done += static_cast<size_t>(n);
+                }
+                _exit(0);
+            }
+            close(fds[1]);
+            if (pid < 0)
+            {
+                close(fds[0]);
+                cerr << RED << "Error: fork() failed: " << strerror(errno) << "\n"
+                     << RESET;
+                return 1;
+            }
+            running[pid] = {next++, fds[0]};
+            continue;
+        }
 
-        cout << "  WB: Writing value 0x" << hex << writeVal << " (dec: " << dec << writeVal
-             << ") to register x" << dec << MOWB.rdl << endl;
-        RF.write(MOWB.rdl, writeVal);
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, 0);
+        auto it = running.find(pid);
+        if (it == running.end())
+            continue;
+        auto [point, fd] = it->second;
+        char buffer[4096];
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+            rows[point].append(buffer, static_cast<size_t>(n));
+        close(fd);
+        running.erase(it);
+        if (rows[point].empty()) // The worker died before its row: keep the point's values
+        {
+            failed++;
+            size_t rest = point;
+            vector<string> values(axes.size());
+            for (size_t a = axes.size(); a-- > 0;)
+            {
+                values[a] = axes[a].values[rest % axes[a].values.size()];
+                rest /= axes[a].values.size();
+            }
+            for (auto &value : values)
+                rows[point] += value + ",";
+            rows[point] += "crashed\n";
+        }
     }
-
-    MOWB.stall = false;
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    for (auto &axis : axes)
+        out << axis.param->name << ",";
+    out << "status,exit_code,cycles,instructions,cpi,load_use,drain,fetch,flush,walk,muldiv,raw,memory,idle,mispredicts,traps,"
+           "interrupts,itlb_misses,dtlb_misses,page_walks,dcache_misses,prefetches,"
+           "useful_prefetches,icache_misses,l2_misses,dram_accesses,dram_row_hits,energy_nj\n";
+    for (auto &row : rows)
+        out << row;
+    cout << GREEN << "DSE: " << points << " configurations in " << fixed << setprecision(2) << seconds << " s, results in "
+         << fileName << "\n"
+         << RESET;
+    if (failed > 0)
+        cerr << RED << "Error: " << failed << " configurations crashed\n"
+             << RESET;
+    return failed > 0 ? 1 : 0;
 }
 
 void printUsage()
 {
     cout << RED << "Usage:\n"
          << RESET;
-    cout << BLUE << "  RISC-V_Pipeline [-i <inputfile>] [-o <outputfile>]\n\n";
+    cout << BLUE << "  RISC-V_Pipeline [-i <inputfile>] [-o <outputfile>] [-s <sandboxdir>] [-c <maxcycles>] [-m <bytes>]\n";
+    cout << "                  [-b <inputsfile>] [--isa <name>] [-q] [--cosim] [--no-skip]\n";
+    cout << "                  [--trace <tracefile>] [--trace-window <start>:<end>]\n";
+    cout << "                  [--profile <reportfile>] [-g <debugfile>] [--gdb <port>]\n";
+    cout << "                  [--energy <reportfile>] [--energy-coeff <event>=<pJ>,...]\n";
+    cout << "                  [--uart-in <file>] [--uart-out <file>] [--uart-cycles <n>]\n";
+    cout << "                  [--itlb <entries>[:<ways>]] [--dtlb <entries>[:<ways>]] [--walk-cycles <n>]\n";
+    cout << "                  [--mul-latency <n>] [--div-latency <n>] [--forwarding <mode>] [--branch-stage <stage>]\n";
+    cout << "                  [--dcache <bytes>[:<ways>[:<line>]]] [--miss-cycles <n>] [--mshrs <n>] [--store-buffer <n>]\n";
+    cout << "                  [--prefetch <kind>] [--prefetch-degree <n>] [--prefetch-distance <n>] [--stream-buffers <n>]\n";
+    cout << "                  [--icache <bytes>[:<ways>[:<line>]]] [--l2 <bytes>[:<ways>[:<line>]]] [--l2-cycles <n>]\n";
+    cout << "                  [--dram <banks>] [--dram-row <bytes>] [--dram-timing <tRCD>:<tCAS>:<tRP>] [--dram-bandwidth <n>]\n";
+    cout << "                  [--sweep <param>=<v1>,<v2>,...] [--dse-out <file>] [-j <jobs>] [--fast-forward <n>]\n\n";
     cout << "Options:\n";
-    cout << "  -i <inputfile>   :  Input machine code file (default: machineCode.txt)\n";
+    cout << "  -i <inputfile>   :  Input machine code or ELF32 file (default: machineCode.txt)\n";
     cout << "  -o <outputfile>  :  Output Final Register File (default: terminal)\n";
+    cout << "  -s <sandboxdir>  :  Directory the program may open files in (default: .)\n";
+    cout << "  -c <maxcycles>   :  Stop the simulation after this many cycles (default: 1000)\n";
+    cout << "  -m <bytes>       :  Data Memory size, also the initial sp (default: 4096)\n";
+    cout << "  -b <inputsfile>  :  Batch mode: run once per a0 value in the file (one per line), lanes in lock-step\n";
+    cout << "  --isa <name>     :  Batch mode SIMD kernels: auto, avx512, avx2 or scalar (default: auto)\n";
+    cout << "  -q               :  Quiet: no per-cycle stage trace, only the summary\n";
+    cout << "  --cosim          :  Check every retired instruction against a reference model, stop at the first mismatch\n";
+    cout << "  --no-skip        :  Clock every cycle, also those in which the whole pipeline waits (see Cycle Skipping)\n";
+    cout << "  --trace <file>   :  Write a binary pipeline trace (convert it with RISC-V_Trace)\n";
+    cout << "  --trace-window <start>:<end> : Only trace these cycles\n";
+    cout << "  --profile <file> :  Write the per-PC cycle profile (retired, stalls, flushes, mispredicts) sorted by cost\n";
+    cout << "  -g <debugfile>   :  Debug file of the assembler (-g): symbols and source lines in the profile and co-simulation\n";
+    cout << "  --line-map <file>:  Same as -g, also reads the line map (-l) of earlier assemblers\n";
+    cout << "  --energy <file>  :  Write the energy report (per event, per instruction and per region of code)\n";
+    cout << "  --energy-coeff <event>=<pJ>,... : Energy per event (repeatable), events: fetch, rf-read, rf-write, logic, add,\n";
+    cout << "                      shift, mul, div, load, store, bubble, flush, and leakage (per cycle)\n";
+    cout << "  --gdb <port>     :  Wait for GDB on this local TCP port (target remote :<port>) and run under it\n";
+    cout << "  --uart-in <file> :  Characters the UART receives, - for the terminal (default: none)\n";
+    cout << "  --uart-out <file>:  File the UART sends to (default: terminal)\n";
+    cout << "  --uart-cycles <n>:  Cycles the UART takes per character (default: 0, no wait)\n";
+    cout << "  --itlb <entries>[:<ways>] : I-TLB size and associativity (default: 32:4)\n";
+    cout << "  --dtlb <entries>[:<ways>] : D-TLB size and associativity (default: 32:4)\n";
+    cout << "  --walk-cycles <n>:  Stall cycles per page table level read on a TLB miss (default: 4)\n";
+    cout << "  --mul-latency <n>:  Execute cycles of MUL, MULH, MULHSU and MULHU (default: 1)\n";
+    cout << "  --div-latency <n>:  Execute cycles of DIV, DIVU, REM and REMU (default: 1)\n";
+    cout << "  --forwarding <mode> : none (full interlock), ex, or ex-mem (plus load to store data) (default: ex)\n";
+    cout << "  --branch-stage <stage> : Stage branches and jumps resolve in, ex or id (default: ex)\n";
+    cout << "  --dcache <bytes>[:<ways>[:<line>]] : L1 D-cache timing model (default: off, 2 ways and 32 byte lines when on)\n";
+    cout << "  --miss-cycles <n>:  Cycles a miss takes in the memory below the caches without --dram (default: 20)\n";
+    cout << "  --mshrs <n>      :  Load misses in flight, 0 for a blocking cache (default: 4)\n";
+    cout << "  --store-buffer <n>: Store buffer entries, 0 for none (default: 4)\n";
+    cout << "  --prefetch <kind>:  D-cache prefetcher: none, next-line, stride or stream (default: none)\n";
+    cout << "  --prefetch-degree <n>   : Lines fetched per prefetch, the depth of a stream buffer (default: 1)\n";
+    cout << "  --prefetch-distance <n> : How far ahead prefetches start, in lines or strides (default: 1)\n";
+    cout << "  --stream-buffers <n>    : Stream buffers of the stream prefetcher (default: 4)\n";
+    cout << "  --icache <bytes>[:<ways>[:<line>]] : L1 I-cache timing model (default: off)\n";
+    cout << "  --l2 <bytes>[:<ways>[:<line>]] : Unified L2 below the L1 caches (default: off)\n";
+    cout << "  --l2-cycles <n>  :  Cycles of an L2 hit (default: 12)\n";
+    cout << "  --dram <banks>   :  DRAM timing model below the caches, 0 for a fixed --miss-cycles (default: 0)\n";
+    cout << "  --dram-row <bytes>  : DRAM row (page) size per bank (default: 2048)\n";
+    cout << "  --dram-timing <tRCD>:<tCAS>:<tRP> : DRAM activate, column and precharge cycles (default: 14:14:14)\n";
+    cout << "  --dram-bandwidth <n> : DRAM bus bytes per cycle (default: 8)\n";
+    cout << "  --sweep <param>=<v1>,<v2>,... : Design-space exploration over a parameter (repeatable, the cross product is run)\n";
+    cout << "                      Parameters: itlb, dtlb, walk-cycles, mul-latency, div-latency, forwarding, branch-stage,\n";
+    cout << "                      dcache, miss-cycles, mshrs, store-buffer, prefetch, prefetch-degree, prefetch-distance,\n";
+    cout << "                      stream-buffers, icache, l2, l2-cycles, dram, dram-row, dram-timing, dram-bandwidth\n";
+    cout << "  --dse-out <file> :  CSV table of the sweep (default: dse.csv)\n";
+    cout << "  -j <jobs>        :  Sweep configurations run in parallel (default: one per core)\n";
+    cout << "  --fast-forward <n>: Clock n cycles once before the sweep, every configuration starts there\n";
     cout << "  -h --help        :  Show this help message\n"
          << RESET;
 }
@@ -1170,7 +6383,22 @@ void printUsage()
 int main(int argc, char *argv[])
 {
     printf(BOLD RED "  RISC-V_Assembler (by anuragmishra-creates)\n" RESET);
-    string inputFileName = "machineCode.txt", outputFileName = "";
+    string inputFileName = "machineCode.txt", outputFileName = "", sandboxDir = ".";
+    uint64_t maxCycles = 1000;
+    uint32_t memSize = 4096;
+    string batchFileName = "", isa = "auto";
+    bool cosimEnabled = false;
+    string traceFileName = "";
+    uint64_t traceStart = 0, traceEnd = UINT64_MAX;
+    string profileFileName = "", debugFileName = "", energyFileName = "";
+    uint16_t gdbPort = 0;
+    string uartIn = "", uartOut = "";
+    uint64_t uartCycles = 0;
+    vector<SweepAxis> sweeps;
+    string dseFileName = "dse.csv";
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned jobs = cores > 0 ? static_cast<unsigned>(cores) : 1;
+    uint64_t fastForward = 0;
 
     for (int i = 1; i < argc; i++)
     {
@@ -1197,6 +6425,250 @@ int main(int argc, char *argv[])
                 return 1;
             }
         }
+        else if (arg == "-s")
+        {
+            if (i + 1 < argc)
+                sandboxDir = argv[++i];
+            else
+            {
+                cerr << RED << "Error: -s requires a directory.\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "-c")
+        {
+            if (i + 1 < argc)
+                maxCycles = stoull(argv[++i]);
+            else
+            {
+                cerr << RED << "Error: -c requires a number of cycles.\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "-m")
+        {
+            if (i + 1 < argc)
+                memSize = stoul(argv[++i]);
+            else
+            {
+                cerr << RED << "Error: -m requires a number of bytes.\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "-b")
+        {
+            if (i + 1 < argc)
+                batchFileName = argv[++i];
+            else
+            {
+                cerr << RED << "Error: -b requires a filename.\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "--isa")
+        {
+            if (i + 1 < argc)
+                isa = argv[++i];
+            else
+            {
+                cerr << RED << "Error: --isa requires auto, avx512, avx2 or scalar.\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "-q")
+            verbose = false;
+        else if (arg == "--cosim")
+            cosimEnabled = true;
+        else if (arg == "--no-skip")
+            cycleSkipping = false;
+        else if (arg == "--trace")
+        {
+            if (i + 1 < argc)
+                traceFileName = argv[++i];
+            else
+            {
+                cerr << RED << "Error: --trace requires a filename.\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "--trace-window")
+        {
+            string window = (i + 1 < argc) ? argv[++i] : "";
+            size_t colon = window.find(':');
+            if (colon == string::npos)
+            {
+                cerr << RED << "Error: --trace-window requires <start>:<end> cycles.\n"
+                     << RESET;
+                return 1;
+            }
+            traceStart = stoull(window.substr(0, colon));
+            traceEnd = stoull(window.substr(colon + 1));
+        }
+        else if (arg == "--profile")
+        {
+            if (i + 1 < argc)
+                profileFileName = argv[++i];
+            else
+            {
+                cerr << RED << "Error: --profile requires a filename.\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "--energy")
+        {
+            if (i + 1 < argc)
+                energyFileName = argv[++i];
+            else
+            {
+                cerr << RED << "Error: --energy requires a filename.\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "--energy-coeff")
+        {
+            string list = (i + 1 < argc) ? argv[++i] : "";
+            if (!setEnergyCoefficients(list))
+            {
+                cerr << RED << "Error: --energy-coeff requires <event>=<pJ>,... with the events " << energyEventList()
+                     << " or leakage.\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "-g" || arg == "--line-map") // --line-map: the line map, now part of the debug file
+        {
+            if (i + 1 < argc)
+                debugFileName = argv[++i];
+            else
+            {
+                cerr << RED << "Error: " << arg << " requires a filename.\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "--gdb")
+        {
+            if (i + 1 < argc)
+                gdbPort = static_cast<uint16_t>(stoul(argv[++i]));
+            else
+            {
+                cerr << RED << "Error: --gdb requires a port.\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "--uart-in" || arg == "--uart-out")
+        {
+            if (i + 1 < argc)
+                (arg == "--uart-in" ? uartIn : uartOut) = argv[++i];
+            else
+            {
+                cerr << RED << "Error: " << arg << " requires a filename.\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "--uart-cycles")
+        {
+            if (i + 1 < argc)
+                uartCycles = stoull(argv[++i]);
+            else
+            {
+                cerr << RED << "Error: --uart-cycles requires a number of cycles.\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg.compare(0, 2, "--") == 0 && findParam(arg.substr(2)) != nullptr)
+        {
+            const SimParam *param = findParam(arg.substr(2));
+            if (i + 1 >= argc || !param->set(argv[++i]))
+            {
+                cerr << RED << "Error: " << arg << " requires " << param->format << ".\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "--sweep")
+        {
+            string spec = (i + 1 < argc) ? argv[++i] : "";
+            size_t equals = spec.find('=');
+            const SimParam *param = equals == string::npos ? nullptr : findParam(spec.substr(0, equals));
+            if (param == nullptr)
+            {
+                cerr << RED << "Error: --sweep requires <param>=<v1>,<v2>,... with one of the parameters:";
+                for (auto &p : simParams)
+                    cerr << " " << p.name;
+                cerr << "\n"
+                     << RESET;
+                return 1;
+            }
+            SweepAxis axis{param, {}};
+            stringstream values(spec.substr(equals + 1));
+            string value;
+            SimParamState commandLine = SimParamState::now(); // The checkpoint runs with the command line values
+            while (getline(values, value, ','))
+            {
+                bool valid = param->set(value); // Checked here, set again by each configuration
+                commandLine.restore();
+                if (!valid)
+                {
+                    cerr << RED << "Error: --sweep " << param->name << " value '" << value << "' is not " << param->format << ".\n"
+                         << RESET;
+                    return 1;
+                }
+                axis.values.push_back(value);
+            }
+            if (axis.values.empty())
+            {
+                cerr << RED << "Error: --sweep " << param->name << " has no values.\n"
+                     << RESET;
+                return 1;
+            }
+            sweeps.push_back(axis);
+        }
+        else if (arg == "--dse-out")
+        {
+            if (i + 1 < argc)
+                dseFileName = argv[++i];
+            else
+            {
+                cerr << RED << "Error: --dse-out requires a filename.\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "-j")
+        {
+            uint32_t n = 0;
+            if (i + 1 < argc && parseNumber(argv[++i], n, 1))
+                jobs = n;
+            else
+            {
+                cerr << RED << "Error: -j requires a number of jobs (at least 1).\n"
+                     << RESET;
+                return 1;
+            }
+        }
+        else if (arg == "--fast-forward")
+        {
+            if (i + 1 < argc)
+                fastForward = stoull(argv[++i]);
+            else
+            {
+                cerr << RED << "Error: --fast-forward requires a number of cycles.\n"
+                     << RESET;
+                return 1;
+            }
+        }
         else if (arg == "-h" || arg == "--help")
         {
             printUsage();
@@ -1211,6 +6683,18 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (!sweeps.empty())
+    {
+        if (gdbPort != 0 || !traceFileName.empty() || !profileFileName.empty() || !uartIn.empty() || !uartOut.empty() ||
+            !batchFileName.empty())
+        {
+            cerr << RED << "Error: --sweep cannot be combined with -b, --gdb, --trace, --profile, --uart-in or --uart-out.\n"
+                 << RESET;
+            return 1;
+        }
+        verbose = false;
+    }
+
     cout << MAGENTA << "   >>> Pipeline Started <<<\n"
          << RESET;
     cout << CYAN << "Input File : " << GREEN << inputFileName << "\n"
@@ -1218,47 +6702,309 @@ int main(int argc, char *argv[])
     cout << CYAN << "Output File: " << GREEN << outputFileName << "\n"
          << RESET;
 
-    // Load Instruction memory:
-    InstructionMemory IM(inputFileName);
-    cout << "Loaded " << IM.size() << " number of instructions.\n";
-    RegisterFile RF(4096);
-    DataMemory DM(4096, 0);
+    // Load the program: ELF32 (text and data segments) or text file of binary instructions
+    vector<Segment> segments;
+    uint32_t entry = 0;
+    bool elf = isELFFile(inputFileName);
+    if (elf && !loadELF(inputFileName, segments, entry))
+        return 1;
 
-    // Setting input parameter (a0/x10) as 4 (temporary):
-    RF.write(10, 2);
+    const Segment *text = nullptr;
+    for (auto &seg : segments)
+        if (seg.executable)
+        {
+            if (text != nullptr)
+            {
+                cerr << RED << "Error: Only one executable segment is supported.\n"
+                     << RESET;
+                return 1;
+            }
+            text = &seg;
+        }
+    if (elf && text == nullptr)
+    {
+        cerr << RED << "Error: The ELF file has no executable segment.\n"
+             << RESET;
+        return 1;
+    }
 
-    uint32_t instrCount = IM.size();
-    uint32_t cycle = 0;
+    InstructionMemory IM = elf ? InstructionMemory(*text) : InstructionMemory(inputFileName);
+    cout << "Loaded " << IM.size() << " bytes of code.\n";
+    if (!debugFileName.empty() && !debugInfo.load(debugFileName))
+    {
+        cerr << RED << "Error: Cannot read the debug file: " << debugFileName << "\n"
+             << RESET;
+        return 1;
+    }
 
-    while (programRunning)
+    if (!batchFileName.empty())
     {
-        cout << BLUE << "\n===================== Cycle " << dec << ++cycle << " =====================" << RESET << endl;
-        WriteBack(RF);
-        MemoryOperation(DM);
-        Execute();
-        InstructionDecode(RF);
-        InstructionFetch(IM);
+        ifstream batchFile(batchFileName);
+        if (!batchFile)
+        {
+            cerr << RED << "Error: Cannot open the batch inputs file: " << batchFileName << "\n"
+                 << RESET;
+            return 1;
+        }
+        vector<uint32_t> inputs;
+        string line;
+        while (getline(batchFile, line))
+        {
+            line = line.substr(0, line.find('#'));
+            if (line.find_first_not_of(" \t\r") == string::npos)
+                continue;
+            inputs.push_back(static_cast<uint32_t>(stoll(line, nullptr, 0)));
+        }
+
+        ALUKernel kernel = selectALUKernel(isa);
+        BatchCore batch(IM, segments, inputs, entry, memSize, sandboxDir, kernel);
+        auto start = chrono::steady_clock::now();
+        batch.run(maxCycles);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-        if (insertBubble) // NOP in the next cycle preparation
+        if (outputFileName.empty())
+            batch.report(cout, inputs);
+        else
         {
-            IFID.valid = false;   // NOP in Decode in the next cycle
-            IDEX.valid = false;   // NOP in Execute in the next cycle
-            insertBubble = false; // Bubble injection is done!
+            ofstream out(outputFileName);
+            batch.report(out, inputs);
         }
+        cout << GREEN << "Batch: " << inputs.size() << " lanes, " << batch.steps << " steps, " << batch.laneInstructions
+             << " lane-instructions, " << batch.divergences << " divergences, SIMD kernels: " << isa << "\n";
+        if (batch.steps > 0 && !inputs.empty())
+            cout << "Lane utilization: " << fixed << setprecision(1) << 100.0 * batch.laneInstructions / (batch.steps * inputs.size())
+                 << "%, " << setprecision(2) << batch.laneInstructions / seconds / 1e6 << " M lane-instructions/s\n"
+                 << RESET;
+        return 0;
+    }
 
-        // Failsafe
-        if (cycle > 1000)
+    RegisterFile RF(memSize);
+    DataMemory DM(memSize, 0);
+
+    // Data segments are preloaded, the heap (brk) starts right after them:
+    uint32_t heapStart = 0;
+    for (auto &seg : segments)
+    {
+        if (seg.executable)
+            continue;
+        if (!DM.loadSegment(seg))
         {
-            cerr << RED << "Simulation timed out with " << cycle << " cycles\n"
+            cerr << RED << "Error: Data segment at 0x" << hex << seg.vaddr << " (" << dec << seg.memSize
+                 << " bytes) does not fit in Data Memory, use a larger -m.\n"
                  << RESET;
-            break;
+            return 1;
         }
+        cout << "Loaded " << seg.memSize << " bytes of data at 0x" << hex << seg.vaddr << dec << ".\n";
+        heapStart = max(heapStart, (seg.vaddr + seg.memSize + 7) & ~7u);
+    }
+    PC.value = entry;
+
+    // Program input and output go through ECALL (read/write/openat...) instead of preset registers:
+    ProxyKernel PK(sandboxDir, heapStart);
+
+    // Devices above the RAM, driven by the event queue:
+    if (memSize > IO_BASE)
+    {
+        cerr << RED << "Error: Data Memory overlaps the devices at 0x" << hex << IO_BASE << dec << ", use a smaller -m.\n"
+             << RESET;
+        return 1;
+    }
+    ifstream uartInFile;
+    ofstream uartOutFile;
+    if (!uartIn.empty() && uartIn != "-")
+        uartInFile.open(uartIn, ios::binary);
+    if (!uartOut.empty())
+        uartOutFile.open(uartOut, ios::binary);
+    if ((!uartIn.empty() && uartIn != "-" && !uartInFile) || (!uartOut.empty() && !uartOutFile))
+    {
+        cerr << RED << "Error: Cannot open the UART file: " << (uartOutFile || uartOut.empty() ? uartIn : uartOut) << "\n"
+             << RESET;
+        return 1;
+    }
+    istream *uartInput = uartIn.empty() ? nullptr : (uartIn == "-") ? &cin : static_cast<istream *>(&uartInFile);
+    Timer timer;
+    Uart uart(uartOut.empty() ? cout : uartOutFile, uartInput, uartCycles);
+    DM.mapDevice(TIMER_BASE, TIMER_SIZE, &timer);
+    DM.mapDevice(UART_BASE, UART_SIZE, &uart);
+    csr.timer = &timer;
+    mmu.attach(DM);
+
+    unique_ptr<CoSimChecker> checker;
+    if (cosimEnabled)
+    {
+        checker.reset(new CoSimChecker(IM, DM, PK, memSize, entry));
+        cosim = checker.get();
+    }
+
+    if (!sweeps.empty())
+        return runDSE(IM, RF, DM, PK, maxCycles, sweeps, jobs, fastForward, dseFileName);
+
+    unique_ptr<TraceWriter> traceWriter;
+    if (!traceFileName.empty())
+    {
+        traceWriter.reset(new TraceWriter(traceFileName, traceStart, traceEnd));
+        trace = traceWriter.get();
+    }
+
+    unique_ptr<Profiler> profile;
+    if (!profileFileName.empty())
+    {
+        profile.reset(new Profiler(IM));
+        profiler = profile.get();
+    }
+
+    unique_ptr<EnergyModel> energyModel;
+    if (!energyFileName.empty())
+    {
+        energyModel.reset(new EnergyModel(IM));
+        energy = energyModel.get();
+    }
+
+    unique_ptr<GdbStub> gdbStub;
+    if (gdbPort != 0)
+    {
+        gdbStub.reset(new GdbStub(gdbPort, IM, RF, DM, PK));
+        gdb = gdbStub.get();
+        gdb->start();
     }
 
+    bool finished = runPipeline(IM, RF, DM, PK, maxCycles);
+    if (!finished)
+        cerr << RED << "Simulation timed out with " << cycle << " cycles\n"
+             << RESET;
+    if (gdb != nullptr)
+        gdb->finish(finished, PK.exited ? PK.exitCode : 0);
+
     cout << MAGENTA << "\n   >>> Pipeline Ended <<<\n"
          << RESET;
-    cout << GREEN << "Execution finished with " << cycle << " cycles\n"
+    cout << GREEN << "Execution finished with " << cycle << " cycles, " << retired << " instructions retired";
+    if (retired > 0)
+        cout << " (CPI " << fixed << setprecision(2) << static_cast<double>(cycle) / retired << ")";
+    cout << "\n"
          << RESET;
+    cout << CYAN << "Fetch: " << FB.instructions << " instructions (" << FB.compressed << " compressed), "
+         << FB.wordsRead << " words read from Instruction Memory, " << FB.stallCycles << " fetch buffer stall cycles\n"
+         << RESET;
+    if (uart.sent || uart.received || events.dispatched)
+        cout << CYAN << "Devices: " << events.dispatched << " events, " << timer.interrupts << " timer interrupts, UART "
+             << uart.sent << " bytes sent, " << uart.received << " received\n"
+             << RESET;
+    if (skippedCycles > 0)
+        cout << CYAN << "Cycle skipping: " << skippedCycles << " of the " << cycle << " cycles jumped over in " << skipJumps
+             << " jumps\n"
+             << RESET;
     RF.dump(outputFileName);
-    return 0;
-}
\ No newline at end of file
+    if (trace != nullptr)
+        cout << CYAN << "Trace: " << trace->records << " events written to " << traceFileName << "\n"
+             << RESET;
+    if (profiler != nullptr)
+    {
+        ofstream profileFile(profileFileName);
+        if (!profileFile)
+        {
+            cerr << RED << "Error: Cannot open the profile file: " << profileFileName << "\n"
+                 << RESET;
+            return 1;
+        }
+        profiler->report(profileFile, debugInfo, cycle);
+        cout << CYAN << "Profile: written to " << profileFileName << "\n"
+             << RESET;
+    }
+    if (energy != nullptr)
+    {
+        ofstream energyFile(energyFileName);
+        if (!energyFile)
+        {
+            cerr << RED << "Error: Cannot open the energy report file: " << energyFileName << "\n"
+                 << RESET;
+            return 1;
+        }
+        energy->report(energyFile, debugInfo, cycle);
+        double total = energy->totalEnergy(cycle);
+        cout << CYAN << "Energy: " << fixed << setprecision(3) << total / 1000 << " nJ";
+        if (retired > 0)
+            cout << ", " << setprecision(2) << total / retired << " pJ/instruction";
+        cout << ", report written to " << energyFileName << "\n"
+             << RESET;
+    }
+
+    if (csr.traps || csr.interrupts)
+        cout << CYAN << "Traps: " << csr.traps << " exceptions, " << csr.interrupts << " interrupts taken\n"
+             << RESET;
+    if (mmu.walks > 0)
+        cout << CYAN << "TLB: I-TLB " << mmu.itlb.hits << " hits " << mmu.itlb.misses << " misses, D-TLB " << mmu.dtlb.hits
+             << " hits " << mmu.dtlb.misses << " misses, " << mmu.walks << " page walks\n"
+             << RESET;
+
+    if (dcache.enabled())
+    {
+        cout << CYAN << "D-cache: " << dcache.loads << " loads (" << dcache.loadHits << " hits, " << dcache.loadMisses
+             << " misses, " << dcache.merged << " merged into an MSHR, " << dcache.forwarded << " from the store buffer), "
+             << dcache.stores << " stores (" << dcache.storeHits << " hits, " << dcache.storeMisses << " misses)\n";
+        cout << "D-cache waits: " << dcache.mshrFullCycles << " cycles MSHRs full, " << dcache.bufferFullCycles
+             << " store buffer full, " << dcache.overlapCycles << " partial store overlap";
+        if (dcache.outstandingCycles > 0)
+            cout << ", memory-level parallelism " << fixed << setprecision(2)
+                 << static_cast<double>(dcache.missCycleSum) / dcache.outstandingCycles;
+        cout << "\n";
+        if (dcache.prefetcher != PREFETCH_NONE)
+        {
+            static const char *kinds[] = {"none", "next-line", "stride", "stream"};
+            uint64_t useful = dcache.usefulPrefetches, misses = dcache.loadMisses + dcache.storeMisses;
+            cout << "Prefetch (" << kinds[dcache.prefetcher] << "): " << dcache.prefetches << " issued, " << useful
+                 << " useful (" << useful - dcache.latePrefetches << " in time, " << dcache.latePrefetches << " late)";
+            if (dcache.prefetches > 0)
+                cout << ", accuracy " << fixed << setprecision(1) << 100.0 * useful / dcache.prefetches << "%";
+            if (useful + misses > 0)
+                cout << ", coverage " << fixed << setprecision(1) << 100.0 * useful / (useful + misses) << "%";
+            if (useful > 0)
+                cout << ", timeliness " << fixed << setprecision(1) << 100.0 * (useful - dcache.latePrefetches) / useful << "%";
+            cout << "\n";
+        }
+        cout << RESET;
+    }
+    if (icache.enabled())
+    {
+        cout << CYAN << "I-cache: " << icache.accesses << " line lookups, " << icache.misses << " misses";
+        if (icache.accesses > 0)
+            cout << " (" << fixed << setprecision(1) << 100.0 * icache.misses / icache.accesses << "%)";
+        cout << "\n"
+             << RESET;
+    }
+    if (lowerMemory.l2.enabled())
+        cout << CYAN << "L2: " << lowerMemory.l2Hits << " hits, " << lowerMemory.l2Misses << " misses, "
+             << lowerMemory.writeBacks << " write backs from the L1s, " << lowerMemory.l2WriteBacks << " to memory\n"
+             << RESET;
+    if (lowerMemory.dram.enabled())
+    {
+        DRAMModel &dram = lowerMemory.dram;
+        uint64_t accesses = dram.reads + dram.writes;
+        cout << CYAN << "DRAM: " << dram.reads << " reads, " << dram.writes << " writes, row buffer " << dram.rowHits
+             << " hits, " << dram.rowEmpty << " empty, " << dram.rowConflicts << " conflicts";
+        if (accesses > 0)
+            cout << " (hit rate " << fixed << setprecision(1) << 100.0 * dram.rowHits / accesses << "%)";
+        cout << "\nDRAM bus: " << dram.busCycles << " cycles busy";
+        if (cycle > 0)
+            cout << " (" << fixed << setprecision(1) << 100.0 * dram.busCycles / cycle << "% of the bandwidth)";
+        cout << ", bursts waited " << dram.busWaitCycles << " cycles for it\n"
+             << RESET;
+    }
+
+    if (cosim != nullptr)
+    {
+        cosim->check(); // Retirements still in the last batch
+        if (cosim->diverged)
+            return 255;
+        cout << GREEN << "Co-simulation: " << cosim->checked << " instructions matched the reference model\n"
+             << RESET;
+    }
+
+    if (PK.exited)
+    {
+        cout << GREEN << "Program exited with code " << PK.exitCode << "\n"
+             << RESET;
+        return PK.exitCode;
+    }
+    return unhandledTrap ? 1 : 0;
+}
+#endif
@@ -0,0 +1,506 @@
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <vector>
+#include <fstream>
+#include <unordered_map>
+#include <map>
+#include <sstream>
+#include <algorithm>
+using namespace std;
+
+#define RESET "\033[0m"
+#define RED "\033[91m"
+#define GREEN "\033[92m"
+#define YELLOW "\033[93m"
+#define BLUE "\033[94m"
+#define MAGENTA "\033[95m"
+#define CYAN "\033[96m"
+#define WHITE "\033[97m"
+#define BOLD "\033[1m"
+
+/*
+    Converts the binary pipeline trace of RISC-V_Pipeline (--trace) to:
+        konata : Kanata log (version 0004), opened by the Konata pipeline viewer
+        chrome : Chrome trace_event JSON (chrome://tracing, Perfetto), one row per stage, 1 us = 1 cycle
+
+    Trace file: the magic "RVTRACE1", then 16 byte little endian records:
+        uint32 cycle, uint32 id (fetch order), uint32 value, uint8 kind, uint8 stage, uint16 reserved
+    value is the instruction word for INSTR records and the DPC for all others.
+    The records are in cycle order, and are processed as a stream.
+    With the debug file of the assembler (-g) instructions are labeled with their symbol and source line.
+*/
+
+enum TraceKind
+{
+    TRACE_STAGE,
+    TRACE_INSTR,
+    TRACE_STALL,
+    TRACE_RETIRE,
+    TRACE_FLUSH
+};
+
+static const char *stageNames[5] = {"IF", "ID", "EX", "MEM", "WB"};
+
+struct TraceRecord
+{
+    uint32_t cycle, id, value;
+    uint8_t kind, stage;
+};
+
+// An instruction in flight
+struct InFlight
+{
+    uint32_t pc = 0, ir = 0;
+    bool hasIR = false;
+    int stage = -1;
+    uint32_t stageStart = 0, stalls = 0;
+    uint64_t logId = 0; // Konata id (order of appearance in the output)
+};
+
+class TraceReader
+{
+private:
+    FILE *file;
+
+public:
+    TraceReader(const string &fileName)
+    {
+        file = fopen(fileName.c_str(), "rb");
+        char magic[8];
+        if (file == nullptr || fread(magic, 1, 8, file) != 8 || memcmp(magic, "RVTRACE1", 8) != 0)
+        {
+            cerr << RED << "Error: '" << fileName << "' is not a pipeline trace file.\n"
+                 << RESET;
+            exit(1);
+        }
+    }
+
+    ~TraceReader()
+    {
+        fclose(file);
+    }
+
+    bool next(TraceRecord &rec)
+    {
+        uint8_t raw[16];
+        if (fread(raw, 1, 16, file) != 16)
+            return false;
+        memcpy(&rec.cycle, raw, 4); // Host is little endian like the format
+        memcpy(&rec.id, raw + 4, 4);
+        memcpy(&rec.value, raw + 8, 4);
+        rec.kind = raw[12];
+        rec.stage = min<uint8_t>(raw[13], 4);
+        return true;
+    }
+};
+
+// Debug file of RISC-V_Assembler -g: "RVDEBUG1 <source file>", then "symbol <text|data> <address> <name>"
+// and "line <address> <line>" records
+class DebugInfo
+{
+private:
+    map<uint32_t, string> textSymbols;
+    unordered_map<uint32_t, int> lines;
+    vector<string> source;
+
+public:
+    bool load(const string &fileName)
+    {
+        ifstream file(fileName);
+        string header, sourceFileName;
+        if (!file || !(file >> header) || header != "RVDEBUG1")
+            return false;
+        getline(file >> ws, sourceFileName);
+
+        string kind, section, addr, name;
+        while (file >> kind)
+        {
+            if (kind == "symbol" && file >> section >> addr >> name)
+            {
+                if (section == "text")
+                    textSymbols.emplace(static_cast<uint32_t>(stoul(addr, nullptr, 0)), name);
+            }
+            else if (kind == "line" && file >> addr >> name)
+                lines[static_cast<uint32_t>(stoul(addr, nullptr, 0))] = stoi(name);
+            else
+                return false;
+        }
+
+        ifstream sourceFile(sourceFileName);
+        if (!sourceFile)
+            cerr << YELLOW << "Warning: Cannot open the source file " << sourceFileName << ", only symbols are shown\n"
+                 << RESET;
+        string line;
+        while (getline(sourceFile, line))
+            source.push_back(line);
+        return true;
+    }
+
+    // "<label+0x8> source text" for the instruction at pc, "" if unknown
+    string describe(uint32_t pc) const
+    {
+        string text;
+        auto sym = textSymbols.upper_bound(pc);
+        if (sym != textSymbols.begin())
+        {
+            --sym;
+            ostringstream os;
+            os << "<" << sym->second;
+            if (pc != sym->first)
+                os << "+0x" << hex << pc - sym->first;
+            os << ">";
+            text = os.str();
+        }
+        auto line = lines.find(pc);
+        if (line != lines.end() && line->second >= 1 && line->second <= static_cast<int>(source.size()))
+        {
+            const string &src = source[line->second - 1];
+            size_t start = src.find_first_not_of(" \t");
+            if (start != string::npos)
+                text += (text.empty() ? "" : " ") + src.substr(start);
+        }
+        return text;
+    }
+};
+
+DebugInfo debugInfo; // Loaded by -g
+
+// Text for JSON strings
+static string jsonEscape(const string &text)
+{
+    string out;
+    for (char ch : text)
+    {
+        if (ch == '"' || ch == '\\')
+            out += '\\';
+        if (ch == '\t')
+            out += ' ';
+        else if (static_cast<unsigned char>(ch) >= 0x20)
+            out += ch;
+    }
+    return out;
+}
+
+// Summary of the converted window: where the pipeline lost cycles
+struct TraceStats
+{
+    uint64_t instructions = 0, retired = 0, flushed = 0, stallCycles = 0;
+    unordered_map<uint32_t, uint64_t> stallsByPC, flushesByPC;
+
+    void print()
+    {
+        cout << GREEN << "Instructions: " << instructions << ", retired " << retired << ", flushed " << flushed
+             << ", stall cycles " << stallCycles << "\n"
+             << RESET;
+        printTop("Most stalled PCs", stallsByPC);
+        printTop("Most flushed PCs", flushesByPC);
+    }
+
+    void printTop(const char *title, const unordered_map<uint32_t, uint64_t> &counts)
+    {
+        vector<pair<uint32_t, uint64_t>> top(counts.begin(), counts.end());
+        sort(top.begin(), top.end(), [](const pair<uint32_t, uint64_t> &a, const pair<uint32_t, uint64_t> &b)
+             { return a.second > b.second || (a.second == b.second && a.first < b.first); });
+        if (top.empty())
+            return;
+        cout << CYAN << title << ":\n";
+        for (size_t i = 0; i < top.size() && i < 5; i++)
+            cout << "  0x" << hex << setw(8) << setfill('0') << top[i].first << dec << setfill(' ') << "  " << top[i].second
+                 << "  " << debugInfo.describe(top[i].first) << "\n";
+        cout << RESET;
+    }
+};
+
+static string hex32(uint32_t value)
+{
+    char buf[11];
+    snprintf(buf, sizeof(buf), "0x%08x", value);
+    return buf;
+}
+
+void convertKonata(TraceReader &in, ofstream &out, uint64_t start, uint64_t end, TraceStats &stats)
+{
+    unordered_map<uint32_t, InFlight> inFlight;
+    vector<string> pending; // Retire/flush lines, written once the cycle is over so the last stage is visible
+    uint64_t nextLogId = 0, retireId = 0;
+    bool started = false;
+    uint32_t current = 0;
+
+    out << "Kanata\t0004\n";
+    TraceRecord rec;
+    while (in.next(rec))
+    {
+        if (rec.cycle < start || rec.cycle > end)
+            continue;
+        if (!started)
+        {
+            out << "C=\t" << rec.cycle << "\n";
+            current = rec.cycle;
+            started = true;
+        }
+        if (rec.cycle != current)
+        {
+            out << "C\t" << rec.cycle - current << "\n";
+            current = rec.cycle;
+            for (auto &line : pending)
+                out << line;
+            pending.clear();
+        }
+
+        auto found = inFlight.find(rec.id);
+        if (found == inFlight.end())
+        {
+            found = inFlight.emplace(rec.id, InFlight()).first;
+            InFlight &ins = found->second;
+            ins.pc = (rec.kind == TRACE_INSTR) ? 0 : rec.value;
+            ins.logId = nextLogId++;
+            stats.instructions++;
+            out << "I\t" << ins.logId << "\t" << rec.id << "\t0\n";
+            string text = debugInfo.describe(ins.pc);
+            out << "L\t" << ins.logId << "\t0\t" << hex32(ins.pc) << (text.empty() ? "" : " " + text) << "\n";
+        }
+        InFlight &ins = found->second;
+
+        if (rec.kind == TRACE_INSTR)
+        {
+            out << "L\t" << ins.logId << "\t0\t: " << hex32(rec.value) << "\n";
+            continue;
+        }
+        if (rec.kind != TRACE_FLUSH && ins.stage != rec.stage)
+        {
+            if (ins.stage >= 0)
+                out << "E\t" << ins.logId << "\t0\t" << stageNames[ins.stage] << "\n";
+            out << "S\t" << ins.logId << "\t0\t" << stageNames[rec.stage] << "\n";
+            ins.stage = rec.stage;
+        }
+
+        if (rec.kind == TRACE_STALL)
+        {
+            stats.stallCycles++;
+            stats.stallsByPC[ins.pc]++;
+            out << "L\t" << ins.logId << "\t1\tStalled in " << stageNames[rec.stage] << " at cycle " << rec.cycle << ". \n";
+        }
+        else if (rec.kind == TRACE_RETIRE || rec.kind == TRACE_FLUSH)
+        {
+            bool flush = (rec.kind == TRACE_FLUSH);
+            pending.push_back("R\t" + to_string(ins.logId) + "\t" + to_string(flush ? 0 : retireId++) + "\t" + (flush ? "1" : "0") + "\n");
+            if (flush)
+            {
+                stats.flushed++;
+                stats.flushesByPC[ins.pc]++;
+            }
+            else
+                stats.retired++;
+            inFlight.erase(found);
+        }
+    }
+    if (started)
+        out << "C\t1\n";
+    for (auto &line : pending)
+        out << line;
+}
+
+void convertChrome(TraceReader &in, ofstream &out, uint64_t start, uint64_t end, TraceStats &stats)
+{
+    unordered_map<uint32_t, InFlight> inFlight;
+    bool first = true;
+    uint32_t last = 0;
+
+    auto event = [&](const string &json)
+    {
+        out << (first ? "\n" : ",\n") << json;
+        first = false;
+    };
+    // Complete event for the stage the instruction is leaving:
+    auto closeStage = [&](uint32_t id, const InFlight &ins, uint32_t endCycle, bool flushed)
+    {
+        if (ins.stage < 0)
+            return;
+        string text = debugInfo.describe(ins.pc);
+        string name = hex32(ins.pc) + (text.empty() ? (ins.hasIR ? " " + hex32(ins.ir) : "") : " " + jsonEscape(text));
+        event("{\"name\":\"" + name + "\",\"cat\":\"" + stageNames[ins.stage] + "\",\"ph\":\"X\",\"pid\":1,\"tid\":" +
+              to_string(ins.stage) + ",\"ts\":" + to_string(ins.stageStart) + ",\"dur\":" +
+              to_string(max<uint32_t>(1, endCycle - ins.stageStart)) + ",\"args\":{\"id\":" + to_string(id) +
+              ",\"stalls\":" + to_string(ins.stalls) + (flushed ? ",\"flushed\":true" : "") + "}}");
+    };
+
+    out << "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"clock\":\"1 us = 1 cycle\"},\"traceEvents\":[";
+    for (int s = 0; s < 5; s++)
+        event("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + to_string(s) + ",\"args\":{\"name\":\"" + stageNames[s] + "\"}}");
+
+    TraceRecord rec;
+    while (in.next(rec))
+    {
+        if (rec.cycle < start || rec.cycle > end)
+            continue;
+        last = rec.cycle;
+
+        auto found = inFlight.find(rec.id);
+        if (found == inFlight.end())
+        {
+            found = inFlight.emplace(rec.id, InFlight()).first;
+            found->second.pc = (rec.kind == TRACE_INSTR) ? 0 : rec.value;
+            stats.instructions++;
+        }
+        InFlight &ins = found->second;
+
+        if (rec.kind == TRACE_INSTR)
+        {
+            ins.ir = rec.value;
+            ins.hasIR = true;
+            continue;
+        }
+        if (rec.kind == TRACE_FLUSH)
+        {
+            closeStage(rec.id, ins, rec.cycle + 1, true);
+            event("{\"name\":\"flush\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":" + to_string(rec.stage) + ",\"ts\":" +
+                  to_string(rec.cycle) + ",\"args\":{\"id\":" + to_string(rec.id) + ",\"pc\":\"" + hex32(ins.pc) + "\"}}");
+            stats.flushed++;
+            stats.flushesByPC[ins.pc]++;
+            inFlight.erase(found);
+            continue;
+        }
+
+        if (ins.stage != rec.stage)
+        {
+            closeStage(rec.id, ins, rec.cycle, false);
+            ins.stage = rec.stage;
+            ins.stageStart = rec.cycle;
+            ins.stalls = 0;
+        }
+        if (rec.kind == TRACE_STALL)
+        {
+            ins.stalls++;
+            stats.stallCycles++;
+            stats.stallsByPC[ins.pc]++;
+        }
+        else if (rec.kind == TRACE_RETIRE)
+        {
+            closeStage(rec.id, ins, rec.cycle + 1, false);
+            stats.retired++;
+            inFlight.erase(found);
+        }
+    }
+
+    // Instructions still in flight at the end of the window:
+    for (auto &entry : inFlight)
+        closeStage(entry.first, entry.second, last + 1, false);
+    out << "\n]}\n";
+}
+
+void printUsage()
+{
+    cout << RED << "Usage:\n"
+         << RESET;
+    cout << BLUE << "  RISC-V_Trace -i <tracefile> [-o <outputfile>] [-f <konata|chrome>] [-w <start>:<end>] [-g <debugfile>]\n\n";
+    cout << "Options:\n";
+    cout << "  -i <tracefile>      :  Binary trace written by RISC-V_Pipeline --trace\n";
+    cout << "  -o <outputfile>     :  Output file (default: trace.json, or trace.kanata for konata)\n";
+    cout << "  -f <konata|chrome>  :  Output format (default: chrome)\n";
+    cout << "  -w <start>:<end>    :  Only convert these cycles\n";
+    cout << "  -g <debugfile>      :  Debug file of RISC-V_Assembler -g, to label instructions with symbols and source\n";
+    cout << "  -h --help           :  Show this help message\n"
+         << RESET;
+}
+
+int main(int argc, char *argv[])
+{
+    printf(BOLD RED "  RISC-V_Trace (by anuragmishra-creates)\n" RESET);
+    string inputFileName = "", outputFileName = "", format = "chrome";
+    uint64_t start = 0, end = UINT64_MAX;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "-i" || arg == "-o" || arg == "-f" || arg == "-w" || arg == "-g")
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << RED << "Error: " << arg << " requires a value.\n"
+                     << RESET;
+                return 1;
+            }
+            string value = argv[++i];
+            if (arg == "-i")
+                inputFileName = value;
+            else if (arg == "-o")
+                outputFileName = value;
+            else if (arg == "-g")
+            {
+                if (!debugInfo.load(value))
+                {
+                    cerr << RED << "Error: Cannot read the debug file: " << value << "\n"
+                         << RESET;
+                    return 1;
+                }
+            }
+            else if (arg == "-f")
+            {
+                if (value != "konata" && value != "chrome")
+                {
+                    cerr << RED << "Error: -f requires 'konata' or 'chrome'.\n"
+                         << RESET;
+                    return 1;
+                }
+                format = value;
+            }
+            else
+            {
+                size_t colon = value.find(':');
+                if (colon == string::npos)
+                {
+                    cerr << RED << "Error: -w requires <start>:<end> cycles.\n"
+                         << RESET;
+                    return 1;
+                }
+                start = stoull(value.substr(0, colon));
+                end = stoull(value.substr(colon + 1));
+            }
+        }
+        else if (arg == "-h" || arg == "--help")
+        {
+            printUsage();
+            return 0;
+        }
+        else
+        {
+            cerr << RED << "Unknown argument: " << arg << "\n"
+                 << RESET;
+            printUsage();
+            return 1;
+        }
+    }
+    if (inputFileName.empty())
+    {
+        cerr << RED << "Error: No trace file given (-i).\n"
+             << RESET;
+        printUsage();
+        return 1;
+    }
+    if (outputFileName.empty())
+        outputFileName = (format == "konata") ? "trace.kanata" : "trace.json";
+
+    TraceReader in(inputFileName);
+    ofstream out(outputFileName);
+    if (!out)
+    {
+        cerr << RED << "Error: Could NOT open the output file: '" << outputFileName << "'!\n"
+             << RESET;
+        return 1;
+    }
+
+    TraceStats stats;
+    if (format == "konata")
+        convertKonata(in, out, start, end, stats);
+    else
+        convertChrome(in, out, start, end, stats);
+
+    cout << CYAN << "Output File: " << GREEN << outputFileName << "\n"
+         << RESET;
+    stats.print();
+    return 0;
+}
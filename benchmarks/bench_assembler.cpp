@@ -0,0 +1,107 @@
+// Assembler benchmarks: tokenize() and parseInstructionLine() throughput over the kernels in kernels/.
+// Built through riscv_assembler_lib, which leaves out main().
+#include "RISC-V_Assembler.cpp"
+
+#include <benchmark/benchmark.h>
+
+struct KernelLine
+{
+    string text;
+    int pc;
+};
+
+static vector<string> sourceLines;        // Every line of every kernel
+static vector<KernelLine> instructionLines; // Instructions with their address, labels in labelMap
+
+// Reads the kernels and places their labels, like the first pass does (text section only)
+static void loadKernels()
+{
+    if (!sourceLines.empty())
+        return;
+    for (const char *name : {"loop", "memcpy", "matmul", "fib"})
+    {
+        string path = string(RISCV_KERNEL_DIR) + "/" + name + ".s";
+        ifstream file(path);
+        if (!file)
+        {
+            cerr << "Error: Cannot open the benchmark kernel " << path << "\n";
+            exit(1);
+        }
+
+        int pc = 0;
+        bool text = true;
+        string line;
+        while (getline(file, line))
+        {
+            sourceLines.push_back(line);
+            vector<string> tokens = tokenize(stripComment(line));
+            if (tokens.empty())
+                continue;
+            if (tokens[0].back() == ':')
+            {
+                labelMap[tokens[0].substr(0, tokens[0].size() - 1)] = pc;
+                continue;
+            }
+            if (tokens[0][0] == '.')
+            {
+                text = (tokens[0] == ".text") || (text && tokens[0] != ".data");
+                continue;
+            }
+            if (!text)
+                continue;
+
+            vector<string> expanded = expandMultiPseudo(tokens);
+            if (expanded.empty())
+                expanded.push_back(line);
+            for (auto &e : expanded)
+            {
+                instructionLines.push_back({e, pc});
+                pc += 4;
+            }
+        }
+    }
+}
+
+static void BM_Tokenize(benchmark::State &state)
+{
+    loadKernels();
+    size_t bytes = 0;
+    for (auto &line : sourceLines)
+        bytes += line.size();
+
+    for (auto _ : state)
+        for (auto &line : sourceLines)
+        {
+            vector<string> tokens = tokenize(stripComment(line));
+            benchmark::DoNotOptimize(tokens.data());
+        }
+    state.SetItemsProcessed(state.iterations() * sourceLines.size());
+    state.SetBytesProcessed(state.iterations() * bytes);
+}
+BENCHMARK(BM_Tokenize);
+
+static void BM_ParseInstructionLine(benchmark::State &state)
+{
+    loadKernels();
+    for (auto &il : instructionLines)
+    {
+        uint32_t machineCode;
+        if (!parseInstructionLine(il.text, machineCode, il.pc))
+        {
+            cerr << "Error: Benchmark kernel line does not assemble: " << il.text << "\n";
+            exit(1);
+        }
+    }
+
+    for (auto _ : state)
+        for (auto &il : instructionLines)
+        {
+            uint32_t machineCode;
+            benchmark::DoNotOptimize(parseInstructionLine(il.text, machineCode, il.pc));
+            benchmark::DoNotOptimize(machineCode);
+        }
+    state.SetItemsProcessed(state.iterations() * instructionLines.size());
+}
+BENCHMARK(BM_ParseInstructionLine);
+
+BENCHMARK_MAIN();
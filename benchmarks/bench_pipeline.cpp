@@ -0,0 +1,176 @@
+// Pipeline simulator benchmarks: Instruction Memory loading, decode and ALU cost, and simulated
+// instructions per second on the kernels in kernels/ (assembled to ELF by the build).
+// Built through riscv_pipeline_lib, which leaves out main().
+#include "RISC-V_Pipeline.cpp"
+
+#include <benchmark/benchmark.h>
+#include <cstdio>
+
+static const uint32_t benchMemSize = 8192;
+
+static string kernelPath(const string &name)
+{
+    return string(RISCV_KERNEL_BIN_DIR) + "/" + name + ".elf";
+}
+
+// Loads the segments of an assembled kernel, aborting the benchmark run if the build did not produce it
+static void loadKernel(const string &name, vector<Segment> &segments, uint32_t &entry)
+{
+    if (!loadELF(kernelPath(name), segments, entry))
+    {
+        cerr << "Error: Cannot load the benchmark kernel " << kernelPath(name) << "\n";
+        exit(1);
+    }
+}
+
+static const Segment &textSegment(const vector<Segment> &segments)
+{
+    for (auto &seg : segments)
+        if (seg.executable)
+            return seg;
+    cerr << "Error: Benchmark kernel without an executable segment\n";
+    exit(1);
+}
+
+// 32 bit instruction words of all kernels (what Decode sees)
+static vector<uint32_t> kernelInstructions()
+{
+    vector<uint32_t> words;
+    for (const char *name : {"loop", "memcpy", "matmul", "fib"})
+    {
+        vector<Segment> segments;
+        uint32_t entry;
+        loadKernel(name, segments, entry);
+        const Segment &text = textSegment(segments);
+        for (size_t off = 0; off + 4 <= text.bytes.size(); off += 4)
+            words.push_back(text.bytes[off] | (text.bytes[off + 1] << 8) | (text.bytes[off + 2] << 16) |
+                            (static_cast<uint32_t>(text.bytes[off + 3]) << 24));
+    }
+    return words;
+}
+
+static void BM_InstructionMemoryLoadText(benchmark::State &state)
+{
+    // Machine code text file with state.range(0) instructions:
+    vector<uint32_t> words = kernelInstructions();
+    string fileName = "bench_machineCode.txt";
+    {
+        ofstream out(fileName);
+        for (int64_t i = 0; i < state.range(0); i++)
+            out << bitset<32>(words[i % words.size()]) << "\n";
+    }
+
+    for (auto _ : state)
+    {
+        InstructionMemory IM(fileName);
+        benchmark::DoNotOptimize(IM.size());
+    }
+    remove(fileName.c_str());
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_InstructionMemoryLoadText)->Arg(1 << 10)->Arg(1 << 14);
+
+static void BM_InstructionMemoryLoadELF(benchmark::State &state)
+{
+    for (auto _ : state)
+    {
+        vector<Segment> segments;
+        uint32_t entry;
+        loadKernel("matmul", segments, entry);
+        InstructionMemory IM(textSegment(segments));
+        benchmark::DoNotOptimize(IM.size());
+    }
+}
+BENCHMARK(BM_InstructionMemoryLoadELF);
+
+// Decode work of one instruction: fields, immediate, control word and ALU select
+static void BM_Decode(benchmark::State &state)
+{
+    vector<uint32_t> words = kernelInstructions();
+    for (auto _ : state)
+    {
+        for (uint32_t ins : words)
+        {
+            uint32_t opcode, rdl, func3, rsl1, rsl2, func7;
+            prepareOpcodeAndFunctions(ins, opcode, rdl, func3, rsl1, rsl2, func7);
+            int32_t imm = genImm(ins, opcode);
+            ControlWord CW = ControlUnit(opcode);
+            uint32_t ALUSelect = ALUControl(CW.ALUOp, func7, func3, opcode);
+            benchmark::DoNotOptimize(imm);
+            benchmark::DoNotOptimize(ALUSelect);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * words.size());
+}
+BENCHMARK(BM_Decode);
+
+static void BM_ALU(benchmark::State &state)
+{
+    // Every ALU select the kernels use, over changing operands:
+    vector<uint32_t> selects;
+    for (uint32_t ins : kernelInstructions())
+    {
+        uint32_t opcode, rdl, func3, rsl1, rsl2, func7;
+        prepareOpcodeAndFunctions(ins, opcode, rdl, func3, rsl1, rsl2, func7);
+        selects.push_back(ALUControl(ControlUnit(opcode).ALUOp, func7, func3, opcode));
+    }
+
+    uint32_t A = 0x12345678, B = 0x9ABCDEF;
+    for (auto _ : state)
+    {
+        for (uint32_t sel : selects)
+        {
+            A = ALU(sel, A, B) + 0x9E3779B9;
+            B += A | 1;
+        }
+        benchmark::DoNotOptimize(A);
+    }
+    state.SetItemsProcessed(state.iterations() * selects.size());
+}
+BENCHMARK(BM_ALU);
+
+// Whole program on the 5-stage pipeline, without the per-cycle trace (optionally co-simulated)
+static void BM_Simulate(benchmark::State &state, const char *name, bool checked)
+{
+    vector<Segment> segments;
+    uint32_t entry;
+    loadKernel(name, segments, entry);
+    InstructionMemory IM(textSegment(segments));
+
+    verbose = false;
+    uint64_t instructions = 0, cycles = 0;
+    for (auto _ : state)
+    {
+        resetPipeline();
+        RegisterFile RF(benchMemSize);
+        DataMemory DM(benchMemSize, 0);
+        for (auto &seg : segments)
+            if (!seg.executable)
+                DM.loadSegment(seg);
+        ProxyKernel PK(".", benchMemSize / 2);
+        PC.value = entry;
+        CoSimChecker checker(IM, DM, PK, benchMemSize, entry);
+        cosim = checked ? &checker : nullptr;
+
+        if (!runPipeline(IM, RF, DM, PK, 100000000) || !PK.exited || (checked && !checker.check()))
+        {
+            state.SkipWithError("kernel did not exit or did not match the reference model");
+            break;
+        }
+        instructions += retired;
+        cycles += cycle;
+    }
+    cosim = nullptr;
+    state.counters["instructions"] = benchmark::Counter(static_cast<double>(instructions), benchmark::Counter::kIsRate);
+    state.counters["CPI"] = instructions ? static_cast<double>(cycles) / instructions : 0;
+}
+BENCHMARK_CAPTURE(BM_Simulate, loop, "loop", false)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Simulate, memcpy, "memcpy", false)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Simulate, matmul, "matmul", false)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Simulate, fib, "fib", false)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Simulate, random, "random", false)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Simulate, matmul_cosim, "matmul", true)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Simulate, fib_cosim, "fib", true)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Simulate, random_cosim, "random", true)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
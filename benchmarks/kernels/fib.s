@@ -0,0 +1,27 @@
+# Recursive fib(15) = 610, a0 = 610 & 0xFF
+    .text
+_start:
+    li a0, 15
+    jal ra, fib
+    andi a0, a0, 255
+    li a7, 93           # exit
+    ecall
+
+fib:                    # a0 = fib(a0)
+    li t0, 2
+    blt a0, t0, fib_base
+    addi sp, sp, -12
+    sw ra, 8(sp)
+    sw a0, 4(sp)
+    addi a0, a0, -1
+    jal ra, fib
+    sw a0, 0(sp)        # fib(n - 1)
+    lw a0, 4(sp)
+    addi a0, a0, -2
+    jal ra, fib
+    lw t1, 0(sp)
+    add a0, a0, t1
+    lw ra, 8(sp)
+    addi sp, sp, 12
+fib_base:
+    ret
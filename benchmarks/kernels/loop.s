@@ -0,0 +1,13 @@
+# Counted loop: a0 = (1 + 2 + ... + 20000) & 0xFF
+    .text
+_start:
+    li t0, 20000
+    li a0, 0
+loop:
+    add a0, a0, t0
+    addi t0, t0, -1
+    bnez t0, loop
+
+    andi a0, a0, 255
+    li a7, 93           # exit
+    ecall
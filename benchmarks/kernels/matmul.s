@@ -0,0 +1,66 @@
+# C = A * B for 8x8 word matrices with A[i][j] = i + j and B[i][j] = i - j, a0 = sum(C) & 0xFF
+    .data
+A:
+    .space 256
+B:
+    .space 256
+C:
+    .space 256
+
+    .text
+_start:
+    la s0, A
+    la s1, B
+    la s2, C
+    li s3, 8            # N
+
+    li t0, 0            # Initialize A and B
+    mv t4, s0
+    mv t5, s1
+init_i:
+    li t1, 0
+init_j:
+    add t2, t0, t1
+    sw t2, 0(t4)
+    sub t2, t0, t1
+    sw t2, 0(t5)
+    addi t4, t4, 4
+    addi t5, t5, 4
+    addi t1, t1, 1
+    blt t1, s3, init_j
+    addi t0, t0, 1
+    blt t0, s3, init_i
+
+    li t0, 0            # i
+    mv a1, s2           # &C[i][j]
+    li a0, 0            # Checksum
+row:
+    li t1, 0            # j
+col:
+    slli t4, t0, 5      # &A[i][0]
+    add t4, t4, s0
+    slli t5, t1, 2      # &B[0][j]
+    add t5, t5, s1
+    li t2, 0            # k
+    li t3, 0            # Dot product
+dot:
+    lw a2, 0(t4)
+    lw a3, 0(t5)
+    mul a2, a2, a3
+    add t3, t3, a2
+    addi t4, t4, 4
+    addi t5, t5, 32
+    addi t2, t2, 1
+    blt t2, s3, dot
+
+    sw t3, 0(a1)
+    add a0, a0, t3
+    addi a1, a1, 4
+    addi t1, t1, 1
+    blt t1, s3, col
+    addi t0, t0, 1
+    blt t0, s3, row
+
+    andi a0, a0, 255
+    li a7, 93           # exit
+    ecall
@@ -0,0 +1,39 @@
+# Word copy of a 1 KiB buffer, 8 times, then a0 = last word copied & 0xFF
+    .data
+src:
+    .space 1024
+dst:
+    .space 1024
+
+    .text
+_start:
+    la t0, src          # Fill src[i] = i
+    li t1, 0
+    li t2, 256
+fill:
+    sw t1, 0(t0)
+    addi t0, t0, 4
+    addi t1, t1, 1
+    blt t1, t2, fill
+
+    li s0, 8            # Repetitions
+again:
+    la t0, src
+    la t1, dst
+    li t2, 256
+copy:
+    lw t3, 0(t0)
+    lw t4, 4(t0)
+    sw t3, 0(t1)
+    sw t4, 4(t1)
+    addi t0, t0, 8
+    addi t1, t1, 8
+    addi t2, t2, -2
+    bnez t2, copy
+    addi s0, s0, -1
+    bnez s0, again
+
+    lw a0, -4(t1)
+    andi a0, a0, 255
+    li a7, 93           # exit
+    ecall